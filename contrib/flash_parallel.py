@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+# encoding: utf-8
+
+# flash a firmware image into all SIMtrace 2 - based devices connected to USB at the same time,
+# and verify the result by reading the image back and comparing the CRC
+
+# library to enumerate USB devices
+import usb.core
+# to run one dfu-util per device at the same time
+from concurrent.futures import ThreadPoolExecutor
+# to compute the CRC-32
+import zlib
+# command line and file utilities
+import argparse, os, sys, tempfile
+# to flash using DFU-util
+import subprocess
+
+# USB vendor and product IDs of the SIMtrace 2 devices (see flash.py)
+DEVICES = {
+	(0x1d50, 0x60e3): "SIMtrace 2",
+	(0x1d50, 0x4004): "sysmoQMOD (Quad Modem)",
+	(0x1d50, 0x4001): "OWHW",
+	(0x1d50, 0x616d): "OCTSIMTEST",
+	(0x1d50, 0x616e): "ngff-cardem",
+}
+
+def dfu_util(vid, pid, usb_path, alt, *args):
+	cmd = ["dfu-util", "--device", "%04x:%04x" % (vid, pid), "--path", usb_path, "--cfg", "1", "--alt", str(alt)]
+	return subprocess.run(cmd + list(args), stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+
+# last line of the dfu-util output, usually the error message
+def last_line(result):
+	lines = result.stdout.strip().splitlines()
+	return lines[-1] if lines else "dfu-util returned %d" % result.returncode
+
+# flash, read back and compare, return an error description or None
+def flash_device(vid, pid, usb_path, alt, image):
+	result = dfu_util(vid, pid, usb_path, alt, "--download", image["path"])
+	if result.returncode != 0:
+		return "download failed: " + last_line(result)
+	with tempfile.TemporaryDirectory() as tmpdir:
+		readback_path = os.path.join(tmpdir, "readback.bin")
+		# the device starts the new firmware after the read back
+		result = dfu_util(vid, pid, usb_path, alt, "--upload", readback_path, "--upload-size", str(image["len"]), "--reset")
+		if not os.path.exists(readback_path):
+			return "read back failed: " + last_line(result)
+		with open(readback_path, "rb") as f:
+			readback = f.read(image["len"])
+	crc = zlib.crc32(readback)
+	if len(readback) != image["len"] or crc != image["crc"]:
+		return "verification failed (CRC %08x instead of %08x)" % (crc, image["crc"])
+	return None
+
+parser = argparse.ArgumentParser(description="flash a firmware image into all connected SIMtrace 2 devices in parallel")
+parser.add_argument("image", help="firmware image (e.g. simtrace-cardem-dfu.bin)")
+parser.add_argument("--alt", type=int, default=1, help="DFU alternate setting (1: application, default)")
+parser.add_argument("--jobs", type=int, default=16, help="maximum number of devices flashed at the same time")
+args = parser.parse_args()
+
+with open(args.image, "rb") as f:
+	data = f.read()
+image = {"path": args.image, "len": len(data), "crc": zlib.crc32(data)}
+print("image %s: %u bytes, CRC %08x" % (args.image, image["len"], image["crc"]))
+
+# find SIMtrace devices
+devices = []
+for usb_device in usb.core.find(find_all=True):
+	name = DEVICES.get((usb_device.idVendor, usb_device.idProduct))
+	if not name:
+		continue
+	usb_path = str(usb_device.bus) + "-" + ".".join(map(str, usb_device.port_numbers))
+	print("found " + name + " device at USB path " + usb_path)
+	devices.append((usb_device.idVendor, usb_device.idProduct, usb_path))
+
+if not devices:
+	print("no SIMtrace 2 device found")
+	sys.exit(1)
+
+failed_nb = 0
+with ThreadPoolExecutor(max_workers=args.jobs) as executor:
+	jobs = {executor.submit(flash_device, vid, pid, usb_path, args.alt, image): usb_path for (vid, pid, usb_path) in devices}
+	for job, usb_path in jobs.items():
+		error = job.result()
+		if error:
+			failed_nb += 1
+			print(usb_path + ": " + error)
+		else:
+			print(usb_path + ": updated and verified")
+
+print(str(len(devices)) + " SIMtrace 2 device(s) found")
+print(str(len(devices) - failed_nb) + " SIMtrace 2 device(s) updated")
+sys.exit(1 if failed_nb else 0)
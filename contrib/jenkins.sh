@@ -44,6 +44,15 @@ for build in $BUILDS; do
 	echo "=============== $board / $app RES:$? =============="
 done
 
+# two link sniffer variant (sniffing the USIM1 slot too), built in a clean tree
+echo
+echo "=============== ngff_cardem / trace SNIFF_USIM1 START  =============="
+make BOARD="ngff_cardem" APP="trace" clean
+make BOARD="ngff_cardem" APP="trace" SNIFF_USIM1=1
+echo "=============== ngff_cardem / trace SNIFF_USIM1 RES:$? =============="
+make BOARD="ngff_cardem" APP="trace" clean
+make BOARD="ngff_cardem" APP="trace"
+
 echo
 echo "=============== FIRMWARE TESTS ==========="
 cd $TOPDIR/firmware/test
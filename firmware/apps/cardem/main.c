@@ -20,6 +20,7 @@
 #include "board.h"
 #include "simtrace.h"
 #include "utils.h"
+#include "main_events.h"
 #include "main_common.h"
 #include <osmocom/core/timer.h>
 
@@ -59,6 +60,7 @@ static const conf_func config_func_ptrs[] = {
 		.init = CCID_init,
 		.exit = CCID_exit,
 		.run = CCID_run,
+		.usart0_irq = CCID_usart_irq,	/* USART_SIM */
 	},
 #endif
 #ifdef HAVE_CARDEM
@@ -109,18 +111,21 @@ void USBDDriverCallbacks_ConfigurationChanged(uint8_t cfgnum)
 	} else {
 		TRACE_ERROR("trying to set out of bounds config %u\r\n", cfgnum);
 	}
+	main_event_set(MAIN_EV_USB);
 }
 
 void USART1_IrqHandler(void)
 {
 	if (config_func_ptrs[simtrace_config].usart1_irq)
 		config_func_ptrs[simtrace_config].usart1_irq();
+	main_event_set(MAIN_EV_USART);
 }
 
 void USART0_IrqHandler(void)
 {
 	if (config_func_ptrs[simtrace_config].usart0_irq)
 		config_func_ptrs[simtrace_config].usart0_irq();
+	main_event_set(MAIN_EV_USART);
 }
 
 /* returns '1' in case we should break any endless loop */
@@ -146,6 +151,8 @@ extern int main(void)
 	uint8_t isUsbConnected = 0;
 	enum confNum last_simtrace_config = simtrace_config;
 	unsigned int i = 0;
+	/* ticks since the mode run() function has been called */
+	unsigned int idle_ticks = 0;
 
 	led_init();
 	led_blink(LED_RED, BLINK_ALWAYS_ON);
@@ -191,15 +198,21 @@ extern int main(void)
 
 	TRACE_INFO("entering main loop...\n\r");
 	while (1) {
-		WDT_Restart(WDT);
+		/* sleep until an interrupt created some work */
+		uint32_t events = main_events_wait();
+
+		if (events & (1 << MAIN_EV_TICK)) {
+			WDT_Restart(WDT);
 #if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
-		const char rotor[] = { '-', '\\', '|', '/' };
-		putchar('\b');
-		putchar(rotor[i++ % ARRAY_SIZE(rotor)]);
+			const char rotor[] = { '-', '\\', '|', '/' };
+			putchar('\b');
+			putchar(rotor[i++ % ARRAY_SIZE(rotor)]);
 #endif
-		check_exec_dbg_cmd();
-		osmo_timers_prepare();
-		osmo_timers_update();
+			check_exec_dbg_cmd();
+			osmo_timers_prepare();
+			osmo_timers_update();
+			idle_ticks++;
+		}
 
 		if (USBD_GetState() < USBD_STATE_CONFIGURED) {
 
@@ -225,7 +238,9 @@ extern int main(void)
 				config_func_ptrs[simtrace_config].init();
 			}
 			last_simtrace_config = simtrace_config;
-		} else {
+			main_event_set(MAIN_EV_MODE);
+		} else if ((events & MAIN_EVS_RUN) || idle_ticks >= MAIN_RUN_IDLE_TICKS) {
+			idle_ticks = 0;
 			if (config_func_ptrs[simtrace_config].run) {
 				config_func_ptrs[simtrace_config].run();
 			}
@@ -21,6 +21,7 @@
 #include "USBD_HAL.h"
 
 #include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
 
 /* USB alternate interface index used to identify which partition to flash */
 /** USB alternate interface index indicating RAM partition */
@@ -60,6 +61,95 @@ static const Pin pinsLeds[] = { PINS_LEDS } ;
 #define IFLASH_END ((uint8_t *)IFLASH_ADDR + BOARD_DFU_BOOT_SIZE)
 #endif
 
+/* Downloaded blocks are programmed into the flash from the main loop, while
+ * the host already transfers the next block into the other buffer.  The
+ * host only gets to see dfuDNBUSY if both buffers are in use. */
+#define NUM_DNLOAD_BUFS	2
+
+static struct dnload_buf {
+	uint32_t data[BOARD_DFU_PAGE_SIZE / sizeof(uint32_t)];
+	uint32_t addr;
+	unsigned int len;
+	volatile bool full;
+} dnload_bufs[NUM_DNLOAD_BUFS];
+/* next buffer to fill (USB interrupt) */
+static unsigned int dnload_head;
+/* next buffer to program (main loop) */
+static unsigned int dnload_tail;
+
+/* program the oldest downloaded block into the flash */
+static void dnload_program(void)
+{
+	struct dnload_buf *buf = &dnload_bufs[dnload_tail];
+	uint8_t status = DFU_STATUS_OK;
+	unsigned int off, len;
+	uint32_t rc = 0;
+
+	if (!buf->full)
+		return;
+
+#ifdef PINS_LEDS
+	PIO_Clear(&pinsLeds[LED_NUM_RED]);
+#endif
+	/* the flash can't be read while an EFC command runs, but the USB
+	 * interrupt handler and the vector table are in the flash: issue one
+	 * command per flash page with interrupts masked, and serve the USB
+	 * interrupt between the pages */
+	for (off = 0; off < buf->len && rc == 0; off += len) {
+		len = OSMO_MIN(buf->len - off, IFLASH_PAGE_SIZE - (buf->addr + off) % IFLASH_PAGE_SIZE);
+		__disable_irq();
+		rc = FLASHD_Unlock(buf->addr + off, buf->addr + off + len, 0, 0);
+		__enable_irq();
+		if (rc != 0)
+			break;
+		__disable_irq();
+		rc = FLASHD_Write(buf->addr + off, (uint8_t *) buf->data + off, len);
+		__enable_irq();
+	}
+	if (rc != 0) {
+		TRACE_ERROR("DFU download flash write failed\n\r");
+		status = DFU_STATUS_errWRITE;
+	} else if (memcmp((void *)buf->addr, buf->data, buf->len)) {
+		TRACE_ERROR("DFU download flash data written not correct\n\r");
+		status = DFU_STATUS_errVERIFY;
+	}
+#ifdef PINS_LEDS
+	PIO_Set(&pinsLeds[LED_NUM_RED]);
+#endif
+
+	__disable_irq();
+	if (status != DFU_STATUS_OK) {
+		g_dfu->state = DFU_STATE_dfuERROR;
+		g_dfu->status = status;
+	}
+	buf->full = false;
+	__enable_irq();
+	dnload_tail = (dnload_tail + 1) % NUM_DNLOAD_BUFS;
+}
+
+/* called before the DFU state is reported to the host (USB interrupt) */
+void dfu_drv_updstatus(void)
+{
+	switch (g_dfu->state) {
+	case DFU_STATE_dfuDNLOAD_IDLE:
+		/* no buffer for the next block yet */
+		if (dnload_bufs[dnload_head].full)
+			g_dfu->state = DFU_STATE_dfuDNBUSY;
+		break;
+	case DFU_STATE_dfuDNBUSY:
+		if (!dnload_bufs[dnload_head].full)
+			g_dfu->state = DFU_STATE_dfuDNLOAD_IDLE;
+		break;
+	case DFU_STATE_dfuMANIFEST_SYNC:
+		/* all blocks have to be in the flash first */
+		if (!dnload_bufs[dnload_tail].full)
+			g_dfu->state = DFU_STATE_dfuMANIFEST;
+		break;
+	default:
+		break;
+	}
+}
+
 /* incoming call-back: Host has transferred 'len' bytes (stored at
  * 'data'), which we shall write to 'offset' into the partition
  * associated with 'altif'.  Guaranted to be less than
@@ -67,8 +157,8 @@ static const Pin pinsLeds[] = { PINS_LEDS } ;
 int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 			 uint8_t *data, unsigned int len)
 {
+	struct dnload_buf *buf;
 	uint32_t addr;
-	unsigned int i;
 	int rc;
 	/* address of the last allocated variable on the stack */
 	uint32_t stack_addr = (uint32_t)&rc;
@@ -83,10 +173,6 @@ int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 	printf("DL off=%u\n\r", offset);
 #endif
 
-#ifdef PINS_LEDS
-	PIO_Clear(&pinsLeds[LED_NUM_RED]);
-#endif
-
 	switch (altif) {
 	case ALTIF_RAM:
 		addr = RAM_ADDR(offset);
@@ -102,7 +188,8 @@ int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 	case ALTIF_FLASH:
 		addr = FLASH_ADDR(offset);
 #if defined(ENVIRONMENT_flash)
-		if (addr < IFLASH_ADDR || addr + len >= IFLASH_ADDR + IFLASH_SIZE) {
+		/* don't overwrite the configuration store at the end of the flash */
+		if (addr < IFLASH_ADDR || addr + len >= IFLASH_ADDR + IFLASH_SIZE - BOARD_CFG_STORE_SIZE) {
 #elif defined(ENVIRONMENT_dfu)
 		if (addr < IFLASH_ADDR || addr + len >= IFLASH_ADDR + BOARD_DFU_BOOT_SIZE) {
 #endif
@@ -111,25 +198,19 @@ int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 			rc = DFU_RET_STALL;
 			break;
 		}
-		rc = FLASHD_Unlock(addr, addr + len, 0, 0);
-		if (rc != 0) {
-			TRACE_ERROR("DFU download flash unlock failed\n\r");
-			rc =  DFU_RET_STALL;
-			break;
-		}
-		rc = FLASHD_Write(addr, data, len);
-		if (rc != 0) {
-			TRACE_ERROR("DFU download flash erase failed\n\r");
+		buf = &dnload_bufs[dnload_head];
+		if (buf->full) {
+			/* the host did not wait for dfuDNLOAD_IDLE */
+			g_dfu->state = DFU_STATE_dfuERROR;
+			g_dfu->status = DFU_STATUS_errUNKNOWN;
 			rc = DFU_RET_STALL;
 			break;
 		}
-		for (i = 0; i < len; i++) {
-			if (((uint8_t*)addr)[i]!=data[i]) {
-				TRACE_ERROR("DFU download flash data written not correct\n\r");
-				rc = DFU_RET_STALL;
-				break;
-			}
-		}
+		memcpy(buf->data, data, len);
+		buf->addr = addr;
+		buf->len = len;
+		buf->full = true;
+		dnload_head = (dnload_head + 1) % NUM_DNLOAD_BUFS;
 		rc = DFU_RET_ZLP;
 		break;
 	default:
@@ -138,10 +219,6 @@ int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 		break;
 	}
 
-#ifdef PINS_LEDS
-	PIO_Set(&pinsLeds[LED_NUM_RED]);
-#endif
-
 	return rc;
 }
 
@@ -367,6 +444,7 @@ extern int main(void)
 		putchar(rotor[i++ % ARRAY_SIZE(rotor)]);
 #endif
 		check_exec_dbg_cmd();
+		dnload_program();
 #if 0
 		osmo_timers_prepare();
 		osmo_timers_update();
@@ -20,6 +20,7 @@
 #include "board.h"
 #include "simtrace.h"
 #include "utils.h"
+#include "main_events.h"
 #include "main_common.h"
 #include "osmocom/core/timer.h"
 
@@ -59,6 +60,7 @@ static const conf_func config_func_ptrs[] = {
 		.init = CCID_init,
 		.exit = CCID_exit,
 		.run = CCID_run,
+		.usart0_irq = CCID_usart_irq,	/* USART_SIM */
 	},
 #endif
 #ifdef HAVE_CARDEM
@@ -100,18 +102,21 @@ void USBDDriverCallbacks_ConfigurationChanged(uint8_t cfgnum)
 {
 	TRACE_INFO_WP("cfgChanged%d ", cfgnum);
 	simtrace_config = cfgnum;
+	main_event_set(MAIN_EV_USB);
 }
 
 void USART1_IrqHandler(void)
 {
 	if (config_func_ptrs[simtrace_config].usart1_irq)
 		config_func_ptrs[simtrace_config].usart1_irq();
+	main_event_set(MAIN_EV_USART);
 }
 
 void USART0_IrqHandler(void)
 {
 	if (config_func_ptrs[simtrace_config].usart0_irq)
 		config_func_ptrs[simtrace_config].usart0_irq();
+	main_event_set(MAIN_EV_USART);
 }
 
 /* returns '1' in case we should break any endless loop */
@@ -136,6 +141,8 @@ extern int main(void)
 	uint8_t isUsbConnected = 0;
 	enum confNum last_simtrace_config = simtrace_config;
 	unsigned int i = 0;
+	/* ticks since the mode run() function has been called */
+	unsigned int idle_ticks = 0;
 
 	/* Configure LED output
 	 * red on = power
@@ -185,15 +192,21 @@ extern int main(void)
 
 	TRACE_INFO("entering main loop...\n\r");
 	while (1) {
-		WDT_Restart(WDT);
+		/* sleep until an interrupt created some work */
+		uint32_t events = main_events_wait();
+
+		if (events & (1 << MAIN_EV_TICK)) {
+			WDT_Restart(WDT);
 #if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
-		const char rotor[] = { '-', '\\', '|', '/' };
-		putchar('\b');
-		putchar(rotor[i++ % ARRAY_SIZE(rotor)]);
+			const char rotor[] = { '-', '\\', '|', '/' };
+			putchar('\b');
+			putchar(rotor[i++ % ARRAY_SIZE(rotor)]);
 #endif
-		check_exec_dbg_cmd();
-		osmo_timers_prepare();
-		osmo_timers_update();
+			check_exec_dbg_cmd();
+			osmo_timers_prepare();
+			osmo_timers_update();
+			idle_ticks++;
+		}
 
 		if (USBD_GetState() < USBD_STATE_CONFIGURED) {
 
@@ -211,7 +224,9 @@ extern int main(void)
 			config_func_ptrs[last_simtrace_config].exit();
 			config_func_ptrs[simtrace_config].init();
 			last_simtrace_config = simtrace_config;
-		} else {
+			main_event_set(MAIN_EV_MODE);
+		} else if ((events & MAIN_EVS_RUN) || idle_ticks >= MAIN_RUN_IDLE_TICKS) {
+			idle_ticks = 0;
 			config_func_ptrs[simtrace_config].run();
 		}
 	}
@@ -1126,18 +1126,16 @@ void USBD_IrqHandler(void)
 
     /* Service interrupts */
 
-    /** / Start Of Frame (SOF) */
-    //if (ISSET(dStatus, UDP_ISR_SOFINT)) {
-    //
-    //    TRACE_DEBUG("SOF");
-    //
-    //    // Invoke the SOF callback
-    //    USB_StartOfFrameCallback(pUsb);
-    //
-    //    // Acknowledge interrupt
-    //    UDP->UDP_ICR = UDP_ICR_SOFINT;
-    //    dStatus &= ~UDP_ISR_SOFINT;
-    //}
+    /* Start Of Frame (SOF), only enabled on demand */
+    if ((status & UDP_ISR_SOFINT) != 0) {
+
+        /* Invoke the SOF callback */
+        USBDCallbacks_StartOfFrame();
+
+        /* Acknowledge interrupt */
+        UDP->UDP_ICR = UDP_ICR_SOFINT;
+        status &= ~UDP_ISR_SOFINT;
+    }
     /* Resume (Wakeup) */
     if ((status & (UDP_ISR_WAKEUP | UDP_ISR_RXRSM)) != 0) {
 
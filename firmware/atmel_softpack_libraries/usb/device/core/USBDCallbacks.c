@@ -75,6 +75,12 @@ WEAK void USBDCallbacks_Suspended(void) {}
  */
 WEAK void USBDCallbacks_Resumed(void) {}
 
+/**
+ * Invoked on a USB start of frame, if the SOF interrupt has been
+ * enabled. By default, do nothing.
+ */
+WEAK void USBDCallbacks_StartOfFrame(void) {}
+
 /**
  * USBDCallbacks_RequestReceived - Invoked when a new SETUP request is
  * received. Does nothing by default.
@@ -52,8 +52,8 @@ WEAK void dfu_drv_updstatus(void)
 	TRACE_INFO("DFU: updstatus()\n\r");
 
 	/* we transition immediately from MANIFEST_SYNC to MANIFEST,
-	 * as the flash-writing is not asynchronous in this
-	 * implementation */
+	 * unless the application overrides this function because it
+	 * writes the flash asynchronously */
 	if (g_dfu->state == DFU_STATE_dfuMANIFEST_SYNC)
 		g_dfu->state = DFU_STATE_dfuMANIFEST;
 }
@@ -272,6 +272,7 @@ extern void USBDCallbacks_Initialized(void);
 extern void USBDCallbacks_Reset(void);
 extern void USBDCallbacks_Suspended(void);
 extern void USBDCallbacks_Resumed(void);
+extern void USBDCallbacks_StartOfFrame(void);
 extern void USBDCallbacks_RequestReceived(const USBGenericRequest *request);
 
 #endif /*#ifndef USBD_H*/
@@ -112,10 +112,16 @@
 
 #define BOARD_DFU_BOOT_SIZE	(16 * 1024)
 #define BOARD_DFU_RAM_SIZE	(2 * 1024)
-#define BOARD_DFU_PAGE_SIZE	512
+/** DFU transfer size (wTransferSize): 16 flash pages per block, which is
+ * buffered three times in the bootloader RAM */
+#define BOARD_DFU_PAGE_SIZE	4096
 /** number of DFU interfaces (used to flash specific partitions) */
 #define BOARD_DFU_NUM_IF	3
 
+/** flash at the end of the application partition, reserved for the
+ * card emulation configuration store (see cfg_store.c) */
+#define BOARD_CFG_STORE_SIZE	(4 * 1024)
+
 extern void board_exec_dbg_cmd(int ch);
 extern void board_main_top(void);
 extern int board_override_enter_dfu(void);
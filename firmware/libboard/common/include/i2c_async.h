@@ -0,0 +1,49 @@
+/* Interrupt driven I2C master with a transaction queue
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <osmocom/core/linuxlist.h>
+
+/* maximum number of bytes written/read by one transaction */
+#define I2C_XFER_DATA_MAX	4
+
+/* status of a transaction that did not complete yet */
+#define I2C_XFER_PENDING	1
+
+/* one transaction: START, write wr[], (repeated START and) read rd[], STOP.
+ * The structure is owned by the caller and must stay valid until done. */
+struct i2c_xfer {
+	struct llist_head list;
+	/* 7-bit slave address */
+	uint8_t slave;
+	uint8_t wr[I2C_XFER_DATA_MAX];
+	uint8_t wr_len;
+	uint8_t rd[I2C_XFER_DATA_MAX];
+	uint8_t rd_len;
+	/* I2C_XFER_PENDING, 0 on success, or -EIO if the slave did not ACK */
+	volatile int status;
+	/* called from interrupt context once the transaction completed (optional) */
+	void (*done)(struct i2c_xfer *xfer);
+	void *priv;
+};
+
+void i2c_init(void);
+
+/* queue a transaction; can be called from any context.
+ * Returns -EBUSY if xfer is still queued. */
+int i2c_xfer_submit(struct i2c_xfer *xfer);
+
+/* queue a transaction and wait for it (not from interrupt context).
+ * Returns the status of the transaction. */
+int i2c_xfer_sync(struct i2c_xfer *xfer);
@@ -0,0 +1,39 @@
+/* This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/* sleep (WFI) in the main loop while no event is pending, instead of busy polling */
+#ifndef MAIN_LOOP_WFI
+#define MAIN_LOOP_WFI	1
+#endif
+
+/* sources of work for the main loop, set from interrupt context */
+enum main_event {
+	MAIN_EV_TICK,		/* SysTick (every ms): timers, watchdog, debug console */
+	MAIN_EV_USART,		/* USART data received/sent, error, or time-out */
+	MAIN_EV_USB,		/* USB transfer completed or configuration changed */
+	MAIN_EV_PIO,		/* input pin changed (card reset, VCC, insertion) */
+	MAIN_EV_TC,		/* timer/counter expired (e.g. waiting time) */
+	MAIN_EV_ADC,		/* ADC conversion completed */
+	MAIN_EV_MODE,		/* mode asks to be run again (e.g. work left after its budget) */
+};
+
+/* events for which the run() function of the current mode is called */
+#define MAIN_EVS_RUN	(~(1 << MAIN_EV_TICK))
+/* maximum time (in ms) without calling run(), for work not signalled by an event */
+#define MAIN_RUN_IDLE_TICKS	10
+
+/* mark an event as pending (can be called from any context) */
+void main_event_set(enum main_event ev);
+/* wait for at least one pending event, clear and return all pending events as bit-mask */
+uint32_t main_events_wait(void);
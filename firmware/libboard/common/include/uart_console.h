@@ -35,6 +35,7 @@ extern void UART_Configure( uint32_t dwBaudrate, uint32_t dwMasterClock ) ;
 extern void UART_Exit( void ) ;
 extern void UART_PutChar( uint8_t uc ) ;
 extern void UART_PutChar_Sync( uint8_t uc ) ;
+extern uint32_t UART_GetTxDropped( void ) ;
 extern uint32_t UART_GetChar( void ) ;
 extern uint32_t UART_IsRxReady( void ) ;
 
@@ -39,6 +39,7 @@
  *----------------------------------------------------------------------------*/
 
 #include "board.h"
+#include "main_events.h"
 
 /*----------------------------------------------------------------------------
  *        Local definitions
@@ -210,6 +211,7 @@ volatile uint32_t jiffies;
 void SysTick_Handler(void)
 {
 	jiffies++;
+	main_event_set(MAIN_EV_TICK);
 }
 
 void mdelay(unsigned int msecs)
@@ -0,0 +1,340 @@
+/* Interrupt driven I2C master with a transaction queue
+ *
+ * The I2C bus of the boards is not wired to the pins of a TWI peripheral, so
+ * SDA/SCL are still driven as open-drain GPIOs.  Instead of busy waiting for
+ * each bit, a timer interrupt performs one step of the bus protocol at a time,
+ * and transactions are queued, so I2C devices (e.g. GPIO expanders) can be
+ * accessed without blocking the main loop or card emulation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "i2c_async.h"
+
+#include <errno.h>
+
+#ifdef PIN_I2C_SCL
+
+/* period of one protocol step.  A bit takes three steps (set SDA, raise SCL,
+ * sample SDA and lower SCL), resulting in about 66 kHz SCL. */
+#define I2C_STEP_US	5
+
+/* TC3 (channel 0 of TC block 1) is not used otherwise */
+#define I2C_TC		(&TC1->TC_CHANNEL[0])
+
+static const Pin pin_sda = PIN_I2C_SDA;
+static const Pin pin_scl = PIN_I2C_SCL;
+
+enum i2c_state {
+	I2C_S_IDLE,
+	I2C_S_START,	/* (repeated) START condition */
+	I2C_S_TX,	/* transmitting a byte */
+	I2C_S_TX_ACK,	/* receiving the ACK of the slave */
+	I2C_S_RX,	/* receiving a byte */
+	I2C_S_RX_ACK,	/* transmitting our ACK/NACK */
+	I2C_S_STOP,	/* STOP condition */
+};
+
+static struct {
+	struct llist_head queue;
+	/* transaction in progress */
+	struct i2c_xfer *cur;
+	enum i2c_state state;
+	/* step within the bit / condition */
+	uint8_t phase;
+	uint8_t bit;
+	uint8_t byte;
+	/* bytes of cur already transmitted (including the address) / received */
+	uint8_t tx_idx;
+	uint8_t rx_idx;
+	/* the address was sent with the read bit */
+	bool reading;
+	/* the slave did not acknowledge */
+	bool nack;
+} i2c;
+
+static inline void sda(bool high)
+{
+	if (high)
+		pin_sda.pio->PIO_SODR = pin_sda.mask;
+	else
+		pin_sda.pio->PIO_CODR = pin_sda.mask;
+}
+
+static inline void scl(bool high)
+{
+	if (high)
+		pin_scl.pio->PIO_SODR = pin_scl.mask;
+	else
+		pin_scl.pio->PIO_CODR = pin_scl.mask;
+}
+
+/* the input buffer of an open-drain output still reflects the line */
+static inline bool sda_get(void)
+{
+	return (pin_sda.pio->PIO_PDSR & pin_sda.mask) != 0;
+}
+
+static void i2c_set_state(enum i2c_state state)
+{
+	i2c.state = state;
+	i2c.phase = 0;
+}
+
+static void i2c_tx_byte(uint8_t byte)
+{
+	i2c.byte = byte;
+	i2c.bit = 0;
+	i2c_set_state(I2C_S_TX);
+}
+
+/* take the next transaction from the queue, or stop the timer */
+static void i2c_next_xfer(void)
+{
+	struct i2c_xfer *xfer = NULL;
+
+	if (!llist_empty(&i2c.queue)) {
+		xfer = llist_entry(i2c.queue.next, struct i2c_xfer, list);
+		llist_del(&xfer->list);
+		INIT_LLIST_HEAD(&xfer->list);
+	}
+	i2c.cur = xfer;
+	if (!xfer) {
+		i2c_set_state(I2C_S_IDLE);
+		I2C_TC->TC_CCR = TC_CCR_CLKDIS;
+		return;
+	}
+	i2c.tx_idx = 0;
+	i2c.rx_idx = 0;
+	i2c.reading = !xfer->wr_len;
+	i2c.nack = false;
+	i2c_set_state(I2C_S_START);
+}
+
+static void i2c_xfer_complete(int status)
+{
+	struct i2c_xfer *xfer = i2c.cur;
+
+	xfer->status = status;
+	if (xfer->done)
+		xfer->done(xfer);
+	i2c_next_xfer();
+}
+
+/* the byte was acknowledged: continue with the next one */
+static void i2c_tx_next(void)
+{
+	struct i2c_xfer *xfer = i2c.cur;
+
+	if (i2c.reading) {
+		i2c.bit = 0;
+		i2c.byte = 0;
+		i2c_set_state(I2C_S_RX);
+	} else if (i2c.tx_idx <= xfer->wr_len) {
+		i2c_tx_byte(xfer->wr[i2c.tx_idx++ - 1]);
+	} else if (xfer->rd_len) {
+		/* repeated START for reading */
+		i2c.reading = true;
+		i2c_set_state(I2C_S_START);
+	} else {
+		i2c_set_state(I2C_S_STOP);
+	}
+}
+
+/* one step of the bus protocol, called every I2C_STEP_US */
+static void i2c_step(void)
+{
+	struct i2c_xfer *xfer = i2c.cur;
+
+	switch (i2c.state) {
+	case I2C_S_START:
+		switch (i2c.phase++) {
+		case 0:
+			sda(1);
+			break;
+		case 1:
+			scl(1);
+			break;
+		case 2:
+			sda(0);
+			break;
+		case 3:
+			scl(0);
+			if (i2c.reading) {
+				i2c_tx_byte(xfer->slave << 1 | 1);
+			} else {
+				i2c.tx_idx = 1;
+				i2c_tx_byte(xfer->slave << 1);
+			}
+			break;
+		}
+		break;
+	case I2C_S_TX:
+		switch (i2c.phase++) {
+		case 0:
+			sda(i2c.byte & 0x80);
+			break;
+		case 1:
+			scl(1);
+			break;
+		case 2:
+			scl(0);
+			i2c.byte <<= 1;
+			i2c.phase = 0;
+			if (++i2c.bit == 8)
+				i2c_set_state(I2C_S_TX_ACK);
+			break;
+		}
+		break;
+	case I2C_S_TX_ACK:
+		switch (i2c.phase++) {
+		case 0:
+			sda(1);
+			break;
+		case 1:
+			scl(1);
+			break;
+		case 2:
+			if (sda_get()) {
+				/* NACK */
+				scl(0);
+				i2c.nack = true;
+				i2c_set_state(I2C_S_STOP);
+				break;
+			}
+			scl(0);
+			i2c_tx_next();
+			break;
+		}
+		break;
+	case I2C_S_RX:
+		switch (i2c.phase++) {
+		case 0:
+			sda(1);
+			break;
+		case 1:
+			scl(1);
+			break;
+		case 2:
+			i2c.byte = i2c.byte << 1 | sda_get();
+			scl(0);
+			i2c.phase = 0;
+			if (++i2c.bit == 8) {
+				xfer->rd[i2c.rx_idx++] = i2c.byte;
+				i2c_set_state(I2C_S_RX_ACK);
+			}
+			break;
+		}
+		break;
+	case I2C_S_RX_ACK:
+		switch (i2c.phase++) {
+		case 0:
+			/* NACK the last byte */
+			sda(i2c.rx_idx >= xfer->rd_len);
+			break;
+		case 1:
+			scl(1);
+			break;
+		case 2:
+			scl(0);
+			if (i2c.rx_idx < xfer->rd_len) {
+				i2c.bit = 0;
+				i2c.byte = 0;
+				i2c_set_state(I2C_S_RX);
+			} else
+				i2c_set_state(I2C_S_STOP);
+			break;
+		}
+		break;
+	case I2C_S_STOP:
+		switch (i2c.phase++) {
+		case 0:
+			sda(0);
+			break;
+		case 1:
+			scl(1);
+			break;
+		case 2:
+			sda(1);
+			i2c_xfer_complete(i2c.nack ? -EIO : 0);
+			break;
+		}
+		break;
+	case I2C_S_IDLE:
+		I2C_TC->TC_CCR = TC_CCR_CLKDIS;
+		break;
+	}
+}
+
+void TC3_IrqHandler(void)
+{
+	if (I2C_TC->TC_SR & TC_SR_CPCS)
+		i2c_step();
+}
+
+void i2c_init(void)
+{
+	PIO_Configure(&pin_scl, 1);
+	PIO_Configure(&pin_sda, 1);
+	/* clock of the PIO input buffer, for reading SDA */
+	PMC_EnablePeripheral(pin_sda.id);
+
+	INIT_LLIST_HEAD(&i2c.queue);
+	i2c.cur = NULL;
+	i2c_set_state(I2C_S_IDLE);
+
+	PMC_EnablePeripheral(ID_TC3);
+	I2C_TC->TC_CCR = TC_CCR_CLKDIS;
+	I2C_TC->TC_CMR = TC_CMR_TCCLKS_TIMER_CLOCK1 |	/* MCK/2 */
+			 TC_CMR_WAVE |
+			 TC_CMR_WAVSEL_UP_RC;
+	I2C_TC->TC_RC = BOARD_MCK / 2 / 1000000 * I2C_STEP_US;
+	I2C_TC->TC_IER = TC_IER_CPCS;
+	/* below everything related to card emulation */
+	NVIC_SetPriority(TC3_IRQn, 15);
+	NVIC_EnableIRQ(TC3_IRQn);
+}
+
+int i2c_xfer_submit(struct i2c_xfer *xfer)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	if (xfer->status == I2C_XFER_PENDING) {
+		local_irq_restore(flags);
+		return -EBUSY;
+	}
+	xfer->status = I2C_XFER_PENDING;
+	llist_add_tail(&xfer->list, &i2c.queue);
+	if (!i2c.cur) {
+		i2c_next_xfer();
+		I2C_TC->TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+	}
+	local_irq_restore(flags);
+
+	return 0;
+}
+
+int i2c_xfer_sync(struct i2c_xfer *xfer)
+{
+	int rc;
+
+	rc = i2c_xfer_submit(xfer);
+	if (rc < 0)
+		return rc;
+	while (xfer->status == I2C_XFER_PENDING)
+		WDT_Restart(WDT);
+
+	return xfer->status;
+}
+
+#endif /* PIN_I2C_SCL */
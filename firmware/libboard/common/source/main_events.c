@@ -0,0 +1,57 @@
+/* Main loop event flags
+ *
+ * Interrupt handlers mark the kind of work they created for the main loop.
+ * The main loop only dispatches the pending work, and sleeps (WFI) while
+ * there is none. SysTick wakes it up at least every ms.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "main_events.h"
+
+/* bit-mask of pending enum main_event */
+static volatile uint32_t main_events;
+
+void main_event_set(enum main_event ev)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	main_events |= (1 << ev);
+	__set_PRIMASK(primask);
+}
+
+uint32_t main_events_wait(void)
+{
+	uint32_t pending;
+
+#if MAIN_LOOP_WFI
+	__disable_irq();
+	while (!(pending = main_events)) {
+		/* a pending interrupt wakes up the core even while interrupts are masked,
+		 * so an event set right after the check can't be missed */
+		__WFI();
+		/* let the interrupt handler run */
+		__enable_irq();
+		__disable_irq();
+	}
+	main_events = 0;
+	__enable_irq();
+#else
+	/* poll everything on every iteration */
+	__disable_irq();
+	main_events = 0;
+	__enable_irq();
+	pending = 0xffffffff;
+#endif
+
+	return pending;
+}
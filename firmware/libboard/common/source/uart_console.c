@@ -44,20 +44,62 @@
 #include <stdio.h>
 #include <stdint.h>
 
-#include "ringbuffer.h"
+#include "utils.h"
 
 /*----------------------------------------------------------------------------
  *        Definitions
  *----------------------------------------------------------------------------*/
 
+/** Size of the console transmit ring (power of two) */
+#ifndef CONSOLE_TX_BUF_LEN
+#define CONSOLE_TX_BUF_LEN	1024
+#endif
+
+#if (CONSOLE_TX_BUF_LEN & (CONSOLE_TX_BUF_LEN - 1)) != 0
+#error "CONSOLE_TX_BUF_LEN must be a power of two"
+#endif
+
 /*----------------------------------------------------------------------------
  *        Variables
  *----------------------------------------------------------------------------*/
 
 /** Is Console Initialized. */
 static uint8_t _ucIsConsoleInitialized=0;
-/** Ring buffer to queue data to be sent */
-static ringbuf uart_tx_buffer;
+/** Ring buffer to queue data to be sent, transmitted by the PDC */
+static struct {
+	uint8_t buf[CONSOLE_TX_BUF_LEN];
+	/* total number of characters written / transmitted (wrap around) */
+	uint32_t wr;
+	uint32_t rd;
+	/* number of characters in the running PDC transfer */
+	uint32_t dma_len;
+	/* characters dropped because the ring was full */
+	uint32_t dropped;
+} uart_tx;
+
+/**
+ * \brief Hand the contiguous part of the ring to the PDC.
+ *
+ * Must be called with interrupts disabled or from the console ISR.
+ */
+static void uart_tx_start(Uart *pUart)
+{
+	uint32_t ofs = uart_tx.rd & (CONSOLE_TX_BUF_LEN - 1);
+	uint32_t len = uart_tx.wr - uart_tx.rd;
+
+	if (len == 0) {
+		pUart->UART_IDR = UART_IDR_ENDTX;
+		return;
+	}
+	/* the part after the wrap-around follows with the next transfer */
+	if (len > CONSOLE_TX_BUF_LEN - ofs)
+		len = CONSOLE_TX_BUF_LEN - ofs;
+
+	uart_tx.dma_len = len;
+	pUart->UART_TPR = (uint32_t) &uart_tx.buf[ofs];
+	pUart->UART_TCR = len;
+	pUart->UART_IER = UART_IER_ENDTX;
+}
 
 /**
  * \brief Configures an USART peripheral with the specified parameters.
@@ -96,10 +138,14 @@ extern void UART_Configure( uint32_t baudrate, uint32_t masterClock)
 	pUart->UART_PTCR = UART_PTCR_RXTDIS | UART_PTCR_TXTDIS;
 
 	/* Reset transmit ring buffer */
-	rbuf_reset(&uart_tx_buffer);
-
-	/* Enable TX interrupts */
-	pUart->UART_IER = UART_IER_TXRDY;
+	uart_tx.wr = uart_tx.rd = 0;
+	uart_tx.dma_len = 0;
+
+	/* The PDC transmits the ring, the ENDTX interrupt is only enabled
+	 * while a transfer is running */
+	pUart->UART_IDR = 0xffffffff;
+	pUart->UART_TCR = 0;
+	pUart->UART_PTCR = UART_PTCR_TXTEN;
 	NVIC_SetPriority(CONSOLE_IRQ, 15); /* lowest priority */
 	NVIC_EnableIRQ(CONSOLE_IRQ);
 	
@@ -120,34 +166,37 @@ void UART_Exit(void)
 	}
 
 	Uart *pUart = CONSOLE_UART;
-	pUart->UART_IDR = UART_IDR_TXRDY;
+	pUart->UART_IDR = UART_IDR_ENDTX;
+	pUart->UART_PTCR = UART_PTCR_RXTDIS | UART_PTCR_TXTDIS;
 	pUart->UART_CR = UART_CR_RSTRX | UART_CR_RSTTX | UART_CR_RXDIS | UART_CR_TXDIS | UART_CR_RSTSTA;
 	PMC->PMC_PCDR0 = 1 << CONSOLE_ID;
 	NVIC_DisableIRQ(CONSOLE_IRQ);
 }
 
-/** Interrupt Service routine to transmit queued data */
+/** Interrupt Service routine called at the end of a PDC transfer */
 void CONSOLE_ISR(void)
 {
 	Uart *uart = CONSOLE_UART;
-	if (uart->UART_SR & UART_SR_TXRDY) {
-		if (!rbuf_is_empty(&uart_tx_buffer)) {
-			uart->UART_THR = rbuf_read(&uart_tx_buffer);
-		} else {
-			uart->UART_IDR = UART_IER_TXRDY;
-		}
+
+	if ((uart->UART_IMR & UART_IMR_ENDTX) && (uart->UART_SR & UART_SR_ENDTX)) {
+		/* only now the transmitted part of the ring may be reused */
+		uart_tx.rd += uart_tx.dma_len;
+		uart_tx.dma_len = 0;
+		uart_tx_start(uart);
 	}
 }
 
 /**
  * \brief Outputs a character on the UART line.
  *
- * \note This function is asynchronous (i.e. uses a buffer and interrupt to complete the transfer).
+ * \note This function is asynchronous (i.e. uses a buffer and the PDC to complete the transfer).
+ * The character is dropped (and counted) if the buffer is full.
  * \param c  Character to send.
  */
 void UART_PutChar( uint8_t uc )
 {
 	Uart *pUart = CONSOLE_UART ;
+	unsigned long state;
 
 	/* Initialize console is not already done */
 	if ( !_ucIsConsoleInitialized )
@@ -155,13 +204,24 @@ void UART_PutChar( uint8_t uc )
 		UART_Configure(CONSOLE_BAUDRATE, BOARD_MCK);
 	}
 
-	if (!rbuf_is_full(&uart_tx_buffer)) {
-		rbuf_write(&uart_tx_buffer, uc);
-		if (!(pUart->UART_IMR & UART_IMR_TXRDY)) {
-			pUart->UART_IER = UART_IER_TXRDY;
-			CONSOLE_ISR();
-		}
-	}
+	local_irq_save(state);
+	if (uart_tx.wr - uart_tx.rd < CONSOLE_TX_BUF_LEN) {
+		uart_tx.buf[uart_tx.wr++ & (CONSOLE_TX_BUF_LEN - 1)] = uc;
+		/* characters written during a transfer follow with the next one */
+		if (!uart_tx.dma_len)
+			uart_tx_start(pUart);
+	} else
+		uart_tx.dropped++;
+	local_irq_restore(state);
+}
+
+/**
+ * \brief Return the number of characters dropped because the console
+ * transmit buffer was full.
+ */
+uint32_t UART_GetTxDropped(void)
+{
+	return uart_tx.dropped;
 }
 
 /**
@@ -180,6 +240,7 @@ void UART_PutChar_Sync( uint8_t uc )
 		UART_Configure(CONSOLE_BAUDRATE, BOARD_MCK);
 	}
 
+	while (pUart->UART_TCR); /* Wait for a running PDC transfer to complete */
 	while (!(pUart->UART_SR & UART_SR_TXRDY)); /* Wait for transfer buffer to be empty */
 	pUart->UART_THR = uc; /* Send data to UART peripheral */
 	while (!(pUart->UART_SR & UART_SR_TXRDY)); /* Wait for transfer buffer to transferred to shift register */
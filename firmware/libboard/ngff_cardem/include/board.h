@@ -123,6 +123,12 @@ void board_set_card_insert(struct cardem_inst *ci, bool card_insert);
 /* Pins used to sniff phone-card communication */
 #define PINS_SIM_SNIFF          PIN_SIM_IO, PIN_SIM_CLK, PIN_SIM_RST_SNIFF
 
+#ifdef SNIFF_USIM1
+/* Second link: also sniff the USIM1 slot using USART1 (build with SNIFF_USIM1=1) */
+#define PIN_SIM_RST_SNIFF2     {PIO_PA24, PIOA, ID_PIOA, PIO_INPUT, PIO_DEGLITCH | PIO_IT_EDGE}
+#define PINS_SIM_SNIFF2         PIN_USIM1_IO, PIN_USIM1_CLK, PIN_SIM_RST_SNIFF2
+#endif
+
 /* Pin to measure card I/O timing (to start measuring the ETU on I/O activity; connected I/O_SIM in schematic) */
 #define PIN_SIM_IO_INPUT       {PIO_PA1B_TIOB0, PIOA, ID_PIOA, PIO_PERIPH_B, PIO_DEFAULT}
 /* Pin used as clock input (to measure the ETU duration; connected to CLK_SIM in schematic) */
@@ -146,7 +152,12 @@ void board_set_card_insert(struct cardem_inst *ci, bool card_insert);
 #define pin_en_mdm_sim_vdd_cem {PIO_PA16, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT}
 
 //trace state: uart2 (!) connected, modem connected to physical sim, st powers sim slot
+#ifdef SNIFF_USIM1
+/* also connect uart1 to the USIM1 slot */
+#define pin_conn_usim1_trace {PIO_PA20, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT}
+#else
 #define pin_conn_usim1_trace {PIO_PA20, PIOA, ID_PIOA, PIO_OUTPUT_1, PIO_DEFAULT}
+#endif
 #define pin_conn_usim2_trace {PIO_PA28, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT}
 #define pin_conn_mdm_sim_trace {PIO_PA0, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT}
 #define pin_conn_set_sim_det_trace {PIO_PA13, PIOA, ID_PIOA, PIO_OUTPUT_1, PIO_DEFAULT}
@@ -12,13 +12,7 @@
  */
 #pragma once
 
-#include <stdbool.h>
-
-void i2c_pin_init(void);
-
-bool i2c_write_byte(bool send_start, bool send_stop, uint8_t byte);
-uint8_t i2c_read_byte(bool nack, bool send_stop);
-void i2c_stop_cond(void);
+#include "i2c_async.h"
 
 int eeprom_write_byte(uint8_t slave, uint8_t addr, uint8_t byte);
 int eeprom_read_byte(uint8_t slave, uint8_t addr);
@@ -73,7 +73,7 @@ void board_main_top(void)
 	usb_buf_init();
 
 	mux_init();
-	i2c_pin_init();
+	i2c_init();
 	/* PORT A: all outputs, Port B0 output, B1..B7 unused */
 	if (mcp23017_init(MCP23017_ADDRESS, 0x00, 0xfe) == 0) {
 		mcp2317_present = true;
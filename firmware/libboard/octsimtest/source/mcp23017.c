@@ -1,5 +1,6 @@
 #include "board.h"
 #include <stdbool.h>
+#include "utils.h"
 #include "i2c.h"
 #include "mcp23017.h"
 
@@ -35,61 +36,84 @@
 #define MCP23017_INT_ERR 255
 
 
-//bool i2c_write_byte(bool send_start, bool send_stop, uint8_t byte)
-//uint8_t i2c_read_byte(bool nack, bool send_stop)
-//static void i2c_stop_cond(void)
+static int mcp23017_write_byte(uint8_t slave, uint8_t addr, uint8_t byte)
+{
+	struct i2c_xfer xfer = {
+		.slave = slave,
+		.wr = { addr, byte },
+		.wr_len = 2,
+	};
+
+	return i2c_xfer_sync(&xfer) < 0 ? -1 : 0;
+}
 
-int mcp23017_write_byte(uint8_t slave, uint8_t addr, uint8_t byte)
+static int mcp23017_read_byte(uint8_t slave, uint8_t addr)
 {
-	bool nack;
-
-	WDT_Restart(WDT);
-
-//	 Write slave address 
-	nack = i2c_write_byte(true, false, slave << 1);
-	if (nack)
-		goto out_stop;
-	nack = i2c_write_byte(false, false, addr);
-	if (nack)
-		goto out_stop;
-	nack = i2c_write_byte(false, true, byte);
-	if (nack)
-		goto out_stop;
-
-out_stop:
-	i2c_stop_cond();
-	if (nack)
+	struct i2c_xfer xfer = {
+		.slave = slave,
+		.wr = { addr },
+		.wr_len = 1,
+		.rd_len = 1,
+	};
+
+	if (i2c_xfer_sync(&xfer) < 0)
 		return -1;
-	else
-		return 0;
+	return xfer.rd[0];
 }
 
-int mcp23017_read_byte(uint8_t slave, uint8_t addr)
+/* Output latches are written in the background, as they are changed from
+ * card emulation (e.g. card insert when switching slots).  If a value changes
+ * again while it is still being written, only the latest one is written. */
+static struct {
+	struct i2c_xfer xfer;
+	uint8_t slave;
+	/* requested values of OLATA, OLATB */
+	uint8_t olat[2];
+	/* bit mask of olat[] not written yet */
+	uint8_t dirty;
+} mcp_out;
+
+/* called with interrupts disabled, or from the I2C interrupt */
+static void mcp23017_out_kick(void)
 {
-	bool nack;
-
-	WDT_Restart(WDT);
-
-	// dummy write cycle
-	nack = i2c_write_byte(true, false, slave << 1);
-	if (nack)
-		goto out_stop;
-	nack = i2c_write_byte(false, false, addr);
-	if (nack)
-		goto out_stop;
-	// Re-start with read
-	nack = i2c_write_byte(true, false, (slave << 1) | 1);
-	if (nack)
-		goto out_stop;
-
-	return i2c_read_byte(true, true);
-
-out_stop:
-	i2c_stop_cond();
-	if (nack)
-		return -1;
-	else
-		return 0;
+	unsigned int i;
+
+	if (mcp_out.xfer.status == I2C_XFER_PENDING)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(mcp_out.olat); i++) {
+		if (!(mcp_out.dirty & (1 << i)))
+			continue;
+		mcp_out.dirty &= ~(1 << i);
+		mcp_out.xfer.slave = mcp_out.slave;
+		mcp_out.xfer.wr[0] = MCP23017_OLATA + i;
+		mcp_out.xfer.wr[1] = mcp_out.olat[i];
+		mcp_out.xfer.wr_len = 2;
+		i2c_xfer_submit(&mcp_out.xfer);
+		return;
+	}
+}
+
+static void mcp23017_out_done(struct i2c_xfer *xfer)
+{
+	if (xfer->status < 0)
+		TRACE_ERROR("mcp23017: writing 0x%02x failed\n\r", xfer->wr[0]);
+	mcp23017_out_kick();
+}
+
+static int mcp23017_set_output(uint8_t slave, unsigned int port, uint8_t val)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	mcp_out.xfer.done = mcp23017_out_done;
+	mcp_out.slave = slave;
+	mcp_out.olat[port] = val;
+	mcp_out.dirty |= 1 << port;
+	mcp23017_out_kick();
+	local_irq_restore(flags);
+
+	return 0;
 }
 
 int mcp23017_init(uint8_t slave, uint8_t iodira, uint8_t iodirb)
@@ -126,14 +150,16 @@ int mcp23017_test(uint8_t slave)
 	return 0;
 }
 
+/* queue writing the output latch of port A (does not wait) */
 int mcp23017_set_output_a(uint8_t slave, uint8_t val)
 {
-	return mcp23017_write_byte(slave, MCP23017_OLATA, val);
+	return mcp23017_set_output(slave, 0, val);
 }
 
+/* queue writing the output latch of port B (does not wait) */
 int mcp23017_set_output_b(uint8_t slave, uint8_t val)
 {
-	return mcp23017_write_byte(slave, MCP23017_OLATB, val);
+	return mcp23017_set_output(slave, 1, val);
 }
 
 int mcp23017_toggle(uint8_t slave)
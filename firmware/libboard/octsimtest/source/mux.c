@@ -14,11 +14,14 @@
  */
 
 #include "board.h"
+#include "utils.h"
 #include "mux.h"
 #include <stdbool.h>
 #include <errno.h>
 
-/* 3-bit S0..S2 signal for slot selection */
+/* 3-bit S0..S2 signal for slot selection (consecutive bits, so they can be written at once) */
+#define IN_SEL_SHIFT	1
+#define IN_SEL_MASK	(7 << IN_SEL_SHIFT)
 static const Pin pin_in_sel[3] = {
 	{ PIO_PA1, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT },
 	{ PIO_PA2, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT },
@@ -26,6 +29,8 @@ static const Pin pin_in_sel[3] = {
 };
 
 /* 3-bit S0..S2 signal for frequency divider selection */
+#define FREQ_SEL_SHIFT	16
+#define FREQ_SEL_MASK	(7 << FREQ_SEL_SHIFT)
 static const Pin pin_freq_sel[3] = {
 	{ PIO_PA16, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT },
 	{ PIO_PA17, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT },
@@ -35,7 +40,20 @@ static const Pin pin_freq_sel[3] = {
 /* low-active output enable for all muxes */
 static const Pin pin_oe = { PIO_PA19, PIOA, ID_PIOA, PIO_OUTPUT_1, PIO_DEFAULT };
 
-static uint8_t g_mux_slot = 0;
+static uint8_t g_mux_slot = 0xff;
+
+/* set the 3-bit field mask/shift of the PIOA outputs to val.  All bits change with a single
+ * write of the output data status register, so the mux never sees an intermediate code.
+ * Only the IN_SEL and FREQ_SEL pins are enabled for writes to PIO_ODSR (see mux_init()) */
+static inline void pio_write_field(uint32_t mask, unsigned int shift, uint8_t val)
+{
+	uint32_t bits = ((uint32_t) val << shift) & mask;
+	unsigned long x;
+
+	local_irq_save(x);
+	PIOA->PIO_ODSR = (PIOA->PIO_ODSR & ~mask) | bits;
+	local_irq_restore(x);
+}
 
 /* initialize the external 1:8 multiplexers */
 void mux_init(void)
@@ -43,6 +61,8 @@ void mux_init(void)
 	PIO_Configure(&pin_oe, PIO_LISTSIZE(pin_oe));
 	PIO_Configure(pin_in_sel, PIO_LISTSIZE(pin_in_sel));
 	PIO_Configure(pin_freq_sel, PIO_LISTSIZE(pin_freq_sel));
+	/* the selection fields are written at once through PIO_ODSR */
+	PIOA->PIO_OWER = IN_SEL_MASK | FREQ_SEL_MASK;
 
 	mux_set_slot(0);
 }
@@ -50,29 +70,21 @@ void mux_init(void)
 /* set the slot selection mux */
 int mux_set_slot(uint8_t s)
 {
-	TRACE_INFO("%s(%u)\r\n", __func__, s);
+	TRACE_DEBUG("%s(%u)\r\n", __func__, s);
 
 	if (s > 7)
 		return -EINVAL;
+	/* don't disturb an already connected card */
+	if (s == g_mux_slot)
+		return s;
 
 	/* !OE = H: disconnect input and output of muxes */
-	PIO_Set(&pin_oe);
-
-	if (s & 1)
-		PIO_Set(&pin_in_sel[0]);
-	else
-		PIO_Clear(&pin_in_sel[0]);
-	if (s & 2)
-		PIO_Set(&pin_in_sel[1]);
-	else
-		PIO_Clear(&pin_in_sel[1]);
-	if (s & 4)
-		PIO_Set(&pin_in_sel[2]);
-	else
-		PIO_Clear(&pin_in_sel[2]);
+	PIOA->PIO_SODR = pin_oe.mask;
+
+	pio_write_field(IN_SEL_MASK, IN_SEL_SHIFT, s);
 
 	/* !OE = L: (re-)enable the output of muxes */
-	PIO_Clear(&pin_oe);
+	PIOA->PIO_CODR = pin_oe.mask;
 
 	g_mux_slot = s;
 	return s;
@@ -86,24 +98,13 @@ int mux_get_slot(void)
 /* set the frequency divider mux */
 void mux_set_freq(uint8_t s)
 {
-	TRACE_INFO("%s(%u)\r\n", __func__, s);
+	TRACE_DEBUG("%s(%u)\r\n", __func__, s);
 
 	/* no need for 'break before make' here, this would also affect
 	 * the SIM card I/O signals which we don't want to disturb */
 
-	if (s & 1)
-		PIO_Set(&pin_freq_sel[0]);
-	else
-		PIO_Clear(&pin_freq_sel[0]);
-	if (s & 2)
-		PIO_Set(&pin_freq_sel[1]);
-	else
-		PIO_Clear(&pin_freq_sel[1]);
-	if (s & 4)
-		PIO_Set(&pin_freq_sel[2]);
-	else
-		PIO_Clear(&pin_freq_sel[2]);
+	pio_write_field(FREQ_SEL_MASK, FREQ_SEL_SHIFT, s);
 
 	/* !OE = L: ensure enable the output of muxes */
-	PIO_Clear(&pin_oe);
+	PIOA->PIO_CODR = pin_oe.mask;
 }
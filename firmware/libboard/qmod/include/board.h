@@ -99,6 +99,10 @@
 #define PIN_SIM_SWITCH1 {PIO_PA20, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT}
 #define PIN_SIM_SWITCH2 {PIO_PA28, PIOA, ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT}
 
+/* I2C bus towards the hub EEPROM, driven by i2c_async.c (PA30/31 are no TWI pins) */
+#define PIN_I2C_SDA	{PIO_PA30, PIOA, ID_PIOA, PIO_OUTPUT_1, PIO_OPENDRAIN}
+#define PIN_I2C_SCL	{PIO_PA31, PIOA, ID_PIOA, PIO_OUTPUT_1, PIO_OPENDRAIN}
+
 #define BOARD_USB_BMATTRIBUTES	USBConfigurationDescriptor_SELFPOWERED_NORWAKEUP
 
 #define BOARD_USB_VENDOR_ID	USB_VENDOR_OPENMOKO
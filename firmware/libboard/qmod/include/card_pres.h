@@ -14,5 +14,11 @@
  */
 #pragma once
 
+#include <stdint.h>
+
 int is_card_present(int port);
+int card_present_state(int port);
+/* Process debounced presence changes (call from the main loop, at least every
+ * few ms while an edge is pending); returns bit-mask of ports that changed */
+uint32_t card_present_poll(void);
 int card_present_init(void);
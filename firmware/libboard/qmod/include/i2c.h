@@ -12,6 +12,7 @@
  */
 #pragma once
 
-void i2c_pin_init(void);
+#include "i2c_async.h"
+
 int eeprom_write_byte(uint8_t slave, uint8_t addr, uint8_t byte);
 int eeprom_read_byte(uint8_t slave, uint8_t addr);
@@ -331,7 +331,7 @@ void board_main_top(void)
 	PIO_Configure(&pin_peer_erase, 1);
 
 #ifndef APPLICATION_dfu
-	i2c_pin_init();
+	i2c_init();
 #endif
 
 	if (qmod_sam3_is_12()) {
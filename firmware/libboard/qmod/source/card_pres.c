@@ -12,18 +12,23 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
-#include <osmocom/core/timer.h>
 #include "board.h"
 #include "utils.h"
+#include "main_events.h"
 #include "card_pres.h"
 
 #define NUM_CARDPRES	2
 
-#define TIMER_INTERVAL_MS	500
+/* the state must be stable for this long after the last edge to be reported */
+#define DEBOUNCE_MS	50
+
+extern volatile uint32_t jiffies;
 
 static const Pin pin_cardpres[NUM_CARDPRES] = { PIN_DET_USIM1_PRES, PIN_DET_USIM2_PRES };
 static int last_state[NUM_CARDPRES] = { -1, -1 };
-static struct osmo_timer_list cardpres_timer;
+/* time of the last edge, and bit-mask of ports with an edge not yet debounced */
+static volatile uint32_t edge_jiffies[NUM_CARDPRES];
+static volatile uint32_t edge_pending;
 
 /* Determine if a SIM card is present in the given slot */
 int is_card_present(int port)
@@ -42,20 +47,54 @@ int is_card_present(int port)
 	return present;
 }
 
-static void cardpres_tmr_cb(void *data)
+/* Debounced state of the card presence in the given slot */
+int card_present_state(int port)
+{
+	if (port < 0 || port >= NUM_CARDPRES)
+		return -1;
+	return last_state[port];
+}
+
+static void cardpres_irqhandler(const Pin *pPin)
+{
+	unsigned int i = pPin - pin_cardpres;
+
+	if (i >= NUM_CARDPRES)
+		return;
+	/* (re)start debouncing, the state is only sampled once it settled */
+	edge_jiffies[i] = jiffies;
+	edge_pending |= (1 << i);
+	main_event_set(MAIN_EV_PIO);
+}
+
+uint32_t card_present_poll(void)
 {
+	uint32_t changed = 0;
 	unsigned int i;
 
+	if (!edge_pending)
+		return 0;
+
 	for (i = 0; i < ARRAY_SIZE(pin_cardpres); i++) {
-		int state = is_card_present(i);
+		int state;
+
+		__disable_irq();
+		if (!(edge_pending & (1 << i)) || jiffies - edge_jiffies[i] < DEBOUNCE_MS) {
+			__enable_irq();
+			continue;
+		}
+		edge_pending &= ~(1 << i);
+		__enable_irq();
+
+		state = is_card_present(i);
 		if (state != last_state[i]) {
 			TRACE_INFO("%u: Card Detect Status %d -> %d\r\n", i, last_state[i], state);
-			/* FIXME: report to USB host */
 			last_state[i] = state;
+			changed |= (1 << i);
 		}
 	}
 
-	osmo_timer_schedule(&cardpres_timer, 0, TIMER_INTERVAL_MS*1000);
+	return changed;
 }
 
 int card_present_init(void)
@@ -64,9 +103,11 @@ int card_present_init(void)
 
 	PIO_Configure(pin_cardpres, ARRAY_SIZE(pin_cardpres));
 
-	/* start timer */
-	cardpres_timer.cb = cardpres_tmr_cb;
-	osmo_timer_schedule(&cardpres_timer, 0, TIMER_INTERVAL_MS*1000);
+	for (i = 0; i < ARRAY_SIZE(pin_cardpres); i++) {
+		last_state[i] = is_card_present(i);
+		PIO_ConfigureIt(&pin_cardpres[i], cardpres_irqhandler);
+		PIO_EnableIt(&pin_cardpres[i]);
+	}
 
 	return 2;
 }
@@ -43,15 +43,34 @@ void card_emu_process_rx_byte(struct card_handle *ch, uint8_t byte);
 /* transmit a single byte to the reader */
 int card_emu_tx_byte(struct card_handle *ch);
 
+/* UART driver informs us that a DMA transmission has completed */
+int card_emu_tx_dma_done(struct card_handle *ch);
+
 /* hardware driver informs us that a card I/O signal has changed */
 void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active);
 
+/* board driver informs us that the (debounced) card presence has changed */
+void card_emu_set_card_present(struct card_handle *ch, bool present);
+/* measured SIM clock frequency in Hz, 0 if unknown */
+void card_emu_set_clk_hz(struct card_handle *ch, uint32_t hz);
+
 /* User sets a new ATR to be returned during next card reset */
 int card_emu_set_atr(struct card_handle *ch, const uint8_t *atr, uint8_t len);
+/* copy the ATR set by the user (before applying the speed policy), returns its length */
+uint8_t card_emu_get_atr(struct card_handle *ch, uint8_t *atr, uint8_t len);
+
+struct msgb;
+
+/* allocate a USB buffer with simtrace_msg_hdr / update msg_len and submit it */
+struct msgb *usb_buf_alloc_st(uint8_t ep, uint8_t msg_class, uint8_t msg_type);
+void usb_buf_upd_len_and_submit(struct msgb *msg);
 
 struct llist_head *card_emu_get_uart_tx_queue(struct card_handle *ch);
 void card_emu_have_new_uart_tx(struct card_handle *ch);
 void card_emu_report_status(struct card_handle *ch, bool report_on_irq);
+void card_emu_report_stats(struct card_handle *ch);
+/* send SIMTRACE_CMD_DO_ERROR for a rejected request of type msg_type */
+void card_emu_report_error(struct card_handle *ch, uint8_t msg_type, int rc);
 
 void card_emu_wtime_half_expired(void *ch);
 void card_emu_wtime_expired(void *ch);
@@ -65,12 +84,26 @@ int card_emu_uart_update_fidi(uint8_t uart_chan, unsigned int fidi);
 void card_emu_uart_update_wt(uint8_t uart_chan, uint32_t wt);
 void card_emu_uart_reset_wt(uint8_t uart_chan);
 int card_emu_uart_tx(uint8_t uart_chan, uint8_t byte);
+int card_emu_uart_tx_dma(uint8_t uart_chan, const uint8_t *data, uint16_t len);
+void card_emu_uart_tx_dma_abort(uint8_t uart_chan);
 void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx);
 void card_emu_uart_wait_tx_idle(uint8_t uart_chan);
 void card_emu_uart_interrupt(uint8_t uart_chan);
+struct cardemu_usb_msg_stats;
+void card_emu_uart_get_stats(uint8_t uart_chan, struct cardemu_usb_msg_stats *st);
 
 int card_emu_get_vcc(uint8_t uart_chan);
+/* connect the card to another slot of the external mux (if there is one) */
+void card_emu_select_slot(uint8_t uart_chan, uint8_t slot);
 
 struct cardemu_usb_msg_config;
 int card_emu_set_config(struct card_handle *ch, const struct cardemu_usb_msg_config *scfg,
 			unsigned int scfg_len);
+/* like card_emu_set_config(), without reporting to the host (e.g. at start-up) */
+int card_emu_apply_config(struct card_handle *ch, const struct cardemu_usb_msg_config *scfg,
+			  unsigned int scfg_len);
+void card_emu_get_config(struct card_handle *ch, struct cardemu_usb_msg_config *cfg);
+
+int card_emu_cache_add(struct card_handle *ch, struct msgb *msg);
+void card_emu_cache_flush(struct card_handle *ch);
+int card_emu_sched_add(struct card_handle *ch, struct msgb *msg);
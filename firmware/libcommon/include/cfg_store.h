@@ -0,0 +1,44 @@
+/* Flash backed store for the card emulation configuration
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "simtrace_prot.h"
+
+/* number of card emulation slots kept in the store */
+#define CFG_STORE_NUM_SLOTS	2
+/* TS plus 32 characters */
+#define CFG_STORE_ATR_LEN_MAX	33
+
+/* configuration of one slot, as applied at start-up */
+struct cfg_store_slot {
+	/* the slot holds a configuration */
+	uint8_t valid;
+	uint8_t atr_len;
+	uint8_t atr[CFG_STORE_ATR_LEN_MAX];
+	struct cardemu_usb_msg_config cfg;
+} __attribute__ ((packed));
+
+/* find the latest valid record in flash */
+void cfg_store_init(void);
+
+/* stored configuration of a slot, or NULL if there is none */
+const struct cfg_store_slot *cfg_store_get(uint8_t slot);
+
+/* write a new record with the configuration of a slot (NULL to forget it).
+ * Stalls the CPU for a few milliseconds while the flash is programmed.
+ * Returns 0 on success, negative errno otherwise. */
+int cfg_store_set(uint8_t slot, const struct cfg_store_slot *s);
+
+/* sequence number of the latest record (number of writes so far) */
+uint32_t cfg_store_seq(void);
@@ -0,0 +1,26 @@
+/* Free-running cycle counter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "board.h"
+
+/* resolution of the cycle counter, in BOARD_MCK cycles */
+#define CYCLE_COUNTER_DIV	8
+
+/* start the cycle counter (can be called by every user). It counts
+ * BOARD_MCK cycles in steps of CYCLE_COUNTER_DIV, keeps running while the
+ * core sleeps (WFI), and wraps around after about 74s, so users have to
+ * extend it themselves */
+void cycle_counter_init(void);
+uint32_t cycle_counter_get(void);
@@ -0,0 +1,73 @@
+/* Deferred binary logging
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "trace.h"
+#include "simtrace_prot.h"
+
+/* size of the RAM ring in 32bit words (power of two, 0 disables deferred
+ * logging: DLOG_*() then print on the console like TRACE_*()) */
+#ifndef DLOG_NUM_WORDS
+#define DLOG_NUM_WORDS		256
+#endif
+
+/* maximum number of arguments per message */
+#define DLOG_MAX_ARGS		8
+
+#if defined(__ARM) && (DLOG_NUM_WORDS > 0)
+
+void dlog_init(void);
+/* record a message; safe to call from interrupt context.  Use DLOG_*() */
+void dlog_write(uint8_t level, uint16_t fmt, unsigned int num_args, ...);
+
+struct msgb;
+/* handle a SIMTRACE_CMD_BD_DLOG request, append the response to msg */
+void dlog_dump(struct msgb *msg);
+
+#define _DLOG_NARGS(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...)	N
+#define DLOG_NARGS(...)	_DLOG_NARGS(0, ## __VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+
+/* The format string is not formatted on the target: it is placed in the
+ * .dlog_fmt section, which is not loaded into flash but extracted into
+ * the .dlog table file at build time.  Only its offset and the raw 32bit
+ * arguments are recorded; the host formats the message.  %s arguments
+ * must point to constant strings in flash. */
+#define _DLOG(level, fmt, ...)							\
+	do {									\
+		static const char __dlog_fmt[]					\
+			__attribute__((section(".dlog_fmt"), used)) = fmt;	\
+		dlog_write(level, (uint32_t) __dlog_fmt,			\
+			   DLOG_NARGS(__VA_ARGS__), ## __VA_ARGS__);		\
+	} while (0)
+
+#if (TRACE_LEVEL >= TRACE_LEVEL_DEBUG)
+#define DLOG_DEBUG(fmt, ...)	_DLOG(TRACE_LEVEL_DEBUG, fmt, ## __VA_ARGS__)
+#else
+#define DLOG_DEBUG(...)		do { } while (0)
+#endif
+
+#if (TRACE_LEVEL >= TRACE_LEVEL_INFO)
+#define DLOG_INFO(fmt, ...)	_DLOG(TRACE_LEVEL_INFO, fmt, ## __VA_ARGS__)
+#else
+#define DLOG_INFO(...)		do { } while (0)
+#endif
+
+#else
+
+/* host unit tests and builds without deferred logging */
+static inline void dlog_init(void) {}
+#define DLOG_DEBUG	TRACE_DEBUG
+#define DLOG_INFO	TRACE_INFO
+
+#endif
@@ -0,0 +1,39 @@
+/* Binary firmware event tracer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "simtrace_prot.h"
+
+/* number of records kept in RAM (power of two, 0 disables the tracer) */
+#ifndef EVTRACE_NUM_RECS
+#define EVTRACE_NUM_RECS	128
+#endif
+
+#if defined(__ARM) && (EVTRACE_NUM_RECS > 0)
+
+void evtrace_init(void);
+/* record an event; safe to call from interrupt context */
+void evtrace_log(enum simtrace_evtrace_id id, uint32_t arg);
+
+struct msgb;
+/* handle a SIMTRACE_CMD_BD_EVTRACE request, append the response to msg */
+void evtrace_dump(struct msgb *msg, const struct simtrace_evtrace_req *req);
+
+#else
+
+/* host unit tests and builds without tracer */
+static inline void evtrace_init(void) {}
+static inline void evtrace_log(enum simtrace_evtrace_id id, uint32_t arg) {}
+
+#endif
@@ -66,6 +66,34 @@
 /** NULL byte to restart byte procedure */
 #define ISO_NULL_VAL            0x60
 
+/** Smallest F/D the reader side negotiates with PPS */
+#ifndef ISO7816_MIN_FD_RATIO
+#define ISO7816_MIN_FD_RATIO    31
+#endif
+
+/** Transfer status for protocol errors (not a US_CSR bit) */
+#define ISO7816_XFR_PROTO_ERROR (1u << 31)
+
+/** Interface parameters announced in an ATR, see ISO7816_ParseATR() */
+struct iso7816_atr_params {
+	/* bit mask of the offered protocols */
+	uint16_t protocols;
+	/* first offered protocol, or the one of the specific mode */
+	uint8_t protocol;
+	/* TA2 present: specific mode, PPS not possible */
+	bool specific;
+	/* TA1 (Fi/Di) */
+	uint8_t fi_di;
+	/* TC1 (extra guard time N) */
+	uint8_t guard_time;
+	/* TC2 (T=0 waiting integer) */
+	uint8_t wi;
+	/* first TA, TB and TC for T=1: IFSC, BWI/CWI, CRC instead of LRC */
+	uint8_t ifsc;
+	uint8_t bwi_cwi;
+	uint8_t t1_crc;
+};
+
 /*------------------------------------------------------------------------------
  *         Exported functions
  *----------------------------------------------------------------------------*/
@@ -79,12 +107,35 @@ extern uint32_t ISO7816_XfrBlockTPDU_T0(const uint8_t *pAPDU,
 					                    uint8_t *pMessage,
 					                    uint16_t wLength,
 					                    uint16_t *retlen);
+/** Completion of an interrupt driven TPDU transfer: US_CSR error bits or 0 */
+typedef void (*ISO7816_XfrDoneCb)(uint32_t status, uint16_t len);
+extern int ISO7816_XfrBlockTPDU_T0_Start(const uint8_t *pAPDU,
+					 uint8_t *pMessage,
+					 uint16_t wLength,
+					 uint16_t wMaxResp,
+					 ISO7816_XfrDoneCb cb);
+extern int ISO7816_XfrBlockAPDU_T0_Start(const uint8_t *pAPDU,
+					 uint8_t *pMessage,
+					 uint16_t wLength,
+					 uint16_t wMaxResp,
+					 ISO7816_XfrDoneCb cb);
+extern void ISO7816_T0_SetWaitingTime(uint32_t etu);
+extern void ISO7816_T0_IrqHandler(void);
+extern void ISO7816_T0_Abort(void);
+extern void ISO7816_TimeoutStart(uint32_t etu);
+extern bool ISO7816_TimeoutExpired(void);
+extern void ISO7816_TimeoutStop(void);
 extern void ISO7816_Escape( void );
 extern void ISO7816_RestartClock(void);
 extern void ISO7816_StopClock( void );
 extern void ISO7816_toAPDU( void );
 extern uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength );
 extern void ISO7816_SetDataRateandClockFrequency( uint32_t dwClockFrequency, uint32_t dwDataRate );
+extern int ISO7816_ParseATR(const uint8_t *pAtr, uint8_t length, struct iso7816_atr_params *params);
+extern uint8_t ISO7816_BestFiDi(uint8_t fi_di);
+extern int ISO7816_SetFiDi(uint8_t fi_di);
+extern uint32_t ISO7816_PPS(uint8_t protocol, uint8_t *pFiDi);
+extern void ISO7816_SetProtocol(uint8_t protocol, uint8_t fi_di, uint8_t guard_time);
 extern uint8_t ISO7816_StatusReset( void );
 extern void ISO7816_cold_reset( void );
 extern void ISO7816_warm_reset( void );
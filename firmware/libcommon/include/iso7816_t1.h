@@ -0,0 +1,35 @@
+/* ISO7816-3 T=1 block transmission protocol for the CCID reader
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "iso7816_4.h"
+
+/* IFSD announced to the card with S(IFS request) */
+#define ISO7816_T1_IFSD		254
+
+/* (re)start the protocol after the ATR / PPS with the card's IFSC and
+ * BWI/CWI (first TA and TB for T=1, see struct iso7816_atr_params) */
+void ISO7816_T1_Init(uint8_t ifsc, uint8_t bwi_cwi);
+
+/* exchange a command APDU, chaining it into I-blocks of at most IFSC bytes
+ * and the response into the buffer.  cb is called from interrupt context. */
+int ISO7816_XfrBlockAPDU_T1_Start(const uint8_t *pAPDU, uint8_t *pMessage,
+				  uint16_t wLength, uint16_t wMaxResp,
+				  ISO7816_XfrDoneCb cb);
+
+/* to be called from the USART_SIM interrupt */
+void ISO7816_T1_IrqHandler(void);
+
+/* abort a transfer without calling its callback */
+void ISO7816_T1_Abort(void);
@@ -28,7 +28,9 @@ typedef struct ringbuf {
 void rbuf_reset(volatile ringbuf * rb);
 uint8_t rbuf_read(volatile ringbuf * rb);
 uint8_t rbuf_peek(volatile ringbuf * rb);
+size_t rbuf_read_buf(volatile ringbuf * rb, uint8_t *data, size_t len);
 int rbuf_write(volatile ringbuf * rb, uint8_t item);
+size_t rbuf_write_buf(volatile ringbuf * rb, const uint8_t *data, size_t len);
 bool rbuf_is_empty(volatile ringbuf * rb);
 bool rbuf_is_full(volatile ringbuf * rb);
 
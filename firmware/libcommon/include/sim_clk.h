@@ -0,0 +1,34 @@
+/* Background measurement of the SIM clock frequency
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* SIM clock cycles between two compare interrupts (16 bit counter) */
+#define SIM_CLK_PERIOD		50000
+/* minimum duration of a measurement */
+#define SIM_CLK_WINDOW_MS	250
+
+/* start measuring the clock on TCLK<tc_chan> (channel 0 or 2 of TC0) */
+void sim_clk_init(uint8_t tc_chan);
+void sim_clk_exit(uint8_t tc_chan);
+/* forget the measured frequency, e.g. when a new card session starts */
+void sim_clk_reset(uint8_t tc_chan);
+/* detect a stopped clock; called from the main loop */
+void sim_clk_poll(void);
+
+/* latest measured frequency in Hz (kept while the clock is stopped), 0 if unknown */
+uint32_t sim_clk_hz(uint8_t tc_chan);
+/* the clock was running, and has stopped (clock stop mode) */
+bool sim_clk_stopped(uint8_t tc_chan);
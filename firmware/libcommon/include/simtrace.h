@@ -117,6 +117,7 @@ extern void MITM_run( void );
 /*  IRQ functions   */
 extern void Sniffer_usart0_irq(void);
 extern void Sniffer_usart1_irq(void);
+extern void CCID_usart_irq(void);
 extern void mode_cardemu_usart0_irq(void);
 extern void mode_cardemu_usart1_irq(void);
 
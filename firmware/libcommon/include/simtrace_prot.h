@@ -40,6 +40,12 @@ enum simtrace_msg_type_generic {
 	SIMTRACE_CMD_DO_ERROR	= 0,
 	/* Request/Response for simtrace_board_info */
 	SIMTRACE_CMD_BD_BOARD_INFO,
+	/* Request/Response for reading the firmware event trace */
+	SIMTRACE_CMD_BD_EVTRACE,
+	/* Request/Response for reading the deferred log */
+	SIMTRACE_CMD_BD_DLOG,
+	/* Request/Response for reading USB start-of-frame time stamps */
+	SIMTRACE_CMD_BD_TIMESYNC,
 };
 
 /* SIMTRACE_MSGC_CARDEM */
@@ -60,6 +66,18 @@ enum simtrace_msg_type_cardem {
 	SIMTRACE_MSGT_DO_CEMU_PTS,
 	/* Set configurable parameters */
 	SIMTRACE_MSGT_BD_CEMU_CONFIG,
+	/* Add a response to the on-device TPDU response cache */
+	SIMTRACE_MSGT_DT_CEMU_CACHE_ADD,
+	/* Remove all entries from the on-device TPDU response cache */
+	SIMTRACE_MSGT_DT_CEMU_CACHE_FLUSH,
+	/* Get VCC voltage trace Request / Response */
+	SIMTRACE_MSGT_BD_CEMU_VCC,
+	/* Set (or append to) the slot schedule of an external mux */
+	SIMTRACE_MSGT_DT_CEMU_SCHEDULE,
+	/* Indicate the schedule entry that became active */
+	SIMTRACE_MSGT_DO_CEMU_SCHED_STEP,
+	/* Store the ATR and configuration in flash Request / Response */
+	SIMTRACE_MSGT_BD_CEMU_PERSIST,
 };
 
 /* SIMTRACE_MSGC_MODEM */
@@ -84,6 +102,16 @@ enum simtrace_msg_type_sniff {
 	SIMTRACE_MSGT_SNIFF_PPS,
 	/* TPDU data */
 	SIMTRACE_MSGT_SNIFF_TPDU,
+	/* ATR data, with reception time-stamps */
+	SIMTRACE_MSGT_SNIFF_ATR_TS,
+	/* PPS (request or response) data, with reception time-stamps */
+	SIMTRACE_MSGT_SNIFF_PPS_TS,
+	/* TPDU data, with reception time-stamps */
+	SIMTRACE_MSGT_SNIFF_TPDU_TS,
+	/* SIM clock frequency measured, changed or stopped */
+	SIMTRACE_MSGT_SNIFF_CLK,
+	/* Sniffer configuration (host to device: set it, device to host: the resulting one) */
+	SIMTRACE_MSGT_SNIFF_CONFIG,
 };
 
 /* common message header */
@@ -174,6 +202,117 @@ struct simtrace_board_info {
 	/* cap_generic + cap_vendor */
 } __attribute__ ((packed));
 
+/* firmware event trace record identifiers */
+enum simtrace_evtrace_id {
+	SIMTRACE_EVT_NONE = 0,
+	/* USART interrupt handler entry (arg: USART status) / exit (arg: slot) */
+	SIMTRACE_EVT_USART_ISR_ENTER,
+	SIMTRACE_EVT_USART_ISR_EXIT,
+	/* card emulation state changes (arg: slot << 16 | new state) */
+	SIMTRACE_EVT_ISO_STATE,
+	SIMTRACE_EVT_TPDU_STATE,
+	/* USB IN message queued / transfer started / transfer completed
+	 * (arg: endpoint << 16 | length) */
+	SIMTRACE_EVT_USB_IN_QUEUE,
+	SIMTRACE_EVT_USB_IN_SUBMIT,
+	SIMTRACE_EVT_USB_IN_DONE,
+	/* USB OUT transfer completed (arg: endpoint << 16 | length) */
+	SIMTRACE_EVT_USB_OUT_DONE,
+	/* half / full waiting time expired (arg: slot) */
+	SIMTRACE_EVT_WT_HALF_EXPIRED,
+	SIMTRACE_EVT_WT_EXPIRED,
+};
+
+/* SIMTRACE_CMD_BD_EVTRACE: stop recording while reading */
+#define SIMTRACE_EVTRACE_F_FREEZE	0x01
+/* SIMTRACE_CMD_BD_EVTRACE: discard all records */
+#define SIMTRACE_EVTRACE_F_CLEAR	0x02
+
+/* SIMTRACE_CMD_BD_EVTRACE request */
+struct simtrace_evtrace_req {
+	/* first record to return, counted from the oldest one */
+	uint16_t offset;
+	/* SIMTRACE_EVTRACE_F_*, recording resumes if FREEZE is not set */
+	uint8_t flags;
+} __attribute__ ((packed));
+
+struct simtrace_evtrace_rec {
+	/* cycle counter (MCK cycles, see cycle_counter.h) when the event was recorded */
+	uint32_t cycles;
+	uint32_t arg;
+	/* enum simtrace_evtrace_id */
+	uint16_t id;
+	uint16_t _reserved;
+} __attribute__ ((packed));
+
+/* SIMTRACE_CMD_BD_EVTRACE response */
+struct simtrace_evtrace_resp {
+	/* frequency of the cycle counter */
+	uint32_t cycles_per_sec;
+	/* number of records available in total */
+	uint16_t num_total;
+	/* index of the first record in this message */
+	uint16_t offset;
+	/* number of records in this message */
+	uint8_t num_recs;
+	/* SIMTRACE_EVTRACE_F_FREEZE if recording is stopped */
+	uint8_t flags;
+	struct simtrace_evtrace_rec recs[0];
+} __attribute__ ((packed));
+
+/* deferred log message, followed by num_args 32bit arguments */
+struct simtrace_dlog_rec {
+	/* cycle counter (MCK cycles, see cycle_counter.h) when the message was recorded */
+	uint32_t cycles;
+	/* offset of the format string in the .dlog_fmt table */
+	uint16_t fmt;
+	/* TRACE_LEVEL_* */
+	uint8_t level;
+	uint8_t num_args;
+	uint32_t args[0];
+} __attribute__ ((packed));
+
+/* SIMTRACE_CMD_BD_DLOG response, the request has no payload.  The
+ * returned messages are removed from the ring. */
+struct simtrace_dlog_resp {
+	/* frequency of the cycle counter */
+	uint32_t cycles_per_sec;
+	/* start address of the firmware image, to resolve %s arguments */
+	uint32_t image_base;
+	/* number of messages lost because the ring was full */
+	uint32_t num_dropped;
+	/* number of 32bit words of simtrace_dlog_rec in data */
+	uint16_t num_words;
+	uint32_t data[0];
+} __attribute__ ((packed));
+
+/* USB start-of-frame, latched together with the cycle counter */
+struct simtrace_timesync_pair {
+	/* USB frame number (11 bits, incremented every millisecond by the host) */
+	uint16_t frame;
+	uint16_t _reserved;
+	/* cycle counter (MCK cycles, see cycle_counter.h) when the SOF interrupt was served */
+	uint32_t cycles;
+} __attribute__ ((packed));
+
+/* SIMTRACE_CMD_BD_TIMESYNC response, the request has no payload.
+ * The firmware latches a start-of-frame about every 100ms and returns the
+ * latest ones.  All devices on one USB bus see a SOF at the same time, so
+ * the pairs relate the cycle counters of the event trace and deferred log
+ * of many devices to the bus time, and from there to the host clocks. */
+struct simtrace_timesync_resp {
+	/* frequency of the cycle counter */
+	uint32_t cycles_per_sec;
+	/* cycle counter when the response was generated */
+	uint32_t cycles_now;
+	/* number of pairs latched since start-up (wraps around); the last
+	 * pair in this message is number num_latched - 1 */
+	uint32_t num_latched;
+	uint8_t num_pairs;
+	/* oldest first */
+	struct simtrace_timesync_pair pairs[0];
+} __attribute__ ((packed));
+
 /***********************************************************************
  * CARD EMULATOR / FORWARDER
  ***********************************************************************/
@@ -237,6 +376,9 @@ struct cardemu_usb_msg_status {
 	};
 	uint8_t wi;		/* <! Waiting Integer as defined in ISO7816-3 Section 10.2 */
 	uint32_t waiting_time;	/* <! Waiting Time in etu as defined in ISO7816-3 Section 8.1 */
+	/* measured frequency of the SIM clock in Hz (0 if not measured yet);
+	 * missing in messages of older firmware */
+	uint32_t clk_hz;
 } __attribute__ ((packed));
 
 /* CEMU_USB_MSGT_DO_PTS */
@@ -248,10 +390,14 @@ struct cardemu_usb_msg_pts_info {
 	uint8_t resp[6];
 } __attribute__ ((packed));
 
-/* CEMU_USB_MSGT_DO_ERROR */
+/* SIMTRACE_CMD_DO_ERROR, sent on the IN endpoint of the slot */
+#define CEMU_ERR_SEV_REJECTED	1	/* the request has been ignored */
 struct cardemu_usb_msg_error {
+	/* CEMU_ERR_SEV_* */
 	uint8_t severity;
+	/* msg_type of the SIMTRACE_MSGC_CARDEM request */
 	uint8_t subsystem;
+	/* positive errno */
 	uint16_t code;
 	uint8_t msg_len;
 	/* human-readable error message */
@@ -260,6 +406,139 @@ struct cardemu_usb_msg_error {
 
 /* enable/disable the generation of DO_STATUS on IRQ endpoint */
 #define CEMU_FEAT_F_STATUS_IRQ	0x00000001
+/* let the firmware send the ACK procedure byte itself for TPDUs known to carry
+ * command data (case 3/4), and receive that data without waiting for a
+ * CEMU_DATA_F_PB_AND_RX from the host. TPDU header and command data are then
+ * reported in a single DO_CEMU_RX_DATA with CEMU_DATA_F_TPDU_HDR|CEMU_DATA_F_FINAL */
+#define CEMU_FEAT_F_AUTO_PB_RX	0x00000002
+
+/* SIMTRACE_MSGT_BD_CEMU_STATS (empty request, counters in response).
+ * All counters are incremented since device start-up and wrap around */
+struct cardemu_usb_msg_stats {
+	/* characters received from / transmitted to the reader */
+	uint32_t rx_bytes;
+	uint32_t tx_bytes;
+	/* PPS requests received */
+	uint32_t pps;
+	/* completed TPDUs without data, with data from the card, and with data
+	 * from the reader. A case 4 command counts as case 3, as T=0 transfers
+	 * its response data using a separate GET RESPONSE */
+	uint32_t tpdu_case1;
+	uint32_t tpdu_case2;
+	uint32_t tpdu_case3;
+	/* NULL procedure bytes sent because the host did not answer in time */
+	uint32_t null_pb;
+	/* characters lost because the UART receive buffer was full */
+	uint32_t rbuf_overruns;
+	/* USART receive errors */
+	uint32_t usart_overrun;
+	uint32_t usart_frame;
+	uint32_t usart_parity;
+	/* characters NACKed by the reader (parity error, repetition requested) */
+	uint32_t usart_nack;
+	/* messages dropped because the host did not read the IN / IRQ endpoint */
+	uint32_t usb_in_dropped;
+	uint32_t usb_irq_dropped;
+	/* failed USB buffer allocations (for the whole device) */
+	uint32_t alloc_failed;
+	/* characters dropped because the console UART buffer was full */
+	uint32_t console_dropped;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_BD_CEMU_VCC: restart minimum/maximum/average after reporting */
+#define CEMU_VCC_F_RESET	0x01
+
+/* SIMTRACE_MSGT_BD_CEMU_VCC request (may be empty) */
+struct cardemu_usb_msg_vcc_req {
+	/* CEMU_VCC_F_* */
+	uint8_t flags;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_BD_CEMU_VCC response.  VCC is sampled continuously by the
+ * ADC; all fields are zero on boards without VCC measurement */
+struct cardemu_usb_msg_vcc {
+	/* latest sample, in mV */
+	uint16_t mv;
+	/* minimum, maximum and average since the last CEMU_VCC_F_RESET, in mV */
+	uint16_t min_mv;
+	uint16_t max_mv;
+	uint16_t avg_mv;
+	/* number of samples the above is based on */
+	uint32_t samples;
+	/* VCC threshold crossings (switched on / off) since start-up */
+	uint32_t vcc_on;
+	uint32_t vcc_off;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_DT_CEMU_SCHEDULE: continue with the first entry after the last one */
+#define CEMU_SCHED_F_LOOP	0x01
+/* SIMTRACE_MSGT_DT_CEMU_SCHEDULE: add the entries to the current schedule instead of replacing it */
+#define CEMU_SCHED_F_APPEND	0x02
+
+/* maximum payload of a single SIMTRACE_MSGT_DT_CEMU_SCHEDULE, longer schedules
+ * are sent as several messages with CEMU_SCHED_F_APPEND */
+#define CEMU_SCHED_MSG_MAX	256
+
+/* entry of SIMTRACE_MSGT_DT_CEMU_SCHEDULE (variable length) */
+struct cardemu_usb_msg_sched_entry {
+	/* slot of the external mux to connect the emulated card to */
+	uint8_t slot_mux_nr;
+	/* not interpreted by the firmware, reported back in SIMTRACE_MSGT_DO_CEMU_SCHED_STEP */
+	uint16_t script_id;
+	/* ATR to use from the next reset on (0: keep the current one) */
+	uint8_t atr_len;
+	uint8_t atr[0];
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_DT_CEMU_SCHEDULE
+ * Each time the reader switches off VCC, the firmware continues with the next
+ * entry, without waiting for the host.  A message without entries (and without
+ * CEMU_SCHED_F_APPEND) cancels the schedule.  Without CEMU_SCHED_F_LOOP, each
+ * message is released once its entries are used up, so the host can keep
+ * appending entries to a running schedule.  A message that is invalid or
+ * doesn't fit into the schedule is answered by SIMTRACE_CMD_DO_ERROR
+ * (subsystem: the message type, code: EINVAL or ENOSPC). */
+struct cardemu_usb_msg_schedule {
+	/* CEMU_SCHED_F_*; LOOP is taken from the first message of a schedule */
+	uint8_t flags;
+	uint8_t num_entries;
+	/* num_entries x struct cardemu_usb_msg_sched_entry */
+	uint8_t entries[0];
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_DO_CEMU_SCHED_STEP: the end of the schedule was reached */
+#define CEMU_SCHED_IDX_DONE	0xff
+
+/* SIMTRACE_MSGT_DO_CEMU_SCHED_STEP (on the IRQ endpoint) */
+struct cardemu_usb_msg_sched_step {
+	/* index of the now active entry in the schedule, or CEMU_SCHED_IDX_DONE */
+	uint8_t index;
+	uint8_t slot_mux_nr;
+	uint16_t script_id;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_BD_CEMU_PERSIST: forget the stored configuration instead */
+#define CEMU_PERSIST_F_ERASE	0x01
+
+/* SIMTRACE_MSGT_BD_CEMU_PERSIST request (may be empty)
+ * The current ATR and configuration (features, mux slot, max_fidi) of the slot
+ * are written to flash, and applied at the next start of the firmware, before
+ * the host connects.  Programming the flash stalls the firmware, so it is
+ * deferred until the readers of all slots have switched off VCC. */
+struct cardemu_usb_msg_persist_req {
+	/* CEMU_PERSIST_F_* */
+	uint8_t flags;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_BD_CEMU_PERSIST response, once the flash was written */
+struct cardemu_usb_msg_persist {
+	/* flags of the request */
+	uint8_t flags;
+	/* 0 on success, negative errno otherwise */
+	int8_t rc;
+	/* number of writes to the store so far */
+	uint32_t seq;
+} __attribute__ ((packed));
 
 /* SIMTRACE_MSGT_BD_CEMU_CONFIG */
 struct cardemu_usb_msg_config {
@@ -267,6 +546,31 @@ struct cardemu_usb_msg_config {
 	uint32_t features;
 	/* the selected slot number (if an external mux is present) */
 	uint8_t slot_mux_nr;
+	/* speed policy: fastest F/D to advertise in the ATR and to accept in PPS,
+	 * encoded like TA1 (F_index << 4 | D_index). 0 to use the ATR as is and
+	 * to accept any PPS request */
+	uint8_t max_fidi;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_DT_CEMU_CACHE_ADD
+ * A TPDU matching hdr is answered by the firmware without involving the
+ * host.  The response contains all bytes sent by the card after the
+ * header: procedure byte, response data (if any) and SW1 SW2.
+ * Since the card behind the host doesn't see cached TPDUs, only commands
+ * which read the current file are accepted: READ BINARY (without short
+ * file identifier), READ RECORD (P2 = 04) and STATUS (P1 = 00).  Other
+ * entries are rejected with SIMTRACE_CMD_DO_ERROR.
+ * All entries are dropped when the card is reset or powered down, and
+ * whenever a TPDU other than the above is passed to the host. */
+struct cardemu_usb_msg_cache_add {
+	/* TPDU header (CLA INS P1 P2 P3) to match */
+	uint8_t hdr[5];
+	/* reserved for matching command data, 0 */
+	uint8_t data_len;
+	/* length of the response */
+	uint16_t resp_len;
+	/* the response */
+	uint8_t data[0];
 } __attribute__ ((packed));
 
 /***********************************************************************
@@ -326,6 +630,29 @@ struct sniff_fidi {
 	uint8_t fidi;
 } __attribute__ ((packed));
 
+/* SIMTRACE_MSGT_SNIFF_CONFIG features */
+/* send ATR, PPS and TPDU as SIMTRACE_MSGT_SNIFF_*_TS messages.  Off after
+ * the sniffer configuration is selected, so hosts unaware of them keep
+ * receiving the original messages */
+#define SNIFF_FEAT_F_TIMESTAMPS (1<<0)
+
+/* SIMTRACE_MSGT_SNIFF_CONFIG */
+struct sniff_config {
+	/* bit-mask of SNIFF_FEAT_F_* flags; the device only enables those it supports */
+	uint32_t features;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_SNIFF_CLK flags */
+#define SNIFF_CLK_F_STOPPED (1<<0)
+
+/* SIMTRACE_MSGT_SNIFF_CLK */
+struct sniff_clk {
+	/* SIMTRACE_MSGT_SNIFF_CLK flags */
+	uint32_t flags;
+	/* measured frequency of the SIM clock in Hz (the last one while stopped) */
+	uint32_t hz;
+} __attribute__ ((packed));
+
 /* SIMTRACE_MSGT_SNIFF_ATR, SIMTRACE_MSGT_SNIFF_PPS, SIMTRACE_MSGT_SNIFF_TPDU */
 struct sniff_data {
 	/* data flags */
@@ -335,3 +662,27 @@ struct sniff_data {
 	/* data */
 	uint8_t data[0];
 } __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_SNIFF_ATR_TS, SIMTRACE_MSGT_SNIFF_PPS_TS, SIMTRACE_MSGT_SNIFF_TPDU_TS */
+struct sniff_data_ts {
+	/* identifies the time base of the time-stamps; it changes whenever
+	 * the device restarts its clock (e.g. when the sniffer is (re)started).
+	 * It is a per-boot counter, starting at 1 after every reset of the
+	 * device, so it does not identify a time base across reboots */
+	uint32_t epoch;
+	/* reception time of the first and of the last byte, in us since the epoch */
+	uint64_t start_us;
+	uint64_t end_us;
+	/* TPDU only: reception time of P3 (the end of the command header) and of
+	 * the first procedure byte sent by the card in response, in us since the
+	 * epoch.  pb_us - hdr_us is the response time of the card.  0 if the byte
+	 * has not been received, and for ATR and PPS */
+	uint64_t hdr_us;
+	uint64_t pb_us;
+	/* data flags (same as for struct sniff_data) */
+	uint32_t flags;
+	/* data length */
+	uint16_t length;
+	/* data */
+	uint8_t data[0];
+} __attribute__ ((packed));
@@ -30,6 +30,9 @@ void *_talloc_zero(const void *ctx, size_t size, const char *name);
 #define talloc_free(ctx) _talloc_free(ctx, __location__)
 int _talloc_free(void *ptr, const char *location);
 
+/* number of allocations which failed (too large or out of memory) */
+unsigned int talloc_num_failed(void);
+
 /* Unsupported! */
 #define talloc_size(ctx, size) talloc_named_const(ctx, size, __location__)
 void *talloc_named_const(const void *context, size_t size, const char *name);
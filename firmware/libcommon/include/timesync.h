@@ -0,0 +1,29 @@
+/* USB start-of-frame based time synchronization
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "simtrace_prot.h"
+
+/* number of latched start-of-frames kept in RAM (power of two) */
+#define TIMESYNC_NUM_PAIRS	8
+/* interval between two latched start-of-frames */
+#define TIMESYNC_INTERVAL_MS	100
+
+void timesync_init(void);
+/* latch the next start-of-frame once the interval has passed; called from the main loop */
+void timesync_poll(void);
+
+struct msgb;
+/* handle a SIMTRACE_CMD_BD_TIMESYNC request, append the response to msg */
+void timesync_dump(struct msgb *msg);
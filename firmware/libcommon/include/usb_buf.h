@@ -27,6 +27,8 @@ struct usb_buffered_ep {
 	struct llist_head queue;
 	/* current length of queue */
 	unsigned int queue_len;
+	/* number of messages dropped because the queue was full */
+	uint32_t dropped;
 };
 
 struct msgb *usb_buf_alloc(uint8_t ep);
@@ -28,3 +28,16 @@
 #define local_irq_save(x)
 #define local_irq_restore(x)
 #endif
+
+/* Execute the function from SRAM instead of flash: avoids the flash wait
+ * states on hot interrupt paths.  The .ramfunc section is copied to RAM
+ * together with .data by the reset handler; calls between flash and RAM
+ * are out of BL range and go through veneers inserted by the linker. */
+#ifndef USE_RAMFUNC
+#define USE_RAMFUNC 1
+#endif
+#if defined(__ARM) && USE_RAMFUNC
+#define __ramfunc __attribute__((section(".ramfunc"), noinline))
+#else
+#define __ramfunc
+#endif
@@ -26,6 +26,8 @@
 #include "card_emu.h"
 #include "simtrace_prot.h"
 #include "usb_buf.h"
+#include "evtrace.h"
+#include "dlog.h"
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
 
@@ -35,8 +37,25 @@
 
 #define NUM_SLOTS		2
 
+/* maximum number of TPDU response cache entries per card. Each one
+ * holds a USB buffer, so this needs to stay well below the buffer pool size */
+#ifndef CARD_EMU_CACHE_MAX
+#define CARD_EMU_CACHE_MAX	4
+#endif
+
+/* maximum number of SIMTRACE_MSGT_DT_CEMU_SCHEDULE messages kept per card */
+#ifndef CARD_EMU_SCHED_MSGS_MAX
+#define CARD_EMU_SCHED_MSGS_MAX	4
+#endif
+
+/* smallest F/D ratio (i.e. highest speed) at which the UART is still
+ * reliable. 32 corresponds to TA1=0x95 (Fi=512, Di=16) */
+#ifndef CARD_EMU_MIN_FD_RATIO
+#define CARD_EMU_MIN_FD_RATIO	32
+#endif
+
 /* bit-mask of supported CEMU_FEAT_F_ flags */
-#define SUPPORTED_FEATURES	(CEMU_FEAT_F_STATUS_IRQ)
+#define SUPPORTED_FEATURES	(CEMU_FEAT_F_STATUS_IRQ | CEMU_FEAT_F_AUTO_PB_RX)
 
 #define	ISO7816_3_INIT_WTIME	9600
 #define ISO7816_3_DEFAULT_WI	10
@@ -44,6 +63,9 @@
 
 #define ISO7816_3_PB_NULL	0x60
 
+/* minimum number of data bytes for which we use UART DMA instead of byte-wise TX */
+#define UART_TX_DMA_MIN_LEN	8
+
 enum iso7816_3_card_state {
 	ISO_S_WAIT_POWER,	/* waiting for power being applied */
 	ISO_S_WAIT_CLK,		/* waiting for clock being applied */
@@ -151,6 +173,9 @@ struct card_handle {
 	bool vcc_active;	/*< if VCC is active (true = active/ON) */
 	bool in_reset;	/*< if card is in reset (true = RST low/asserted, false = RST high/ released) */
 	bool clocked;	/*< if clock is active ( true = active, false = inactive) */
+	bool card_present;	/*< if the board detected a card in its slot (only on boards with detection) */
+	uint32_t clk_hz;	/*< measured clock frequency (0 = unknown) */
+	uint32_t clk_hz_reported;	/*< clock frequency in the latest status report */
 
 	/* All below variables with _index suffix are indexes from 0..15 into Tables 7 + 8
 	 * of ISO7816-3. */
@@ -167,6 +192,9 @@ struct card_handle {
 	/*! Current value of index to baud rate adjustment factor D (ISO 7816-3 Section 7.1). */
 	uint8_t D_index;
 
+	/*! Fastest F/D (encoded like TA1) to advertise and accept, 0 for no speed policy */
+	uint8_t max_fidi;
+
 	/*! Waiting Integer (ISO7816-3 Section 10.2).
 	 *  \note this value can be set in TA2 */
 	uint8_t wi;
@@ -187,6 +215,9 @@ struct card_handle {
 		//uint8_t hist_len;
 		//uint8_t last_td;
 		uint8_t atr[ISO7816_3_ATR_LEN_MAX];
+		/* ATR as set by the host, before applying the speed policy */
+		uint8_t orig_len;
+		uint8_t orig[ISO7816_3_ATR_LEN_MAX];
 	} atr;
 
 	/* PPS / PTS support */
@@ -200,17 +231,41 @@ struct card_handle {
 	struct {
 		enum tpdu_state state;
 		uint8_t hdr[5];		/* CLA INS P1 P2 P3 */
+		bool rx_data;		/* data has been received from reader */
+		uint16_t tx_len;	/* number of bytes transmitted (PB, data, SW) */
 	} tpdu;
 
 	struct msgb *uart_rx_msg;	/* UART RX -> USB TX */
 	struct msgb *uart_tx_msg;	/* USB RX -> UART TX */
+	uint16_t uart_tx_dma_len;	/* bytes of uart_tx_msg currently handed to UART DMA */
 
 	struct llist_head uart_tx_queue;
 
+	/* TPDU response cache (msgb containing cardemu_usb_msg_cache_add) */
+	struct llist_head cache;
+	unsigned int cache_len;
+
+	/* slot schedule (msgb containing cardemu_usb_msg_schedule) */
+	struct {
+		struct llist_head msgs;
+		unsigned int msgs_len;
+		uint8_t flags;
+		/* message of the active entry, NULL if the schedule did not start yet */
+		struct msgb *cur;
+		/* active entry: number within cur, offset in its payload, index in the schedule */
+		uint8_t cur_entry;
+		uint16_t cur_off;
+		uint8_t index;
+	} sched;
+
 	struct {
 		uint32_t tx_bytes;
 		uint32_t rx_bytes;
 		uint32_t pps;
+		uint32_t tpdu_case1;
+		uint32_t tpdu_case2;
+		uint32_t tpdu_case3;
+		uint32_t null_pb;
 	} stats;
 };
 
@@ -221,6 +276,12 @@ static void card_handle_reset(struct card_handle *ch)
 
 	card_emu_uart_update_wt(ch->uart_chan, 0);
 
+	/* stop any DMA transfer still reading from uart_tx_msg */
+	if (ch->uart_tx_dma_len) {
+		card_emu_uart_tx_dma_abort(ch->uart_chan);
+		ch->uart_tx_dma_len = 0;
+	}
+
 	/* release any buffers we may still own */
 	if (ch->uart_tx_msg) {
 		usb_buf_free(ch->uart_tx_msg);
@@ -233,6 +294,9 @@ static void card_handle_reset(struct card_handle *ch)
 	while ((msg = msgb_dequeue(&ch->uart_tx_queue))) {
 		usb_buf_free(msg);
 	}
+
+	/* cached responses are only valid within a card session */
+	card_emu_cache_flush(ch);
 }
 
 struct llist_head *card_emu_get_uart_tx_queue(struct card_handle *ch)
@@ -242,6 +306,7 @@ struct llist_head *card_emu_get_uart_tx_queue(struct card_handle *ch)
 
 static void set_tpdu_state(struct card_handle *ch, enum tpdu_state new_ts);
 static void set_pts_state(struct card_handle *ch, enum pts_state new_ptss);
+static void sched_next(struct card_handle *ch);
 
 /* update simtrace header msg_len and submit USB buffer */
 void usb_buf_upd_len_and_submit(struct msgb *msg)
@@ -281,7 +346,8 @@ struct msgb *usb_buf_alloc_st(uint8_t ep, uint8_t msg_class, uint8_t msg_type)
 			}
 			usb_buf_free(msg);
 			msg = NULL;
-			TRACE_DEBUG("ep %u: %s queue msg dropped\n\r",
+			bep->dropped++;
+			DLOG_DEBUG("ep %u: %s queue msg dropped\n\r",
 			            ep, __func__);
 		}
 	}
@@ -313,7 +379,7 @@ static void flush_rx_buffer(struct card_handle *ch)
 	rd = (struct cardemu_usb_msg_rx_data *) msg->l2h;
 	rd->data_len = msgb_l2len(msg) - sizeof(*rd);
 
-	TRACE_INFO("%u: %s (%u)\n\r",
+	DLOG_INFO("%u: %s (%u)\n\r",
 			ch->num, __func__, rd->data_len);
 
 	usb_buf_upd_len_and_submit(msg);
@@ -376,12 +442,12 @@ static void emu_update_fidi(struct card_handle *ch)
 
 	rc = iso7816_3_compute_fd_ratio(ch->F_index, ch->D_index);
 	if (rc > 0 && rc < 0x400) {
-		TRACE_INFO("%u: computed F(%u)/D(%u) ratio: %d\r\n", ch->num,
+		DLOG_INFO("%u: computed F(%u)/D(%u) ratio: %d\r\n", ch->num,
 			   ch->F_index, ch->D_index, rc);
 		/* make sure UART uses new F/D ratio */
 		card_emu_uart_update_fidi(ch->uart_chan, rc);
 	} else
-		TRACE_INFO("%u: computed F/D ratio %d unsupported\r\n",
+		DLOG_INFO("%u: computed F/D ratio %d unsupported\r\n",
 			   ch->num, rc);
 }
 
@@ -392,10 +458,11 @@ static void card_set_state(struct card_handle *ch,
 	if (ch->state == new_state)
 		return;
 
-	TRACE_DEBUG("%u: 7816 card state %s -> %s\r\n", ch->num,
+	DLOG_DEBUG("%u: 7816 card state %s -> %s\r\n", ch->num,
 		    get_value_string(iso7816_3_card_state_names, ch->state),
 		    get_value_string(iso7816_3_card_state_names, new_state));
 	ch->state = new_state;
+	evtrace_log(SIMTRACE_EVT_ISO_STATE, (ch->num << 16) | new_state);
 
 	switch (new_state) {
 	case ISO_S_WAIT_POWER:
@@ -518,6 +585,64 @@ static int tx_byte_atr(struct card_handle *ch)
 	return 1;
 }
 
+/* is the check byte TCK present in the ATR (any protocol other than T=0 indicated)? */
+static bool atr_has_tck(const uint8_t *atr, uint8_t len)
+{
+	uint8_t y = atr[1] & 0xf0;
+	uint8_t idx = 2;
+
+	while (y) {
+		if (y & 0x10) /* TAi */
+			idx++;
+		if (y & 0x20) /* TBi */
+			idx++;
+		if (y & 0x40) /* TCi */
+			idx++;
+		if (!(y & 0x80) || idx >= len) /* no TDi */
+			break;
+		if (atr[idx] & 0x0f)
+			return true;
+		y = atr[idx++] & 0xf0;
+	}
+	return false;
+}
+
+/* derive the ATR to be sent from the one set by the host, advertising the
+ * speed policy in TA1 */
+static void update_atr(struct card_handle *ch)
+{
+	uint8_t *atr = ch->atr.atr;
+	uint8_t i;
+
+	memcpy(atr, ch->atr.orig, ch->atr.orig_len);
+	ch->atr.len = ch->atr.orig_len;
+
+	if (!ch->max_fidi || ch->atr.len < 2)
+		return;
+
+	if (atr[1] & 0x10) {
+		/* replace TA1 */
+		atr[2] = ch->max_fidi;
+	} else {
+		/* insert TA1 */
+		if (ch->atr.len >= sizeof(ch->atr.atr)) {
+			TRACE_ERROR("%u: no space to insert TA1 into ATR\r\n", ch->num);
+			return;
+		}
+		memmove(atr + 3, atr + 2, ch->atr.len - 2);
+		atr[1] |= 0x10;
+		atr[2] = ch->max_fidi;
+		ch->atr.len++;
+	}
+
+	/* TCK is the XOR of all bytes from T0 on */
+	if (atr_has_tck(atr, ch->atr.len)) {
+		atr[ch->atr.len - 1] = 0;
+		for (i = 1; i < ch->atr.len - 1; i++)
+			atr[ch->atr.len - 1] ^= atr[i];
+	}
+}
+
 /**********************************************************************
  * PTS / PPS handling
  **********************************************************************/
@@ -525,7 +650,7 @@ static int tx_byte_atr(struct card_handle *ch)
 /* Update the PTS sub-state */
 static void set_pts_state(struct card_handle *ch, enum pts_state new_ptss)
 {
-	TRACE_DEBUG("%u: 7816 PTS state %s -> %s\r\n", ch->num,
+	DLOG_DEBUG("%u: 7816 PTS state %s -> %s\r\n", ch->num,
 		    get_value_string(pts_state_names, ch->pts.state),
 		    get_value_string(pts_state_names, new_ptss));
 	ch->pts.state = new_ptss;
@@ -575,6 +700,22 @@ from_pts3:
 }
 
 
+/* does the F/D proposed in PPS1 comply with the speed policy? */
+static bool pts_fidi_acceptable(struct card_handle *ch, uint8_t pps1)
+{
+	int ratio;
+
+	/* without policy, we accept whatever the reader proposes */
+	if (!ch->max_fidi)
+		return true;
+
+	ratio = iso7816_3_compute_fd_ratio(pps1 >> 4, pps1 & 0xf);
+	if (ratio <= 0 || ratio >= 0x400)
+		return false;
+
+	return ratio >= iso7816_3_compute_fd_ratio(ch->max_fidi >> 4, ch->max_fidi & 0xf);
+}
+
 static int
 process_byte_pts(struct card_handle *ch, uint8_t byte)
 {
@@ -603,8 +744,15 @@ process_byte_pts(struct card_handle *ch, uint8_t byte)
 			set_pts_state(ch, PTS_S_WAIT_REQ_PTSS);
 			return ISO_S_WAIT_TPDU;
 		}
-		/* FIXME: check if proposal matches capabilities in ATR */
 		memcpy(ch->pts.resp, ch->pts.req, sizeof(ch->pts.resp));
+		if ((ch->pts.req[_PTS0] & (1 << 4)) && !pts_fidi_acceptable(ch, ch->pts.req[_PTS1])) {
+			/* the card can't propose other values, it can only
+			 * omit PPS1 to stay at the default F/D */
+			DLOG_INFO("%u: PPS1=%02x refused by speed policy\r\n", ch->num,
+				   ch->pts.req[_PTS1]);
+			ch->pts.resp[_PTS0] &= ~(1 << 4);
+			ch->pts.resp[_PCK] = csum_pts(ch->pts.resp);
+		}
 		break;
 	default:
 		TRACE_ERROR("%u: process_byte_pts() in invalid PTS state %s\r\n", ch->num,
@@ -645,7 +793,7 @@ static int tx_byte_pts(struct card_handle *ch)
 		/* This must be TA1 */
 		ch->F_index = byte >> 4;
 		ch->D_index = byte & 0xf;
-		TRACE_DEBUG("%u: found F=%u D=%u\r\n", ch->num,
+		DLOG_DEBUG("%u: found F=%u D=%u\r\n", ch->num,
 			    iso7816_3_fi_table[ch->F_index], iso7816_3_di_table[ch->D_index]);
 		/* FIXME: if F or D are 0, become unresponsive to signal error condition */
 		break;
@@ -707,6 +855,75 @@ static unsigned int t0_num_data_bytes(uint8_t p3, int reader_to_card)
 	}
 }
 
+/**********************************************************************
+ * TPDU response cache
+ **********************************************************************/
+
+static struct cardemu_usb_msg_cache_add *cache_entry(struct msgb *msg)
+{
+	return (struct cardemu_usb_msg_cache_add *) msg->l2h;
+}
+
+/* may the response to a TPDU with this header be answered from the cache?
+ * The card behind the host has to see every command that changes its
+ * state, so only instructions that read the current file qualify. */
+static bool cache_hdr_allowed(const uint8_t *hdr)
+{
+	switch (hdr[_INS]) {
+	case 0xB0:	/* READ BINARY, unless P1 selects an EF by short file identifier */
+		return !(hdr[_P1] & 0x80);
+	case 0xB2:	/* READ RECORD, absolute mode on the current EF */
+		return hdr[_P2] == 0x04;
+	case 0xF2:	/* STATUS, without application status indication */
+		return hdr[_P1] == 0x00;
+	default:
+		return false;
+	}
+}
+
+/* find the cache entry for the current TPDU header */
+static struct msgb *cache_lookup(struct card_handle *ch)
+{
+	struct msgb *msg;
+
+	llist_for_each_entry(msg, &ch->cache, list) {
+		struct cardemu_usb_msg_cache_add *ce = cache_entry(msg);
+		if (!memcmp(ce->hdr, ch->tpdu.hdr, sizeof(ce->hdr)))
+			return msg;
+	}
+	return NULL;
+}
+
+/* queue the cached response for the current TPDU (if any) for transmission
+ * @return 0 if the response has been queued, negative otherwise */
+static int cache_tx_response(struct card_handle *ch)
+{
+	struct msgb *msg, *cmsg;
+	struct cardemu_usb_msg_cache_add *ce;
+	struct cardemu_usb_msg_tx_data *td;
+
+	cmsg = cache_lookup(ch);
+	if (!cmsg)
+		return -ENOENT;
+	ce = cache_entry(cmsg);
+
+	/* the transmitter consumes the message, so send a copy */
+	msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_TX_DATA);
+	if (!msg)
+		return -ENOMEM;
+	td = (struct cardemu_usb_msg_tx_data *) msgb_put(msg, sizeof(*td));
+	td->flags = CEMU_DATA_F_PB_AND_TX | CEMU_DATA_F_FINAL;
+	td->data_len = ce->resp_len;
+	memcpy(msgb_put(msg, ce->resp_len), ce->data, ce->resp_len);
+
+	DLOG_DEBUG("%u: %s: %u bytes\r\n", ch->num, __func__, ce->resp_len);
+
+	/* uart_tx_queue is only used from main loop context */
+	msgb_enqueue(&ch->uart_tx_queue, msg);
+
+	return 0;
+}
+
 /* add a just-received TPDU byte (from reader) to USB buffer */
 static void add_tpdu_byte(struct card_handle *ch, uint8_t byte)
 {
@@ -730,6 +947,10 @@ static void add_tpdu_byte(struct card_handle *ch, uint8_t byte)
 	rd = (struct cardemu_usb_msg_rx_data *) msg->l2h;
 	msgb_put_u8(msg, byte);
 
+	/* the TPDU header precedes the data if we acknowledged it ourselves */
+	if (rd->flags & CEMU_DATA_F_TPDU_HDR)
+		num_data_bytes += sizeof(ch->tpdu.hdr);
+
 	/* check if the buffer is full. If so, send it */
 	if (msgb_l2len(msg) >= sizeof(*rd) + num_data_bytes) {
 		rd->flags |= CEMU_DATA_F_FINAL;
@@ -745,13 +966,16 @@ static void set_tpdu_state(struct card_handle *ch, enum tpdu_state new_ts)
 	if (ch->tpdu.state == new_ts)
 		return;
 
-	TRACE_DEBUG("%u: 7816 TPDU state %s -> %s\r\n", ch->num,
+	DLOG_DEBUG("%u: 7816 TPDU state %s -> %s\r\n", ch->num,
 		get_value_string(tpdu_state_names, ch->tpdu.state),
 		get_value_string(tpdu_state_names, new_ts));
 	ch->tpdu.state = new_ts;
+	evtrace_log(SIMTRACE_EVT_TPDU_STATE, (ch->num << 16) | new_ts);
 
 	switch (new_ts) {
 	case TPDU_S_WAIT_CLA:
+		ch->tpdu.rx_data = false;
+		ch->tpdu.tx_len = 0;
 		/* switch back to receiving mode */
 		card_emu_uart_enable(ch->uart_chan, ENABLE_RX);
 		/* disable waiting time since we don't expect any data */
@@ -762,6 +986,7 @@ static void set_tpdu_state(struct card_handle *ch, enum tpdu_state new_ts)
 		card_emu_uart_update_wt(ch->uart_chan, ch->waiting_time);
 		break;
 	case TPDU_S_WAIT_RX:
+		ch->tpdu.rx_data = true;
 		/* switch to receive mode to receive the body */
 		card_emu_uart_enable(ch->uart_chan, ENABLE_RX);
 		/* start waiting for the body */
@@ -806,13 +1031,14 @@ static enum tpdu_state next_tpdu_state(struct card_handle *ch)
 	return -1;
 }
 
-static void send_tpdu_header(struct card_handle *ch)
+/* allocate a new uart_rx_msg and put the TPDU header into it */
+static struct msgb *alloc_tpdu_header(struct card_handle *ch)
 {
 	struct msgb *msg;
 	struct cardemu_usb_msg_rx_data *rd;
 	uint8_t *cur;
 
-	TRACE_INFO("%u: %s: %02x %02x %02x %02x %02x\r\n",
+	DLOG_INFO("%u: %s: %02x %02x %02x %02x %02x\r\n",
 			ch->num, __func__,
 			ch->tpdu.hdr[0], ch->tpdu.hdr[1],
 			ch->tpdu.hdr[2], ch->tpdu.hdr[3],
@@ -820,19 +1046,19 @@ static void send_tpdu_header(struct card_handle *ch)
 
 	/* if we already/still have a context, send it off */
 	if (ch->uart_rx_msg) {
-		TRACE_DEBUG("%u: have old buffer\r\n", ch->num);
+		DLOG_DEBUG("%u: have old buffer\r\n", ch->num);
 		if (msgb_l2len(ch->uart_rx_msg)) {
-			TRACE_DEBUG("%u: flushing old buffer\r\n", ch->num);
+			DLOG_DEBUG("%u: flushing old buffer\r\n", ch->num);
 			flush_rx_buffer(ch);
 		}
 	}
-	TRACE_DEBUG("%u: allocating new buffer\r\n", ch->num);
+	DLOG_DEBUG("%u: allocating new buffer\r\n", ch->num);
 	/* ensure we have a new buffer */
 	ch->uart_rx_msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM,
 					   SIMTRACE_MSGT_DO_CEMU_RX_DATA);
 	if (!ch->uart_rx_msg) {
 		TRACE_ERROR("%u: %s: ENOMEM\r\n", ch->num, __func__);
-		return;
+		return NULL;
 	}
 	msg = ch->uart_rx_msg;
 	rd = (struct cardemu_usb_msg_rx_data *) msgb_put(msg, sizeof(*rd));
@@ -845,7 +1071,86 @@ static void send_tpdu_header(struct card_handle *ch)
 	memcpy(cur, ch->tpdu.hdr, sizeof(ch->tpdu.hdr));
 	/* rd->data_len is set in flush_rx_buffer() */
 
-	flush_rx_buffer(ch);
+	return msg;
+}
+
+static void send_tpdu_header(struct card_handle *ch)
+{
+	if (alloc_tpdu_header(ch))
+		flush_rx_buffer(ch);
+}
+
+/* instructions (ISO 7816-4, TS 51.011, TS 102 221) for which a non-zero P3
+ * always is Lc, i.e. the reader will send P3 bytes of command data */
+static const uint8_t auto_pb_rx_ins[] = {
+	0x04,	/* DEACTIVATE FILE / INVALIDATE */
+	0x10,	/* TERMINAL PROFILE */
+	0x14,	/* TERMINAL RESPONSE */
+	0x20,	/* VERIFY */
+	0x24,	/* CHANGE REFERENCE DATA */
+	0x26,	/* DISABLE VERIFICATION REQUIREMENT */
+	0x28,	/* ENABLE VERIFICATION REQUIREMENT */
+	0x2C,	/* RESET RETRY COUNTER / UNBLOCK CHV */
+	0x32,	/* INCREASE */
+	0x44,	/* ACTIVATE FILE / REHABILITATE */
+	0x88,	/* AUTHENTICATE / RUN GSM ALGORITHM */
+	0xA2,	/* SEARCH RECORD / SEEK */
+	0xA4,	/* SELECT */
+	0xAA,	/* TERMINAL CAPABILITY */
+	0xC2,	/* ENVELOPE */
+	0xD0,	/* WRITE BINARY */
+	0xD2,	/* WRITE RECORD */
+	0xD6,	/* UPDATE BINARY */
+	0xDB,	/* SET DATA */
+	0xDC,	/* UPDATE RECORD */
+	0xE2,	/* APPEND RECORD */
+};
+
+/* should we acknowledge the just-received TPDU header ourselves? */
+static bool tpdu_auto_pb_rx(struct card_handle *ch)
+{
+	unsigned int i;
+
+	/* without command data there is nothing to receive */
+	if (ch->tpdu.hdr[_P3] == 0)
+		return false;
+
+	if (!(ch->features & CEMU_FEAT_F_AUTO_PB_RX))
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(auto_pb_rx_ins); i++) {
+		if (ch->tpdu.hdr[_INS] == auto_pb_rx_ins[i])
+			return true;
+	}
+	return false;
+}
+
+/* send the ACK procedure byte without host involvement and keep the TPDU
+ * header in uart_rx_msg, so it is sent to the host together with the data.
+ * @return 0 on success, negative if the host needs to handle the TPDU */
+static int auto_pb_rx(struct card_handle *ch)
+{
+	struct msgb *msg;
+	struct cardemu_usb_msg_tx_data *td;
+
+	/* procedure byte, queued as if it had been sent by the host */
+	msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_TX_DATA);
+	if (!msg)
+		return -ENOMEM;
+	td = (struct cardemu_usb_msg_tx_data *) msgb_put(msg, sizeof(*td));
+	td->flags = CEMU_DATA_F_PB_AND_RX;
+	td->data_len = 1;
+	msgb_put_u8(msg, ch->tpdu.hdr[_INS]);
+
+	if (!alloc_tpdu_header(ch)) {
+		usb_buf_free(msg);
+		return -ENOMEM;
+	}
+
+	/* uart_tx_queue is only used from main loop context */
+	msgb_enqueue(&ch->uart_tx_queue, msg);
+
+	return 0;
 }
 
 static enum iso7816_3_card_state
@@ -870,6 +1175,21 @@ process_byte_tpdu(struct card_handle *ch, uint8_t byte)
 		break;
 	case TPDU_S_WAIT_P3:
 		ch->tpdu.hdr[_P3] = byte;
+		/* cached response to a TPDU without command data */
+		if (cache_tx_response(ch) == 0) {
+			set_tpdu_state(ch, next_tpdu_state(ch));
+			break;
+		}
+		/* the TPDU reaches the card, which may select another file or
+		 * change the contents of the current one */
+		if (!cache_hdr_allowed(ch->tpdu.hdr))
+			card_emu_cache_flush(ch);
+		if (tpdu_auto_pb_rx(ch) && auto_pb_rx(ch) == 0) {
+			/* the procedure byte is already queued, the
+			 * transmitter will pick it up in WAIT_PB */
+			set_tpdu_state(ch, next_tpdu_state(ch));
+			break;
+		}
 		set_tpdu_state(ch, next_tpdu_state(ch));
 		/* FIXME: start timer to transmit further 0x60 */
 		/* send the TPDU header as part of a procedure byte
@@ -888,12 +1208,53 @@ process_byte_tpdu(struct card_handle *ch, uint8_t byte)
 	return ISO_S_IN_TPDU;
 }
 
-/* tx a single byte to be transmitted to the reader */
+/* uart_tx_msg has been completely transmitted: update state and release it
+ * @return 1 if the card still expects to transmit, 0 otherwise */
+static __ramfunc int tx_msg_done(struct card_handle *ch)
+{
+	struct msgb *msg = ch->uart_tx_msg;
+	struct cardemu_usb_msg_tx_data *td = (struct cardemu_usb_msg_tx_data *) msg->l2h;
+	int more = 1;
+
+	if (td->flags & CEMU_DATA_F_PB_AND_RX) {
+		/* we have just sent the procedure byte and now
+		 * need to continue receiving */
+		set_tpdu_state(ch, TPDU_S_WAIT_RX);
+		more = 0;
+	} else {
+		/* we have transmitted all bytes */
+		if (td->flags & CEMU_DATA_F_FINAL) {
+			/* anything beyond SW1 SW2 contains data */
+			if (ch->tpdu.rx_data)
+				ch->stats.tpdu_case3++;
+			else if (ch->tpdu.tx_len > 2)
+				ch->stats.tpdu_case2++;
+			else
+				ch->stats.tpdu_case1++;
+			/* this was the final part of the APDU, go
+			 * back to state one */
+			card_set_state(ch, ISO_S_WAIT_TPDU);
+			more = 0;
+		}
+	}
+	usb_buf_free(msg);
+	ch->uart_tx_msg = NULL;
+
+	return more;
+}
+
+/* tx a single byte (or a DMA block of data bytes) to be transmitted to the reader */
 static int tx_byte_tpdu(struct card_handle *ch)
 {
 	struct msgb *msg;
 	struct cardemu_usb_msg_tx_data *td;
 	uint8_t byte;
+	int len;
+
+	/* the UART DMA still owns the current buffer, we'll be called
+	 * again from card_emu_tx_dma_done() */
+	if (ch->uart_tx_dma_len)
+		return 0;
 
 	/* ensure we are aware of any data that might be pending for
 	 * transmit */
@@ -914,11 +1275,26 @@ static int tx_byte_tpdu(struct card_handle *ch)
 	msg = ch->uart_tx_msg;
 	td = (struct cardemu_usb_msg_tx_data *) msg->l2h;
 
+	/* send the data phase using a single DMA transfer instead of one
+	 * TXRDY interrupt per byte. Procedure bytes are always sent byte-wise,
+	 * as the state machine needs to act on them */
+	if (ch->tpdu.state == TPDU_S_WAIT_TX && msgb_length(msg) >= UART_TX_DMA_MIN_LEN) {
+		len = card_emu_uart_tx_dma(ch->uart_chan, msgb_data(msg), msgb_length(msg));
+		if (len > 0) {
+			ch->uart_tx_dma_len = len;
+			ch->tpdu.tx_len += len;
+			card_emu_uart_reset_wt(ch->uart_chan);
+			return len;
+		}
+		/* DMA not available, fall back to byte-wise transmit */
+	}
+
 	/* take the next pending byte out of the msgb */
 	byte = msgb_pull_u8(msg);
 
 	card_emu_uart_tx(ch->uart_chan, byte);
 	card_emu_uart_reset_wt(ch->uart_chan);
+	ch->tpdu.tx_len++;
 
 	/* this must happen _after_ the byte has been transmitted */
 	switch (ch->tpdu.state) {
@@ -935,22 +1311,8 @@ static int tx_byte_tpdu(struct card_handle *ch)
 	}
 
 	/* check if the buffer has now been fully transmitted */
-	if (msgb_length(msg) == 0) {
-		if (td->flags & CEMU_DATA_F_PB_AND_RX) {
-			/* we have just sent the procedure byte and now
-			 * need to continue receiving */
-			set_tpdu_state(ch, TPDU_S_WAIT_RX);
-		} else {
-			/* we have transmitted all bytes */
-			if (td->flags & CEMU_DATA_F_FINAL) {
-				/* this was the final part of the APDU, go
-				 * back to state one */
-				card_set_state(ch, ISO_S_WAIT_TPDU);
-			}
-		}
-		usb_buf_free(msg);
-		ch->uart_tx_msg = NULL;
-	}
+	if (msgb_length(msg) == 0)
+		tx_msg_done(ch);
 
 	return 1;
 }
@@ -994,7 +1356,7 @@ out_silent:
 }
 
 /* transmit a single byte to the reader */
-int card_emu_tx_byte(struct card_handle *ch)
+__ramfunc int card_emu_tx_byte(struct card_handle *ch)
 {
 	int rc = 0;
 
@@ -1012,16 +1374,39 @@ int card_emu_tx_byte(struct card_handle *ch)
 		break;
 	}
 
-	if (rc)
-		ch->stats.tx_bytes++;
+	if (rc > 0)
+		ch->stats.tx_bytes += rc;
 
 	/* if we return 0 here, the UART needs to disable transmit-ready
 	 * interrupts */
 	return rc;
 }
 
+/* UART driver informs us that a DMA transfer started by card_emu_uart_tx_dma()
+ * has completed. Returns 1 if byte-wise transmission should resume */
+__ramfunc int card_emu_tx_dma_done(struct card_handle *ch)
+{
+	struct msgb *msg = ch->uart_tx_msg;
+
+	if (!msg || !ch->uart_tx_dma_len)
+		return 0;
+
+	msgb_pull(msg, ch->uart_tx_dma_len);
+	ch->uart_tx_dma_len = 0;
+	card_emu_uart_reset_wt(ch->uart_chan);
+
+	if (msgb_length(msg) == 0)
+		return tx_msg_done(ch);
+
+	return 1;
+}
+
 void card_emu_have_new_uart_tx(struct card_handle *ch)
 {
+	/* TX will be resumed once the DMA transfer completes */
+	if (ch->uart_tx_dma_len)
+		return;
+
 	switch (ch->state) {
 	case ISO_S_IN_TPDU:
 		switch (ch->tpdu.state) {
@@ -1061,11 +1446,64 @@ void card_emu_report_status(struct card_handle *ch, bool report_on_irq)
 #ifdef DETECT_VCC_BY_ADC
 	sts->voltage_mv = card_emu_get_vcc(ch->num);
 #endif
-	/* FIXME: card insert */
+	if (ch->card_present)
+		sts->flags |= CEMU_STATUS_F_CARD_INSERT;
 	sts->F_index = ch->F_index;
 	sts->D_index = ch->D_index;
 	sts->wi = ch->wi;
 	sts->waiting_time = ch->waiting_time;
+	sts->clk_hz = ch->clk_hz;
+	ch->clk_hz_reported = ch->clk_hz;
+
+	usb_buf_upd_len_and_submit(msg);
+}
+
+/* tell the host that one of its requests has been rejected */
+void card_emu_report_error(struct card_handle *ch, uint8_t msg_type, int rc)
+{
+	struct msgb *msg;
+	struct cardemu_usb_msg_error *err;
+
+	msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_DO_ERROR);
+	if (!msg)
+		return;
+
+	err = (struct cardemu_usb_msg_error *) msgb_put(msg, sizeof(*err));
+	err->severity = CEMU_ERR_SEV_REJECTED;
+	err->subsystem = msg_type;
+	err->code = -rc;
+	err->msg_len = 0;
+
+	usb_buf_upd_len_and_submit(msg);
+}
+
+void card_emu_report_stats(struct card_handle *ch)
+{
+	struct msgb *msg;
+	struct cardemu_usb_msg_stats *st;
+	struct usb_buffered_ep *bep;
+
+	msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_STATS);
+	if (!msg)
+		return;
+
+	st = (struct cardemu_usb_msg_stats *) msgb_put(msg, sizeof(*st));
+	memset(st, 0, sizeof(*st));
+	st->rx_bytes = ch->stats.rx_bytes;
+	st->tx_bytes = ch->stats.tx_bytes;
+	st->pps = ch->stats.pps;
+	st->tpdu_case1 = ch->stats.tpdu_case1;
+	st->tpdu_case2 = ch->stats.tpdu_case2;
+	st->tpdu_case3 = ch->stats.tpdu_case3;
+	st->null_pb = ch->stats.null_pb;
+	/* UART level and buffer allocation counters are maintained by the driver */
+	card_emu_uart_get_stats(ch->uart_chan, st);
+	bep = usb_get_buf_ep(ch->in_ep);
+	if (bep)
+		st->usb_in_dropped = bep->dropped;
+	bep = usb_get_buf_ep(ch->irq_ep);
+	if (bep)
+		st->usb_irq_dropped = bep->dropped;
 
 	usb_buf_upd_len_and_submit(msg);
 }
@@ -1081,13 +1519,7 @@ static void card_emu_report_config(struct card_handle *ch)
 		return;
 
 	cfg = (struct cardemu_usb_msg_config *) msgb_put(msg, sizeof(*cfg));
-	cfg->features = ch->features;
-#ifdef HAVE_SLOT_MUX
-	cfg->slot_mux_nr = mux_get_slot();
-#else
-	cfg->slot_mux_nr = 0;
-#endif
-
+	card_emu_get_config(ch, cfg);
 
 	usb_buf_upd_len_and_submit(msg);
 }
@@ -1100,16 +1532,18 @@ void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active)
 	switch (io) {
 	case CARD_IO_VCC:
 		if (active == 0 && ch->vcc_active == 1) {
-			TRACE_INFO("%u: VCC deactivated\r\n", ch->num);
+			DLOG_INFO("%u: VCC deactivated\r\n", ch->num);
 			card_handle_reset(ch);
 			card_set_state(ch, ISO_S_WAIT_POWER);
 			chg_mask |= CEMU_STATUS_F_VCC_PRESENT;
+			/* the card session ended: continue with the next slot */
+			sched_next(ch);
 		} else if (active == 1 && ch->vcc_active == 0) {
 #ifdef DETECT_VCC_BY_ADC
-			TRACE_INFO("%u: VCC activated (%d mV)\r\n", ch->num,
+			DLOG_INFO("%u: VCC activated (%d mV)\r\n", ch->num,
 				   card_emu_get_vcc(ch->num));
 #else
-			TRACE_INFO("%u: VCC activated\r\n", ch->num);
+			DLOG_INFO("%u: VCC activated\r\n", ch->num);
 #endif
 			card_set_state(ch, ISO_S_WAIT_CLK);
 			chg_mask |= CEMU_STATUS_F_VCC_PRESENT;
@@ -1118,26 +1552,26 @@ void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active)
 		break;
 	case CARD_IO_CLK:
 		if (active == 1 && ch->clocked == 0) {
-			TRACE_INFO("%u: CLK activated\r\n", ch->num);
+			DLOG_INFO("%u: CLK activated\r\n", ch->num);
 			if (ch->state == ISO_S_WAIT_CLK)
 				card_set_state(ch, ISO_S_WAIT_RST);
 			chg_mask |= CEMU_STATUS_F_CLK_ACTIVE;
 		} else if (active == 0 && ch->clocked == 1) {
-			TRACE_INFO("%u: CLK deactivated\r\n", ch->num);
+			DLOG_INFO("%u: CLK deactivated\r\n", ch->num);
 			chg_mask |= CEMU_STATUS_F_CLK_ACTIVE;
 		}
 		ch->clocked = active;
 		break;
 	case CARD_IO_RST:
 		if (active == 0 && ch->in_reset) {
-			TRACE_INFO("%u: RST released\r\n", ch->num);
+			DLOG_INFO("%u: RST released\r\n", ch->num);
 			if (ch->vcc_active && ch->clocked && ch->state == ISO_S_WAIT_RST) {
 				/* prepare to send the ATR */
 				card_set_state(ch, ISO_S_WAIT_ATR);
 			}
 			chg_mask |= CEMU_STATUS_F_RESET_ACTIVE;
 		} else if (active && !ch->in_reset) {
-			TRACE_INFO("%u: RST asserted\r\n", ch->num);
+			DLOG_INFO("%u: RST asserted\r\n", ch->num);
 			card_handle_reset(ch);
 			chg_mask |= CEMU_STATUS_F_RESET_ACTIVE;
 			card_set_state(ch, ISO_S_WAIT_RST);
@@ -1166,21 +1600,58 @@ void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active)
 		card_emu_report_status(ch, true);
 }
 
+/* board driver informs us that the (debounced) card presence has changed */
+void card_emu_set_card_present(struct card_handle *ch, bool present)
+{
+	if (ch->card_present == present)
+		return;
+
+	DLOG_INFO("%u: card %s\r\n", ch->num, present ? "inserted" : "removed");
+	ch->card_present = present;
+
+	/* notify the host about the state change */
+	if (ch->features & CEMU_FEAT_F_STATUS_IRQ)
+		card_emu_report_status(ch, true);
+}
+
+/* board driver informs us about the measured clock frequency */
+void card_emu_set_clk_hz(struct card_handle *ch, uint32_t hz)
+{
+	uint32_t diff;
+
+	if (ch->clk_hz == hz)
+		return;
+	ch->clk_hz = hz;
+
+	/* forgetting the frequency goes along with a VCC change, which is reported anyway */
+	if (!hz)
+		return;
+
+	/* notify the host when the clock is first measured, or changed by more than 1% */
+	diff = hz > ch->clk_hz_reported ? hz - ch->clk_hz_reported : ch->clk_hz_reported - hz;
+	if (ch->clk_hz_reported && diff <= ch->clk_hz_reported / 100)
+		return;
+	DLOG_INFO("%u: CLK %lu Hz\r\n", ch->num, hz);
+	if (ch->features & CEMU_FEAT_F_STATUS_IRQ)
+		card_emu_report_status(ch, true);
+}
+
 /* User sets a new ATR to be returned during next card reset */
 int card_emu_set_atr(struct card_handle *ch, const uint8_t *atr, uint8_t len)
 {
-	if (len > sizeof(ch->atr.atr))
+	if (len > sizeof(ch->atr.orig))
 		return -1;
 
-	memcpy(ch->atr.atr, atr, len);
-	ch->atr.len = len;
+	memcpy(ch->atr.orig, atr, len);
+	ch->atr.orig_len = len;
 	ch->atr.idx = 0;
+	update_atr(ch);
 
 #if TRACE_LEVEL >= TRACE_LEVEL_INFO 
 	uint8_t i;
 	TRACE_INFO("%u: ATR set: ", ch->num);
 	for (i = 0; i < ch->atr.len; i++) {
-		TRACE_INFO_WP("%02x ", atr[i]);
+		TRACE_INFO_WP("%02x ", ch->atr.atr[i]);
 	}
 	TRACE_INFO_WP("\n\r");
 #endif
@@ -1189,20 +1660,37 @@ int card_emu_set_atr(struct card_handle *ch, const uint8_t *atr, uint8_t len)
 	return 0;
 }
 
+uint8_t card_emu_get_atr(struct card_handle *ch, uint8_t *atr, uint8_t len)
+{
+	if (len > ch->atr.orig_len)
+		len = ch->atr.orig_len;
+	memcpy(atr, ch->atr.orig, len);
+
+	return len;
+}
+
 /* hardware driver informs us that one (more) ETU has expired */
 void card_emu_wtime_half_expired(void *handle)
 {
 	struct card_handle *ch = handle;
+
+	evtrace_log(SIMTRACE_EVT_WT_HALF_EXPIRED, ch->num);
 	/* transmit NULL procedure byte well before waiting time expires */
 	switch (ch->state) {
 	case ISO_S_IN_TPDU:
 		switch (ch->tpdu.state) {
 		case TPDU_S_WAIT_PB:
 		case TPDU_S_WAIT_TX:
+			if (ch->uart_tx_dma_len) {
+				/* data is still flowing, a NULL byte must not be inserted */
+				card_emu_uart_reset_wt(ch->uart_chan);
+				break;
+			}
 			putchar('N');
 			/* we are waiting for data from the user. Send a procedure byte to ask the
 			 * reader to wait more time */
 			card_emu_uart_tx(ch->uart_chan, ISO7816_3_PB_NULL);
+			ch->stats.null_pb++;
 			card_emu_uart_reset_wt(ch->uart_chan);
 			break;
 		default:
@@ -1218,6 +1706,8 @@ void card_emu_wtime_half_expired(void *handle)
 void card_emu_wtime_expired(void *handle)
 {
 	struct card_handle *ch = handle;
+
+	evtrace_log(SIMTRACE_EVT_WT_EXPIRED, ch->num);
 	switch (ch->state) {
 	case ISO_S_WAIT_ATR:
 		/* ISO 7816-3 6.2.1 time tc has passed, we can now send the ATR */
@@ -1249,8 +1739,229 @@ static const uint8_t default_atr[] = { 0x3B, 0x80, 0x80, 0x81 , 0x1F, 0xC7, 0x59
 
 static struct card_handle card_handles[NUM_SLOTS];
 
-int card_emu_set_config(struct card_handle *ch, const struct cardemu_usb_msg_config *scfg,
-			unsigned int scfg_len)
+/* add a TPDU response cache entry. Takes ownership of msg
+ * (SIMTRACE_MSGT_DT_CEMU_CACHE_ADD with l2h pointing to the payload) */
+int card_emu_cache_add(struct card_handle *ch, struct msgb *msg)
+{
+	struct cardemu_usb_msg_cache_add *ce = cache_entry(msg);
+	struct msgb *old;
+
+	if (msgb_l2len(msg) < sizeof(*ce) ||
+	    msgb_l2len(msg) < sizeof(*ce) + ce->resp_len || ce->resp_len < 2) {
+		TRACE_ERROR("%u: %s: invalid entry\r\n", ch->num, __func__);
+		usb_buf_free(msg);
+		return -EINVAL;
+	}
+
+	if (ce->data_len || !cache_hdr_allowed(ce->hdr)) {
+		TRACE_ERROR("%u: %s: INS %02x can't be cached\r\n", ch->num, __func__, ce->hdr[_INS]);
+		usb_buf_free(msg);
+		return -EPERM;
+	}
+
+	/* replace an existing entry for the same command */
+	llist_for_each_entry(old, &ch->cache, list) {
+		struct cardemu_usb_msg_cache_add *oce = cache_entry(old);
+		if (!memcmp(oce->hdr, ce->hdr, sizeof(ce->hdr))) {
+			llist_del(&old->list);
+			usb_buf_free(old);
+			ch->cache_len--;
+			break;
+		}
+	}
+
+	/* evict the oldest entry */
+	if (ch->cache_len >= CARD_EMU_CACHE_MAX) {
+		old = msgb_dequeue(&ch->cache);
+		usb_buf_free(old);
+		ch->cache_len--;
+	}
+
+	msgb_enqueue(&ch->cache, msg);
+	ch->cache_len++;
+
+	return 0;
+}
+
+/* remove all TPDU response cache entries */
+void card_emu_cache_flush(struct card_handle *ch)
+{
+	struct msgb *msg;
+
+	while ((msg = msgb_dequeue(&ch->cache))) {
+		usb_buf_free(msg);
+	}
+	ch->cache_len = 0;
+}
+
+/***********************************************************************
+ * Slot schedule
+ ***********************************************************************/
+
+static struct cardemu_usb_msg_schedule *sched_hdr(struct msgb *msg)
+{
+	return (struct cardemu_usb_msg_schedule *) msg->l2h;
+}
+
+static struct cardemu_usb_msg_sched_entry *sched_entry(struct msgb *msg, uint16_t off)
+{
+	return (struct cardemu_usb_msg_sched_entry *) (msg->l2h + off);
+}
+
+static bool sched_msg_valid(struct card_handle *ch, struct msgb *msg)
+{
+	unsigned int len = msgb_l2len(msg);
+	unsigned int off = sizeof(struct cardemu_usb_msg_schedule);
+	unsigned int i;
+
+	if (len < off)
+		return false;
+	for (i = 0; i < sched_hdr(msg)->num_entries; i++) {
+		struct cardemu_usb_msg_sched_entry *se = sched_entry(msg, off);
+		if (off + sizeof(*se) > len || off + sizeof(*se) + se->atr_len > len ||
+		    se->atr_len > sizeof(ch->atr.orig))
+			return false;
+		off += sizeof(*se) + se->atr_len;
+	}
+	return true;
+}
+
+static void sched_report(struct card_handle *ch, const struct cardemu_usb_msg_sched_entry *se)
+{
+	struct cardemu_usb_msg_sched_step *step;
+	struct msgb *msg;
+
+	msg = usb_buf_alloc_st(ch->irq_ep, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DO_CEMU_SCHED_STEP);
+	if (!msg)
+		return;
+
+	step = (struct cardemu_usb_msg_sched_step *) msgb_put(msg, sizeof(*step));
+	step->index = se ? ch->sched.index : CEMU_SCHED_IDX_DONE;
+	step->slot_mux_nr = se ? se->slot_mux_nr : 0;
+	step->script_id = se ? se->script_id : 0;
+
+	usb_buf_upd_len_and_submit(msg);
+}
+
+/* drop the schedule */
+static void sched_flush(struct card_handle *ch)
+{
+	struct msgb *msg;
+
+	while ((msg = msgb_dequeue(&ch->sched.msgs)))
+		usb_buf_free(msg);
+	ch->sched.msgs_len = 0;
+	ch->sched.cur = NULL;
+}
+
+/* continue with the next entry of the schedule (or start with its first one) */
+static void sched_next(struct card_handle *ch)
+{
+	struct msgb *msg = ch->sched.cur;
+	struct cardemu_usb_msg_sched_entry *se;
+
+	if (llist_empty(&ch->sched.msgs))
+		return;
+
+	if (!msg) {
+		msg = llist_entry(ch->sched.msgs.next, struct msgb, list);
+		ch->sched.cur_entry = 0;
+		ch->sched.cur_off = sizeof(struct cardemu_usb_msg_schedule);
+		ch->sched.index = 0;
+	} else {
+		se = sched_entry(msg, ch->sched.cur_off);
+		ch->sched.cur_off += sizeof(*se) + se->atr_len;
+		ch->sched.cur_entry++;
+		/* the index of a long schedule wraps, but never reads as 'done' */
+		if (++ch->sched.index == CEMU_SCHED_IDX_DONE)
+			ch->sched.index = 0;
+	}
+
+	/* messages without entries are not queued, so this ends */
+	while (ch->sched.cur_entry >= sched_hdr(msg)->num_entries) {
+		if (msg->list.next != &ch->sched.msgs) {
+			struct msgb *next = llist_entry(msg->list.next, struct msgb, list);
+			/* without LOOP, a consumed message makes room for the host
+			 * to append more entries while the schedule runs */
+			if (!(ch->sched.flags & CEMU_SCHED_F_LOOP)) {
+				llist_del(&msg->list);
+				ch->sched.msgs_len--;
+				usb_buf_free(msg);
+			}
+			msg = next;
+		} else if (ch->sched.flags & CEMU_SCHED_F_LOOP) {
+			msg = llist_entry(ch->sched.msgs.next, struct msgb, list);
+			ch->sched.index = 0;
+		} else {
+			DLOG_INFO("%u: schedule done\r\n", ch->num);
+			sched_flush(ch);
+			sched_report(ch, NULL);
+			return;
+		}
+		ch->sched.cur_entry = 0;
+		ch->sched.cur_off = sizeof(struct cardemu_usb_msg_schedule);
+	}
+	ch->sched.cur = msg;
+
+	se = sched_entry(msg, ch->sched.cur_off);
+	DLOG_INFO("%u: schedule entry %u: slot %u\r\n", ch->num, ch->sched.index, se->slot_mux_nr);
+	card_emu_select_slot(ch->uart_chan, se->slot_mux_nr);
+	if (se->atr_len)
+		card_emu_set_atr(ch, se->atr, se->atr_len);
+	sched_report(ch, se);
+}
+
+/* set or extend the slot schedule. Takes ownership of msg
+ * (SIMTRACE_MSGT_DT_CEMU_SCHEDULE with l2h pointing to the payload) */
+int card_emu_sched_add(struct card_handle *ch, struct msgb *msg)
+{
+	struct cardemu_usb_msg_schedule *sh = sched_hdr(msg);
+	bool start;
+
+	if (!sched_msg_valid(ch, msg)) {
+		TRACE_ERROR("%u: %s: invalid schedule\r\n", ch->num, __func__);
+		usb_buf_free(msg);
+		return -EINVAL;
+	}
+
+	if (!(sh->flags & CEMU_SCHED_F_APPEND)) {
+		sched_flush(ch);
+		ch->sched.flags = sh->flags;
+	}
+	if (!sh->num_entries) {
+		usb_buf_free(msg);
+		return 0;
+	}
+	if (ch->sched.msgs_len >= CARD_EMU_SCHED_MSGS_MAX) {
+		TRACE_ERROR("%u: %s: schedule too long\r\n", ch->num, __func__);
+		usb_buf_free(msg);
+		return -ENOSPC;
+	}
+
+	start = llist_empty(&ch->sched.msgs);
+	msgb_enqueue(&ch->sched.msgs, msg);
+	ch->sched.msgs_len++;
+
+	/* never switch slots during a card session, wait for VCC to go off */
+	if (start && !ch->vcc_active)
+		sched_next(ch);
+
+	return 0;
+}
+
+void card_emu_get_config(struct card_handle *ch, struct cardemu_usb_msg_config *cfg)
+{
+	cfg->features = ch->features;
+#ifdef HAVE_SLOT_MUX
+	cfg->slot_mux_nr = mux_get_slot();
+#else
+	cfg->slot_mux_nr = 0;
+#endif
+	cfg->max_fidi = ch->max_fidi;
+}
+
+int card_emu_apply_config(struct card_handle *ch, const struct cardemu_usb_msg_config *scfg,
+			  unsigned int scfg_len)
 {
 	if (scfg_len >= sizeof(uint32_t))
 		ch->features = (scfg->features & SUPPORTED_FEATURES);
@@ -1261,6 +1972,26 @@ int card_emu_set_config(struct card_handle *ch, const struct cardemu_usb_msg_con
 	}
 #endif
 
+	if (scfg_len >= sizeof(uint32_t)+2*sizeof(uint8_t) && scfg->max_fidi != ch->max_fidi) {
+		int ratio = iso7816_3_compute_fd_ratio(scfg->max_fidi >> 4, scfg->max_fidi & 0xf);
+		if (scfg->max_fidi && (ratio < CARD_EMU_MIN_FD_RATIO || ratio >= 0x400)) {
+			TRACE_ERROR("%u: F/D %02x (ratio %d) not supported by UART\r\n", ch->num,
+				    scfg->max_fidi, ratio);
+		} else {
+			ch->max_fidi = scfg->max_fidi;
+			/* applies from the next ATR on */
+			update_atr(ch);
+		}
+	}
+
+	return 0;
+}
+
+int card_emu_set_config(struct card_handle *ch, const struct cardemu_usb_msg_config *scfg,
+			unsigned int scfg_len)
+{
+	card_emu_apply_config(ch, scfg, scfg_len);
+
 	/* send back a report of our current configuration */
 	card_emu_report_config(ch);
 
@@ -1279,6 +2010,8 @@ struct card_handle *card_emu_init(uint8_t slot_num, uint8_t uart_chan, uint8_t i
 	memset(ch, 0, sizeof(*ch));
 
 	INIT_LLIST_HEAD(&ch->uart_tx_queue);
+	INIT_LLIST_HEAD(&ch->cache);
+	INIT_LLIST_HEAD(&ch->sched.msgs);
 
 	ch->num = slot_num;
 	ch->irq_ep = irq_ep;
@@ -1296,8 +2029,9 @@ struct card_handle *card_emu_init(uint8_t slot_num, uint8_t uart_chan, uint8_t i
 	ch->waiting_time = ISO7816_3_INIT_WTIME;
 
 	ch->atr.idx = 0;
-	ch->atr.len = sizeof(default_atr);
-	memcpy(ch->atr.atr, default_atr, ch->atr.len);
+	ch->atr.orig_len = sizeof(default_atr);
+	memcpy(ch->atr.orig, default_atr, ch->atr.orig_len);
+	update_atr(ch);
 
 	ch->pts.state = PTS_S_WAIT_REQ_PTSS;
 	ch->tpdu.state = TPDU_S_WAIT_CLA;
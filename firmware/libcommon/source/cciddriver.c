@@ -45,6 +45,10 @@
 
 #include "board.h"
 #include "simtrace.h"
+#include "iso7816_fidi.h"
+#include "iso7816_t1.h"
+
+#include <errno.h>
 
 #ifdef HAVE_CCID
 
@@ -112,6 +116,12 @@ typedef struct {
 static CCIDDriver ccidDriver;
 static CCIDDriverConfigurationDescriptors *configurationDescriptorsFS;
 
+/// Interrupt driven T=0 transfer: pending / completed with status and length
+static volatile unsigned char xfrPending;
+static volatile unsigned char xfrDone;
+static volatile uint32_t xfrStatus;
+static volatile uint16_t xfrLen;
+
 //------------------------------------------------------------------------------
 //      Internal functions
 //------------------------------------------------------------------------------
@@ -158,6 +168,94 @@ static void RDRtoPCSlotStatus( void )
 	ccidDriver.sCcidMessage.bSpecific = 0;
 }
 
+//------------------------------------------------------------------------------
+/// Automatic parameter configuration and negotiation after the ATR: select
+/// T=1 if the card offers it, request the fastest Fi/Di the USART supports
+/// with PPS and fill in the protocol data structure
+/// \return 0 on success, -ENOTSUP if the card requires T=1 with CRC
+//------------------------------------------------------------------------------
+static int CCID_NegotiateProtocol( const unsigned char *Atr, unsigned char length )
+{
+	struct iso7816_atr_params params;
+	unsigned char protocol;
+	unsigned char fi_di = 0x11;
+	unsigned char tmp[ATR_SIZE_MAX];
+	unsigned char tmp_len;
+
+	if (ISO7816_ParseATR(Atr, length, &params) != 0) {
+		TRACE_ERROR("Bad ATR\n\r");
+	}
+	protocol = params.protocol;
+
+	if (params.specific) {
+		// Specific mode: no PPS, use the parameters of the ATR
+		fi_di = params.fi_di;
+	}
+	else {
+		// Larger blocks: prefer T=1 (only LRC is supported, a card
+		// offering T=1 with CRC only is rejected below)
+		if ((params.protocols & (1 << PROTOCOL_T1)) && !params.t1_crc) {
+			protocol = PROTOCOL_T1;
+		}
+		else if (params.protocols & (1 << PROTOCOL_TO)) {
+			protocol = PROTOCOL_TO;
+		}
+		fi_di = ISO7816_BestFiDi(params.fi_di);
+		if (fi_di != 0x11 || protocol != params.protocol) {
+			if (ISO7816_PPS(protocol, &fi_di) != 0) {
+				// The card has to be reset after a failed PPS
+				TRACE_WARNING("PPS failed, using default parameters\n\r");
+				ISO7816_warm_reset();
+				ISO7816_Datablock_ATR(tmp, &tmp_len);
+				protocol = params.protocol;
+				fi_di = 0x11;
+			}
+		}
+	}
+	// selected by specific mode, as the only protocol or after a failed PPS
+	if (protocol == PROTOCOL_T1 && params.t1_crc) {
+		TRACE_ERROR("Unsupported protocol T=1 with CRC\n\r");
+		return -ENOTSUP;
+	}
+	if (protocol != PROTOCOL_TO && protocol != PROTOCOL_T1) {
+		TRACE_ERROR("Unsupported protocol T=%u\n\r", protocol);
+		protocol = PROTOCOL_TO;
+	}
+	TRACE_INFO("T=%u, Fi/Di 0x%02X\n\r", protocol, fi_di);
+
+	ISO7816_SetProtocol(protocol, fi_di, params.guard_time);
+	ccidDriver.bProtocol = protocol;
+
+	memset(ccidDriver.ProtocolDataStructure, 0, sizeof(ccidDriver.ProtocolDataStructure));
+	// bmFindexDindex
+	ccidDriver.ProtocolDataStructure[0] = fi_di;
+	// bGuardTimeT0 / bGuardTimeT1
+	ccidDriver.ProtocolDataStructure[2] = params.guard_time;
+	// bClockStop: stopping the clock is not allowed
+	ccidDriver.ProtocolDataStructure[4] = 0x00;
+
+	if (protocol == PROTOCOL_T1) {
+		ISO7816_T1_Init(params.ifsc, params.bwi_cwi);
+		// bmTCCKST1: LRC, convention
+		ccidDriver.ProtocolDataStructure[1] = 0x10 | (Atr[0] == 0x3F ? 0x02 : 0);
+		// bmWaitingIntegersT1
+		ccidDriver.ProtocolDataStructure[3] = params.bwi_cwi;
+		// bIFSC, bNadValue
+		ccidDriver.ProtocolDataStructure[5] = params.ifsc;
+		ccidDriver.ProtocolDataStructure[6] = 0;
+	}
+	else {
+		// WWT = 960 * WI * Di etu
+		ISO7816_T0_SetWaitingTime(960UL * params.wi * iso7816_3_di_table[fi_di & 0x0F]);
+		// bmTCCKST0: convention
+		ccidDriver.ProtocolDataStructure[1] = (Atr[0] == 0x3F ? 0x02 : 0);
+		// bWaitingIntegerT0
+		ccidDriver.ProtocolDataStructure[3] = params.wi;
+	}
+
+	return 0;
+}
+
 //------------------------------------------------------------------------------
 /// Response Pipe, Bulk-IN Messages
 /// Answer to PC_to_RDR_IccPowerOn
@@ -168,6 +266,7 @@ static void RDRtoPCDatablock_ATR( void )
 	unsigned char Atr[ATR_SIZE_MAX];
 	unsigned char length;
 	uint32_t status; 
+	int negotiated;
 
 	TRACE_DEBUG(".");
 
@@ -180,39 +279,7 @@ static void RDRtoPCDatablock_ATR( void )
 //        return;
 	}
 
-// FIXME: More tests? Is bProtocol = Atr[3] ?
-	if( length > 5 ) {
-		ccidDriver.ProtocolDataStructure[1] = Atr[3]&0x0F; // TD(1)
-		ccidDriver.bProtocol = Atr[3]&0x0F;           // TD(1)
-		TRACE_INFO("Protocol data structure: 0x%x\n\r",
-					    ccidDriver.ProtocolDataStructure[1]);
-	}
-
-	// S_ccid_protocol_t0
-	// bmFindexDindex
-	ccidDriver.ProtocolDataStructure[0] = Atr[2];     // TA(1)
-
-	// bmTCCKST0
-	// For T=0 ,B0  0b, B7-2  000000b
-	// B1  Convention used (b1=0 for direct, b1=1 for inverse)
-
-	// bGuardTimeT0
-	// Extra Guardtime between two characters. Add 0 to 254 etu to the normal 
-	// guardtime of 12etu. FFh is the same as 00h.
-	ccidDriver.ProtocolDataStructure[2] = Atr[4];     // TC(1)
-	// AT91C_BASE_US0->US_TTGR = 0;  // TC1
-
-	// bWaitingIntegerT0
-	// WI for T=0 used to define WWT
-	ccidDriver.ProtocolDataStructure[3] = Atr[7];     // TC(2)
-
-	// bClockStop
-	// ICC Clock Stop Support
-	// 00 = Stopping the Clock is not allowed
-	// 01 = Stop with Clock signal Low
-	// 02 = Stop with Clock signal High
-	// 03 = Stop with Clock either High or Low
-	ccidDriver.ProtocolDataStructure[4] = 0x00;       // 0 to 3
+	negotiated = CCID_NegotiateProtocol( Atr, length );
 
 	// Header fields settings
 	ccidDriver.sCcidMessage.bMessageType = RDR_TO_PC_DATABLOCK;
@@ -226,6 +293,14 @@ static void RDRtoPCDatablock_ATR( void )
 		ccidDriver.sCcidMessage.abData[i]  = Atr[i];
 	}
 
+	if (negotiated != 0) {
+		// the card can't be used, deactivate it again
+		ISO7816_IccPowerOff();
+		ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED | ICC_BS_PRESENT_NOTACTIVATED;
+		ccidDriver.sCcidMessage.bError = ICC_PROTOCOL_NOT_SUPPORTED;
+		return;
+	}
+
 	// Set the slot to an active status
 	ccidDriver.sCcidMessage.bStatus = 0;
 	ccidDriver.sCcidMessage.bError = 0;
@@ -275,7 +350,7 @@ static void RDRtoPCParameters( void )
 	//ccidDriver.sCcidMessage.bStatus = 0;
 	ccidDriver.sCcidMessage.bError  = 0;
 
-	if( ccidDriver.ProtocolDataStructure[1] == PROTOCOL_TO ) {
+	if( ccidDriver.bProtocol == PROTOCOL_TO ) {
 
 		// T=0
 		ccidDriver.sCcidMessage.wLength   = sizeof(S_ccid_protocol_t0);
@@ -423,10 +498,26 @@ static void PCtoRDRGetSlotStatus( void )
 /// If the command header is valid, an APDU command is received and can be read
 /// by the application
 //------------------------------------------------------------------------------
-static void PCtoRDRXfrBlock( void )
+static void XfrBlockDone( uint32_t status, uint16_t len )
+{
+	// called from the USART interrupt, the response is sent by
+	// CCID_SmartCardRequest() in the main loop
+	xfrStatus = status;
+	xfrLen = len;
+	xfrDone = 1;
+}
+
+//------------------------------------------------------------------------------
+/// Command Pipe, Bulk-OUT Messages
+/// If the command header is valid, an APDU command is received and can be read
+/// by the application
+/// \return 1 if the response can be sent, 0 if it is sent on completion of
+///          the transfer to the card
+//------------------------------------------------------------------------------
+static unsigned char PCtoRDRXfrBlock( void )
 {
 	uint16_t msglen = 0;
-	uint32_t ret;
+	int ret;
 
 	TRACE_DEBUG("PCtoRDRXfrBlock\n\r");
 
@@ -444,30 +535,36 @@ static void PCtoRDRXfrBlock( void )
 	else {
 
 		// APDU or TPDU
+		TRACE_DEBUG("APDU cmd: %x %x %x ..", ccidDriver.sCcidCommand.APDU[0], ccidDriver.sCcidCommand.APDU[1],ccidDriver.sCcidCommand.APDU[2] );
+
+		// Send commande APDU, the card is served from the USART
+		// interrupt
+		ret = -ENOTSUP;
+		xfrPending = 1;
 		switch(configurationDescriptorsFS->ccid.dwFeatures 
 			  & (CCID_FEATURES_EXC_TPDU|CCID_FEATURES_EXC_SAPDU|CCID_FEATURES_EXC_APDU)) {
 
 			case CCID_FEATURES_EXC_TPDU:
-				if (ccidDriver.ProtocolDataStructure[1] == PROTOCOL_TO) {
-					TRACE_DEBUG("APDU cmd: %x %x %x ..", ccidDriver.sCcidCommand.APDU[0], ccidDriver.sCcidCommand.APDU[1],ccidDriver.sCcidCommand.APDU[2] );
+				if (ccidDriver.bProtocol == PROTOCOL_TO) {
+					ret = ISO7816_XfrBlockTPDU_T0_Start( ccidDriver.sCcidCommand.APDU,
+					                        ccidDriver.sCcidMessage.abData,
+					                        ccidDriver.sCcidCommand.wLength,
+					                        ABDATA_SIZE, XfrBlockDone );
+				}
+				break;
 
-					// Send commande APDU
-					ret = ISO7816_XfrBlockTPDU_T0( ccidDriver.sCcidCommand.APDU ,
+			case CCID_FEATURES_EXC_SAPDU:
+				if (ccidDriver.bProtocol == PROTOCOL_T1) {
+					ret = ISO7816_XfrBlockAPDU_T1_Start( ccidDriver.sCcidCommand.APDU,
 					                        ccidDriver.sCcidMessage.abData,
 					                        ccidDriver.sCcidCommand.wLength,
-					                        &msglen );
-					if (ret != 0) {
-					    TRACE_ERROR("APDU could not be sent: (US_CSR = 0x%x)", ret);
-					    return;
-					}
+					                        ABDATA_SIZE, XfrBlockDone );
 				}
 				else {
-					if (ccidDriver.ProtocolDataStructure[1] == PROTOCOL_T1) {
-					    TRACE_DEBUG("Not supported T=1\n\r");
-					}
-					else {
-					    TRACE_DEBUG("Not supported 0x%x\n\r", ccidDriver.ProtocolDataStructure[1]);
-					}
+					ret = ISO7816_XfrBlockAPDU_T0_Start( ccidDriver.sCcidCommand.APDU,
+					                        ccidDriver.sCcidMessage.abData,
+					                        ccidDriver.sCcidCommand.wLength,
+					                        ABDATA_SIZE, XfrBlockDone );
 				}
 				break;
 
@@ -478,7 +575,17 @@ static void PCtoRDRXfrBlock( void )
 			default:
 				break;
 		}
-
+		if (ret == 0) {
+			return 0;
+		}
+		xfrPending = 0;
+		TRACE_ERROR("APDU could not be sent: %d\n\r", ret);
+		ccidDriver.sCcidMessage.wLength = 0;
+		RDRtoPCDatablock();
+		ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED;
+		// error value 1: offset of the bad dwLength field
+		ccidDriver.sCcidMessage.bError = (ret == -EBUSY) ? CMD_SLOT_BUSY : 1;
+		return 1;
 	}
 
 	ccidDriver.sCcidMessage.wLength = msglen;
@@ -489,6 +596,7 @@ static void PCtoRDRXfrBlock( void )
 					                                                ccidDriver.sCcidMessage.abData[4] );
 	 RDRtoPCDatablock();
 
+	 return 1;
 }
 
 //------------------------------------------------------------------------------
@@ -767,8 +875,7 @@ static void CCIDCommandDispatcher( void *pArg, uint8_t status, uint32_t transfer
 			break;
 
 		case PC_TO_RDR_XFRBLOCK:
-			PCtoRDRXfrBlock();
-			MessageToSend = 1;
+			MessageToSend = PCtoRDRXfrBlock();
 			break;
 
 		case PC_TO_RDR_GETPARAMETERS:
@@ -923,6 +1030,29 @@ void CCID_SmartCardRequest( void )
 	unsigned char bStatus;
 	TRACE_DEBUG("CCID_req\n\r");
 
+	if (xfrDone) {
+		xfrDone = 0;
+		ccidDriver.sCcidMessage.wLength = xfrStatus ? 0 : xfrLen;
+		RDRtoPCDatablock();
+		if (xfrStatus != 0) {
+			TRACE_ERROR("APDU could not be sent: (US_CSR = 0x%x)\n\r", xfrStatus);
+			ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED;
+			if (xfrStatus & US_CSR_TIMEOUT)
+				ccidDriver.sCcidMessage.bError = ICC_MUTE;
+			else if (xfrStatus & US_CSR_OVRE)
+				ccidDriver.sCcidMessage.bError = XFR_OVERRUN;
+			else if (xfrStatus & ISO7816_XFR_PROTO_ERROR)
+				ccidDriver.sCcidMessage.bError = PROCEDURE_BYTE_CONFLICT;
+			else
+				ccidDriver.sCcidMessage.bError = XFR_PARITY_ERROR;
+		}
+		xfrPending = 0;
+		vCCIDSendResponse();
+	}
+	// the command buffer holds the APDU until the card has answered
+	if (xfrPending)
+		return;
+
 	do {
 
 		bStatus = CCID_Read( (void*)&ccidDriver.sCcidCommand,
@@ -0,0 +1,172 @@
+/* Flash backed store for the card emulation configuration
+ *
+ * Keeps the ATR and the configuration (features, mux slot, speed policy) of
+ * each card emulation slot in the last flash pages, so they can be applied
+ * at start-up, before the host connects.
+ *
+ * Each write programs a complete record (all slots, sequence number, CRC)
+ * into the next page of a ring.  A page is thus only erased once every
+ * CFG_STORE_NUM_PAGES writes, and an interrupted write leaves the previous
+ * record intact.  At start-up, the valid record with the highest sequence
+ * number wins.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "cfg_store.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#define CFG_STORE_ADDR		(IFLASH_ADDR + IFLASH_SIZE - BOARD_CFG_STORE_SIZE)
+#define CFG_STORE_NUM_PAGES	(BOARD_CFG_STORE_SIZE / IFLASH_PAGE_SIZE)
+#define CFG_STORE_MAGIC		0x32435453	/* "STC2" */
+
+struct cfg_store_rec {
+	uint32_t magic;
+	/* incremented with each write */
+	uint32_t seq;
+	struct cfg_store_slot slot[CFG_STORE_NUM_SLOTS];
+	/* CRC-32 over all of the above */
+	uint32_t crc;
+} __attribute__ ((packed));
+
+#if (BOARD_CFG_STORE_SIZE % IFLASH_PAGE_SIZE) != 0
+#error "BOARD_CFG_STORE_SIZE must be a multiple of the flash page size"
+#endif
+
+static struct {
+	/* copy of the latest record */
+	struct cfg_store_rec rec;
+	/* ring page of the latest record, -1 if there is none */
+	int page;
+	bool flash_initialized;
+} store;
+
+static uint32_t crc32(const uint8_t *data, unsigned int len)
+{
+	uint32_t crc = 0xffffffff;
+	unsigned int i, j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (j = 0; j < 8; j++) {
+			if (crc & 1)
+				crc = (crc >> 1) ^ 0xEDB88320;
+			else
+				crc >>= 1;
+		}
+	}
+
+	return ~crc;
+}
+
+static const struct cfg_store_rec *page_rec(unsigned int page)
+{
+	return (const struct cfg_store_rec *) (CFG_STORE_ADDR + page * IFLASH_PAGE_SIZE);
+}
+
+static bool rec_valid(const struct cfg_store_rec *rec)
+{
+	return rec->magic == CFG_STORE_MAGIC &&
+	       rec->crc == crc32((const uint8_t *) rec, offsetof(struct cfg_store_rec, crc));
+}
+
+void cfg_store_init(void)
+{
+	unsigned int i;
+
+	memset(&store.rec, 0, sizeof(store.rec));
+	store.page = -1;
+
+	for (i = 0; i < CFG_STORE_NUM_PAGES; i++) {
+		const struct cfg_store_rec *rec = page_rec(i);
+
+		if (!rec_valid(rec))
+			continue;
+		/* the sequence number may have wrapped around */
+		if (store.page < 0 || (int32_t) (rec->seq - store.rec.seq) > 0) {
+			memcpy(&store.rec, rec, sizeof(store.rec));
+			store.page = i;
+		}
+	}
+
+	if (store.page >= 0)
+		TRACE_INFO("cfg_store: using record %lu in page %d\r\n", store.rec.seq, store.page);
+}
+
+const struct cfg_store_slot *cfg_store_get(uint8_t slot)
+{
+	if (slot >= CFG_STORE_NUM_SLOTS || !store.rec.slot[slot].valid)
+		return NULL;
+
+	return &store.rec.slot[slot];
+}
+
+int cfg_store_set(uint8_t slot, const struct cfg_store_slot *s)
+{
+	struct cfg_store_rec rec;
+	unsigned int page;
+	uint32_t addr;
+	unsigned long x;
+	int rc;
+
+	if (slot >= CFG_STORE_NUM_SLOTS)
+		return -EINVAL;
+	if (s && s->atr_len > sizeof(s->atr))
+		return -EINVAL;
+
+	memcpy(&rec, &store.rec, sizeof(rec));
+	if (s) {
+		memcpy(&rec.slot[slot], s, sizeof(rec.slot[slot]));
+		rec.slot[slot].valid = 1;
+	} else
+		memset(&rec.slot[slot], 0, sizeof(rec.slot[slot]));
+	rec.magic = CFG_STORE_MAGIC;
+	rec.seq = store.rec.seq + 1;
+	rec.crc = crc32((const uint8_t *) &rec, offsetof(struct cfg_store_rec, crc));
+
+	page = (store.page + 1) % CFG_STORE_NUM_PAGES;
+	addr = CFG_STORE_ADDR + page * IFLASH_PAGE_SIZE;
+
+	if (!store.flash_initialized) {
+		/* the IAP function in ROM keeps running while the flash is busy */
+		FLASHD_Initialize(BOARD_MCK, 1);
+		store.flash_initialized = true;
+	}
+	/* the flash can't be read while a command runs, so no interrupt handler
+	 * (or vector) may be fetched from it in the meantime */
+	local_irq_save(x);
+	rc = FLASHD_Unlock(addr, addr + IFLASH_PAGE_SIZE, 0, 0);
+	local_irq_restore(x);
+	if (rc == 0) {
+		local_irq_save(x);
+		rc = FLASHD_Write(addr, &rec, sizeof(rec));
+		local_irq_restore(x);
+	}
+	if (rc != 0 || !rec_valid(page_rec(page))) {
+		TRACE_ERROR("cfg_store: writing page %u failed\r\n", page);
+		return -EIO;
+	}
+
+	memcpy(&store.rec, &rec, sizeof(store.rec));
+	store.page = page;
+	TRACE_INFO("cfg_store: wrote record %lu to page %u\r\n", rec.seq, page);
+
+	return 0;
+}
+
+uint32_t cfg_store_seq(void)
+{
+	return store.rec.seq;
+}
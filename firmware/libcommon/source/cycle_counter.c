@@ -0,0 +1,93 @@
+/* Free-running cycle counter
+ *
+ * The DWT cycle counter of the core stops while the core sleeps (WFI).
+ * Instead, TC4 (channel 1 of TC block 1) counts MCK/8, and its overflows
+ * extend it to 32 bits in software.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "cycle_counter.h"
+
+#include <stdbool.h>
+
+/* TC4 (channel 1 of TC block 1) is not used otherwise */
+#define CC_TC		(&TC1->TC_CHANNEL[1])
+
+/* the 16 bit counter overflows every 2^16 * CYCLE_COUNTER_DIV MCK cycles
+ * (9 ms at 58 MHz). Interrupts may be masked up to that long without
+ * losing time */
+#define CC_TC_BITS	16
+
+static struct {
+	/* number of counter overflows */
+	volatile uint32_t overflows;
+	bool running;
+} cc;
+
+/* account the counter overflow if it happened. Both the interrupt and
+ * cycle_counter_get() check for it, since reading the status register
+ * clears the flag (must be called with interrupts masked) */
+static inline bool cc_check_overflow(void)
+{
+	if (CC_TC->TC_SR & TC_SR_COVFS) {
+		cc.overflows++;
+		return true;
+	}
+	return false;
+}
+
+void TC4_IrqHandler(void)
+{
+	unsigned long x;
+
+	local_irq_save(x);
+	cc_check_overflow();
+	local_irq_restore(x);
+}
+
+__ramfunc uint32_t cycle_counter_get(void)
+{
+	uint32_t cv;
+	uint32_t ret;
+	unsigned long x;
+
+	local_irq_save(x);
+	cv = CC_TC->TC_CV;
+	/* the counter might have overflowed before reading it */
+	if (cc_check_overflow())
+		cv = CC_TC->TC_CV;
+	ret = ((cc.overflows << CC_TC_BITS) | (cv & 0xffff)) * CYCLE_COUNTER_DIV;
+	local_irq_restore(x);
+
+	return ret;
+}
+
+void cycle_counter_init(void)
+{
+	if (cc.running)
+		return;
+
+	PMC_EnablePeripheral(ID_TC4);
+	CC_TC->TC_CCR = TC_CCR_CLKDIS;
+	CC_TC->TC_CMR = TC_CMR_TCCLKS_TIMER_CLOCK2 |	/* MCK/8 */
+			TC_CMR_WAVE |
+			TC_CMR_WAVSEL_UP;
+	CC_TC->TC_IDR = 0xffffffff;
+	CC_TC->TC_IER = TC_IER_COVFS;
+	cc.overflows = 0;
+	CC_TC->TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+	/* the overflow has to be accounted before the counter wraps again */
+	NVIC_SetPriority(TC4_IRQn, 0);
+	NVIC_EnableIRQ(TC4_IRQn);
+	cc.running = true;
+}
@@ -0,0 +1,122 @@
+/* Deferred binary logging
+ *
+ * DLOG_*() statements do not format anything on the target.  They record
+ * a cycle counter time-stamp, the offset of the format string in the
+ * .dlog_fmt table and the raw arguments into a RAM ring, which costs
+ * about as much as an evtrace_log().  The ring is drained by the host
+ * using SIMTRACE_CMD_BD_DLOG, and simtrace2-tool formats the messages
+ * using the .dlog table extracted from the ELF file at build time.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "dlog.h"
+#include "cycle_counter.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/utils.h>
+
+#if DLOG_NUM_WORDS > 0
+
+#if (DLOG_NUM_WORDS & (DLOG_NUM_WORDS - 1)) != 0
+#error "DLOG_NUM_WORDS must be a power of two"
+#endif
+
+/* start of the firmware image, see linker script */
+extern uint32_t _sfixed;
+
+static struct {
+	uint32_t buf[DLOG_NUM_WORDS];
+	/* total number of words written / read (wrap around) */
+	uint32_t wr;
+	uint32_t rd;
+	uint32_t num_dropped;
+} dlog;
+
+void dlog_init(void)
+{
+	cycle_counter_init();
+}
+
+static inline void dlog_put(uint32_t word)
+{
+	dlog.buf[dlog.wr++ & (DLOG_NUM_WORDS - 1)] = word;
+}
+
+void dlog_write(uint8_t level, uint16_t fmt, unsigned int num_args, ...)
+{
+	va_list ap;
+	unsigned long x;
+	unsigned int i;
+
+	if (num_args > DLOG_MAX_ARGS)
+		num_args = DLOG_MAX_ARGS;
+
+	local_irq_save(x);
+	/* never overwrite messages the host has not read yet */
+	if (DLOG_NUM_WORDS - (dlog.wr - dlog.rd) < 2 + num_args) {
+		dlog.num_dropped++;
+		local_irq_restore(x);
+		return;
+	}
+	/* same layout as struct simtrace_dlog_rec */
+	dlog_put(cycle_counter_get());
+	dlog_put(fmt | (level << 16) | (num_args << 24));
+	va_start(ap, num_args);
+	for (i = 0; i < num_args; i++)
+		dlog_put(va_arg(ap, uint32_t));
+	va_end(ap);
+	local_irq_restore(x);
+}
+
+void dlog_dump(struct msgb *msg)
+{
+	struct simtrace_dlog_resp *resp;
+	uint32_t rd, wr;
+	unsigned int num = 0;
+	unsigned long x;
+
+	local_irq_save(x);
+	wr = dlog.wr;
+	local_irq_restore(x);
+
+	resp = (struct simtrace_dlog_resp *) msgb_put(msg, sizeof(*resp));
+	resp->cycles_per_sec = BOARD_MCK;
+	resp->image_base = (uint32_t) &_sfixed;
+
+	/* only return complete messages; the writer never touches the words
+	 * between rd and wr, so they can be copied with interrupts enabled */
+	rd = dlog.rd;
+	while (rd != wr) {
+		uint32_t hdr = dlog.buf[(rd + 1) & (DLOG_NUM_WORDS - 1)];
+		unsigned int len = 2 + (hdr >> 24);
+		unsigned int i;
+
+		if (msgb_tailroom(msg) < len * sizeof(uint32_t))
+			break;
+		for (i = 0; i < len; i++) {
+			uint32_t word = dlog.buf[rd++ & (DLOG_NUM_WORDS - 1)];
+			memcpy(msgb_put(msg, sizeof(word)), &word, sizeof(word));
+		}
+		num += len;
+	}
+	resp->num_words = num;
+
+	local_irq_save(x);
+	dlog.rd = rd;
+	resp->num_dropped = dlog.num_dropped;
+	local_irq_restore(x);
+}
+
+#endif
@@ -0,0 +1,102 @@
+/* Binary firmware event tracer
+ *
+ * Records a cycle counter time-stamp, an event identifier and a 32bit
+ * argument into a RAM ring.  Unlike TRACE_*() output on the debug UART,
+ * recording an event only costs a few dozen cycles, so it can stay
+ * enabled in production builds.  The ring is read by the host using
+ * SIMTRACE_CMD_BD_EVTRACE.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "evtrace.h"
+#include "cycle_counter.h"
+
+#include <string.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/utils.h>
+
+#if EVTRACE_NUM_RECS > 0
+
+#if (EVTRACE_NUM_RECS & (EVTRACE_NUM_RECS - 1)) != 0
+#error "EVTRACE_NUM_RECS must be a power of two"
+#endif
+
+static struct {
+	struct simtrace_evtrace_rec recs[EVTRACE_NUM_RECS];
+	/* total number of records written (wraps around) */
+	uint32_t num_written;
+	bool frozen;
+} evtrace;
+
+void evtrace_init(void)
+{
+	cycle_counter_init();
+
+	evtrace.num_written = 0;
+	evtrace.frozen = false;
+}
+
+__ramfunc void evtrace_log(enum simtrace_evtrace_id id, uint32_t arg)
+{
+	struct simtrace_evtrace_rec *rec;
+	unsigned long x;
+
+	local_irq_save(x);
+	if (!evtrace.frozen) {
+		rec = &evtrace.recs[evtrace.num_written++ & (EVTRACE_NUM_RECS - 1)];
+		rec->cycles = cycle_counter_get();
+		rec->arg = arg;
+		rec->id = id;
+	}
+	local_irq_restore(x);
+}
+
+void evtrace_dump(struct msgb *msg, const struct simtrace_evtrace_req *req)
+{
+	struct simtrace_evtrace_resp *resp;
+	uint32_t num_total, first;
+	unsigned int i, num;
+	unsigned long x;
+
+	local_irq_save(x);
+	if (req->flags & SIMTRACE_EVTRACE_F_CLEAR)
+		evtrace.num_written = 0;
+	if (req->flags & SIMTRACE_EVTRACE_F_FREEZE)
+		evtrace.frozen = true;
+	local_irq_restore(x);
+
+	num_total = OSMO_MIN(evtrace.num_written, EVTRACE_NUM_RECS);
+	/* index of the oldest record */
+	first = evtrace.num_written - num_total;
+
+	resp = (struct simtrace_evtrace_resp *) msgb_put(msg, sizeof(*resp));
+	resp->cycles_per_sec = BOARD_MCK;
+	resp->num_total = num_total;
+	resp->offset = req->offset;
+	resp->flags = evtrace.frozen ? SIMTRACE_EVTRACE_F_FREEZE : 0;
+
+	num = 0;
+	if (req->offset < num_total)
+		num = OSMO_MIN(num_total - req->offset, msgb_tailroom(msg) / sizeof(resp->recs[0]));
+	for (i = 0; i < num; i++) {
+		uint32_t idx = (first + req->offset + i) & (EVTRACE_NUM_RECS - 1);
+		memcpy(msgb_put(msg, sizeof(resp->recs[0])), &evtrace.recs[idx], sizeof(resp->recs[0]));
+	}
+	resp->num_recs = num;
+
+	/* resume recording once the host has read everything it wanted */
+	if (!(req->flags & SIMTRACE_EVTRACE_F_FREEZE))
+		evtrace.frozen = false;
+}
+
+#endif
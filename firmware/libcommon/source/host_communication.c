@@ -14,6 +14,8 @@
 #include "llist_irqsafe.h"
 #include "usb_buf.h"
 #include "utils.h"
+#include "evtrace.h"
+#include "main_events.h"
 
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
@@ -45,11 +47,14 @@ static void usb_write_cb(uint8_t *arg, uint8_t status, uint32_t transferred,
 	bep->in_progress--;
 	local_irq_restore(x);
 	TRACE_DEBUG("%u: in_progress=%lu\r\n", bep->ep, bep->in_progress);
+	evtrace_log(SIMTRACE_EVT_USB_IN_DONE, (bep->ep << 16) | msgb_length(msg));
 
 	if (status != USBD_STATUS_SUCCESS)
 		TRACE_ERROR("%s error, status=%d\r\n", __func__, status);
 
 	usb_buf_free(msg);
+	/* the next queued message can be sent */
+	main_event_set(MAIN_EV_USB);
 }
 
 /* check if the spcified IN endpoint is idle and submit the next buffer from queue */
@@ -100,6 +105,7 @@ int usb_refill_to_host(uint8_t ep)
 		TRACE_DEBUG("%02x: in_progress=%lu\r\n", bep->ep, bep->in_progress);
 		return 0;
 	}
+	evtrace_log(SIMTRACE_EVT_USB_IN_SUBMIT, (ep << 16) | msgb_length(msg));
 
 	return 1;
 }
@@ -121,8 +127,10 @@ static void usb_read_cb(uint8_t *arg, uint8_t status, uint32_t transferred,
 		usb_buf_free(msg);
 		return;
 	}
+	evtrace_log(SIMTRACE_EVT_USB_OUT_DONE, (bep->ep << 16) | transferred);
 	msgb_put(msg, transferred);
 	llist_add_tail_irqsafe(&msg->list, &bep->queue);
+	main_event_set(MAIN_EV_USB);
 }
 
 /* refill the read queue for data received from host PC on OUT EP, if needed */
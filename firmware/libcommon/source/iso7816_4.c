@@ -44,6 +44,9 @@
  *------------------------------------------------------------------------------*/
 
 #include "board.h"
+#include "iso7816_fidi.h"
+
+#include <errno.h>
 
 /*------------------------------------------------------------------------------
  *         Definitions
@@ -57,6 +60,23 @@
 #define USART_SEND 0
 #define USART_RCV  1
 
+/** US_CSR bits reported as transfer errors */
+#define ISO7816_CSR_ERRORS	(US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE | \
+				 US_CSR_TIMEOUT | US_CSR_NACK | (1<<10))
+
+/** Work waiting time in etu (960 * WI, with the default WI = 10) */
+#define ISO7816_T0_WWT_ETU	(960 * 10)
+
+/** States of the interrupt driven T=0 TPDU transfer */
+enum t0_state {
+	T0_S_IDLE,
+	T0_S_TX_HDR,		/* sending the 5 byte TPDU header */
+	T0_S_WAIT_PB,		/* waiting for a procedure byte */
+	T0_S_TX_DATA,		/* sending command data after INS / ~INS */
+	T0_S_RX_DATA,		/* receiving response data after INS / ~INS */
+	T0_S_WAIT_SW2,		/* waiting for the second status byte */
+};
+
 /*-----------------------------------------------------------------------------
  *          Internal variables
  *-----------------------------------------------------------------------------*/
@@ -65,6 +85,45 @@ static Pin *st_pinIso7816RstMC;
 
 struct Usart_info usart_sim = {.base = USART_SIM, .id = ID_USART_SIM, .state = USART_RCV};
 
+/** Interrupt driven T=0 TPDU transfer */
+static struct {
+	volatile enum t0_state state;
+	/* TPDU header (P3 = 0 for a case 1 command) and command data */
+	uint8_t hdr[5];
+	const uint8_t *data;
+	uint8_t *resp;
+	uint16_t resp_size;
+	/* next byte to send (hdr[0..4], then data[]) / to receive into resp */
+	uint16_t tx_idx;
+	uint16_t resp_idx;
+	/* tx_idx after the last byte of the current transmission */
+	uint16_t tx_end;
+	/* data bytes still to be exchanged (Nc or Ne) */
+	uint16_t ne_nc;
+	/* data bytes to receive before the next procedure byte */
+	uint16_t rx_remain;
+	uint8_t cmd_case;
+	/* work waiting time in etu */
+	uint32_t wwt_etu;
+	ISO7816_XfrDoneCb done_cb;
+} t0 = { .wwt_etu = ISO7816_T0_WWT_ETU };
+
+/** Short APDU transported by T=0 TPDUs (GET RESPONSE, Le correction) */
+static struct {
+	uint8_t cla;
+	uint8_t *resp;
+	uint16_t resp_size;
+	/* response bytes of the previous TPDUs */
+	uint16_t resp_len;
+	/* header of the follow-up TPDU */
+	uint8_t hdr[5];
+	uint8_t le_retry;
+	ISO7816_XfrDoneCb done_cb;
+} t0_apdu;
+
+/** etu of a receiver time-out beyond what fits into US_RTOR */
+static uint32_t wt_left;
+
 /*----------------------------------------------------------------------------
  *          Internal functions
  *----------------------------------------------------------------------------*/
@@ -183,6 +242,58 @@ static void ISO7816_IccPowerOn( void )
 	}
 }
 
+/**
+ * Determine the case of a command TPDU
+ * \param pAPDU         APDU buffer
+ * \param wLength       Block length
+ * \param pNeNc         Returns the number of data bytes to send / receive
+ * \return              CASE1, CASE2 or CASE3
+ */
+static uint8_t get_apdu_case(const uint8_t *pAPDU, uint16_t wLength, uint16_t *pNeNc)
+{
+	uint16_t NeNc;
+	uint8_t cmdCase;
+
+	if( wLength == 4 ) {
+		cmdCase = CASE1;
+		NeNc = 0;
+	}
+	else if( wLength == 5) {
+		cmdCase = CASE2;
+		NeNc = pAPDU[4]; /* C5 */
+		if (NeNc == 0) {
+			NeNc = 256;
+		}
+	}
+	else if( wLength == 6) {
+		NeNc = pAPDU[4]; /* C5 */
+		cmdCase = CASE3;
+	}
+	else if( wLength == 7) {
+		NeNc = pAPDU[4]; /* C5 */
+		if( NeNc == 0 ) {
+			cmdCase = CASE2;
+			NeNc = (pAPDU[5]<<8)+pAPDU[6];
+		}
+		else {
+			cmdCase = CASE3;
+		}
+	}
+	else {
+		NeNc = pAPDU[4]; /* C5 */
+		if( NeNc == 0 ) {
+			cmdCase = CASE3;
+			NeNc = (pAPDU[5]<<8)+pAPDU[6];
+		}
+		else {
+			cmdCase = CASE3;
+		}
+	}
+
+	*pNeNc = NeNc;
+	return cmdCase;
+}
+
 /*----------------------------------------------------------------------------
  *          Exported functions
  *----------------------------------------------------------------------------*/
@@ -235,42 +346,7 @@ uint32_t ISO7816_XfrBlockTPDU_T0(const uint8_t *pAPDU,
 
 	/* Handle the four structures of command APDU */
 	indexApdu = 5;
-
-	if( wLength == 4 ) {
-		cmdCase = CASE1;
-		NeNc = 0;
-	}
-	else if( wLength == 5) {
-		cmdCase = CASE2;
-		NeNc = pAPDU[4]; /* C5 */
-		if (NeNc == 0) {
-			NeNc = 256;
-		}
-	}
-	else if( wLength == 6) {
-		NeNc = pAPDU[4]; /* C5 */
-		cmdCase = CASE3;
-	}
-	else if( wLength == 7) {
-		NeNc = pAPDU[4]; /* C5 */
-		if( NeNc == 0 ) {
-			cmdCase = CASE2;
-			NeNc = (pAPDU[5]<<8)+pAPDU[6];
-		}
-		else {
-			cmdCase = CASE3;
-		}
-	}
-	else {
-		NeNc = pAPDU[4]; /* C5 */
-		if( NeNc == 0 ) {
-			cmdCase = CASE3;
-			NeNc = (pAPDU[5]<<8)+pAPDU[6];
-		}
-		else {
-			cmdCase = CASE3;
-		}
-	}
+	cmdCase = get_apdu_case(pAPDU, wLength, &NeNc);
 
 	TRACE_DEBUG("CASE=0x%X NeNc=0x%X\n\r", cmdCase, NeNc);
 
@@ -363,6 +439,357 @@ uint32_t ISO7816_XfrBlockTPDU_T0(const uint8_t *pAPDU,
 
 }
 
+/**
+ * Arm the receiver time-out of USART_SIM.  US_RTOR only holds 16 bits, so
+ * longer waiting times are split, see ISO7816_TimeoutExpired().
+ * \param etu           Time-out in etu, counted from now and restarted by
+ *                      the hardware on each received character
+ */
+void ISO7816_TimeoutStart(uint32_t etu)
+{
+	Usart *us_base = usart_sim.base;
+
+	wt_left = etu;
+	if (etu > US_RTOR_TO_Msk)
+		etu = US_RTOR_TO_Msk;
+	wt_left -= etu;
+	us_base->US_RTOR = etu;
+	us_base->US_CR = US_CR_STTTO;
+	us_base->US_CR = US_CR_RETTO;
+}
+
+/**
+ * To be called on US_CSR_TIMEOUT
+ * \return              true if the time-out has expired, false if the rest
+ *                      of a long time-out has been armed
+ */
+bool ISO7816_TimeoutExpired(void)
+{
+	if (wt_left == 0)
+		return true;
+	ISO7816_TimeoutStart(wt_left);
+	return false;
+}
+
+/**
+ * Disable the receiver time-out of USART_SIM
+ */
+void ISO7816_TimeoutStop(void)
+{
+	usart_sim.base->US_RTOR = 0;
+	wt_left = 0;
+}
+
+/* Interrupt driven variant of ISO7816_XfrBlockTPDU_T0().  The state
+ * machine below is run from the USART_SIM interrupt; the work waiting time
+ * is supervised by the USART receiver time-out instead of a busy loop. */
+
+static void t0_finish(uint32_t status)
+{
+	Usart *us_base = usart_sim.base;
+
+	us_base->US_IDR = US_IDR_TXRDY | US_IDR_TXEMPTY | US_IDR_RXRDY | US_IDR_TIMEOUT;
+	ISO7816_TimeoutStop();
+	if (status)
+		us_base->US_CR = US_CR_RSTSTA;
+	t0.state = T0_S_IDLE;
+	if (t0.done_cb)
+		t0.done_cb(status, t0.resp_idx);
+}
+
+/* send the TPDU bytes tx_idx..end-1 */
+static void t0_tx_start(enum t0_state state, uint16_t end)
+{
+	Usart *us_base = usart_sim.base;
+
+	us_base->US_IDR = US_IDR_RXRDY | US_IDR_TIMEOUT;
+	if (usart_sim.state == USART_RCV) {
+		us_base->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
+		usart_sim.state = USART_SEND;
+	}
+	t0.tx_end = end;
+	t0.state = state;
+	us_base->US_IER = US_IER_TXRDY;
+}
+
+/* wait for the next procedure byte (or data byte) from the card */
+static void t0_rx_start(void)
+{
+	Usart *us_base = usart_sim.base;
+
+	us_base->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
+	usart_sim.state = USART_RCV;
+	ISO7816_TimeoutStart(t0.wwt_etu);
+	t0.state = T0_S_WAIT_PB;
+	us_base->US_IER = US_IER_RXRDY | US_IER_TIMEOUT;
+}
+
+static int t0_store(uint8_t byte)
+{
+	if (t0.resp_idx >= t0.resp_size) {
+		TRACE_ERROR("T=0 response exceeds %u bytes\n\r", t0.resp_size);
+		t0_finish(US_CSR_OVRE);
+		return -1;
+	}
+	t0.resp[t0.resp_idx++] = byte;
+	return 0;
+}
+
+static void t0_rx_byte(uint8_t byte)
+{
+	uint8_t ins = t0.hdr[1];
+
+	switch (t0.state) {
+	case T0_S_WAIT_PB:
+		if (byte == ISO_NULL_VAL) {
+			/* card requests more time */
+			break;
+		} else if ((byte & 0xF0) == 0x60 || (byte & 0xF0) == 0x90) {
+			if (t0_store(byte) == 0)
+				t0.state = T0_S_WAIT_SW2;
+		} else if (byte == ins && t0.ne_nc) {
+			/* all remaining data bytes */
+			if (t0.cmd_case == CASE2) {
+				t0.rx_remain = t0.ne_nc;
+				t0.ne_nc = 0;
+				t0.state = T0_S_RX_DATA;
+			} else {
+				uint16_t end = t0.tx_idx + t0.ne_nc;
+				t0.ne_nc = 0;
+				t0_tx_start(T0_S_TX_DATA, end);
+			}
+		} else if (byte == (ins ^ 0xFF) && t0.ne_nc) {
+			/* a single data byte */
+			t0.ne_nc--;
+			if (t0.cmd_case == CASE2) {
+				t0.rx_remain = 1;
+				t0.state = T0_S_RX_DATA;
+			} else
+				t0_tx_start(T0_S_TX_DATA, t0.tx_idx + 1);
+		} else if (byte == ins || byte == (ins ^ 0xFF)) {
+			/* no data left to exchange, keep waiting for SW1 */
+			break;
+		} else {
+			/* unexpected procedure byte: take it as SW1 */
+			TRACE_INFO("procByte=0x%X\n\r", byte);
+			if (t0_store(byte) == 0)
+				t0.state = T0_S_WAIT_SW2;
+		}
+		break;
+	case T0_S_RX_DATA:
+		if (t0_store(byte) == 0 && --t0.rx_remain == 0)
+			t0.state = T0_S_WAIT_PB;
+		break;
+	case T0_S_WAIT_SW2:
+		if (t0_store(byte) == 0) {
+			TRACE_DEBUG("SW1=0x%X, SW2=0x%X\n\r", t0.resp[t0.resp_idx-2], byte);
+			t0_finish(0);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Interrupt handler of the interrupt driven T=0 TPDU transfer, to be called
+ * from the USART_SIM interrupt.
+ */
+void ISO7816_T0_IrqHandler(void)
+{
+	Usart *us_base = usart_sim.base;
+	uint32_t csr = us_base->US_CSR & us_base->US_IMR;
+
+	if (t0.state == T0_S_IDLE)
+		return;
+
+	if (csr & US_CSR_TXRDY) {
+		if (t0.tx_idx < t0.tx_end) {
+			if (t0.tx_idx < sizeof(t0.hdr))
+				us_base->US_THR = t0.hdr[t0.tx_idx];
+			else
+				us_base->US_THR = t0.data[t0.tx_idx - sizeof(t0.hdr)];
+			t0.tx_idx++;
+		}
+		if (t0.tx_idx >= t0.tx_end) {
+			/* wait until the last byte left the shift register */
+			us_base->US_IDR = US_IDR_TXRDY;
+			us_base->US_IER = US_IER_TXEMPTY;
+		}
+		return;
+	}
+
+	if (csr & US_CSR_TXEMPTY) {
+		us_base->US_IDR = US_IDR_TXEMPTY;
+		t0_rx_start();
+		return;
+	}
+
+	if (csr & US_CSR_RXRDY) {
+		uint8_t byte = us_base->US_RHR & 0xFF;
+		uint32_t status = us_base->US_CSR & ISO7816_CSR_ERRORS & ~US_CSR_TIMEOUT;
+
+		if (status) {
+			TRACE_INFO("T=0 status: 0x%" PRIX32 "\n\r", status);
+			t0_finish(status);
+			return;
+		}
+		/* restart the work waiting time */
+		ISO7816_TimeoutStart(t0.wwt_etu);
+		t0_rx_byte(byte);
+		return;
+	}
+
+	if (csr & US_CSR_TIMEOUT) {
+		if (!ISO7816_TimeoutExpired())
+			return;
+		TRACE_WARNING("TimeOut\n\r");
+		t0_finish(US_CSR_TIMEOUT);
+	}
+}
+
+/**
+ * Start an interrupt driven T=0 TPDU transfer.  The USART_SIM interrupt
+ * must be enabled and call ISO7816_T0_IrqHandler().
+ * \param pAPDU         TPDU buffer, must stay valid until completion
+ * \param pMessage      Response buffer, must stay valid until completion
+ * \param wLength       Block length
+ * \param wMaxResp      Size of the response buffer
+ * \param cb            Called from interrupt context on completion with
+ *                      0 or the US_CSR error bits and the response length
+ * \return              0 on success, -EBUSY if a transfer is in progress
+ */
+int ISO7816_XfrBlockTPDU_T0_Start(const uint8_t *pAPDU, uint8_t *pMessage,
+				  uint16_t wLength, uint16_t wMaxResp,
+				  ISO7816_XfrDoneCb cb)
+{
+	if (t0.state != T0_S_IDLE)
+		return -EBUSY;
+	if (wLength < 4)
+		return -EINVAL;
+
+	memcpy(t0.hdr, pAPDU, 4);
+	t0.hdr[4] = wLength > 4 ? pAPDU[4] : 0;
+	t0.data = pAPDU + sizeof(t0.hdr);
+	t0.resp = pMessage;
+	t0.resp_size = wMaxResp;
+	t0.tx_idx = 0;
+	t0.resp_idx = 0;
+	t0.rx_remain = 0;
+	t0.done_cb = cb;
+	t0.cmd_case = get_apdu_case(pAPDU, wLength, &t0.ne_nc);
+
+	TRACE_DEBUG("CASE=0x%X NeNc=0x%X\n\r", t0.cmd_case, t0.ne_nc);
+
+	/* CLA INS P1 P2 P3 */
+	t0_tx_start(T0_S_TX_HDR, sizeof(t0.hdr));
+	return 0;
+}
+
+/* completion of a TPDU sent for ISO7816_XfrBlockAPDU_T0_Start() */
+static void t0_apdu_done(uint32_t status, uint16_t len)
+{
+	uint16_t total = t0_apdu.resp_len + len;
+	const uint8_t *sw = t0_apdu.resp + total - 2;
+
+	if (status != 0 || len < 2) {
+		t0_apdu.done_cb(status, total);
+		return;
+	}
+
+	if (sw[0] == 0x61 || (sw[0] == 0x6C && !t0_apdu.le_retry)) {
+		uint16_t more = sw[1] ? sw[1] : 256;
+
+		if (sw[0] == 0x61) {
+			/* GET RESPONSE, the response replaces SW1 SW2 */
+			t0_apdu.hdr[0] = t0_apdu.cla;
+			t0_apdu.hdr[1] = 0xC0;
+			t0_apdu.hdr[2] = 0x00;
+			t0_apdu.hdr[3] = 0x00;
+		} else {
+			/* wrong Le: repeat the command with Le = SW2 */
+			t0_apdu.le_retry = 1;
+		}
+		t0_apdu.hdr[4] = sw[1];
+		if (total - 2 + more + 2 <= t0_apdu.resp_size) {
+			t0_apdu.resp_len = total - 2;
+			ISO7816_XfrBlockTPDU_T0_Start(t0_apdu.hdr, t0_apdu.resp + t0_apdu.resp_len,
+						      sizeof(t0_apdu.hdr),
+						      t0_apdu.resp_size - t0_apdu.resp_len,
+						      t0_apdu_done);
+			return;
+		}
+	}
+
+	t0_apdu.done_cb(0, total);
+}
+
+/**
+ * Start an interrupt driven exchange of a short command APDU using T=0
+ * TPDUs (ISO 7816-3 12.2): Le is stripped from case 4 commands, the
+ * response is fetched with GET RESPONSE on '61XX' and the command is
+ * repeated with the right Le on '6CXX'.
+ * \param pAPDU         APDU buffer, must stay valid until completion
+ * \param pMessage      Response buffer, must stay valid until completion
+ * \param wLength       APDU length
+ * \param wMaxResp      Size of the response buffer
+ * \param cb            As for ISO7816_XfrBlockTPDU_T0_Start()
+ * \return              0 on success, negative error otherwise
+ */
+int ISO7816_XfrBlockAPDU_T0_Start(const uint8_t *pAPDU, uint8_t *pMessage,
+				  uint16_t wLength, uint16_t wMaxResp,
+				  ISO7816_XfrDoneCb cb)
+{
+	uint16_t tpdu_len = wLength;
+
+	if (t0.state != T0_S_IDLE)
+		return -EBUSY;
+
+	if (wLength > 5) {
+		uint8_t lc = pAPDU[4];
+
+		if (lc == 0)
+			return -EINVAL;		/* extended length */
+		if (wLength == 5 + lc + 1)
+			tpdu_len = 5 + lc;	/* case 4: Le is not sent */
+		else if (wLength != 5 + lc)
+			return -EINVAL;
+	} else if (wLength < 4)
+		return -EINVAL;
+
+	t0_apdu.cla = pAPDU[0];
+	t0_apdu.resp = pMessage;
+	t0_apdu.resp_size = wMaxResp;
+	t0_apdu.resp_len = 0;
+	t0_apdu.le_retry = 0;
+	t0_apdu.done_cb = cb;
+	memcpy(t0_apdu.hdr, pAPDU, 4);
+
+	return ISO7816_XfrBlockTPDU_T0_Start(pAPDU, pMessage, tpdu_len, wMaxResp, t0_apdu_done);
+}
+
+/**
+ * Set the work waiting time of T=0 transfers
+ * \param etu           960 * WI * Di etu (ISO 7816-3 10.2), 0 for the default (WI = 10)
+ */
+void ISO7816_T0_SetWaitingTime(uint32_t etu)
+{
+	/* a time-out of 0 would disable the receive time-out altogether */
+	t0.wwt_etu = etu ? etu : ISO7816_T0_WWT_ETU;
+}
+
+/**
+ * Abort an interrupt driven T=0 TPDU transfer without calling its callback
+ */
+void ISO7816_T0_Abort(void)
+{
+	Usart *us_base = usart_sim.base;
+
+	us_base->US_IDR = US_IDR_TXRDY | US_IDR_TXEMPTY | US_IDR_RXRDY | US_IDR_TIMEOUT;
+	ISO7816_TimeoutStop();
+	t0.state = T0_S_IDLE;
+}
+
 /**
  *  Escape ISO7816
  */
@@ -410,6 +837,7 @@ uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength )
 	uint32_t j;
 	uint32_t y;
 	uint32_t status = 0; 
+	uint8_t tck = 0;
 
 	*pLength = 0;
 
@@ -442,6 +870,10 @@ uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength )
 		}
 		if (y & 0x80) {  /* TD[i] */
 			status = ISO7816_GetChar(&pAtr[i], &usart_sim);
+			/* TCK is present unless only T=0 is indicated */
+			if (pAtr[i] & 0x0F) {
+				tck = 1;
+			}
 			y =  pAtr[i++] & 0xF0;
 		}
 		else {
@@ -458,6 +890,11 @@ uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength )
 		status = ISO7816_GetChar(&pAtr[i++], &usart_sim);
 	}
 
+	/* Check character, it must not be taken for the first PPS byte */
+	if (tck && (status == 0)) {
+		status = ISO7816_GetChar(&pAtr[i++], &usart_sim);
+	}
+
 	if (status != 0) {
 		return status;
 	}
@@ -473,7 +910,7 @@ uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength )
  */
 void ISO7816_SetDataRateandClockFrequency( uint32_t dwClockFrequency, uint32_t dwDataRate )
 {
-	uint8_t ClockFrequency;
+	uint32_t ClockFrequency;
 
 	/* Define the baud rate divisor register */
 	/* CD  = MCK / SCK */
@@ -488,6 +925,217 @@ void ISO7816_SetDataRateandClockFrequency( uint32_t dwClockFrequency, uint32_t d
 
 }
 
+/**
+ * Parse the interface bytes of an ATR (ISO 7816-3 8.2.3)
+ * \param pAtr          ATR buffer
+ * \param length        ATR length
+ * \param params        Returns the parameters, defaults for absent bytes
+ * \return              0 on success, -EINVAL for a truncated ATR
+ */
+int ISO7816_ParseATR(const uint8_t *pAtr, uint8_t length, struct iso7816_atr_params *params)
+{
+	uint8_t i = 2;
+	uint8_t y;
+	uint8_t group = 1;
+	/* protocol the current group of interface bytes belongs to */
+	uint8_t proto = 0;
+	bool t1_ta = false, t1_tb = false, t1_tc = false;
+
+	memset(params, 0, sizeof(*params));
+	params->fi_di = 0x11;
+	params->wi = 10;
+	params->ifsc = 32;
+	params->bwi_cwi = 0x4D;
+
+	if (length < 2)
+		return -EINVAL;
+
+	y = pAtr[1] & 0xF0;
+	while (y) {
+		uint8_t ta = 0, tb = 0, tc = 0;
+		bool has_ta = y & 0x10, has_tb = y & 0x20, has_tc = y & 0x40;
+
+		if (has_ta)
+			ta = pAtr[i++];
+		if (has_tb)
+			tb = pAtr[i++];
+		if (has_tc)
+			tc = pAtr[i++];
+		if (i > length)
+			return -EINVAL;
+
+		if (group == 1) {
+			if (has_ta)
+				params->fi_di = ta;
+			if (has_tc)
+				params->guard_time = tc;
+		} else if (group == 2) {
+			if (has_ta) {
+				/* specific mode: no PPS, protocol set by TA2 */
+				params->specific = true;
+				params->protocol = ta & 0x0F;
+				if (ta & 0x10)
+					params->fi_di = 0x11;
+			}
+			/* WI = 0 is reserved (ISO 7816-3 10.2), keep the default */
+			if (has_tc && tc)
+				params->wi = tc;
+		}
+		if (group >= 3 && proto == 1) {
+			if (has_ta && !t1_ta) {
+				params->ifsc = ta;
+				t1_ta = true;
+			}
+			if (has_tb && !t1_tb) {
+				params->bwi_cwi = tb;
+				t1_tb = true;
+			}
+			if (has_tc && !t1_tc) {
+				params->t1_crc = tc & 0x01;
+				t1_tc = true;
+			}
+		}
+
+		if (!(y & 0x80))
+			break;
+		if (i >= length)
+			return -EINVAL;
+		proto = pAtr[i] & 0x0F;
+		if (proto != 15) {
+			if (!params->protocols && !params->specific)
+				params->protocol = proto;
+			params->protocols |= 1 << proto;
+		}
+		y = pAtr[i++] & 0xF0;
+		group++;
+	}
+
+	/* no TD1: only T=0 */
+	if (!params->protocols)
+		params->protocols = 1 << 0;
+
+	return 0;
+}
+
+/**
+ * Select the fastest Fi/Di the USART supports for a card
+ * \param fi_di         Fi/Di supported by the card (TA1)
+ * \return              Fi/Di to request with PPS, 0x11 for the default
+ */
+uint8_t ISO7816_BestFiDi(uint8_t fi_di)
+{
+	uint16_t f = iso7816_3_fi_table[fi_di >> 4];
+	uint8_t d_max = iso7816_3_di_table[fi_di & 0x0F];
+	uint8_t best = 0x11;
+	uint16_t best_ratio = 372;
+	uint8_t d_index;
+
+	if (f == 0 || d_max == 0)
+		return best;
+
+	/* Di 1..9: 1, 2, 4, 8, 16, 32, 64, 12, 20 */
+	for (d_index = 1; d_index <= 9; d_index++) {
+		uint8_t d = iso7816_3_di_table[d_index];
+		uint16_t ratio = f / d;
+
+		if (d > d_max || ratio < ISO7816_MIN_FD_RATIO)
+			continue;
+		if (ratio < best_ratio) {
+			best_ratio = ratio;
+			best = (fi_di & 0xF0) | d_index;
+		}
+	}
+	return best;
+}
+
+/**
+ * Program the USART for a Fi/Di (TA1 / PPS1 encoding) at the current clock
+ * \return              0 on success, -EINVAL for RFU values
+ */
+int ISO7816_SetFiDi(uint8_t fi_di)
+{
+	uint16_t f = iso7816_3_fi_table[fi_di >> 4];
+	uint8_t d = iso7816_3_di_table[fi_di & 0x0F];
+	uint32_t clk_khz;
+
+	if (f == 0 || d == 0)
+		return -EINVAL;
+
+	clk_khz = BOARD_MCK / USART_SIM->US_BRGR / 1000;
+	ISO7816_SetDataRateandClockFrequency(clk_khz, clk_khz * 1000 * d / f);
+	TRACE_INFO("Fi/Di 0x%02X: F/D %" PRIu32 "\n\r", fi_di, USART_SIM->US_FIDI);
+	return 0;
+}
+
+/**
+ * Protocol and parameters selection (ISO 7816-3 9), right after the ATR.
+ * \param protocol      T to select
+ * \param pFiDi         Fi/Di to request; returns the one accepted by the
+ *                      card (0x11 if it answered without PPS1)
+ * \return              0 on success, otherwise the card must be reset
+ */
+uint32_t ISO7816_PPS(uint8_t protocol, uint8_t *pFiDi)
+{
+	uint8_t req[4], resp[6];
+	uint8_t i, n, pck = 0;
+	uint32_t status = 0;
+
+	req[0] = 0xFF;				/* PPSS */
+	req[1] = 0x10 | protocol;		/* PPS0: PPS1 follows */
+	req[2] = *pFiDi;			/* PPS1 */
+	req[3] = req[0] ^ req[1] ^ req[2];	/* PCK */
+
+	for (i = 0; i < sizeof(req); i++)
+		status |= ISO7816_SendChar(req[i], &usart_sim);
+
+	memset(resp, 0, sizeof(resp));
+	status |= ISO7816_GetChar(&resp[0], &usart_sim);
+	status |= ISO7816_GetChar(&resp[1], &usart_sim);
+	n = 2;
+	/* PPS1, PPS2 and PPS3 as announced in PPS0, then PCK */
+	for (i = 0x10; i <= 0x40; i <<= 1) {
+		if (resp[1] & i)
+			status |= ISO7816_GetChar(&resp[n++], &usart_sim);
+	}
+	status |= ISO7816_GetChar(&resp[n++], &usart_sim);
+	if (status != 0)
+		return status;
+
+	for (i = 0; i < n; i++)
+		pck ^= resp[i];
+
+	TRACE_INFO("PPS %02X %02X %02X %02X: %02X %02X %02X\n\r",
+		   req[0], req[1], req[2], req[3], resp[0], resp[1], resp[2]);
+
+	if (resp[0] != 0xFF || pck != 0 || (resp[1] & 0x0F) != protocol)
+		return US_CSR_PARE;
+	if (resp[1] & 0x10) {
+		if (resp[2] != *pFiDi)
+			return US_CSR_PARE;
+	} else
+		*pFiDi = 0x11;
+
+	return 0;
+}
+
+/**
+ * Configure the USART for a protocol and its transmission parameters
+ * \param protocol      0 or 1
+ * \param fi_di         Fi/Di in use
+ * \param guard_time    Extra guard time N (TC1)
+ */
+void ISO7816_SetProtocol(uint8_t protocol, uint8_t fi_di, uint8_t guard_time)
+{
+	uint32_t mode = protocol == 1 ? US_MR_USART_MODE_IS07816_T_1
+				      : US_MR_USART_MODE_IS07816_T_0;
+
+	USART_SIM->US_MR = (USART_SIM->US_MR & ~US_MR_USART_MODE_Msk) | mode;
+	if (ISO7816_SetFiDi(fi_di) != 0)
+		ISO7816_SetFiDi(0x11);
+	/* N = 255: minimum character guard time */
+	USART_SIM->US_TTGR = guard_time == 0xFF ? 0 : guard_time;
+}
+
 /**
  * Pin status for ISO7816 RESET
  * \return 1 if the Pin RstMC is high; otherwise 0.
@@ -500,6 +1148,16 @@ uint8_t ISO7816_StatusReset( void )
 	return 0;
 }
 
+/* transmission parameters of a card after reset */
+static void iso7816_set_defaults(void)
+{
+	USART_SIM->US_MR = (USART_SIM->US_MR & ~US_MR_USART_MODE_Msk)
+				| US_MR_USART_MODE_IS07816_T_0;
+	USART_SIM->US_FIDI = 372;
+	USART_SIM->US_TTGR = 0;
+	t0.wwt_etu = ISO7816_T0_WWT_ETU;
+}
+
 /**
  *  cold reset
  */
@@ -511,6 +1169,7 @@ void ISO7816_cold_reset( void )
 	for( i=0; i<(400*(BOARD_MCK/1000000)); i++ ) {
 	}
 
+	iso7816_set_defaults();
 	USART_SIM->US_RHR;
 	USART_SIM->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
 
@@ -531,6 +1190,7 @@ void ISO7816_warm_reset( void )
 	for( i=0; i<(400*(BOARD_MCK/1000000)); i++ ) {
 	}
 
+	iso7816_set_defaults();
 	USART_SIM->US_RHR;
 	USART_SIM->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
 
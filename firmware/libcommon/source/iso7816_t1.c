@@ -0,0 +1,507 @@
+/* ISO7816-3 T=1 block transmission protocol for the CCID reader
+ *
+ * The reader side of ISO 7816-3 clause 11: command APDUs are sent in
+ * I-blocks (chained if longer than IFSC), chained responses are
+ * acknowledged with R-blocks, transmission errors are recovered with
+ * R-blocks and retransmissions, and the card's S(IFS) and S(WTX) requests
+ * are answered.  IFSD is negotiated before the first APDU.
+ *
+ * Like the T=0 transfer in iso7816_4.c, everything runs from the USART_SIM
+ * interrupt: the block waiting time and the character waiting time are
+ * supervised by the USART receiver time-out.  Only LRC is supported as
+ * error detection code.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "iso7816_t1.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* NAD PCB LEN INF[LEN] LRC */
+#define T1_PROLOGUE_LEN		3
+#define T1_MAX_INF		254
+#define T1_MAX_BLOCK		(T1_PROLOGUE_LEN + T1_MAX_INF + 1)
+
+/* PCB coding, ISO 7816-3 11.3.2.2 */
+#define T1_PCB_R		0x80
+#define T1_PCB_S		0xC0
+#define T1_I_NS			0x40
+#define T1_I_MORE		0x20
+#define T1_R_NR			0x10
+#define T1_R_ERR_EDC		0x01
+#define T1_R_ERR_OTHER		0x02
+#define T1_S_RESPONSE		0x20
+#define T1_S_TYPE_MASK		0x1F
+#define T1_S_RESYNCH		0x00
+#define T1_S_IFS		0x01
+#define T1_S_ABORT		0x02
+#define T1_S_WTX		0x03
+
+/* attempts to recover from a transmission error before giving up */
+#define T1_MAX_RETRIES		3
+
+#define T1_RX_ERRORS		(US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE)
+
+enum t1_state {
+	T1_S_IDLE,
+	T1_S_TX,		/* sending a block */
+	T1_S_RX,		/* receiving a block */
+};
+
+/* what the transfer is waiting for */
+enum t1_phase {
+	T1_P_RESYNCH,		/* S(RESYNCH response) */
+	T1_P_IFS,		/* S(IFS response) to our IFSD */
+	T1_P_APDU,		/* exchanging the APDU */
+};
+
+static struct {
+	volatile enum t1_state state;
+	bool active;
+
+	/* block level */
+	uint8_t tx[T1_MAX_BLOCK];
+	uint16_t tx_len;
+	uint16_t tx_idx;
+	uint8_t rx[T1_MAX_BLOCK];
+	uint16_t rx_len;
+	uint16_t rx_idx;
+	uint32_t rx_status;
+
+	/* protocol */
+	uint8_t ifsc;
+	uint8_t bwi_cwi;
+	enum t1_phase phase;
+	bool ifsd_done;
+	bool need_resynch;
+	uint8_t ns;		/* N(S) of our next I-block */
+	uint8_t nr;		/* N(S) expected in the card's next I-block */
+	bool ack_pending;	/* our last I-block is not acknowledged yet */
+	uint8_t wtx;		/* BWT multiplier for the next block */
+	uint8_t retries;
+
+	/* APDU */
+	const uint8_t *apdu;
+	uint16_t apdu_len;
+	uint16_t apdu_idx;	/* start of the last I-block sent */
+	uint8_t chunk;		/* INF length of the last I-block sent */
+	uint8_t *resp;
+	uint16_t resp_size;
+	uint16_t resp_len;
+	ISO7816_XfrDoneCb done_cb;
+} t1 = { .ifsc = 32, .bwi_cwi = 0x4D };
+
+/* block waiting time in etu: 11 etu + 2^BWI * 960 * Fd / f */
+static uint32_t t1_bwt_etu(void)
+{
+	uint32_t bwi = t1.bwi_cwi >> 4;
+
+	return 11 + ((960UL << bwi) * 372) / USART_SIM->US_FIDI;
+}
+
+/* character waiting time in etu after the end of a character */
+static uint32_t t1_cwt_etu(void)
+{
+	return 11 + (1UL << (t1.bwi_cwi & 0x0F));
+}
+
+static void t1_finish(uint32_t status)
+{
+	Usart *us_base = USART_SIM;
+
+	us_base->US_IDR = US_IDR_TXRDY | US_IDR_TXEMPTY | US_IDR_RXRDY | US_IDR_TIMEOUT;
+	ISO7816_TimeoutStop();
+	if (status) {
+		us_base->US_CR = US_CR_RSTSTA;
+		/* sequence numbers may be out of step with the card */
+		t1.need_resynch = true;
+		TRACE_ERROR("T=1 transfer failed: 0x%" PRIX32 "\n\r", status);
+	}
+	t1.state = T1_S_IDLE;
+	t1.active = false;
+	if (t1.done_cb)
+		t1.done_cb(status, t1.resp_len);
+}
+
+static void t1_send_block(uint8_t pcb, const uint8_t *inf, uint8_t len)
+{
+	Usart *us_base = USART_SIM;
+	uint8_t lrc;
+	uint16_t i;
+
+	t1.tx[0] = 0;		/* NAD */
+	t1.tx[1] = pcb;
+	t1.tx[2] = len;
+	if (len)
+		memcpy(&t1.tx[T1_PROLOGUE_LEN], inf, len);
+	t1.tx_len = T1_PROLOGUE_LEN + len;
+	for (lrc = 0, i = 0; i < t1.tx_len; i++)
+		lrc ^= t1.tx[i];
+	t1.tx[t1.tx_len++] = lrc;
+	t1.tx_idx = 0;
+
+	us_base->US_IDR = US_IDR_RXRDY | US_IDR_TIMEOUT;
+	us_base->US_CR = US_CR_RSTSTA | US_CR_RSTIT;
+	t1.state = T1_S_TX;
+	us_base->US_IER = US_IER_TXRDY;
+}
+
+/* wait for the card's block after the last character has been sent */
+static void t1_rx_start(void)
+{
+	Usart *us_base = USART_SIM;
+
+	us_base->US_CR = US_CR_RSTSTA | US_CR_RSTIT;
+	t1.rx_idx = 0;
+	t1.rx_len = T1_PROLOGUE_LEN;
+	t1.rx_status = 0;
+	ISO7816_TimeoutStart(t1_bwt_etu() * t1.wtx);
+	t1.wtx = 1;
+	t1.state = T1_S_RX;
+	us_base->US_IER = US_IER_RXRDY | US_IER_TIMEOUT;
+}
+
+static void t1_send_iblock(void)
+{
+	uint16_t left = t1.apdu_len - t1.apdu_idx;
+	uint8_t pcb = t1.ns ? T1_I_NS : 0;
+
+	t1.chunk = left > t1.ifsc ? t1.ifsc : left;
+	if (t1.chunk < left)
+		pcb |= T1_I_MORE;
+	t1.ack_pending = true;
+	t1_send_block(pcb, t1.apdu + t1.apdu_idx, t1.chunk);
+}
+
+static void t1_send_rblock(uint8_t err)
+{
+	t1_send_block(T1_PCB_R | (t1.nr ? T1_R_NR : 0) | err, NULL, 0);
+}
+
+static void t1_send_sblock(uint8_t type, const uint8_t *inf, uint8_t len)
+{
+	t1_send_block(T1_PCB_S | type, inf, len);
+}
+
+/* send the first block of the current phase */
+static void t1_phase_start(void)
+{
+	uint8_t ifsd = ISO7816_T1_IFSD;
+
+	switch (t1.phase) {
+	case T1_P_RESYNCH:
+		t1_send_sblock(T1_S_RESYNCH, NULL, 0);
+		break;
+	case T1_P_IFS:
+		t1_send_sblock(T1_S_IFS, &ifsd, 1);
+		break;
+	case T1_P_APDU:
+		t1_send_iblock();
+		break;
+	}
+}
+
+/* invalid block or no block at all from the card (ISO 7816-3 11.6.3) */
+static void t1_error(uint32_t status, uint8_t err)
+{
+	if (++t1.retries > T1_MAX_RETRIES) {
+		if (t1.phase == T1_P_IFS) {
+			/* card does not negotiate IFSD, stay with 32 */
+			TRACE_WARNING("T=1: no S(IFS response)\n\r");
+			t1.ifsd_done = true;
+			t1.phase = T1_P_APDU;
+			t1.retries = 0;
+			t1_phase_start();
+			return;
+		}
+		t1_finish(status);
+		return;
+	}
+
+	if (t1.phase != T1_P_APDU) {
+		/* an S(request) without valid response is repeated */
+		t1_phase_start();
+	} else
+		t1_send_rblock(err);
+}
+
+static void t1_rx_iblock(uint8_t pcb, const uint8_t *inf, uint8_t len)
+{
+	if (t1.phase != T1_P_APDU || t1.apdu_idx + t1.chunk < t1.apdu_len ||
+	    !!(pcb & T1_I_NS) != t1.nr) {
+		t1_error(ISO7816_XFR_PROTO_ERROR, T1_R_ERR_OTHER);
+		return;
+	}
+	t1.retries = 0;
+	/* acknowledges our last I-block */
+	if (t1.ack_pending) {
+		t1.ack_pending = false;
+		t1.ns ^= 1;
+	}
+	t1.nr ^= 1;
+
+	if (t1.resp_len + len > t1.resp_size) {
+		t1_finish(US_CSR_OVRE);
+		return;
+	}
+	memcpy(t1.resp + t1.resp_len, inf, len);
+	t1.resp_len += len;
+
+	if (pcb & T1_I_MORE)
+		t1_send_rblock(0);	/* next part of the chained response */
+	else
+		t1_finish(0);
+}
+
+static void t1_rx_rblock(uint8_t pcb)
+{
+	uint8_t nr = !!(pcb & T1_R_NR);
+
+	if (t1.phase == T1_P_APDU && t1.ack_pending) {
+		if (nr != t1.ns && t1.apdu_idx + t1.chunk < t1.apdu_len) {
+			/* chained I-block acknowledged, send the next one */
+			t1.ack_pending = false;
+			t1.ns ^= 1;
+			t1.apdu_idx += t1.chunk;
+			t1.retries = 0;
+			t1_send_iblock();
+			return;
+		}
+		if (nr == t1.ns) {
+			/* the card asks for our last I-block again */
+			if (++t1.retries > T1_MAX_RETRIES)
+				t1_finish(ISO7816_XFR_PROTO_ERROR);
+			else
+				t1_send_iblock();
+			return;
+		}
+	}
+	t1_error(ISO7816_XFR_PROTO_ERROR, T1_R_ERR_OTHER);
+}
+
+static void t1_rx_sblock(uint8_t pcb, const uint8_t *inf, uint8_t len)
+{
+	uint8_t type = pcb & T1_S_TYPE_MASK;
+
+	if (pcb & T1_S_RESPONSE) {
+		if (t1.phase == T1_P_RESYNCH && type == T1_S_RESYNCH) {
+			t1.ns = t1.nr = 0;
+			t1.need_resynch = false;
+			/* IFSD is back to its default */
+			t1.ifsd_done = false;
+			t1.phase = T1_P_IFS;
+		} else if (t1.phase == T1_P_IFS && type == T1_S_IFS) {
+			t1.ifsd_done = true;
+			t1.phase = T1_P_APDU;
+		} else {
+			t1_error(ISO7816_XFR_PROTO_ERROR, T1_R_ERR_OTHER);
+			return;
+		}
+		t1.retries = 0;
+		t1_phase_start();
+		return;
+	}
+
+	switch (type) {
+	case T1_S_IFS:
+		if (len != 1 || inf[0] == 0 || inf[0] == 0xFF) {
+			t1_error(ISO7816_XFR_PROTO_ERROR, T1_R_ERR_OTHER);
+			return;
+		}
+		t1.ifsc = inf[0];
+		t1_send_sblock(T1_S_RESPONSE | type, inf, len);
+		break;
+	case T1_S_WTX:
+		if (len != 1) {
+			t1_error(ISO7816_XFR_PROTO_ERROR, T1_R_ERR_OTHER);
+			return;
+		}
+		t1.wtx = inf[0] ? inf[0] : 1;
+		t1_send_sblock(T1_S_RESPONSE | type, inf, len);
+		break;
+	case T1_S_ABORT:
+		t1_finish(ISO7816_XFR_PROTO_ERROR);
+		break;
+	default:
+		t1_error(ISO7816_XFR_PROTO_ERROR, T1_R_ERR_OTHER);
+		break;
+	}
+}
+
+static void t1_rx_block(void)
+{
+	uint8_t pcb = t1.rx[1];
+	uint8_t len = t1.rx[2];
+	uint8_t lrc = 0;
+	uint16_t i;
+
+	for (i = 0; i < t1.rx_len; i++)
+		lrc ^= t1.rx[i];
+
+	if ((t1.rx_status & T1_RX_ERRORS) || lrc != 0) {
+		TRACE_INFO("T=1 rx error 0x%" PRIX32 " LRC 0x%02X\n\r", t1.rx_status, lrc);
+		t1_error(t1.rx_status ? t1.rx_status : US_CSR_PARE, T1_R_ERR_EDC);
+		return;
+	}
+
+	if ((pcb & 0x80) == 0)
+		t1_rx_iblock(pcb, &t1.rx[T1_PROLOGUE_LEN], len);
+	else if ((pcb & 0xC0) == T1_PCB_R)
+		t1_rx_rblock(pcb);
+	else
+		t1_rx_sblock(pcb, &t1.rx[T1_PROLOGUE_LEN], len);
+}
+
+/**
+ * Interrupt handler of the T=1 transfer, to be called from the USART_SIM
+ * interrupt.
+ */
+void ISO7816_T1_IrqHandler(void)
+{
+	Usart *us_base = USART_SIM;
+	uint32_t csr = us_base->US_CSR & us_base->US_IMR;
+
+	if (t1.state == T1_S_IDLE)
+		return;
+
+	if (csr & US_CSR_TXRDY) {
+		if (t1.tx_idx < t1.tx_len)
+			us_base->US_THR = t1.tx[t1.tx_idx++];
+		if (t1.tx_idx >= t1.tx_len) {
+			/* wait until the last byte left the shift register */
+			us_base->US_IDR = US_IDR_TXRDY;
+			us_base->US_IER = US_IER_TXEMPTY;
+		}
+		return;
+	}
+
+	if (csr & US_CSR_TXEMPTY) {
+		us_base->US_IDR = US_IDR_TXEMPTY;
+		t1_rx_start();
+		return;
+	}
+
+	if (csr & US_CSR_RXRDY) {
+		uint8_t byte = us_base->US_RHR & 0xFF;
+		uint32_t status = us_base->US_CSR & T1_RX_ERRORS;
+
+		if (status) {
+			/* no retransmission in T=1: keep receiving, then
+			 * ask for the block again */
+			t1.rx_status |= status;
+			us_base->US_CR = US_CR_RSTSTA;
+		}
+		if (t1.rx_idx < sizeof(t1.rx))
+			t1.rx[t1.rx_idx] = byte;
+		t1.rx_idx++;
+		if (t1.rx_idx == T1_PROLOGUE_LEN) {
+			uint8_t len = t1.rx[2];
+
+			if (len > T1_MAX_INF) {
+				t1.rx_status |= ISO7816_XFR_PROTO_ERROR;
+				len = T1_MAX_INF;
+			}
+			t1.rx_len = T1_PROLOGUE_LEN + len + 1;
+		}
+		if (t1.rx_idx >= t1.rx_len) {
+			us_base->US_IDR = US_IDR_RXRDY | US_IDR_TIMEOUT;
+			ISO7816_TimeoutStop();
+			t1_rx_block();
+		} else
+			ISO7816_TimeoutStart(t1_cwt_etu());
+		return;
+	}
+
+	if (csr & US_CSR_TIMEOUT) {
+		if (!ISO7816_TimeoutExpired())
+			return;
+		us_base->US_IDR = US_IDR_RXRDY | US_IDR_TIMEOUT;
+		ISO7816_TimeoutStop();
+		TRACE_WARNING("T=1 time-out after %u bytes\n\r", t1.rx_idx);
+		t1_error(US_CSR_TIMEOUT, T1_R_ERR_OTHER);
+	}
+}
+
+/**
+ * (Re)start the T=1 protocol after the ATR and PPS
+ * \param ifsc          IFSC announced by the card
+ * \param bwi_cwi       BWI and CWI announced by the card
+ */
+void ISO7816_T1_Init(uint8_t ifsc, uint8_t bwi_cwi)
+{
+	ISO7816_T1_Abort();
+	t1.ifsc = (ifsc == 0 || ifsc == 0xFF) ? 32 : ifsc;
+	t1.bwi_cwi = bwi_cwi;
+	t1.ns = t1.nr = 0;
+	t1.ifsd_done = false;
+	t1.need_resynch = false;
+}
+
+/**
+ * Start an interrupt driven exchange of a command APDU using T=1.  The
+ * USART_SIM interrupt must be enabled and call ISO7816_T1_IrqHandler().
+ * \param pAPDU         APDU buffer, must stay valid until completion
+ * \param pMessage      Response buffer, must stay valid until completion
+ * \param wLength       APDU length
+ * \param wMaxResp      Size of the response buffer
+ * \param cb            Called from interrupt context on completion with 0,
+ *                      US_CSR error bits or ISO7816_XFR_PROTO_ERROR and
+ *                      the response length
+ * \return              0 on success, -EBUSY if a transfer is in progress
+ */
+int ISO7816_XfrBlockAPDU_T1_Start(const uint8_t *pAPDU, uint8_t *pMessage,
+				  uint16_t wLength, uint16_t wMaxResp,
+				  ISO7816_XfrDoneCb cb)
+{
+	if (t1.active)
+		return -EBUSY;
+	if (wLength == 0)
+		return -EINVAL;
+
+	t1.active = true;
+	t1.apdu = pAPDU;
+	t1.apdu_len = wLength;
+	t1.apdu_idx = 0;
+	t1.chunk = 0;
+	t1.resp = pMessage;
+	t1.resp_size = wMaxResp;
+	t1.resp_len = 0;
+	t1.done_cb = cb;
+	t1.retries = 0;
+	t1.wtx = 1;
+	t1.ack_pending = false;
+
+	if (t1.need_resynch)
+		t1.phase = T1_P_RESYNCH;
+	else if (!t1.ifsd_done)
+		t1.phase = T1_P_IFS;
+	else
+		t1.phase = T1_P_APDU;
+	t1_phase_start();
+	return 0;
+}
+
+/**
+ * Abort a T=1 transfer without calling its callback
+ */
+void ISO7816_T1_Abort(void)
+{
+	Usart *us_base = USART_SIM;
+
+	us_base->US_IDR = US_IDR_TXRDY | US_IDR_TXEMPTY | US_IDR_RXRDY | US_IDR_TIMEOUT;
+	ISO7816_TimeoutStop();
+	if (t1.active)
+		t1.need_resynch = true;
+	t1.state = T1_S_IDLE;
+	t1.active = false;
+}
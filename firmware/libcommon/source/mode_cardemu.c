@@ -24,9 +24,22 @@
 #include <osmocom/core/msgb.h>
 #include "llist_irqsafe.h"
 #include "usb_buf.h"
+#include "talloc.h"
+#include "evtrace.h"
+#include "dlog.h"
+#include "cfg_store.h"
+#include "timesync.h"
+#include "sim_clk.h"
+#include "main_events.h"
 #include "simtrace_usb.h"
 #include "simtrace_prot.h"
 #include "sim_switch.h"
+#ifdef HAVE_SLOT_MUX
+#include "mux.h"
+#endif
+#ifdef PIN_DET_USIM1_PRES
+#include "card_pres.h"
+#endif
 
 #define TRACE_ENTRY()	TRACE_DEBUG("%s entering\r\n", __func__)
 
@@ -41,12 +54,16 @@ static const Pin pin_usim1_rst	= PIN_USIM2_nRST;
 #define FIRST_USART_BASE USART0
 #define FIRST_USART_ID ID_USART0
 #define FIRST_USART_IRQ USART0_IRQn
+/* PA4/TCLK0 (see sim_clk.h) */
+#define FIRST_USART_CLK_TC 0
 #else
 static const Pin pins_usim1[]	= {PINS_USIM1};
 static const Pin pin_usim1_rst	= PIN_USIM1_nRST;
 #define FIRST_USART_BASE USART1
 #define FIRST_USART_ID ID_USART1
 #define FIRST_USART_IRQ USART1_IRQn
+/* PA29/TCLK2 (see sim_clk.h) */
+#define FIRST_USART_CLK_TC 2
 #endif
 static const Pin pin_usim1_vcc	= PIN_USIM1_VCC;
 
@@ -75,13 +92,33 @@ struct cardem_inst {
 		/*! did we already notify about half the time having expired? */
 		bool half_time_notified;
 	} wt;
+	/*! UART level error counters, reported via SIMTRACE_MSGT_BD_CEMU_STATS */
+	struct {
+		uint32_t rbuf_overruns;
+		uint32_t usart_overrun;
+		uint32_t usart_frame;
+		uint32_t usart_parity;
+		uint32_t usart_nack;
+	} stats;
 	int usb_pending_old;
 	uint8_t ep_out;
 	uint8_t ep_in;
 	uint8_t ep_int;
 	const Pin pin_insert;
+	/*! timer/counter channel whose TCLK input is the SIM clock (see sim_clk.h) */
+	uint8_t clk_tc;
 #ifdef DETECT_VCC_BY_ADC
 	uint32_t vcc_uv;
+	/*! VCC trace (ADC counts) since the last SIMTRACE_MSGT_BD_CEMU_VCC with CEMU_VCC_F_RESET */
+	struct {
+		uint16_t min;
+		uint16_t max;
+		uint64_t sum;
+		uint32_t samples;
+		/*! threshold crossings since start-up */
+		uint32_t vcc_on;
+		uint32_t vcc_off;
+	} vcc_trace;
 #endif
 
 	/*! real-time state of VCC I/O line, irrespective of enabled flag */
@@ -96,8 +133,18 @@ struct cardem_inst {
 	/*! last RST state we reported to the card emu state machine (conditioned by enabled flag) */
 	bool rst_active_last;
 
+	/*! last CLK state we reported to the card emu state machine */
+	bool clk_active_last;
+
 	/*! flag indicating whether this instance should perform card emulation, or not */
 	bool enabled;
+
+	/*! card insert state last requested by the host */
+	bool card_insert;
+
+	/*! SIMTRACE_MSGT_BD_CEMU_PERSIST waiting for VCC to be switched off */
+	bool persist_pending;
+	uint8_t persist_flags;
 };
 
 struct cardem_inst cardem_inst[] = {
@@ -111,6 +158,7 @@ struct cardem_inst cardem_inst[] = {
 		.ep_out = SIMTRACE_CARDEM_USB_EP_USIM1_DATAOUT,
 		.ep_in = SIMTRACE_CARDEM_USB_EP_USIM1_DATAIN,
 		.ep_int = SIMTRACE_CARDEM_USB_EP_USIM1_INT,
+		.clk_tc = FIRST_USART_CLK_TC,
 #ifdef PIN_SET_USIM1_PRES
 		.pin_insert = PIN_SET_USIM1_PRES,
 #endif
@@ -126,6 +174,8 @@ struct cardem_inst cardem_inst[] = {
 		.ep_out = SIMTRACE_CARDEM_USB_EP_USIM2_DATAOUT,
 		.ep_in = SIMTRACE_CARDEM_USB_EP_USIM2_DATAIN,
 		.ep_int = SIMTRACE_CARDEM_USB_EP_USIM2_INT,
+		/* PA4/TCLK0 */
+		.clk_tc = 0,
 #ifdef PIN_SET_USIM2_PRES
 		.pin_insert = PIN_SET_USIM2_PRES,
 #endif
@@ -189,6 +239,23 @@ int card_emu_get_vcc(uint8_t uart_chan)
 #endif
 }
 
+/* call-back from card_emu.c to connect the card to another slot of the external mux */
+void card_emu_select_slot(uint8_t uart_chan, uint8_t slot)
+{
+#ifdef HAVE_SLOT_MUX
+	struct cardem_inst *ci = &cardem_inst[uart_chan];
+
+	if (mux_get_slot() == slot)
+		return;
+	mux_set_slot(slot);
+#ifdef HAVE_BOARD_CARDINSERT
+	/* the card insert signal follows the card */
+	if (ci->card_insert)
+		board_set_card_insert(ci, true);
+#endif
+#endif
+}
+
 /* call-back from card_emu.c to enable/disable transmit and/or receive */
 void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx)
 {
@@ -237,7 +304,7 @@ void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx)
 }
 
 /* call-back from card_emu.c to transmit a byte */
-int card_emu_uart_tx(uint8_t uart_chan, uint8_t byte)
+__ramfunc int card_emu_uart_tx(uint8_t uart_chan, uint8_t byte)
 {
 	Usart *usart = get_usart_by_chan(uart_chan);
 #if 0
@@ -261,6 +328,34 @@ int card_emu_uart_tx(uint8_t uart_chan, uint8_t byte)
 	return 1;
 }
 
+/* call-back from card_emu.c to transmit a block of bytes using the PDC.
+ * Returns the number of bytes handed to the PDC, or 0 if not possible */
+__ramfunc int card_emu_uart_tx_dma(uint8_t uart_chan, const uint8_t *data, uint16_t len)
+{
+	Usart *usart = get_usart_by_chan(uart_chan);
+
+	/* the end-of-transfer interrupt replaces the per-byte TXRDY interrupt */
+	USART_DisableIt(usart, US_IDR_TXRDY);
+	if (!USART_WriteBuffer(usart, (void *) data, len)) {
+		USART_EnableIt(usart, US_IER_TXRDY);
+		return 0;
+	}
+	USART_EnableIt(usart, US_IER_ENDTX);
+
+	return len;
+}
+
+/* call-back from card_emu.c to stop a PDC transfer (e.g. on reset) */
+void card_emu_uart_tx_dma_abort(uint8_t uart_chan)
+{
+	Usart *usart = get_usart_by_chan(uart_chan);
+
+	USART_DisableIt(usart, US_IDR_ENDTX);
+	usart->US_PTCR = US_PTCR_TXTDIS;
+	usart->US_TCR = 0;
+	usart->US_TNCR = 0;
+}
+
 static uint16_t compute_next_timeout(struct cardem_inst *ci)
 {
 	uint32_t want_to_expire;
@@ -280,7 +375,7 @@ static uint16_t compute_next_timeout(struct cardem_inst *ci)
 
 /*! common handler if interrupt was received.
  *  \param[in] inst_num Instance number, range 0..1 (some boards only '0' permitted) */
-static void usart_irq_rx(uint8_t inst_num)
+static __ramfunc void usart_irq_rx(uint8_t inst_num)
 {
 	Usart *usart = get_usart_by_chan(inst_num);
 	struct cardem_inst *ci = &cardem_inst[inst_num];
@@ -289,14 +384,17 @@ static void usart_irq_rx(uint8_t inst_num)
 
 	/* get one atomic snapshot of state/flags before they get changed */
 	csr = usart->US_CSR & usart->US_IMR;
+	evtrace_log(SIMTRACE_EVT_USART_ISR_ENTER, csr);
 
 	/* check if one byte has been completely received and is now in the holding register */
 	if (csr & US_CSR_RXRDY) {
 		/* read the bye from the holding register */
 		byte = (usart->US_RHR) & 0xFF;
 		/* append it to the buffer */
-		if (rbuf_write(&ci->rb, byte) < 0)
+		if (rbuf_write(&ci->rb, byte) < 0) {
+			ci->stats.rbuf_overruns++;
 			TRACE_ERROR("rbuf overrun\r\n");
+		}
 	}
 
 	/* check if the transmitter is ready for the next byte */
@@ -308,8 +406,25 @@ static void usart_irq_rx(uint8_t inst_num)
 		}
 	}
 
+	/* check if a PDC transfer started by card_emu_uart_tx_dma() has completed */
+	if (csr & US_CSR_ENDTX) {
+		USART_DisableIt(usart, US_IDR_ENDTX);
+		usart->US_PTCR = US_PTCR_TXTDIS;
+		/* resume byte-wise transmission if there is more to send */
+		if (card_emu_tx_dma_done(ci->ch))
+			USART_EnableIt(usart, US_IER_TXRDY);
+	}
+
 	/* check if any error flags are set */
 	if (csr & (US_CSR_OVRE|US_CSR_FRAME|US_CSR_PARE|US_CSR_NACK|(1<<10))) {
+		if (csr & US_CSR_OVRE)
+			ci->stats.usart_overrun++;
+		if (csr & US_CSR_FRAME)
+			ci->stats.usart_frame++;
+		if (csr & US_CSR_PARE)
+			ci->stats.usart_parity++;
+		if (csr & US_CSR_NACK)
+			ci->stats.usart_nack++;
 		/* clear any error flags */
 		usart->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
 		TRACE_ERROR("%u USART error on 0x%x status: 0x%lx\n", ci->num, byte, csr);
@@ -355,6 +470,8 @@ static void usart_irq_rx(uint8_t inst_num)
 				card_emu_wtime_half_expired(ci->ch);
 		}
 	}
+
+	evtrace_log(SIMTRACE_EVT_USART_ISR_EXIT, inst_num);
 }
 
 /*! ISR called for USART0 */
@@ -404,7 +521,7 @@ void card_emu_uart_update_wt(uint8_t uart_chan, uint32_t wt)
 
 /*! Reset and re-start waiting timeout count down on USART peripheral.
  *  \param[in] usart USART peripheral to configure */
-void card_emu_uart_reset_wt(uint8_t uart_chan)
+__ramfunc void card_emu_uart_reset_wt(uint8_t uart_chan)
 {
 	OSMO_ASSERT(uart_chan < ARRAY_SIZE(cardem_inst));
 	struct cardem_inst *ci = &cardem_inst[uart_chan];
@@ -431,6 +548,23 @@ void card_emu_uart_interrupt(uint8_t uart_chan)
 	}
 }
 
+/* call-back from card_emu.c to fill in the UART level counters */
+void card_emu_uart_get_stats(uint8_t uart_chan, struct cardemu_usb_msg_stats *st)
+{
+	struct cardem_inst *ci;
+
+	OSMO_ASSERT(uart_chan < ARRAY_SIZE(cardem_inst));
+	ci = &cardem_inst[uart_chan];
+
+	st->rbuf_overruns = ci->stats.rbuf_overruns;
+	st->usart_overrun = ci->stats.usart_overrun;
+	st->usart_frame = ci->stats.usart_frame;
+	st->usart_parity = ci->stats.usart_parity;
+	st->usart_nack = ci->stats.usart_nack;
+	st->alloc_failed = talloc_num_failed();
+	st->console_dropped = UART_GetTxDropped();
+}
+
 /***********************************************************************
  * ADC for VCC voltage detection
  ***********************************************************************/
@@ -440,13 +574,130 @@ void card_emu_uart_interrupt(uint8_t uart_chan)
 #error "You must define VCC_UV_THRESH_{1V1,3V} if you use ADC VCC detection"
 #endif
 
+/*! Number of conversions in each of the two PDC buffers (all VCC channels interleaved) */
+#define ADC_PDC_BUF_LEN	128
+
 static volatile int adc_triggered = 0;
 static int adc_sam3s_reva_errata = 0;
 
+/*! ADC channel measuring VCC of each card emulation instance */
+static const uint8_t vcc_adc_chan[] = {
+	7,
+#ifdef CARDEMU_SECOND_UART
+	6,
+#endif
+};
+
+/*! PDC receive buffers (one is being filled while the other is queued as next buffer);
+ *  the channel number is tagged into bits 12..15 of each conversion */
+static uint16_t adc_pdc_buf[2][ADC_PDC_BUF_LEN];
+/*! Index of the PDC buffer currently being filled */
+static uint8_t adc_pdc_cur;
+
+/*! VCC threshold in ADC counts */
+static uint16_t vcc_adc_thresh;
+
+static void vcc_trace_reset(struct cardem_inst *ci)
+{
+	ci->vcc_trace.min = 0xFFFF;
+	ci->vcc_trace.max = 0;
+	ci->vcc_trace.sum = 0;
+	ci->vcc_trace.samples = 0;
+}
+
+/* (re-)arm the comparison window, so that only the next VCC threshold crossing raises an interrupt */
+static void adc_cmp_arm(void)
+{
+	uint32_t on_mask = 0, all_mask = (1 << ARRAY_SIZE(vcc_adc_chan)) - 1;
+	uint32_t emr = ADC_EMR_TAG;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(vcc_adc_chan); i++) {
+		if (cardem_inst[i].vcc_active)
+			on_mask |= (1 << i);
+	}
+
+	if (on_mask == 0) {
+		/* any channel rising above the threshold */
+		emr |= ADC_EMR_CMPALL | ADC_EMR_CMPMODE_HIGH;
+	} else if (on_mask == all_mask) {
+		/* any channel dropping below the threshold */
+		emr |= ADC_EMR_CMPALL | ADC_EMR_CMPMODE_LOW;
+	} else {
+		/* only a single window: watch the slot without VCC, as a fast power-up
+		 * matters most (ATR).  Power-down of the other one is detected at the end
+		 * of the PDC buffer */
+		for (i = 0; on_mask & (1 << i); i++)
+			;
+		emr |= ADC_EMR_CMPSEL(vcc_adc_chan[i]) | ADC_EMR_CMPMODE_HIGH;
+	}
+	ADC->ADC_EMR = emr;
+}
+
+/* update the VCC state of an instance from a new sample; returns true if it changed */
+static bool process_vcc_adc(struct cardem_inst *ci, uint16_t val)
+{
+	bool vcc_active = val >= vcc_adc_thresh;
+
+	ci->vcc_uv = adc2uv(val);
+
+	/* only wake up the main loop on changes, not on every conversion */
+	if (vcc_active == ci->vcc_active)
+		return false;
+
+	ci->vcc_active = vcc_active;
+	if (vcc_active)
+		ci->vcc_trace.vcc_on++;
+	else
+		ci->vcc_trace.vcc_off++;
+	main_event_set(MAIN_EV_ADC);
+	return true;
+}
+
+/* account the conversions of a completed PDC buffer to the per-slot VCC trace */
+static bool adc_pdc_rx_complete(void)
+{
+	uint16_t *buf = adc_pdc_buf[adc_pdc_cur];
+	uint16_t last[ARRAY_SIZE(vcc_adc_chan)] = { 0 };
+	bool changed = false;
+	unsigned int i, j;
+
+	for (i = 0; i < ADC_PDC_BUF_LEN; i++) {
+		uint16_t val = buf[i] & ADC_LCDR_LDATA_Msk;
+		uint8_t chan = (buf[i] & ADC_LCDR_CHNB_Msk) >> ADC_LCDR_CHNB_Pos;
+
+		for (j = 0; j < ARRAY_SIZE(vcc_adc_chan); j++) {
+			if (vcc_adc_chan[j] != chan)
+				continue;
+			struct cardem_inst *ci = &cardem_inst[j];
+			if (val < ci->vcc_trace.min)
+				ci->vcc_trace.min = val;
+			if (val > ci->vcc_trace.max)
+				ci->vcc_trace.max = val;
+			ci->vcc_trace.sum += val;
+			ci->vcc_trace.samples++;
+			last[j] = val;
+		}
+	}
+
+	/* queue the completed buffer again */
+	ADC->ADC_RNPR = (uint32_t) buf;
+	ADC->ADC_RNCR = ADC_PDC_BUF_LEN;
+	adc_pdc_cur ^= 1;
+
+	for (j = 0; j < ARRAY_SIZE(vcc_adc_chan); j++) {
+		if (cardem_inst[j].vcc_trace.samples)
+			changed |= process_vcc_adc(&cardem_inst[j], last[j]);
+	}
+
+	return changed;
+}
+
 static int card_vcc_adc_init(void)
 {
 	uint32_t chip_arch = CHIPID->CHIPID_CIDR & CHIPID_CIDR_ARCH_Msk;
 	uint32_t chip_ver = CHIPID->CHIPID_CIDR & CHIPID_CIDR_VERSION_Msk;
+	unsigned int i;
 
 	PMC_EnablePeripheral(ID_ADC);
 
@@ -462,69 +713,124 @@ static int card_vcc_adc_init(void)
 	if (adc_sam3s_reva_errata) {
 		/* Errata Work-Around to clear EOCx flags */
 		volatile uint32_t foo;
-		int i;
 		for (i = 0; i < 16; i++)
 			foo = ADC->ADC_CDR[i];
 	}
 
-	/* Initialize ADC for AD7 / AD6, fADC=48/24=2MHz */
+	/* Initialize ADC for AD7 / AD6, fADC=48/24=2MHz.  It converts continuously
+	 * (free run), the PDC collects the samples, and the comparison window
+	 * signals threshold crossings: no CPU involvement per conversion */
 	ADC->ADC_MR = ADC_MR_TRGEN_DIS | ADC_MR_LOWRES_BITS_12 |
 		      ADC_MR_SLEEP_NORMAL | ADC_MR_FWUP_OFF |
-		      ADC_MR_FREERUN_OFF | ADC_MR_PRESCAL(23) |
+		      ADC_MR_FREERUN_ON | ADC_MR_PRESCAL(23) |
 		      ADC_MR_STARTUP_SUT8 | ADC_MR_SETTLING(3) |
 		      ADC_MR_ANACH_NONE | ADC_MR_TRACKTIM(4) |
 		      ADC_MR_TRANSFER(1) | ADC_MR_USEQ_NUM_ORDER;
-	/* enable AD6 + AD7 channels */
-	ADC->ADC_CHER = ADC_CHER_CH7;
-	ADC->ADC_IER = ADC_IER_EOC7;
-#ifdef CARDEMU_SECOND_UART
-	ADC->ADC_CHER |= ADC_CHER_CH6;
-	ADC->ADC_IER |= ADC_IER_EOC6;
+#ifdef octsimtest
+	vcc_adc_thresh = VCC_UV_THRESH_1V8 / adc2uv(1);
+#else
+	vcc_adc_thresh = VCC_UV_THRESH_3V / adc2uv(1);
 #endif
+	/* the window matches process_vcc_adc(): HIGH is > HIGHTHRES, LOW is < LOWTHRES */
+	ADC->ADC_EMR = ADC_EMR_TAG;
+	ADC->ADC_CWR = ADC_CWR_LOWTHRES(vcc_adc_thresh) | ADC_CWR_HIGHTHRES(vcc_adc_thresh - 1);
+	/* enable AD6 + AD7 channels */
+	for (i = 0; i < ARRAY_SIZE(vcc_adc_chan); i++) {
+		ADC->ADC_CHER = (1 << vcc_adc_chan[i]);
+		vcc_trace_reset(&cardem_inst[i]);
+	}
+	ADC->ADC_CR |= ADC_CR_START;
+
+	/* determine the initial state from the first conversions */
+	for (i = 0; i < ARRAY_SIZE(vcc_adc_chan); i++) {
+		while (!(ADC->ADC_ISR & (1 << vcc_adc_chan[i])))
+			;
+		uint16_t val = ADC->ADC_CDR[vcc_adc_chan[i]] & 0xFFF;
+		cardem_inst[i].vcc_uv = adc2uv(val);
+		cardem_inst[i].vcc_active = val >= vcc_adc_thresh;
+	}
+
+	ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+	adc_pdc_cur = 0;
+	ADC->ADC_RPR = (uint32_t) adc_pdc_buf[0];
+	ADC->ADC_RCR = ADC_PDC_BUF_LEN;
+	ADC->ADC_RNPR = (uint32_t) adc_pdc_buf[1];
+	ADC->ADC_RNCR = ADC_PDC_BUF_LEN;
+	ADC->ADC_PTCR = ADC_PTCR_RXTEN;
+
+	adc_cmp_arm();
+	/* reading the status clears a stale comparison event */
+	(void) ADC->ADC_ISR;
+	ADC->ADC_IER = ADC_IER_COMPE | ADC_IER_ENDRX;
 	NVIC_SetPriority(ADC_IRQn, 13);
 	NVIC_EnableIRQ(ADC_IRQn);
-	ADC->ADC_CR |= ADC_CR_START;
+	adc_triggered = 1;
 
 	return 0;
 }
 
-static void process_vcc_adc(struct cardem_inst *ci)
+static void card_vcc_adc_exit(void)
 {
-#ifdef octsimtest
-	if (ci->vcc_uv >= VCC_UV_THRESH_1V8)
-#else
-	if (ci->vcc_uv >= VCC_UV_THRESH_3V)
-#endif
-		ci->vcc_active = true;
-	else
-		ci->vcc_active = false;
+	NVIC_DisableIRQ(ADC_IRQn);
+	ADC->ADC_IDR = 0xFFFFFFFF;
+	ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+	ADC->ADC_MR &= ~ADC_MR_FREERUN_ON;
 }
 
 void ADC_IrqHandler(void)
 {
-#ifdef CARDEMU_SECOND_UART
-	if (ADC->ADC_ISR & ADC_ISR_EOC6) {
-		uint16_t val = ADC->ADC_CDR[6] & 0xFFF;
-		cardem_inst[1].vcc_uv = adc2uv(val);
-		process_vcc_adc(&cardem_inst[1]);
-		if (adc_sam3s_reva_errata) {
-			/* Errata: START doesn't start a conversion
-			 * sequence, but only a single conversion */
-			ADC->ADC_CR |= ADC_CR_START;
-		}
-	}
-#endif
+	/* COMPE is cleared by reading the status */
+	uint32_t isr = ADC->ADC_ISR & ADC->ADC_IMR;
+	bool changed = false;
+	unsigned int i;
+
+	if (isr & ADC_ISR_ENDRX)
+		changed |= adc_pdc_rx_complete();
 
-	if (ADC->ADC_ISR & ADC_ISR_EOC7) {
-		uint16_t val = ADC->ADC_CDR[7] & 0xFFF;
-		cardem_inst[0].vcc_uv = adc2uv(val);
-		process_vcc_adc(&cardem_inst[0]);
-		ADC->ADC_CR |= ADC_CR_START;
-		adc_triggered = 1;
+	if (isr & ADC_ISR_COMPE) {
+		/* the comparison only tells that some channel crossed, take the latest
+		 * conversion of each */
+		for (i = 0; i < ARRAY_SIZE(vcc_adc_chan); i++)
+			changed |= process_vcc_adc(&cardem_inst[i], ADC->ADC_CDR[vcc_adc_chan[i]] & 0xFFF);
 	}
+
+	if (changed)
+		adc_cmp_arm();
 }
+
 #endif /* DETECT_VCC_BY_ADC */
 
+/* SIMTRACE_MSGT_BD_CEMU_VCC: report the VCC trace to the host */
+static void report_vcc(struct cardem_inst *ci, const struct cardemu_usb_msg_vcc_req *req)
+{
+	struct cardemu_usb_msg_vcc *v;
+	struct msgb *resp;
+
+	resp = usb_buf_alloc_st(ci->ep_in, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_VCC);
+	if (!resp)
+		return;
+	v = (struct cardemu_usb_msg_vcc *) msgb_put(resp, sizeof(*v));
+	memset(v, 0, sizeof(*v));
+
+#ifdef DETECT_VCC_BY_ADC
+	__disable_irq();
+	v->mv = ci->vcc_uv / 1000;
+	if (ci->vcc_trace.samples) {
+		v->min_mv = adc2uv(ci->vcc_trace.min) / 1000;
+		v->max_mv = adc2uv(ci->vcc_trace.max) / 1000;
+		v->avg_mv = adc2uv(ci->vcc_trace.sum / ci->vcc_trace.samples) / 1000;
+	}
+	v->samples = ci->vcc_trace.samples;
+	v->vcc_on = ci->vcc_trace.vcc_on;
+	v->vcc_off = ci->vcc_trace.vcc_off;
+	if (req && (req->flags & CEMU_VCC_F_RESET))
+		vcc_trace_reset(ci);
+	__enable_irq();
+#endif
+
+	usb_buf_upd_len_and_submit(resp);
+}
+
 
 /**
  * called from main loop; dispatches card I/O state changes to card_emu from main loop.
@@ -535,12 +841,23 @@ static void process_io_statechg(struct cardem_inst *ci)
 {
 	const bool vcc_active = ci->vcc_active && ci->enabled;
 	if (vcc_active != ci->vcc_active_last) {
+		/* the phone may use another clock in the new session */
+		if (vcc_active)
+			sim_clk_reset(ci->clk_tc);
+		card_emu_set_clk_hz(ci->ch, sim_clk_hz(ci->clk_tc));
 		card_emu_io_statechg(ci->ch, CARD_IO_VCC, vcc_active);
-		/* FIXME do this for real */
-		card_emu_io_statechg(ci->ch, CARD_IO_CLK, vcc_active);
 		ci->vcc_active_last = vcc_active;
 	}
 
+	/* measuring takes longer than the phone waits before releasing RST, so
+	 * the clock is assumed to run while powered, until it is seen stopping */
+	const bool clk_active = vcc_active && !sim_clk_stopped(ci->clk_tc);
+	if (clk_active != ci->clk_active_last) {
+		card_emu_io_statechg(ci->ch, CARD_IO_CLK, clk_active);
+		ci->clk_active_last = clk_active;
+	}
+	card_emu_set_clk_hz(ci->ch, sim_clk_hz(ci->clk_tc));
+
 	const bool rst_active = ci->rst_active && ci->enabled;
 	if (rst_active != ci->rst_active_last) {
 		card_emu_io_statechg(ci->ch, CARD_IO_RST, rst_active);
@@ -548,6 +865,19 @@ static void process_io_statechg(struct cardem_inst *ci)
 	}
 }
 
+/* forward the debounced card presence of the given instances (bit-mask) to card_emu */
+static void update_card_present(uint32_t mask)
+{
+#ifdef PIN_DET_USIM1_PRES
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(cardem_inst); i++) {
+		if (mask & (1 << i))
+			card_emu_set_card_present(cardem_inst[i].ch, card_present_state(i) == 1);
+	}
+#endif
+}
+
 /***********************************************************************
  * Core USB  / main loop integration
  ***********************************************************************/
@@ -555,12 +885,14 @@ static void process_io_statechg(struct cardem_inst *ci)
 static void usim1_rst_irqhandler(const Pin *pPin)
 {
 	cardem_inst[0].rst_active = PIO_Get(&pin_usim1_rst) ? false : true;
+	main_event_set(MAIN_EV_PIO);
 }
 
 #ifndef DETECT_VCC_BY_ADC
 static void usim1_vcc_irqhandler(const Pin *pPin)
 {
 	cardem_inst[0].vcc_active = PIO_Get(&pin_usim1_vcc) ? true : false;
+	main_event_set(MAIN_EV_PIO);
 }
 #endif /* !DETECT_VCC_BY_ADC */
 
@@ -568,15 +900,68 @@ static void usim1_vcc_irqhandler(const Pin *pPin)
 static void usim2_rst_irqhandler(const Pin *pPin)
 {
 	cardem_inst[1].rst_active = PIO_Get(&pin_usim2_rst) ? false : true;
+	main_event_set(MAIN_EV_PIO);
 }
 
 #ifndef DETECT_VCC_BY_ADC
 static void usim2_vcc_irqhandler(const Pin *pPin)
 {
 	cardem_inst[1].vcc_active = PIO_Get(&pin_usim2_vcc) ? true : false;
+	main_event_set(MAIN_EV_PIO);
 }
 #endif /* !DETECT_VCC_BY_ADC */
 #endif /* CARDEMU_SECOND_UART */
+/* apply the configuration stored in flash (if any) */
+static void restore_config(struct cardem_inst *ci)
+{
+	const struct cfg_store_slot *s = cfg_store_get(ci->num);
+
+	if (!s)
+		return;
+	TRACE_INFO("%u: applying stored configuration\r\n", ci->num);
+	card_emu_apply_config(ci->ch, &s->cfg, sizeof(s->cfg));
+	card_emu_set_atr(ci->ch, s->atr, s->atr_len);
+}
+
+/* is any slot in a card session? */
+static bool any_vcc_active(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(cardem_inst); i++) {
+		if (cardem_inst[i].vcc_active)
+			return true;
+	}
+	return false;
+}
+
+/* write the current configuration to flash and report the result to the host */
+static void persist_config(struct cardem_inst *ci)
+{
+	struct cardemu_usb_msg_persist *p;
+	struct cfg_store_slot s;
+	struct msgb *resp;
+	int rc;
+
+	ci->persist_pending = false;
+	if (ci->persist_flags & CEMU_PERSIST_F_ERASE) {
+		rc = cfg_store_set(ci->num, NULL);
+	} else {
+		memset(&s, 0, sizeof(s));
+		s.atr_len = card_emu_get_atr(ci->ch, s.atr, sizeof(s.atr));
+		card_emu_get_config(ci->ch, &s.cfg);
+		rc = cfg_store_set(ci->num, &s);
+	}
+
+	resp = usb_buf_alloc_st(ci->ep_in, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_PERSIST);
+	if (!resp)
+		return;
+	p = (struct cardemu_usb_msg_persist *) msgb_put(resp, sizeof(*p));
+	p->flags = ci->persist_flags;
+	p->rc = rc;
+	p->seq = cfg_store_seq();
+	usb_buf_upd_len_and_submit(resp);
+}
 
 /* executed once at system boot for each config */
 void mode_cardemu_configure(void)
@@ -592,6 +977,10 @@ void mode_cardemu_init(void)
 	TRACE_ENTRY();
 
 	NVIC_SetPriority(UDP_IRQn, 14);
+	evtrace_init();
+	dlog_init();
+	timesync_init();
+	cfg_store_init();
 
 #ifdef PINS_CARDSIM
 	PIO_Configure(pins_cardsim, PIO_LISTSIZE(pins_cardsim));
@@ -603,6 +992,7 @@ void mode_cardemu_init(void)
 	INIT_LLIST_HEAD(&cardem_inst[0].usb_out_queue);
 	rbuf_reset(&cardem_inst[0].rb);
 	PIO_Configure(pins_usim1, PIO_LISTSIZE(pins_usim1));
+	sim_clk_init(cardem_inst[0].clk_tc);
 
 	/* configure USART as ISO-7816 slave (e.g. card) */
 	ISO7816_Init(&cardem_inst[0].usart_info, CLK_SLAVE);
@@ -626,12 +1016,14 @@ void mode_cardemu_init(void)
 	cardem_inst[0].ch = card_emu_init(0, 0, SIMTRACE_CARDEM_USB_EP_USIM1_DATAIN,
 					  SIMTRACE_CARDEM_USB_EP_USIM1_INT, cardem_inst[0].vcc_active,
 					  cardem_inst[0].rst_active, cardem_inst[0].vcc_active);
+	restore_config(&cardem_inst[0]);
 	sim_switch_use_physical(0, 1);
 
 #ifdef CARDEMU_SECOND_UART
 	INIT_LLIST_HEAD(&cardem_inst[1].usb_out_queue);
 	rbuf_reset(&cardem_inst[1].rb);
 	PIO_Configure(pins_usim2, PIO_LISTSIZE(pins_usim2));
+	sim_clk_init(cardem_inst[1].clk_tc);
 	ISO7816_Init(&cardem_inst[1].usart_info, CLK_SLAVE);
 	/* TODO enable timeout */
 	NVIC_SetPriority(USART0_IRQn, 0);
@@ -650,9 +1042,12 @@ void mode_cardemu_init(void)
 	cardem_inst[1].ch = card_emu_init(1, 1, SIMTRACE_CARDEM_USB_EP_USIM2_DATAIN,
 					  SIMTRACE_CARDEM_USB_EP_USIM2_INT, cardem_inst[1].vcc_active,
 					  cardem_inst[1].rst_active, cardem_inst[1].vcc_active);
+	restore_config(&cardem_inst[1]);
 	sim_switch_use_physical(1, 1);
 	/* TODO check RST and VCC */
 #endif /* CARDEMU_SECOND_UART */
+
+	update_card_present(0xffffffff);
 }
 
 /* called if config is deactivated */
@@ -669,6 +1064,7 @@ void mode_cardemu_exit(void)
 	NVIC_DisableIRQ(FIRST_USART_IRQ);
 	USART_SetTransmitterEnabled(FIRST_USART_BASE, 0);
 	USART_SetReceiverEnabled(FIRST_USART_BASE, 0);
+	sim_clk_exit(cardem_inst[0].clk_tc);
 
 #ifdef CARDEMU_SECOND_UART
 	PIO_DisableIt(&pin_usim2_rst);
@@ -677,7 +1073,56 @@ void mode_cardemu_exit(void)
 	NVIC_DisableIRQ(USART0_IRQn);
 	USART_SetTransmitterEnabled(USART0, 0);
 	USART_SetReceiverEnabled(USART0, 0);
+	sim_clk_exit(cardem_inst[1].clk_tc);
+#endif
+
+#ifdef DETECT_VCC_BY_ADC
+	card_vcc_adc_exit();
+#endif
+}
+
+#if EVTRACE_NUM_RECS > 0
+/* return (a part of) the event trace ring to the host */
+static void dispatch_evtrace(struct msgb *msg, struct cardem_inst *ci)
+{
+	struct simtrace_evtrace_req *req = (struct simtrace_evtrace_req *) msg->l2h;
+	struct msgb *resp;
+
+	if (msgb_l2len(msg) < sizeof(*req))
+		return;
+
+	resp = usb_buf_alloc_st(ci->ep_in, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_EVTRACE);
+	if (!resp)
+		return;
+	evtrace_dump(resp, req);
+	usb_buf_upd_len_and_submit(resp);
+}
 #endif
+
+#if DLOG_NUM_WORDS > 0
+/* return the pending deferred log messages to the host */
+static void dispatch_dlog(struct msgb *msg, struct cardem_inst *ci)
+{
+	struct msgb *resp;
+
+	resp = usb_buf_alloc_st(ci->ep_in, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_DLOG);
+	if (!resp)
+		return;
+	dlog_dump(resp);
+	usb_buf_upd_len_and_submit(resp);
+}
+#endif
+
+/* return the latest latched USB start-of-frames to the host */
+static void dispatch_timesync(struct msgb *msg, struct cardem_inst *ci)
+{
+	struct msgb *resp;
+
+	resp = usb_buf_alloc_st(ci->ep_in, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_TIMESYNC);
+	if (!resp)
+		return;
+	timesync_dump(resp);
+	usb_buf_upd_len_and_submit(resp);
 }
 
 /* handle a single USB command as received from the USB host */
@@ -689,6 +1134,19 @@ static void dispatch_usb_command_generic(struct msgb *msg, struct cardem_inst *c
 	switch (hdr->msg_type) {
 	case SIMTRACE_CMD_BD_BOARD_INFO:
 		break;
+#if EVTRACE_NUM_RECS > 0
+	case SIMTRACE_CMD_BD_EVTRACE:
+		dispatch_evtrace(msg, ci);
+		break;
+#endif
+#if DLOG_NUM_WORDS > 0
+	case SIMTRACE_CMD_BD_DLOG:
+		dispatch_dlog(msg, ci);
+		break;
+#endif
+	case SIMTRACE_CMD_BD_TIMESYNC:
+		dispatch_timesync(msg, ci);
+		break;
 	default:
 		break;
 	}
@@ -699,6 +1157,7 @@ static void process_card_insert(struct cardem_inst *ci, bool card_insert)
 {
 	TRACE_INFO("%u: set card_insert to %s\r\n", ci->num, card_insert ? "INSERTED" : "REMOVED");
 
+	ci->card_insert = card_insert;
 #ifdef HAVE_BOARD_CARDINSERT
 	board_set_card_insert(ci, card_insert);
 #else
@@ -723,6 +1182,7 @@ static void dispatch_usb_command_cardem(struct msgb *msg, struct cardem_inst *ci
 	struct cardemu_usb_msg_cardinsert *cardins;
 	struct cardemu_usb_msg_config *cfg;
 	struct llist_head *queue;
+	int rc;
 
 	hdr = (struct simtrace_msg_hdr *) msg->l1h;
 	switch (hdr->msg_type) {
@@ -750,7 +1210,38 @@ static void dispatch_usb_command_cardem(struct msgb *msg, struct cardem_inst *ci
 		card_emu_set_config(ci->ch, cfg, msgb_l2len(msg));
 		usb_buf_free(msg);
 		break;
+	case SIMTRACE_MSGT_DT_CEMU_CACHE_ADD:
+		/* the cache keeps the message */
+		rc = card_emu_cache_add(ci->ch, msg);
+		if (rc < 0)
+			card_emu_report_error(ci->ch, hdr->msg_type, rc);
+		break;
+	case SIMTRACE_MSGT_DT_CEMU_CACHE_FLUSH:
+		card_emu_cache_flush(ci->ch);
+		usb_buf_free(msg);
+		break;
+	case SIMTRACE_MSGT_DT_CEMU_SCHEDULE:
+		/* the schedule keeps the message */
+		rc = card_emu_sched_add(ci->ch, msg);
+		if (rc < 0)
+			card_emu_report_error(ci->ch, hdr->msg_type, rc);
+		break;
 	case SIMTRACE_MSGT_BD_CEMU_STATS:
+		card_emu_report_stats(ci->ch);
+		usb_buf_free(msg);
+		break;
+	case SIMTRACE_MSGT_BD_CEMU_VCC:
+		report_vcc(ci, msgb_l2len(msg) >= sizeof(struct cardemu_usb_msg_vcc_req) ?
+			   (struct cardemu_usb_msg_vcc_req *) msg->l2h : NULL);
+		usb_buf_free(msg);
+		break;
+	case SIMTRACE_MSGT_BD_CEMU_PERSIST:
+		/* executed from the main loop, once VCC is off on all slots */
+		ci->persist_flags = msgb_l2len(msg) >= sizeof(struct cardemu_usb_msg_persist_req) ?
+				    ((struct cardemu_usb_msg_persist_req *) msg->l2h)->flags : 0;
+		ci->persist_pending = true;
+		usb_buf_free(msg);
+		break;
 	default:
 		/* FIXME: Send Error */
 		usb_buf_free(msg);
@@ -928,6 +1419,12 @@ void mode_cardemu_run(void)
 	struct llist_head *queue;
 	unsigned int i;
 
+#ifdef PIN_DET_USIM1_PRES
+	update_card_present(card_present_poll());
+#endif
+	timesync_poll();
+	sim_clk_poll();
+
 	for (i = 0; i < ARRAY_SIZE(cardem_inst); i++) {
 		struct cardem_inst *ci = &cardem_inst[i];
 
@@ -949,6 +1446,10 @@ void mode_cardemu_run(void)
 
 		process_io_statechg(ci);
 
+		/* don't stall the firmware while any card is in use */
+		if (ci->persist_pending && !any_vcc_active())
+			persist_config(ci);
+
 		/* first try to send any pending messages on IRQ */
 		usb_refill_to_host(ci->ep_int);
 
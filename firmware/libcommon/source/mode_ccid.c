@@ -29,6 +29,8 @@
 
 #include "board.h"
 #include "simtrace.h"
+#include "iso7816_t1.h"
+#include "main_events.h"
 
 #ifdef HAVE_CCID
 
@@ -108,6 +110,7 @@ Output:
 			CCID_Removal();
 		}
 	}
+	main_event_set(MAIN_EV_PIO);
 }
 
 /**
@@ -138,6 +141,9 @@ void CCID_configure(void)
 void CCID_exit(void)
 {
 	PIO_DisableIt(&pinSmartCard);
+	NVIC_DisableIRQ(IRQ_USART_SIM);
+	ISO7816_T0_Abort();
+	ISO7816_T1_Abort();
 	USART_SetTransmitterEnabled(usart_info.base, 0);
 	USART_SetReceiverEnabled(usart_info.base, 0);
 }
@@ -175,6 +181,9 @@ void CCID_init(void)
 	/*  Decode ATR and print it */
 	ISO7816_Decode_ATR(pAtr);
 
+	/* TPDUs are exchanged with the card from the USART interrupt */
+	NVIC_EnableIRQ(IRQ_USART_SIM);
+
 	// FIXME. what if smcard is not inserted?
 	if (PIO_Get(&pinSmartCard) == 0) {
 		printf("SIM card inserted\n\r");
@@ -182,6 +191,13 @@ void CCID_init(void)
 	}
 }
 
+/* USART_SIM interrupt while the CCID configuration is active */
+void CCID_usart_irq(void)
+{
+	ISO7816_T0_IrqHandler();
+	ISO7816_T1_IrqHandler();
+}
+
 /* main (idle/busy) loop of this USB configuration */
 void CCID_run(void)
 {
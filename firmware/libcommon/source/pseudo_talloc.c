@@ -21,10 +21,12 @@
 /* TODO: this number should dynamically scale. We need at least one per IN/IRQ endpoint,
  * as well as at least 3 for every OUT endpoint.  Plus some more depending on the application */
 #define NUM_RCTX_SMALL 20
-#define RCTX_SIZE_SMALL 348
+/* a USB buffer: struct msgb (68 bytes) + USB_ALLOC_SIZE */
+#define RCTX_SIZE_SMALL 388
 
 static uint8_t msgb_data[NUM_RCTX_SMALL][RCTX_SIZE_SMALL] __attribute__((aligned(sizeof(long))));
 static uint8_t msgb_inuse[NUM_RCTX_SMALL];
+static unsigned int num_failed;
 
 void *_talloc_zero(const void *ctx, size_t size, const char *name)
 {
@@ -33,6 +35,7 @@ void *_talloc_zero(const void *ctx, size_t size, const char *name)
 
 	local_irq_save(x);
 	if (size > RCTX_SIZE_SMALL) {
+		num_failed++;
 		local_irq_restore(x);
 		TRACE_ERROR("%s() request too large(%d > %d)\r\n", __func__, size, RCTX_SIZE_SMALL);
 		return NULL;
@@ -47,12 +50,18 @@ void *_talloc_zero(const void *ctx, size_t size, const char *name)
 			return out;
 		}
 	}
+	num_failed++;
 	local_irq_restore(x);
 	TRACE_ERROR("%s() out of memory!\r\n", __func__);
 	return NULL;
 }
 
-int _talloc_free(void *ptr, const char *location)
+unsigned int talloc_num_failed(void)
+{
+	return num_failed;
+}
+
+__ramfunc int _talloc_free(void *ptr, const char *location)
 {
 	unsigned int i;
 	unsigned long x;
@@ -28,7 +28,7 @@ void rbuf_reset(volatile ringbuf * rb)
 	local_irq_restore(state);
 }
 
-uint8_t rbuf_read(volatile ringbuf * rb)
+__ramfunc uint8_t rbuf_read(volatile ringbuf * rb)
 {
 	unsigned long state;
 	uint8_t val;
@@ -46,7 +46,7 @@ uint8_t rbuf_peek(volatile ringbuf * rb)
 	return rb->buf[rb->ird];
 }
 
-bool rbuf_is_empty(volatile ringbuf * rb)
+__ramfunc bool rbuf_is_empty(volatile ringbuf * rb)
 {
 	return rb->ird == rb->iwr;
 }
@@ -56,7 +56,7 @@ static bool __rbuf_is_full(volatile ringbuf * rb)
 	return rb->ird == (rb->iwr + 1) % RING_BUFLEN;
 }
 
-bool rbuf_is_full(volatile ringbuf * rb)
+__ramfunc bool rbuf_is_full(volatile ringbuf * rb)
 {
 	unsigned long state;
 	bool rc;
@@ -68,7 +68,25 @@ bool rbuf_is_full(volatile ringbuf * rb)
 	return rc;
 }
 
-int rbuf_write(volatile ringbuf * rb, uint8_t item)
+/* read up to len bytes at once, returns the number of bytes read */
+__ramfunc size_t rbuf_read_buf(volatile ringbuf * rb, uint8_t *data, size_t len)
+{
+	unsigned long state;
+	size_t i;
+
+	local_irq_save(state);
+	for (i = 0; i < len; i++) {
+		if (rb->ird == rb->iwr)
+			break;
+		data[i] = rb->buf[rb->ird];
+		rb->ird = (rb->ird + 1) % RING_BUFLEN;
+	}
+	local_irq_restore(state);
+
+	return i;
+}
+
+__ramfunc int rbuf_write(volatile ringbuf * rb, uint8_t item)
 {
 	unsigned long state;
 
@@ -84,4 +102,20 @@ int rbuf_write(volatile ringbuf * rb, uint8_t item)
 	}
 }
 
+/* write up to len bytes at once, returns the number of bytes written */
+__ramfunc size_t rbuf_write_buf(volatile ringbuf * rb, const uint8_t *data, size_t len)
+{
+	unsigned long state;
+	size_t i;
+
+	local_irq_save(state);
+	for (i = 0; i < len; i++) {
+		if (__rbuf_is_full(rb))
+			break;
+		rb->buf[rb->iwr] = data[i];
+		rb->iwr = (rb->iwr + 1) % RING_BUFLEN;
+	}
+	local_irq_restore(state);
 
+	return i;
+}
@@ -0,0 +1,217 @@
+/* Background measurement of the SIM clock frequency
+ *
+ * A channel of the timer/counter block counts the SIM clock on its TCLK
+ * input and interrupts every SIM_CLK_PERIOD clock cycles.  The interrupt
+ * samples the cycle counter (MCK cycles, running while the core sleeps)
+ * together with the counter value of the channel, so the SIM clock cycles
+ * since the compare cancel the interrupt latency out.  The frequency is
+ * computed over consecutive periods of about equal
+ * length, which excludes the periods during which the clock was stopped
+ * or changed.  Unlike apps/freq_ctr, no gate signal (and thus no extra
+ * pin) is required, so this runs next to the card emulation and the
+ * sniffer on the pins they already use.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "sim_clk.h"
+#include "cycle_counter.h"
+
+struct sim_clk_state {
+	TcChannel *chan;
+	bool enabled;
+	/* cycle counter and channel counter value, sampled at the latest interrupt */
+	uint32_t last_cycles;
+	uint32_t last_cv;
+	/* MCK cycles of the latest period */
+	uint32_t last_period;
+	/* latest period, if it matches the one before it (0 otherwise) */
+	volatile uint32_t valid_period;
+	/* SIM clock cycles (and their MCK cycles) of the current measurement */
+	uint32_t run_clks;
+	uint32_t run_cycles;
+	volatile uint32_t hz;
+	volatile bool stopped;
+};
+
+static struct sim_clk_state sim_clk_state[3];
+
+static struct sim_clk_state *get_sc(uint8_t tc_chan)
+{
+	if (tc_chan != 0 && tc_chan != 2)
+		return NULL;
+	return &sim_clk_state[tc_chan];
+}
+
+static void sim_clk_irq(struct sim_clk_state *sc)
+{
+	uint32_t sr = sc->chan->TC_SR;
+	uint32_t now, cv, period, clks;
+	unsigned long flags;
+
+	if (!(sr & TC_SR_CPCS))
+		return;
+
+	local_irq_save(flags);
+	now = cycle_counter_get();
+	cv = sc->chan->TC_CV;
+	local_irq_restore(flags);
+	/* the counter is reset at the compare, once per interrupt */
+	clks = SIM_CLK_PERIOD - sc->last_cv + cv;
+	period = now - sc->last_cycles;
+	sc->last_cycles = now;
+	sc->last_cv = cv;
+	sc->stopped = false;
+
+	/* the clock started, stopped or changed during this period, or an
+	 * interrupt was missed: start a new measurement */
+	if (period > sc->last_period + sc->last_period / 8 ||
+	    period < sc->last_period - sc->last_period / 8) {
+		sc->last_period = period;
+		sc->valid_period = 0;
+		sc->run_clks = 0;
+		sc->run_cycles = 0;
+		return;
+	}
+	sc->last_period = period;
+	sc->valid_period = period;
+
+	sc->run_clks += clks;
+	sc->run_cycles += period;
+	if (sc->run_cycles >= BOARD_MCK / 1000 * SIM_CLK_WINDOW_MS) {
+		sc->hz = (uint64_t) sc->run_clks * BOARD_MCK / sc->run_cycles;
+		sc->run_clks = 0;
+		sc->run_cycles = 0;
+	}
+}
+
+void TC0_IrqHandler(void)
+{
+	sim_clk_irq(&sim_clk_state[0]);
+}
+
+void TC2_IrqHandler(void)
+{
+	sim_clk_irq(&sim_clk_state[2]);
+}
+
+void sim_clk_init(uint8_t tc_chan)
+{
+	struct sim_clk_state *sc = get_sc(tc_chan);
+	uint32_t tc_clks;
+
+	if (!sc)
+		return;
+
+	cycle_counter_init();
+
+	switch (tc_chan) {
+	case 0:
+		PMC_EnablePeripheral(ID_TC0);
+		/* route TCLK0 to XC0 */
+		TC0->TC_BMR &= ~TC_BMR_TC0XC0S_Msk;
+		TC0->TC_BMR |= TC_BMR_TC0XC0S_TCLK0;
+		tc_clks = TC_CMR_TCCLKS_XC0;
+		break;
+	case 2:
+		PMC_EnablePeripheral(ID_TC2);
+		/* route TCLK2 to XC2. TC0 really means TCA in this case */
+		TC0->TC_BMR &= ~TC_BMR_TC2XC2S_Msk;
+		TC0->TC_BMR |= TC_BMR_TC2XC2S_TCLK2;
+		tc_clks = TC_CMR_TCCLKS_XC2;
+		break;
+	default:
+		return;
+	}
+
+	sc->chan = &TC0->TC_CHANNEL[tc_chan];
+	sim_clk_reset(tc_chan);
+
+	/* free running, reset on compare C */
+	sc->chan->TC_CMR = tc_clks | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC;
+	sc->chan->TC_RC = SIM_CLK_PERIOD - 1;
+	sc->chan->TC_IER = TC_IER_CPCS;
+	sc->chan->TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+	sc->enabled = true;
+
+	NVIC_EnableIRQ((IRQn_Type) (TC0_IRQn + tc_chan));
+}
+
+void sim_clk_exit(uint8_t tc_chan)
+{
+	struct sim_clk_state *sc = get_sc(tc_chan);
+
+	if (!sc || !sc->enabled)
+		return;
+
+	NVIC_DisableIRQ((IRQn_Type) (TC0_IRQn + tc_chan));
+	sc->chan->TC_IDR = TC_IDR_CPCS;
+	sc->chan->TC_CCR = TC_CCR_CLKDIS;
+	sc->enabled = false;
+}
+
+void sim_clk_reset(uint8_t tc_chan)
+{
+	struct sim_clk_state *sc = get_sc(tc_chan);
+	unsigned long flags;
+
+	if (!sc)
+		return;
+
+	local_irq_save(flags);
+	sc->last_cycles = cycle_counter_get();
+	sc->last_cv = sc->chan ? sc->chan->TC_CV : 0;
+	sc->last_period = 0;
+	sc->valid_period = 0;
+	sc->run_clks = 0;
+	sc->run_cycles = 0;
+	sc->hz = 0;
+	sc->stopped = false;
+	local_irq_restore(flags);
+}
+
+void sim_clk_poll(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(sim_clk_state); i++) {
+		struct sim_clk_state *sc = &sim_clk_state[i];
+		unsigned long flags;
+
+		if (!sc->enabled || !sc->valid_period)
+			continue;
+
+		local_irq_save(flags);
+		/* no compare during two periods */
+		if (sc->valid_period && cycle_counter_get() - sc->last_cycles > 2 * sc->valid_period) {
+			/* the period spanning the stop must not be measured */
+			sc->last_period = 0;
+			sc->valid_period = 0;
+			sc->stopped = true;
+		}
+		local_irq_restore(flags);
+	}
+}
+
+uint32_t sim_clk_hz(uint8_t tc_chan)
+{
+	struct sim_clk_state *sc = get_sc(tc_chan);
+
+	return sc ? sc->hz : 0;
+}
+
+bool sim_clk_stopped(uint8_t tc_chan)
+{
+	struct sim_clk_state *sc = get_sc(tc_chan);
+
+	return sc ? sc->stopped : false;
+}
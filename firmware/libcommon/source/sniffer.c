@@ -18,6 +18,8 @@
  * reader).
  * For historical reasons (i.e. SIMtrace hardware) the USART peripheral 
  * connected to the SIM card is used.
+ * Boards wiring a second phone-card link to the phone USART can sniff both
+ * links at once, each one being reported as separate USB slot.
  * TODO put common ISO7816-3 code is separate library (and combine clean with 
  * iso7816_4)
  */
@@ -40,6 +42,10 @@
 #include "usb_buf.h"
 #include "simtrace_usb.h"
 #include "simtrace_prot.h"
+#include "cycle_counter.h"
+#include "sim_clk.h"
+#include "timesync.h"
+#include "main_events.h"
 
 /*------------------------------------------------------------------------------
  *         Internal definitions
@@ -55,6 +61,42 @@
  */
 #define MAX_PPS_SIZE 6
 
+/*! Use the PDC to receive the sniffed data, instead of one interrupt per byte */
+#ifndef SNIFFER_RX_PDC
+#define SNIFFER_RX_PDC 1
+#endif
+/*! Size of each of the two PDC receive buffers
+ *  @note received bytes are only time-stamped when a buffer is full (or on the receiver time-out),
+ *  so this bounds how late a time-stamp can be during continuous reception, in characters
+ *  (about 5 ms at Fi=372, Di=1 and 3.57 MHz), while still saving 3 of 4 interrupts */
+#define SNIFF_PDC_BUF_LEN 4
+/*! Receiver time-out (in ETU) after which partially filled PDC buffers are flushed
+ *  @note this also is the granularity of the WT time-out detection */
+#define SNIFF_PDC_FLUSH_ETU 24
+
+/*! Maximum number of sniffed bytes processed per Sniffer_run() call
+ *  @note this bounds the time between two watchdog restarts in the main loop */
+#ifndef SNIFF_RUN_BUDGET
+#define SNIFF_RUN_BUDGET 256
+#endif
+/*! Number of bytes read at once from the sniff ring buffer */
+#define SNIFF_RUN_CHUNK_LEN 32
+
+/*! Support sending the sniffed data with reception time-stamps (SIMTRACE_MSGT_SNIFF_*_TS)
+ *  @note the host enables them using SIMTRACE_MSGT_SNIFF_CONFIG, the original messages are sent otherwise */
+#ifndef SNIFFER_TIMESTAMPS
+#define SNIFFER_TIMESTAMPS 1
+#endif
+/*! Bit-mask of the supported SNIFF_FEAT_F_* flags */
+#if SNIFFER_TIMESTAMPS
+#define SNIFF_SUPPORTED_FEATURES SNIFF_FEAT_F_TIMESTAMPS
+#else
+#define SNIFF_SUPPORTED_FEATURES 0
+#endif
+/*! Number of reception time markers (power of two)
+ *  @note one is used per PDC buffer; when all are in use, new data is attributed to the last marker */
+#define SNIFF_TS_MARKERS 32
+
 /*! ISO 7816-3 states relevant to the sniff mode */
 enum iso7816_3_sniff_state {
 	ISO7816_S_RESET, /*!< in Reset */
@@ -115,9 +157,161 @@ enum tpdu_sniff_state {
  *         Internal variables
  *------------------------------------------------------------------------------*/
 
-/* note: the sniffer code is currently designed to support only one sniffing interface, but the hardware would support a second one.
- * to support a second sniffer interface the code should be restructured to use handles.
+/*! Number of sniffer instances
+ *  @note boards wiring a second card/phone link to the phone USART define the PINS_SIM_SNIFF2 and PIN_SIM_RST_SNIFF2 pins
  */
+#ifdef PINS_SIM_SNIFF2
+#define NUM_SNIFF_INST 2
+#else
+#define NUM_SNIFF_INST 1
+#endif
+
+/*! State of a sniffer instance (one per sniffed card/phone link) */
+struct sniff_inst {
+	/*! instance number, used as USB slot number */
+	uint8_t num;
+
+	/* Pin configurations */
+	/*! Pin configuration to sniff communication (using USART connection card) */
+	const Pin *pins_sniff;
+	unsigned int pins_sniff_num;
+	/*! Pin configuration to interconnect phone and card using the bus switch */
+	const Pin *pins_bus;
+	unsigned int pins_bus_num;
+	/*! Pin configuration to power the card by the phone */
+	const Pin *pins_power;
+	unsigned int pins_power_num;
+	/*! Pin configuration for card reset line */
+	Pin pin_rst;
+
+	/* USART related variables */
+	/*! USART peripheral used to sniff communication */
+	struct Usart_info usart;
+	/*! Interrupt request ID of the USART peripheral */
+	IRQn_Type usart_irq;
+	/*! Ring buffer to store sniffer communication data */
+	struct ringbuf buffer;
+#if SNIFFER_RX_PDC
+	/*! PDC receive buffers (one is being filled while the other is queued as next buffer) */
+	uint8_t pdc_buf[2][SNIFF_PDC_BUF_LEN];
+	/*! Index of the PDC buffer currently being filled */
+	uint8_t pdc_cur;
+	/*! Number of bytes of the current PDC buffer already flushed to the ring buffer */
+	uint16_t pdc_rd;
+#endif
+	/*! Remaining Waiting Time (WI) counter (>16 bits) */
+	volatile uint32_t wt_remaining;
+
+	/*! Reception time of the data in the ring buffer
+	 *  @note the ISR records when data is written into the ring buffer, the main loop looks
+	 *  it up for each byte read.  In PDC mode data is written when it is flushed (the receiver
+	 *  time-out, SNIFF_PDC_FLUSH_ETU after the last byte) or when a PDC buffer is full, so
+	 *  during continuous reception a byte can be stamped up to SNIFF_PDC_BUF_LEN characters
+	 *  late.  Only when the SIM clock is measured (clk_tc) is each byte moved back to its own
+	 *  reception time; in per-byte interrupt mode the time-stamps are exact.
+	 */
+	struct {
+		/*! cycle counter time-stamped data, ordered by position */
+		struct {
+			/*! total number of bytes written to the ring buffer after this chunk */
+			uint32_t pos;
+			/*! cycle counter value when the chunk was written */
+			uint32_t cycles;
+			/*! ETU between the end of the last byte of the chunk and the marker */
+			uint16_t late_etu;
+			/*! clock cycles per ETU (Fi/Di) when the chunk was received */
+			uint16_t etu_clk;
+		} markers[SNIFF_TS_MARKERS];
+		/*! next marker to be written (by the ISR) */
+		volatile uint8_t m_wr;
+		/*! oldest marker not yet consumed (by the main loop) */
+		uint8_t m_rd;
+		/*! total number of bytes written to the ring buffer */
+		volatile uint32_t wr_pos;
+		/*! total number of bytes read from the ring buffer */
+		uint32_t rd_pos;
+		/*! identifier of the current time base
+		 *  @note counts the sniffer (re)starts since boot, it is not unique across reboots */
+		uint32_t epoch;
+		/*! last cycle counter value seen by the main loop */
+		uint32_t last;
+		/*! cycles since the start of the epoch, corresponding to last */
+		uint64_t now64;
+	} ts;
+	/*! Timer/counter channel whose TCLK input is the SIM clock (see sim_clk.h), -1 if none */
+	int8_t clk_tc;
+	/*! Clock frequency and state last reported to the host */
+	uint32_t clk_hz_sent;
+	bool clk_stopped_sent;
+	/*! Reception time (cycle counter) of the byte currently processed */
+	uint32_t byte_cycles;
+	/*! Reception time (cycle counter) of the first byte of the current ATR/PPS/TPDU */
+	uint32_t record_cycles;
+	/*! Reception time (cycle counter) of P3 and of the first procedure byte of the current TPDU */
+	uint32_t hdr_cycles;
+	uint32_t pb_cycles;
+	/*! P3 and the first procedure byte of the current TPDU have been received */
+	bool hdr_received;
+	bool pb_received;
+
+	/* Flags  to know is the card status changed (see SIMTRACE_MSGT_DT_SNIFF_CHANGE flags) */
+	volatile uint32_t change_flags;
+
+	/* ISO 7816 variables */
+	/*! ISO 7816-3 state */
+	enum iso7816_3_sniff_state iso_state;
+	/*! ATR state */
+	enum atr_sniff_state atr_state;
+	/*! ATR data
+	 *  @remark can be used to check later protocol changes
+	 */
+	uint8_t atr[MAX_ATR_SIZE];
+	/*! Current index in the ATR data */
+	uint8_t atr_i;
+	/*! Number of expected historical bytes */
+	uint8_t atr_hist_len;
+	/*! Last mask of the upcoming TA, TB, TC, TD interface bytes */
+	uint8_t atr_y;
+	/*! Interface byte subgroup number */
+	uint8_t atr_ifs_i;
+	/*! ATR error flags */
+	uint32_t atr_flags;
+	/*! If convention conversion is needed */
+	bool convention_convert;
+	/*! The supported T protocols */
+	uint16_t t_protocol_support;
+	/*! PPS state 
+	 *  @remark it is shared between request and response since they aren't simultaneous but follow the same procedure
+	 */
+	enum pps_sniff_state pps_state;
+	/*! PPS error flags */
+	uint32_t pps_flags;
+	/*! PPS request data
+	 *  @remark can be used to check PPS response
+	 */
+	uint8_t pps_req[MAX_PPS_SIZE];
+	/*! PPS response data */
+	uint8_t pps_rsp[MAX_PPS_SIZE];
+	/*! TPDU state */
+	enum tpdu_sniff_state tpdu_state;
+	/*! Final TPDU packet
+	 *  @note this is the complete command+response TPDU, including header, data, and status words
+	 *  @remark this does not include the procedure bytes
+	 */
+	uint8_t tpdu_packet[5+256+2];
+	/*! Current index in TPDU packet */
+	uint16_t tpdu_packet_i;
+
+	/*! Waiting Time (WT)
+	 *  @note defined in ISO/IEC 7816-3:2006(E) section 8.1 and 10.2
+	 */
+	uint32_t wt;
+	/*! Waiting time Integer (WI), used to calculate the Waiting Time (WT) */
+	uint8_t wt_wi;
+	/*! baud rate adjustment integer (the actual value, not the table index) */
+	uint8_t wt_d;
+};
+
 /* Pin configurations */
 /*! Pin configuration to sniff communication (using USART connection card) */
 static const Pin pins_sniff[] = { PINS_SIM_SNIFF };
@@ -127,61 +321,81 @@ static const Pin pins_bus[] = { PINS_BUS_SNIFF };
 static const Pin pins_power[] = { PINS_PWR_SNIFF };
 /*! Pin configuration for timer counter to measure ETU timing */
 static const Pin pins_tc[] = { PINS_TC };
-/*! Pin configuration for card reset line */
-static const Pin pin_rst = PIN_SIM_RST_SNIFF;
-
-/* USART related variables */
-/*! USART peripheral used to sniff communication */
-static struct Usart_info sniff_usart = {
-	.base = USART_SIM,
-	.id = ID_USART_SIM,
-	.state = USART_RCV,
+#ifdef PIN_SIM_CLK_INPUT
+/* only the clock input is needed to measure the SIM clock */
+static const Pin pin_clk_input = PIN_SIM_CLK_INPUT;
+#endif
+#if NUM_SNIFF_INST > 1
+/*! Pin configuration to sniff the second link (using the phone USART) */
+static const Pin pins_sniff2[] = { PINS_SIM_SNIFF2 };
+#ifdef PINS_BUS_SNIFF2
+static const Pin pins_bus2[] = { PINS_BUS_SNIFF2 };
+#endif
+#ifdef PINS_PWR_SNIFF2
+static const Pin pins_power2[] = { PINS_PWR_SNIFF2 };
+#endif
+#endif
+
+/*! Features enabled by the host (SNIFF_FEAT_F_* flags, for all links)
+ *  @note cleared when the sniffer configuration is selected, for hosts unaware of SIMTRACE_MSGT_SNIFF_CONFIG */
+static uint32_t sniff_features;
+
+/*! Sniffer instances */
+static struct sniff_inst sniff_inst[NUM_SNIFF_INST] = {
+	{
+		.num = 0,
+		.pins_sniff = pins_sniff,
+		.pins_sniff_num = PIO_LISTSIZE(pins_sniff),
+		.pins_bus = pins_bus,
+		.pins_bus_num = PIO_LISTSIZE(pins_bus),
+		.pins_power = pins_power,
+		.pins_power_num = PIO_LISTSIZE(pins_power),
+		.pin_rst = PIN_SIM_RST_SNIFF,
+		.usart = {
+			.base = USART_SIM,
+			.id = ID_USART_SIM,
+			.state = USART_RCV,
+		},
+		.usart_irq = IRQ_USART_SIM,
+#ifdef PIN_SIM_CLK_INPUT
+		/* PA4 */
+		.clk_tc = 0,
+#else
+		.clk_tc = -1,
+#endif
+		.iso_state = ISO7816_S_RESET,
+		.wt = 9600,
+		.wt_wi = 10,
+		.wt_d = 1,
+	},
+#if NUM_SNIFF_INST > 1
+	{
+		.num = 1,
+		.pins_sniff = pins_sniff2,
+		.pins_sniff_num = PIO_LISTSIZE(pins_sniff2),
+#ifdef PINS_BUS_SNIFF2
+		.pins_bus = pins_bus2,
+		.pins_bus_num = PIO_LISTSIZE(pins_bus2),
+#endif
+#ifdef PINS_PWR_SNIFF2
+		.pins_power = pins_power2,
+		.pins_power_num = PIO_LISTSIZE(pins_power2),
+#endif
+		.pin_rst = PIN_SIM_RST_SNIFF2,
+		.usart = {
+			.base = USART_PHONE,
+			.id = ID_USART_PHONE,
+			.state = USART_RCV,
+		},
+		.usart_irq = IRQ_USART_PHONE,
+		.clk_tc = -1,
+		.iso_state = ISO7816_S_RESET,
+		.wt = 9600,
+		.wt_wi = 10,
+		.wt_d = 1,
+	},
+#endif
 };
-/*! Ring buffer to store sniffer communication data */
-static struct ringbuf sniff_buffer;
-
-/* Flags  to know is the card status changed (see SIMTRACE_MSGT_DT_SNIFF_CHANGE flags) */
-volatile uint32_t change_flags = 0;
-
-/* ISO 7816 variables */
-/*! ISO 7816-3 state */
-enum iso7816_3_sniff_state iso_state = ISO7816_S_RESET;
-/*! ATR state */
-enum atr_sniff_state atr_state;
-/*! ATR data
- *  @remark can be used to check later protocol changes
- */
-uint8_t atr[MAX_ATR_SIZE];
-/*! Current index in the ATR data */
-uint8_t atr_i = 0;
-/*! If convention conversion is needed */
-bool convention_convert = false;
-/*! The supported T protocols */
-uint16_t t_protocol_support = 0;
-/*! PPS state 
- *  @remark it is shared between request and response since they aren't simultaneous but follow the same procedure
- */
-enum pps_sniff_state pps_state;
-/*! PPS request data
- *  @remark can be used to check PPS response
- */
-uint8_t pps_req[MAX_PPS_SIZE];
-/*! PPS response data */
-uint8_t pps_rsp[MAX_PPS_SIZE];
-/*! TPDU state */
-enum tpdu_sniff_state tpdu_state;
-/*! Final TPDU packet
- *  @note this is the complete command+response TPDU, including header, data, and status words
- *  @remark this does not include the procedure bytes
- */
-uint8_t tpdu_packet[5+256+2];
-/*! Current index in TPDU packet */
-uint16_t tpdu_packet_i = 0;
-
-/*! Waiting Time (WT)
- *  @note defined in ISO/IEC 7816-3:2006(E) section 8.1 and 10.2
- */
-uint32_t wt = 9600;
 
 /*------------------------------------------------------------------------------
  *         Internal functions
@@ -199,19 +413,16 @@ static const uint8_t convention_convert_lut[256] = { 0xff, 0x7f, 0xbf, 0x3f, 0xd
  *  @note set wt to be used by the receiver timeout
  *  @note defined in ISO/IEC 7816-3:2006(E) section 8.1 and 10.2
  */
-static void update_wt(uint8_t wi, uint8_t d)
+static void update_wt(struct sniff_inst *si, uint8_t wi, uint8_t d)
 {
-	static uint8_t wt_wi = 10; /* Waiting time Integer (WI), used to calculate the Waiting Time (WT) */
-	static uint8_t wt_d = 1; /* baud rate adjustment integer (the actual value, not the table index) */
-	
 	if (0 != wi) {
-		wt_wi = wi;
+		si->wt_wi = wi;
 	}
 	if (0 != d) {
-		wt_d = d;
+		si->wt_d = d;
 	}
-	wt = wt_wi * 960UL * wt_d;
-	TRACE_INFO("WT updated to %lu ETU\n\r", wt);
+	si->wt = si->wt_wi * 960UL * si->wt_d;
+	TRACE_INFO("WT updated to %lu ETU\n\r", si->wt);
 }
 
 /*! Allocate USB buffer and push + initialize simtrace_msg_hdr
@@ -220,7 +431,7 @@ static void update_wt(uint8_t wi, uint8_t d)
  *  @param[in] msg_type SIMtrace USB message type
  *  @return USB message with allocated ans initialized header, or NULL if allocation failed
  */
-static struct msgb *usb_msg_alloc_hdr(uint8_t ep, uint8_t msg_class, uint8_t msg_type)
+static struct msgb *usb_msg_alloc_hdr(struct sniff_inst *si, uint8_t ep, uint8_t msg_class, uint8_t msg_type)
 {
 	/* Only allocate message if not too many are already in the queue */
 	struct llist_head *head = usb_get_queue(SIMTRACE_USB_EP_CARD_DATAIN);
@@ -240,6 +451,7 @@ static struct msgb *usb_msg_alloc_hdr(uint8_t ep, uint8_t msg_class, uint8_t msg
 	memset(usb_msg_header, 0, sizeof(*usb_msg_header));
 	usb_msg_header->msg_class = msg_class;
 	usb_msg_header->msg_type = msg_type;
+	usb_msg_header->slot_nr = si->num;
 	usb_msg->l2h = usb_msg->l1h + sizeof(*usb_msg_header);
 
 	return usb_msg;
@@ -255,47 +467,146 @@ void usb_msg_upd_len_and_submit(struct msgb *usb_msg)
 	usb_buf_submit(usb_msg);
 }
 
+/*! Record that data has been written into the ring buffer
+ *  @param[in] len number of bytes written
+ *  @param[in] late_etu ETU elapsed since the end of the last written byte (e.g. the receiver time-out)
+ *  @note to be called from the USART ISR
+ */
+static void sniff_ts_mark(struct sniff_inst *si, uint16_t len, uint16_t late_etu)
+{
+	uint8_t next = (si->ts.m_wr + 1) % SNIFF_TS_MARKERS;
+
+	if (!len) {
+		return;
+	}
+	si->ts.wr_pos += len;
+	if (next == si->ts.m_rd) {
+		/* no marker left: extend the newest one */
+		si->ts.markers[(si->ts.m_wr + SNIFF_TS_MARKERS - 1) % SNIFF_TS_MARKERS].pos = si->ts.wr_pos;
+		return;
+	}
+	si->ts.markers[si->ts.m_wr].pos = si->ts.wr_pos;
+	si->ts.markers[si->ts.m_wr].cycles = cycle_counter_get();
+	si->ts.markers[si->ts.m_wr].late_etu = late_etu;
+	si->ts.markers[si->ts.m_wr].etu_clk = si->usart.base->US_FIDI & US_FIDI_FI_DI_RATIO_Msk;
+	si->ts.m_wr = next;
+}
+
+/*! Get the reception time of the next byte read from the ring buffer
+ *  @return cycle counter value
+ */
+static uint32_t sniff_ts_next(struct sniff_inst *si)
+{
+	uint32_t cycles;
+
+	/* skip the markers of data already read */
+	while (si->ts.m_rd != si->ts.m_wr && (int32_t)(si->ts.markers[si->ts.m_rd].pos - si->ts.rd_pos) <= 0) {
+		si->ts.m_rd = (si->ts.m_rd + 1) % SNIFF_TS_MARKERS;
+	}
+	if (si->ts.m_rd != si->ts.m_wr) {
+		const uint32_t hz = si->clk_tc >= 0 ? sim_clk_hz(si->clk_tc) : 0;
+
+		cycles = si->ts.markers[si->ts.m_rd].cycles;
+		if (hz) {
+			/* Move back from the marker to the end of this byte, knowing the clock: the bytes
+			 * after it in the chunk took at least one character (12 ETU for T=0) each */
+			uint32_t etu = si->ts.markers[si->ts.m_rd].late_etu;
+			etu += 12 * (si->ts.markers[si->ts.m_rd].pos - si->ts.rd_pos - 1);
+			cycles -= (uint64_t) etu * si->ts.markers[si->ts.m_rd].etu_clk * BOARD_MCK / hz;
+		}
+	} else { /* should not happen since the ISR marks the data when writing it */
+		cycles = cycle_counter_get();
+	}
+	si->ts.rd_pos++;
+
+	return cycles;
+}
+
+/*! Discard the data in the ring buffer, together with its reception time */
+static void sniff_buffer_reset(struct sniff_inst *si)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	rbuf_reset(&si->buffer);
+	si->ts.rd_pos = si->ts.wr_pos;
+	si->ts.m_rd = si->ts.m_wr;
+	local_irq_restore(flags);
+}
+
+/*! Extend the 32-bit cycle counter to the epoch
+ *  @note must be called at least once per counter wrap-around (~70 s)
+ */
+static void sniff_ts_update(struct sniff_inst *si)
+{
+	uint32_t now = cycle_counter_get();
+
+	si->ts.now64 += (uint32_t)(now - si->ts.last);
+	si->ts.last = now;
+}
+
+/*! Convert a (recent) cycle counter value to the time since the epoch
+ *  @param[in] cycles cycle counter value, not older than one wrap-around
+ *  @return time in us
+ */
+static uint64_t sniff_ts_us(struct sniff_inst *si, uint32_t cycles)
+{
+	uint64_t c;
+
+	sniff_ts_update(si);
+	c = si->ts.now64 - (uint32_t)(si->ts.last - cycles);
+	/* BOARD_MCK is not a multiple of 1 MHz on all boards */
+	return (c / BOARD_MCK) * 1000000 + ((c % BOARD_MCK) * 1000000) / BOARD_MCK;
+}
+
 /*! Update the ISO 7816-3 state
  *  @param[in] iso_state_new new ISO 7816-3 state to update to
  */
-static void change_state(enum iso7816_3_sniff_state iso_state_new)
+static void change_state(struct sniff_inst *si, enum iso7816_3_sniff_state iso_state_new)
 {
 	/* sanity check */
-	if (iso_state_new == iso_state) {
-		TRACE_WARNING("Already in ISO 7816 state %u\n\r", iso_state);
+	if (iso_state_new == si->iso_state) {
+		TRACE_WARNING("Already in ISO 7816 state %u\n\r", si->iso_state);
 		return;
 	}
 
 	/* handle actions to perform when switching state */
 	switch (iso_state_new) {
 	case ISO7816_S_RESET:
-		update_fidi(&sniff_usart, 0x11); /* reset baud rate to default Di/Fi values */
-		update_wt(10, 1); /* reset WT time-out */
+		update_fidi(&si->usart, 0x11); /* reset baud rate to default Di/Fi values */
+		update_wt(si, 10, 1); /* reset WT time-out */
 		break;
 	case ISO7816_S_WAIT_ATR:
-		rbuf_reset(&sniff_buffer); /* reset buffer for new communication */
+		sniff_buffer_reset(si); /* reset buffer for new communication */
 		break;
 	case ISO7816_S_IN_ATR:
-		atr_i = 0;
-		convention_convert = false;
-		t_protocol_support = 0;
-		atr_state = ATR_S_WAIT_TS;
+		si->record_cycles = si->byte_cycles;
+		si->atr_i = 0;
+		si->convention_convert = false;
+		si->t_protocol_support = 0;
+		si->atr_state = ATR_S_WAIT_TS;
 		break;
 	case ISO7816_S_IN_PPS_REQ:
 	case ISO7816_S_IN_PPS_RSP:
-		pps_state = PPS_S_WAIT_PPSS;
+		si->record_cycles = si->byte_cycles;
+		si->pps_state = PPS_S_WAIT_PPSS;
 		break;
 	case ISO7816_S_WAIT_TPDU:
-		tpdu_state = TPDU_S_CLA;
-		tpdu_packet_i = 0;
+		si->tpdu_state = TPDU_S_CLA;
+		si->tpdu_packet_i = 0;
+		break;
+	case ISO7816_S_IN_TPDU:
+		si->record_cycles = si->byte_cycles;
+		si->hdr_received = false;
+		si->pb_received = false;
 		break;
 	default:
 		break;
 	}
 
 	/* save new state */
-	iso_state = iso_state_new;
-	TRACE_INFO("Changed to ISO 7816-3 state %u\n\r", iso_state);
+	si->iso_state = iso_state_new;
+	TRACE_INFO("Changed to ISO 7816-3 state %u\n\r", si->iso_state);
 }
 
 const struct value_string data_flags[] = {
@@ -318,7 +629,7 @@ static void print_flags(const struct value_string* flag_meanings, uint32_t nb_fl
 	}
 }
 
-static void usb_send_data(enum simtrace_msg_type_sniff type, const uint8_t* data, uint16_t length, uint32_t flags)
+static void usb_send_data(struct sniff_inst *si, enum simtrace_msg_type_sniff type, const uint8_t* data, uint16_t length, uint32_t flags)
 {
 	/* Sanity check */
 	if (type != SIMTRACE_MSGT_SNIFF_ATR && type != SIMTRACE_MSGT_SNIFF_PPS && type != SIMTRACE_MSGT_SNIFF_TPDU) {
@@ -329,6 +640,9 @@ static void usb_send_data(enum simtrace_msg_type_sniff type, const uint8_t* data
 	led_blink(LED_GREEN, BLINK_2F_O);
 
 	/* Print message */
+	if (NUM_SNIFF_INST > 1) {
+		printf("%u: ", si->num);
+	}
 	switch (type) {
 	case SIMTRACE_MSGT_SNIFF_ATR:
 		printf("ATR");
@@ -355,15 +669,49 @@ static void usb_send_data(enum simtrace_msg_type_sniff type, const uint8_t* data
 	}
 	printf("\n\r");
 
-	/* Send data over USB */
-	struct msgb *usb_msg = usb_msg_alloc_hdr(SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, type);
-	if (!usb_msg) {
-		return;
+	/* Send data over USB (with time-stamps only if the host asked for them) */
+	struct msgb *usb_msg;
+	if (sniff_features & SNIFF_FEAT_F_TIMESTAMPS) {
+		switch (type) {
+		case SIMTRACE_MSGT_SNIFF_ATR:
+			type = SIMTRACE_MSGT_SNIFF_ATR_TS;
+			break;
+		case SIMTRACE_MSGT_SNIFF_PPS:
+			type = SIMTRACE_MSGT_SNIFF_PPS_TS;
+			break;
+		default:
+			type = SIMTRACE_MSGT_SNIFF_TPDU_TS;
+			break;
+		}
+		usb_msg = usb_msg_alloc_hdr(si, SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, type);
+		if (!usb_msg) {
+			return;
+		}
+		struct sniff_data_ts *usb_sniff_data_ts = (struct sniff_data_ts *) msgb_put(usb_msg, sizeof(*usb_sniff_data_ts));
+		usb_sniff_data_ts->epoch = si->ts.epoch;
+		/* the last byte processed is the last one of the record */
+		usb_sniff_data_ts->start_us = sniff_ts_us(si, si->record_cycles);
+		usb_sniff_data_ts->end_us = sniff_ts_us(si, si->byte_cycles);
+		usb_sniff_data_ts->hdr_us = 0;
+		usb_sniff_data_ts->pb_us = 0;
+		if (SIMTRACE_MSGT_SNIFF_TPDU_TS == type && si->hdr_received) {
+			usb_sniff_data_ts->hdr_us = sniff_ts_us(si, si->hdr_cycles);
+			if (si->pb_received) {
+				usb_sniff_data_ts->pb_us = sniff_ts_us(si, si->pb_cycles);
+			}
+		}
+		usb_sniff_data_ts->flags = flags;
+		usb_sniff_data_ts->length = length;
+	} else {
+		usb_msg = usb_msg_alloc_hdr(si, SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, type);
+		if (!usb_msg) {
+			return;
+		}
+		struct sniff_data *usb_sniff_data = (struct sniff_data *) msgb_put(usb_msg, sizeof(*usb_sniff_data));
+		usb_sniff_data->flags = flags;
+		usb_sniff_data->length = length;
 	}
-	struct sniff_data *usb_sniff_data = (struct sniff_data *) msgb_put(usb_msg, sizeof(*usb_sniff_data));
-	usb_sniff_data->flags = flags;
-	usb_sniff_data->length = length;
-	uint8_t *sniff_data = msgb_put(usb_msg, usb_sniff_data->length);
+	uint8_t *sniff_data = msgb_put(usb_msg, length);
 	memcpy(sniff_data, data, length);
 	usb_msg_upd_len_and_submit(usb_msg);
 
@@ -373,112 +721,107 @@ static void usb_send_data(enum simtrace_msg_type_sniff type, const uint8_t* data
  *  @param[in] flags SNIFF_DATA_FLAG_ data flags 
  *  @note Also print the ATR to debug console
  */
-static void usb_send_atr(uint32_t flags)
+static void usb_send_atr(struct sniff_inst *si, uint32_t flags)
 {
 	/* Check state */
-	if (ISO7816_S_IN_ATR != iso_state) {
-		TRACE_WARNING("Can't print ATR in ISO 7816-3 state %u\n\r", iso_state);
+	if (ISO7816_S_IN_ATR != si->iso_state) {
+		TRACE_WARNING("Can't print ATR in ISO 7816-3 state %u\n\r", si->iso_state);
 		return;
 	}
-	if (atr_i >= ARRAY_SIZE(atr)) {
+	if (si->atr_i >= ARRAY_SIZE(si->atr)) {
 		TRACE_ERROR("ATR buffer overflow\n\r");
 		return;
 	}
 
 	/* Send ATR over USB */
-	usb_send_data(SIMTRACE_MSGT_SNIFF_ATR, atr, atr_i, flags);
+	usb_send_data(si, SIMTRACE_MSGT_SNIFF_ATR, si->atr, si->atr_i, flags);
 }
 
 /*! Process ATR byte
  *  @param[in] byte ATR byte to process
  */
-static void process_byte_atr(uint8_t byte)
+static void process_byte_atr(struct sniff_inst *si, uint8_t byte)
 {
-	static uint8_t atr_hist_len = 0; /* store the number of expected historical bytes */
-	static uint8_t y = 0; /* last mask of the upcoming TA, TB, TC, TD interface bytes */
-	static uint8_t i = 0; /* interface byte subgroup number */
-	static uint32_t flags = 0; /* error flag */
-
 	/* sanity check */
-	if (ISO7816_S_IN_ATR != iso_state) {
-		TRACE_ERROR("Processing ATR data in wrong ISO 7816-3 state %u\n\r", iso_state);
+	if (ISO7816_S_IN_ATR != si->iso_state) {
+		TRACE_ERROR("Processing ATR data in wrong ISO 7816-3 state %u\n\r", si->iso_state);
 		return;
 	}
-	if (atr_i >= ARRAY_SIZE(atr)) {
+	if (si->atr_i >= ARRAY_SIZE(si->atr)) {
 		TRACE_ERROR("ATR data overflow\n\r");
 		return;
 	}
 
 	/* save data for use by other functions */
-	atr[atr_i++] = byte;
+	si->atr[si->atr_i++] = byte;
 
 	/* handle ATR byte depending on current state */
-	switch (atr_state) {
+	switch (si->atr_state) {
 	case ATR_S_WAIT_TS: /* see ISO/IEC 7816-3:2006 section 8.1 */
-		flags = 0;
+		si->atr_flags = 0;
 		switch (byte) {
 		case 0x23: /* direct convention used, but decoded using inverse convention (a parity error should also have occurred) */
 		case 0x30: /* inverse convention used, but decoded using direct convention (a parity error should also have occurred) */
-			convention_convert = !convention_convert;
+			si->convention_convert = !si->convention_convert;
 		case 0x3b: /* direct convention used and correctly decoded */
 		case 0x3f: /* inverse convention used and correctly decoded */
-			atr_state = ATR_S_WAIT_T0; /* wait for format byte */
+			si->atr_state = ATR_S_WAIT_T0; /* wait for format byte */
 			break;
 		default:
 			TRACE_WARNING("Invalid TS received\n\r");
 			led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-			usb_send_atr(SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
-			change_state(ISO7816_S_WAIT_ATR); /* reset state */
+			usb_send_atr(si, SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
+			change_state(si, ISO7816_S_WAIT_ATR); /* reset state */
 			break;
 		}
-		i = 0; /* first interface byte sub-group is coming (T0 is kind of TD0) */
+		si->atr_ifs_i = 0; /* first interface byte sub-group is coming (T0 is kind of TD0) */
 		break;
 	case ATR_S_WAIT_T0: /* see ISO/IEC 7816-3:2006 section 8.2.2 */
 	case ATR_S_WAIT_TD: /* see ISO/IEC 7816-3:2006 section 8.2.3 */
-		if (ATR_S_WAIT_T0 == atr_state) {
-			atr_hist_len = (byte & 0x0f); /* save the number of historical bytes */
-		} else if (ATR_S_WAIT_TD == atr_state) {
-			t_protocol_support |= (1<<(byte & 0x0f)); /* remember supported protocol to know if TCK will be present */
+		if (ATR_S_WAIT_T0 == si->atr_state) {
+			si->atr_hist_len = (byte & 0x0f); /* save the number of historical bytes */
+		} else if (ATR_S_WAIT_TD == si->atr_state) {
+			si->t_protocol_support |= (1<<(byte & 0x0f)); /* remember supported protocol to know if TCK will be present */
 		}
-		y = (byte & 0xf0); /* remember upcoming interface bytes */
-		i++; /* next interface byte sub-group is coming */
-		if (y & 0x10) {
-			atr_state = ATR_S_WAIT_TA; /* wait for interface byte TA */
+		si->atr_y = (byte & 0xf0); /* remember upcoming interface bytes */
+		si->atr_ifs_i++; /* next interface byte sub-group is coming */
+		if (si->atr_y & 0x10) {
+			si->atr_state = ATR_S_WAIT_TA; /* wait for interface byte TA */
 			break;
 		}
 	case ATR_S_WAIT_TA: /* see ISO/IEC 7816-3:2006 section 8.2.3 */
-		if (y & 0x20) {
-			atr_state = ATR_S_WAIT_TB; /* wait for interface byte TB */
+		if (si->atr_y & 0x20) {
+			si->atr_state = ATR_S_WAIT_TB; /* wait for interface byte TB */
 			break;
 		}
 	case ATR_S_WAIT_TB: /* see ISO/IEC 7816-3:2006 section 8.2.3 */
-		if (y & 0x40) {
-			atr_state = ATR_S_WAIT_TC; /* wait for interface byte TC */
+		if (si->atr_y & 0x40) {
+			si->atr_state = ATR_S_WAIT_TC; /* wait for interface byte TC */
 			break;
 		}
 	case ATR_S_WAIT_TC: /* see ISO/IEC 7816-3:2006 section 8.2.3 */
 		/* retrieve WI encoded in TC2*/
-		if (ATR_S_WAIT_TC==atr_state && 2==i) {
+		if (ATR_S_WAIT_TC==si->atr_state && 2==si->atr_ifs_i) {
 			if (0 == byte) {
-				update_wt(10, 0);
+				update_wt(si, 10, 0);
 			} else {
-				update_wt(byte, 0);
+				update_wt(si, byte, 0);
 			}
 		}
-		if (y & 0x80) {
-			atr_state = ATR_S_WAIT_TD; /* wait for interface byte TD */
+		if (si->atr_y & 0x80) {
+			si->atr_state = ATR_S_WAIT_TD; /* wait for interface byte TD */
 			break;
-		} else if (atr_hist_len) {
-			atr_state = ATR_S_WAIT_HIST; /* wait for historical bytes */
+		} else if (si->atr_hist_len) {
+			si->atr_state = ATR_S_WAIT_HIST; /* wait for historical bytes */
 			break;
 		}
 	case ATR_S_WAIT_HIST: /* see ISO/IEC 7816-3:2006 section 8.2.4 */
-		if (atr_hist_len) {
-			atr_hist_len--;
+		if (si->atr_hist_len) {
+			si->atr_hist_len--;
 		}
-		if (0 == atr_hist_len) {
-			if (t_protocol_support > 1) {
-				atr_state = ATR_S_WAIT_TCK; /* wait for check bytes */
+		if (0 == si->atr_hist_len) {
+			if (si->t_protocol_support > 1) {
+				si->atr_state = ATR_S_WAIT_TCK; /* wait for check bytes */
 				break;
 			}
 		} else {
@@ -486,24 +829,24 @@ static void process_byte_atr(uint8_t byte)
 		}
 	case ATR_S_WAIT_TCK:  /* see ISO/IEC 7816-3:2006 section 8.2.5 */
 		/* verify checksum if present */
-		if (ATR_S_WAIT_TCK == atr_state) {
+		if (ATR_S_WAIT_TCK == si->atr_state) {
 			uint8_t ui;
 			uint8_t checksum = 0;
-			for (ui = 1; ui < atr_i; ui++) {
-				checksum ^= atr[ui];
+			for (ui = 1; ui < si->atr_i; ui++) {
+				checksum ^= si->atr[ui];
 			}
 			if (checksum) {
-				flags |= SNIFF_DATA_FLAG_ERROR_CHECKSUM;
+				si->atr_flags |= SNIFF_DATA_FLAG_ERROR_CHECKSUM;
 				/* We still consider the data as valid (e.g. for WT) even is the checksum is wrong.
 				 * It is up to the reader to handle this error (e.g. by resetting)
 				 */
 			}
 		}
-		usb_send_atr(flags); /* send ATR to host software using USB */
-		change_state(ISO7816_S_WAIT_TPDU); /* go to next state */
+		usb_send_atr(si, si->atr_flags); /* send ATR to host software using USB */
+		change_state(si, ISO7816_S_WAIT_TPDU); /* go to next state */
 		break;
 	default:
-		TRACE_INFO("Unknown ATR state %u\n\r", atr_state);
+		TRACE_INFO("Unknown ATR state %u\n\r", si->atr_state);
 	}
 }
 
@@ -511,53 +854,53 @@ static void process_byte_atr(uint8_t byte)
  *  @param[in] flags SNIFF_DATA_FLAG_ data flags
  *  @note Also print the PPS over the debug console
  */
-static void usb_send_pps(uint32_t flags)
+static void usb_send_pps(struct sniff_inst *si, uint32_t flags)
 {
 	uint8_t *pps_cur; /* current PPS (request or response) */
 
 	/* Sanity check */
-	if (ISO7816_S_IN_PPS_REQ == iso_state) {
-		pps_cur = pps_req;
-	} else if (ISO7816_S_IN_PPS_RSP == iso_state) {
-		pps_cur = pps_rsp;
+	if (ISO7816_S_IN_PPS_REQ == si->iso_state) {
+		pps_cur = si->pps_req;
+	} else if (ISO7816_S_IN_PPS_RSP == si->iso_state) {
+		pps_cur = si->pps_rsp;
 	} else {
-		TRACE_ERROR("Can't print PPS in ISO 7816-3 state %u\n\r", iso_state);
+		TRACE_ERROR("Can't print PPS in ISO 7816-3 state %u\n\r", si->iso_state);
 		return;
 	}
 
 	/* Get only relevant data */
 	uint8_t pps[6];
 	uint8_t pps_i = 0;
-	if (pps_state > PPS_S_WAIT_PPSS) {
+	if (si->pps_state > PPS_S_WAIT_PPSS) {
 		pps[pps_i++] = pps_cur[0];
 	}
-	if (pps_state > PPS_S_WAIT_PPS0) {
+	if (si->pps_state > PPS_S_WAIT_PPS0) {
 		pps[pps_i++] = pps_cur[1];
 	}
-	if (pps_state > PPS_S_WAIT_PPS1 && pps_cur[1] & 0x10) {
+	if (si->pps_state > PPS_S_WAIT_PPS1 && pps_cur[1] & 0x10) {
 		pps[pps_i++] = pps_cur[2];
 	}
-	if (pps_state > PPS_S_WAIT_PPS2 && pps_cur[1] & 0x20) {
+	if (si->pps_state > PPS_S_WAIT_PPS2 && pps_cur[1] & 0x20) {
 		pps[pps_i++] = pps_cur[3];
 	}
-	if (pps_state > PPS_S_WAIT_PPS3 && pps_cur[1] & 0x40) {
+	if (si->pps_state > PPS_S_WAIT_PPS3 && pps_cur[1] & 0x40) {
 		pps[pps_i++] = pps_cur[4];
 	}
-	if (pps_state > PPS_S_WAIT_PCK) {
+	if (si->pps_state > PPS_S_WAIT_PCK) {
 		pps[pps_i++] = pps_cur[5];
 	}
 
 	/* Send message over USB */
-	usb_send_data(SIMTRACE_MSGT_SNIFF_PPS, pps, pps_i, flags);
+	usb_send_data(si, SIMTRACE_MSGT_SNIFF_PPS, pps, pps_i, flags);
 }
 
 /*! Send Fi/Di change over USB
  *  @param[in] fidi Fi/Di factor as encoded in TA1 
  */
-static void usb_send_fidi(uint8_t fidi)
+static void usb_send_fidi(struct sniff_inst *si, uint8_t fidi)
 {
 	/* Send message over USB */
-	struct msgb *usb_msg = usb_msg_alloc_hdr(SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, SIMTRACE_MSGT_SNIFF_FIDI);
+	struct msgb *usb_msg = usb_msg_alloc_hdr(si, SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, SIMTRACE_MSGT_SNIFF_FIDI);
 	if (!usb_msg) {
 		return;
 	}
@@ -566,56 +909,55 @@ static void usb_send_fidi(uint8_t fidi)
 	usb_msg_upd_len_and_submit(usb_msg);
 }
 
-static void process_byte_pps(uint8_t byte)
+static void process_byte_pps(struct sniff_inst *si, uint8_t byte)
 {
 	uint8_t *pps_cur; /* current PPS (request or response) */
-	static uint32_t flags = 0; /* error flag */
 
 	/* sanity check */
-	if (ISO7816_S_IN_PPS_REQ == iso_state) {
-		pps_cur = pps_req;
-	} else if (ISO7816_S_IN_PPS_RSP == iso_state) {
-		pps_cur = pps_rsp;
+	if (ISO7816_S_IN_PPS_REQ == si->iso_state) {
+		pps_cur = si->pps_req;
+	} else if (ISO7816_S_IN_PPS_RSP == si->iso_state) {
+		pps_cur = si->pps_rsp;
 	} else {
-		TRACE_ERROR("Processing PPS data in wrong ISO 7816-3 state %u\n\r", iso_state);
+		TRACE_ERROR("Processing PPS data in wrong ISO 7816-3 state %u\n\r", si->iso_state);
 		return;
 	}
 
 	/* handle PPS byte depending on current state */
-	switch (pps_state) { /* see ISO/IEC 7816-3:2006 section 9.2 */
+	switch (si->pps_state) { /* see ISO/IEC 7816-3:2006 section 9.2 */
 	case PPS_S_WAIT_PPSS: /*!< initial byte */
-		flags = 0;
+		si->pps_flags = 0;
 		if (0xff) {
 			pps_cur[0] = byte;
-			pps_state = PPS_S_WAIT_PPS0; /* go to next state */
+			si->pps_state = PPS_S_WAIT_PPS0; /* go to next state */
 		} else {
 			TRACE_INFO("Invalid PPSS received\n\r");
 			led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-			usb_send_pps(SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
-			change_state(ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
+			usb_send_pps(si, SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
+			change_state(si, ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
 		}
 		break;
 	case PPS_S_WAIT_PPS0: /*!< format byte */
 		pps_cur[1] = byte;
 		if (pps_cur[1] & 0x10) {
-			pps_state = PPS_S_WAIT_PPS1; /* go to next state */
+			si->pps_state = PPS_S_WAIT_PPS1; /* go to next state */
 			break;
 		}
 	case PPS_S_WAIT_PPS1: /*!< first parameter byte */
 		pps_cur[2] = byte; /* not always right but doesn't affect the process */
 		if (pps_cur[1] & 0x20) {
-			pps_state = PPS_S_WAIT_PPS2; /* go to next state */
+			si->pps_state = PPS_S_WAIT_PPS2; /* go to next state */
 			break;
 		}
 	case PPS_S_WAIT_PPS2: /*!< second parameter byte */
 		pps_cur[3] = byte; /* not always right but doesn't affect the process */
 		if (pps_cur[1] & 0x40) {
-			pps_state = PPS_S_WAIT_PPS3; /* go to next state */
+			si->pps_state = PPS_S_WAIT_PPS3; /* go to next state */
 			break;
 		}
 	case PPS_S_WAIT_PPS3: /*!< third parameter byte */
 		pps_cur[4] = byte; /* not always right but doesn't affect the process */
-		pps_state = PPS_S_WAIT_PCK; /* go to next state */
+		si->pps_state = PPS_S_WAIT_PCK; /* go to next state */
 		break;
 	case PPS_S_WAIT_PCK: /*!< check byte */
 		pps_cur[5] = byte; /* not always right but doesn't affect the process */
@@ -634,17 +976,17 @@ static void process_byte_pps(uint8_t byte)
 		}
 		check ^= pps_cur[5];
 		if (check) {
-			flags |= SNIFF_DATA_FLAG_ERROR_CHECKSUM;
+			si->pps_flags |= SNIFF_DATA_FLAG_ERROR_CHECKSUM;
 		}
-		pps_state = PPS_S_WAIT_END;
-		usb_send_pps(flags); /* send PPS to host software using USB */
-		if (ISO7816_S_IN_PPS_REQ == iso_state) {
+		si->pps_state = PPS_S_WAIT_END;
+		usb_send_pps(si, si->pps_flags); /* send PPS to host software using USB */
+		if (ISO7816_S_IN_PPS_REQ == si->iso_state) {
 			if (0 == check) { /* checksum is valid */
-				change_state(ISO7816_S_WAIT_PPS_RSP); /* go to next state */
+				change_state(si, ISO7816_S_WAIT_PPS_RSP); /* go to next state */
 			} else { /* checksum is invalid */
-				change_state(ISO7816_S_WAIT_TPDU); /* go to next state */
+				change_state(si, ISO7816_S_WAIT_TPDU); /* go to next state */
 			}
-		} else if (ISO7816_S_IN_PPS_RSP == iso_state) {
+		} else if (ISO7816_S_IN_PPS_RSP == si->iso_state) {
 			if (0 == check) { /* checksum is valid */
 				uint8_t fn, dn;
 				if (pps_cur[1] & 0x10) {
@@ -656,20 +998,20 @@ static void process_byte_pps(uint8_t byte)
 				}
 				TRACE_INFO("PPS negotiation successful: Fn=%u Dn=%u\n\r",
 					   iso7816_3_fi_table[fn], iso7816_3_di_table[dn]);
-				update_fidi(&sniff_usart, pps_cur[2]);
-				update_wt(0, iso7816_3_di_table[dn]);
-				usb_send_fidi(pps_cur[2]); /* send Fi/Di change notification to host software over USB */
+				update_fidi(&si->usart, pps_cur[2]);
+				update_wt(si, 0, iso7816_3_di_table[dn]);
+				usb_send_fidi(si, pps_cur[2]); /* send Fi/Di change notification to host software over USB */
 			} else { /* checksum is invalid */
 				TRACE_INFO("PPS negotiation failed\n\r");
 			}
-			change_state(ISO7816_S_WAIT_TPDU); /* go to next state */
+			change_state(si, ISO7816_S_WAIT_TPDU); /* go to next state */
 		}
 		break;
 	case PPS_S_WAIT_END:
-		TRACE_WARNING("Unexpected PPS received %u\n\r", pps_state);
+		TRACE_WARNING("Unexpected PPS received %u\n\r", si->pps_state);
 		break;
 	default:
-		TRACE_WARNING("Unknown PPS state %u\n\r", pps_state);
+		TRACE_WARNING("Unknown PPS state %u\n\r", si->pps_state);
 		break;
 	}
 }
@@ -678,171 +1020,273 @@ static void process_byte_pps(uint8_t byte)
  *  @param[in] flags SNIFF_DATA_FLAG_ data flags
  *  @note Also print the TPDU over the debug console
  */
-static void usb_send_tpdu(uint32_t flags)
+static void usb_send_tpdu(struct sniff_inst *si, uint32_t flags)
 {
 	/* Check state */
-	if (ISO7816_S_IN_TPDU != iso_state) {
-		TRACE_WARNING("Can't print TPDU in ISO 7816-3 state %u\n\r", iso_state);
+	if (ISO7816_S_IN_TPDU != si->iso_state) {
+		TRACE_WARNING("Can't print TPDU in ISO 7816-3 state %u\n\r", si->iso_state);
 		return;
 	}
 
 	/* Send ATR over USB */
-	usb_send_data(SIMTRACE_MSGT_SNIFF_TPDU, tpdu_packet, tpdu_packet_i, flags);
+	usb_send_data(si, SIMTRACE_MSGT_SNIFF_TPDU, si->tpdu_packet, si->tpdu_packet_i, flags);
 }
 
-static void process_byte_tpdu(uint8_t byte)
+static void process_byte_tpdu(struct sniff_inst *si, uint8_t byte)
 {
 	/* sanity check */
-	if (ISO7816_S_IN_TPDU != iso_state) {
-		TRACE_ERROR("Processing TPDU data in wrong ISO 7816-3 state %u\n\r", iso_state);
+	if (ISO7816_S_IN_TPDU != si->iso_state) {
+		TRACE_ERROR("Processing TPDU data in wrong ISO 7816-3 state %u\n\r", si->iso_state);
 		return;
 	}
-	if (tpdu_packet_i >= ARRAY_SIZE(tpdu_packet)) {
+	if (si->tpdu_packet_i >= ARRAY_SIZE(si->tpdu_packet)) {
 		TRACE_ERROR("TPDU data overflow\n\r");
 		return;
 	}
 
 	/* handle TPDU byte depending on current state */
-	switch (tpdu_state) {
+	switch (si->tpdu_state) {
 	case TPDU_S_CLA:
 		if (0xff == byte) {
 			TRACE_WARNING("0xff is not a valid class byte\n\r");
 			led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-			usb_send_tpdu(SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
-			change_state(ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
+			usb_send_tpdu(si, SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
+			change_state(si, ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
 			return;
 		}
-		tpdu_packet_i = 0;
-		tpdu_packet[tpdu_packet_i++] = byte;
-		tpdu_state = TPDU_S_INS;
+		si->tpdu_packet_i = 0;
+		si->tpdu_packet[si->tpdu_packet_i++] = byte;
+		si->tpdu_state = TPDU_S_INS;
 		break;
 	case TPDU_S_INS:
 		if ((0x60 == (byte & 0xf0)) || (0x90 == (byte & 0xf0))) {
 			TRACE_WARNING("invalid CLA 0x%02x\n\r", byte);
 			led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-			usb_send_tpdu(SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
-			change_state(ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
+			usb_send_tpdu(si, SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
+			change_state(si, ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
 			return;
 		}
-		tpdu_packet_i = 1;
-		tpdu_packet[tpdu_packet_i++] = byte;
-		tpdu_state = TPDU_S_P1;
+		si->tpdu_packet_i = 1;
+		si->tpdu_packet[si->tpdu_packet_i++] = byte;
+		si->tpdu_state = TPDU_S_P1;
 		break;
 	case TPDU_S_P1:
-		tpdu_packet_i = 2;
-		tpdu_packet[tpdu_packet_i++] = byte;
-		tpdu_state = TPDU_S_P2;
+		si->tpdu_packet_i = 2;
+		si->tpdu_packet[si->tpdu_packet_i++] = byte;
+		si->tpdu_state = TPDU_S_P2;
 		break;
 	case TPDU_S_P2:
-		tpdu_packet_i = 3;
-		tpdu_packet[tpdu_packet_i++] = byte;
-		tpdu_state = TPDU_S_P3;
+		si->tpdu_packet_i = 3;
+		si->tpdu_packet[si->tpdu_packet_i++] = byte;
+		si->tpdu_state = TPDU_S_P3;
 		break;
 	case TPDU_S_P3:
-		tpdu_packet_i = 4;
-		tpdu_packet[tpdu_packet_i++] = byte;
-		tpdu_state = TPDU_S_PROCEDURE;
+		si->tpdu_packet_i = 4;
+		si->tpdu_packet[si->tpdu_packet_i++] = byte;
+		si->tpdu_state = TPDU_S_PROCEDURE;
+		si->hdr_cycles = si->byte_cycles;
+		si->hdr_received = true;
 		break;
 	case TPDU_S_PROCEDURE:
+		/* the first reaction of the card to the command header (NULL byte included) */
+		if (!si->pb_received) {
+			si->pb_cycles = si->byte_cycles;
+			si->pb_received = true;
+		}
 		if (0x60 == byte) { /* wait for next procedure byte */
 			break;
-		} else if (tpdu_packet[1] == byte) { /* get all remaining data bytes */
-			tpdu_state = TPDU_S_DATA_REMAINING;
+		} else if (si->tpdu_packet[1] == byte) { /* get all remaining data bytes */
+			si->tpdu_state = TPDU_S_DATA_REMAINING;
 			break;
-		} else if ((~tpdu_packet[1]) == byte) { /* get single data byte */
-			tpdu_state = TPDU_S_DATA_SINGLE;
+		} else if ((~si->tpdu_packet[1]) == byte) { /* get single data byte */
+			si->tpdu_state = TPDU_S_DATA_SINGLE;
 			break;
 		}
 	case TPDU_S_SW1:
 		if ((0x60 == (byte & 0xf0)) || (0x90 == (byte & 0xf0))) { /* this procedure byte is SW1 */
-			tpdu_packet[tpdu_packet_i++] = byte;
-			tpdu_state = TPDU_S_SW2;
+			si->tpdu_packet[si->tpdu_packet_i++] = byte;
+			si->tpdu_state = TPDU_S_SW2;
 		} else {
 			TRACE_WARNING("invalid SW1 0x%02x\n\r", byte);
 			led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-			usb_send_tpdu(SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
-			change_state(ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
+			usb_send_tpdu(si, SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send ATR to host software using USB */
+			change_state(si, ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
 			return;
 		}
 		break;
 	case TPDU_S_SW2:
-		tpdu_packet[tpdu_packet_i++] = byte;
-		usb_send_tpdu(0); /* send TPDU to host software using USB */
-		change_state(ISO7816_S_WAIT_TPDU); /* this is the end of the TPDU */
+		si->tpdu_packet[si->tpdu_packet_i++] = byte;
+		usb_send_tpdu(si, 0); /* send TPDU to host software using USB */
+		change_state(si, ISO7816_S_WAIT_TPDU); /* this is the end of the TPDU */
 		break;
 	case TPDU_S_DATA_SINGLE:
 	case TPDU_S_DATA_REMAINING:
-		tpdu_packet[tpdu_packet_i++] = byte;
-		if (0 == tpdu_packet[4]) {
-			if (5+256 <= tpdu_packet_i) {
-				tpdu_state = TPDU_S_PROCEDURE;
+		si->tpdu_packet[si->tpdu_packet_i++] = byte;
+		if (0 == si->tpdu_packet[4]) {
+			if (5+256 <= si->tpdu_packet_i) {
+				si->tpdu_state = TPDU_S_PROCEDURE;
 			}
 		} else {
-			if (5+tpdu_packet[4] <= tpdu_packet_i) {
-				tpdu_state = TPDU_S_PROCEDURE;
+			if (5+si->tpdu_packet[4] <= si->tpdu_packet_i) {
+				si->tpdu_state = TPDU_S_PROCEDURE;
 			}
 		}
-		if (TPDU_S_DATA_SINGLE == tpdu_state) {
-			tpdu_state = TPDU_S_PROCEDURE;
+		if (TPDU_S_DATA_SINGLE == si->tpdu_state) {
+			si->tpdu_state = TPDU_S_PROCEDURE;
 		}
 		break;
 	default:
-		TRACE_ERROR("unhandled TPDU state %u\n\r", tpdu_state);
+		TRACE_ERROR("unhandled TPDU state %u\n\r", si->tpdu_state);
 	}
 }
 
+#if SNIFFER_RX_PDC
+/*! Hand received bytes over to the main loop
+ *  @param[in] data received data
+ *  @param[in] len number of received bytes
+ *  @return number of bytes written into the ring buffer (to be marked by the caller)
+ */
+static uint16_t sniff_pdc_push(struct sniff_inst *si, const uint8_t *data, uint16_t len)
+{
+	uint16_t written = rbuf_write_buf(&si->buffer, data, len);
+
+	if (written < len) {
+		TRACE_ERROR("USART buffer full\n\r");
+	}
+	return written;
+}
+
+/*! Handle the current PDC buffer being full
+ *  @return number of bytes written into the ring buffer (to be marked by the caller)
+ *  @note the PDC already switched to the next buffer, the completed one is queued again as next buffer
+ */
+static uint16_t sniff_pdc_rx_complete(struct sniff_inst *si)
+{
+	uint8_t *buf = si->pdc_buf[si->pdc_cur];
+	uint16_t written;
+
+	written = sniff_pdc_push(si, buf + si->pdc_rd, SNIFF_PDC_BUF_LEN - si->pdc_rd);
+	/* re-queue the buffer (this also clears ENDRX) */
+	si->usart.base->US_RNPR = (uint32_t) buf;
+	si->usart.base->US_RNCR = SNIFF_PDC_BUF_LEN;
+	si->pdc_cur ^= 1;
+	si->pdc_rd = 0;
+
+	return written;
+}
+
+/*! Flush the bytes received so far (including the partially filled PDC buffer)
+ *  @return number of bytes flushed
+ *  @note to be called on the receiver time-out, which elapsed since the last byte
+ */
+static uint16_t sniff_pdc_flush(struct sniff_inst *si)
+{
+	uint16_t flushed = 0;
+	uint16_t written = 0;
+	uint16_t received;
+
+	/* a completed buffer has to be handled first, else US_RCR refers to the next one */
+	if (si->usart.base->US_CSR & US_CSR_ENDRX) {
+		flushed += SNIFF_PDC_BUF_LEN - si->pdc_rd;
+		written += sniff_pdc_rx_complete(si);
+	}
+	received = SNIFF_PDC_BUF_LEN - si->usart.base->US_RCR;
+	if (received > si->pdc_rd) {
+		written += sniff_pdc_push(si, si->pdc_buf[si->pdc_cur] + si->pdc_rd, received - si->pdc_rd);
+		flushed += received - si->pdc_rd;
+		si->pdc_rd = received;
+	}
+	sniff_ts_mark(si, written, si->usart.base->US_RTOR & 0xffff);
+
+	return flushed;
+}
+
+/*! Start receiving using the PDC (double buffered) */
+static void sniff_pdc_start(struct sniff_inst *si)
+{
+	Usart *usart = si->usart.base;
+
+	usart->US_PTCR = US_PTCR_RXTDIS;
+	si->pdc_cur = 0;
+	si->pdc_rd = 0;
+	usart->US_RPR = (uint32_t) si->pdc_buf[0];
+	usart->US_RCR = SNIFF_PDC_BUF_LEN;
+	usart->US_RNPR = (uint32_t) si->pdc_buf[1];
+	usart->US_RNCR = SNIFF_PDC_BUF_LEN;
+	usart->US_PTCR = US_PTCR_RXTEN;
+}
+#endif /* SNIFFER_RX_PDC */
+
 /*! Interrupt Service Routine called on USART activity */
-void Sniffer_usart_isr(void)
+static __ramfunc void sniff_usart_isr(struct sniff_inst *si)
 {
-	/* Remaining Waiting Time (WI) counter (>16 bits) */
-	static volatile uint32_t wt_remaining = 9600;
+	/* Maximum value for the receiver time-out */
+	uint32_t rtor_max = 0xffff;
 
 	/* Read channel status register */
-	uint32_t csr = sniff_usart.base->US_CSR;
+	uint32_t csr = si->usart.base->US_CSR;
 	/* Verify if there was an error */
 	if (csr & US_CSR_OVRE) {
 		TRACE_WARNING("USART overrun error\n\r");
-		sniff_usart.base->US_CR |= US_CR_RSTSTA;
+		si->usart.base->US_CR |= US_CR_RSTSTA;
 	}
 	if (csr & US_CSR_FRAME) {
 		TRACE_WARNING("USART framing error\n\r");
-		sniff_usart.base->US_CR |= US_CR_RSTSTA;
+		si->usart.base->US_CR |= US_CR_RSTSTA;
 	}
 
+#if SNIFFER_RX_PDC
+	/* Verify if a PDC buffer is full */
+	if (csr & US_CSR_ENDRX) {
+		/* Reset WT timer */
+		si->wt_remaining = si->wt;
+		sniff_ts_mark(si, sniff_pdc_rx_complete(si), 0);
+	}
+	/* Partially filled buffers are flushed on the receiver time-out */
+	rtor_max = SNIFF_PDC_FLUSH_ETU;
+#else
 	/* Verify if character has been received */
 	if (csr & US_CSR_RXRDY) {
 		/* Read communication data byte between phone and SIM */
-		uint8_t byte = sniff_usart.base->US_RHR;
+		uint8_t byte = si->usart.base->US_RHR;
 		/* Reset WT timer */
-		wt_remaining = wt;
+		si->wt_remaining = si->wt;
 		/* Store sniffed data into buffer (also clear interrupt */
-		if (rbuf_is_full(&sniff_buffer)) {
+		if (rbuf_is_full(&si->buffer)) {
 			TRACE_ERROR("USART buffer full\n\r");
 		} else {
-			rbuf_write(&sniff_buffer, byte);
+			rbuf_write(&si->buffer, byte);
+			sniff_ts_mark(si, 1, 0);
 		}
 	}
+#endif
 
 	/* Verify it WT timeout occurred, to detect unresponsive card */
 	if (csr & US_CSR_TIMEOUT) {
-		if (wt_remaining <= (sniff_usart.base->US_RTOR & 0xffff)) {
+#if SNIFFER_RX_PDC
+		/* Data received since the last time-out restarts WT (the time-out counter itself is reloaded by each character) */
+		if (sniff_pdc_flush(si)) {
+			si->wt_remaining = si->wt;
+		}
+#endif
+		if (si->wt_remaining <= (si->usart.base->US_RTOR & 0xffff)) {
 			/* Just set the flag and let the main loop handle it */
-			change_flags |= SNIFF_CHANGE_FLAG_TIMEOUT_WT;
+			si->change_flags |= SNIFF_CHANGE_FLAG_TIMEOUT_WT;
 			/* Reset timeout value */
-			wt_remaining = wt;
+			si->wt_remaining = si->wt;
 		} else {
-			wt_remaining -= (sniff_usart.base->US_RTOR & 0xffff); /* be sure to subtract the actual timeout since the new might not have been set and reloaded yet */
+			si->wt_remaining -= (si->usart.base->US_RTOR & 0xffff); /* be sure to subtract the actual timeout since the new might not have been set and reloaded yet */
 		}
-		if (wt_remaining > 0xffff) {
-			sniff_usart.base->US_RTOR = 0xffff;
+		if (si->wt_remaining > rtor_max) {
+			si->usart.base->US_RTOR = rtor_max;
 		} else {
-			sniff_usart.base->US_RTOR = wt_remaining;
+			si->usart.base->US_RTOR = si->wt_remaining;
 		}
 		/* Stop timeout until next character is received (and clears the timeout flag) */
-		sniff_usart.base->US_CR |= US_CR_STTTO;
-		if (!(change_flags & SNIFF_CHANGE_FLAG_TIMEOUT_WT)) {
+		si->usart.base->US_CR |= US_CR_STTTO;
+		if (!(si->change_flags & SNIFF_CHANGE_FLAG_TIMEOUT_WT)) {
 			/* Immediately restart the counter it the WT timeout did not occur (needs the timeout flag to be cleared) */
-			sniff_usart.base->US_CR |= US_CR_RETTO;
+			si->usart.base->US_CR |= US_CR_RETTO;
 		}
 	}
 }
@@ -851,17 +1295,44 @@ void Sniffer_usart_isr(void)
  */
 static void Sniffer_reset_isr(const Pin* pPin)
 {
+	struct sniff_inst *si = NULL;
+	unsigned int i;
+
 	/* Ensure an edge on the reset pin cause the interrupt */
-	if (pPin->id != pin_rst.id || 0 == (pPin->mask & pin_rst.mask)) {
+	for (i = 0; i < ARRAY_SIZE(sniff_inst); i++) {
+		if (pPin->id == sniff_inst[i].pin_rst.id && (pPin->mask & sniff_inst[i].pin_rst.mask)) {
+			si = &sniff_inst[i];
+			break;
+		}
+	}
+	if (!si) {
 		TRACE_ERROR("Pin other than reset caused a interrupt\n\r");
 		return;
 	}
 	/* Update the ISO state according to the reset change (reset is active low) */
-	if (PIO_Get(&pin_rst)) {
-		change_flags |= SNIFF_CHANGE_FLAG_RESET_DEASSERT; /* set flag and let main loop send it */
+	if (PIO_Get(&si->pin_rst)) {
+		si->change_flags |= SNIFF_CHANGE_FLAG_RESET_DEASSERT; /* set flag and let main loop send it */
 	} else {
-		change_flags |= SNIFF_CHANGE_FLAG_RESET_ASSERT; /* set flag and let main loop send it */
+		si->change_flags |= SNIFF_CHANGE_FLAG_RESET_ASSERT; /* set flag and let main loop send it */
 	}
+	main_event_set(MAIN_EV_PIO);
+}
+
+/*! Find the sniffer instance using a USART peripheral
+ *  @param[in] id USART peripheral ID
+ *  @return sniffer instance, or NULL if the USART is not used for sniffing
+ */
+static struct sniff_inst *sniff_inst_by_usart(uint32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(sniff_inst); i++) {
+		if (id == sniff_inst[i].usart.id) {
+			return &sniff_inst[i];
+		}
+	}
+
+	return NULL;
 }
 
 /*------------------------------------------------------------------------------
@@ -870,15 +1341,19 @@ static void Sniffer_reset_isr(const Pin* pPin)
 
 void Sniffer_usart1_irq(void)
 {
-	if (ID_USART1 == sniff_usart.id) {
-		Sniffer_usart_isr();
+	struct sniff_inst *si = sniff_inst_by_usart(ID_USART1);
+
+	if (si) {
+		sniff_usart_isr(si);
 	}
 }
 
 void Sniffer_usart0_irq(void)
 {
-	if (ID_USART0 == sniff_usart.id) {
-		Sniffer_usart_isr();
+	struct sniff_inst *si = sniff_inst_by_usart(ID_USART0);
+
+	if (si) {
+		sniff_usart_isr(si);
 	}
 }
 
@@ -895,62 +1370,115 @@ void Sniffer_configure(void)
 /* called when *different* configuration is set by host */
 void Sniffer_exit(void)
 {
+	unsigned int i;
+
 	TRACE_INFO("Sniffer exit\n\r");
-	/* Disable USART */
-	USART_DisableIt(sniff_usart.base, US_IER_RXRDY);
-	/* NOTE: don't forget to set the IRQ according to the USART peripheral used */
-	NVIC_DisableIRQ(IRQ_USART_SIM);
-	USART_SetReceiverEnabled(sniff_usart.base, 0);
-	/* Disable RST IRQ */
-	PIO_DisableIt(&pin_rst);
-	NVIC_DisableIRQ(PIOA_IRQn); /* CAUTION this needs to match to the correct port */
+	for (i = 0; i < ARRAY_SIZE(sniff_inst); i++) {
+		struct sniff_inst *si = &sniff_inst[i];
+		/* Disable USART */
+		USART_DisableIt(si->usart.base, US_IER_RXRDY | US_IER_ENDRX | US_IER_TIMEOUT);
+		si->usart.base->US_PTCR = US_PTCR_RXTDIS;
+		NVIC_DisableIRQ(si->usart_irq);
+		USART_SetReceiverEnabled(si->usart.base, 0);
+		/* Disable RST IRQ */
+		PIO_DisableIt(&si->pin_rst);
+		/* the peripheral ID of the PIO controller is also its interrupt number */
+		NVIC_DisableIRQ((IRQn_Type) si->pin_rst.id);
+		/* Stop measuring the clock */
+		if (si->clk_tc >= 0) {
+			sim_clk_exit(si->clk_tc);
+		}
+	}
 }
 
-/* called when *Sniffer* configuration is set by host */
-void Sniffer_init(void)
+/*! Start sniffing on one link
+ *  @param[in] si sniffer instance
+ */
+static void sniff_inst_init(struct sniff_inst *si)
 {
-	TRACE_INFO("Sniffer Init\n\r");
-
 	/* Configure pins to sniff communication between phone and card */
-	PIO_Configure(pins_sniff, PIO_LISTSIZE(pins_sniff));
+	PIO_Configure(si->pins_sniff, si->pins_sniff_num);
 	/* Configure pins to connect phone to card */
-	PIO_Configure(pins_bus, PIO_LISTSIZE(pins_bus));
+	if (si->pins_bus_num) {
+		PIO_Configure(si->pins_bus, si->pins_bus_num);
+	}
 	/* Configure pins to forward phone power to card */
-	PIO_Configure(pins_power, PIO_LISTSIZE(pins_power));
-	/* Enable interrupts on port with reset line */
-	NVIC_EnableIRQ(PIOA_IRQn); /* CAUTION this needs to match to the correct port */
+	if (si->pins_power_num) {
+		PIO_Configure(si->pins_power, si->pins_power_num);
+	}
+	/* Enable interrupts on port with reset line (the PIO peripheral ID is also its interrupt number) */
+	NVIC_EnableIRQ((IRQn_Type) si->pin_rst.id);
 	/* Register ISR to handle card reset change */
-	PIO_ConfigureIt(&pin_rst, &Sniffer_reset_isr);
+	PIO_ConfigureIt(&si->pin_rst, &Sniffer_reset_isr);
 	/* Enable interrupt on card reset pin */
-	PIO_EnableIt(&pin_rst);
-
+	PIO_EnableIt(&si->pin_rst);
+
+	/* Start a new time base for the time-stamps */
+	cycle_counter_init();
+	si->ts.epoch++;
+	si->ts.last = cycle_counter_get();
+	si->ts.now64 = 0;
+	/* Measure the clock in the background, to time-stamp with and report it */
+#ifdef PIN_SIM_CLK_INPUT
+	if (si->clk_tc >= 0) {
+		PIO_Configure(&pin_clk_input, 1);
+		sim_clk_init(si->clk_tc);
+	}
+#endif
+	si->clk_hz_sent = 0;
+	si->clk_stopped_sent = false;
 	/* Clear ring buffer containing the sniffed data */
-	rbuf_reset(&sniff_buffer);
+	sniff_buffer_reset(si);
+	si->wt_remaining = si->wt;
 	/* Configure USART to as ISO-7816 slave communication to sniff communication */
-	ISO7816_Init(&sniff_usart, CLK_SLAVE);
+	ISO7816_Init(&si->usart, CLK_SLAVE);
 	/* Only receive data when sniffing */
-	USART_SetReceiverEnabled(sniff_usart.base, 1);
+	USART_SetReceiverEnabled(si->usart.base, 1);
+#if SNIFFER_RX_PDC
+	/* Enable Receiver time-out to flush partially received data and detect waiting time (WT) time-out */
+	si->usart.base->US_RTOR = SNIFF_PDC_FLUSH_ETU;
+	/* Let the PDC receive the data */
+	sniff_pdc_start(si);
+	/* Enable interrupt to indicate when a buffer is full or timeout occurred */
+	USART_EnableIt(si->usart.base, US_IER_ENDRX | US_IER_TIMEOUT);
+#else
 	/* Enable Receiver time-out to detect waiting time (WT) time-out (e.g. unresponsive cards) */
-	sniff_usart.base->US_RTOR = wt;
+	si->usart.base->US_RTOR = si->wt;
 	/* Enable interrupt to indicate when data has been received or timeout occurred */
-	USART_EnableIt(sniff_usart.base, US_IER_RXRDY | US_IER_TIMEOUT);
+	USART_EnableIt(si->usart.base, US_IER_RXRDY | US_IER_TIMEOUT);
+#endif
 	/* Set USB priority lower than USART to not miss sniffing data (both at 0 per default) */
-	if (NVIC_GetPriority(IRQ_USART_SIM) >= NVIC_GetPriority(UDP_IRQn)) {
-		NVIC_SetPriority(UDP_IRQn, NVIC_GetPriority(IRQ_USART_SIM) + 2);
+	if (NVIC_GetPriority(si->usart_irq) >= NVIC_GetPriority(UDP_IRQn)) {
+		NVIC_SetPriority(UDP_IRQn, NVIC_GetPriority(si->usart_irq) + 2);
 	}
 	/* Enable interrupt requests for the USART peripheral */
-	NVIC_EnableIRQ(IRQ_USART_SIM);
+	NVIC_EnableIRQ(si->usart_irq);
 
 	/* Reset state */
-	if (ISO7816_S_RESET != iso_state) {
-		change_state(ISO7816_S_RESET);
+	if (ISO7816_S_RESET != si->iso_state) {
+		change_state(si, ISO7816_S_RESET);
 	}
 }
 
+/* called when *Sniffer* configuration is set by host */
+void Sniffer_init(void)
+{
+	unsigned int i;
+
+	TRACE_INFO("Sniffer Init (%u link%s)\n\r", NUM_SNIFF_INST, NUM_SNIFF_INST > 1 ? "s" : "");
+	/* The host has to enable the features again */
+	sniff_features = 0;
+	for (i = 0; i < ARRAY_SIZE(sniff_inst); i++) {
+		sniff_inst_init(&sniff_inst[i]);
+	}
+	/* Relate the cycle counter (the time base of the time-stamps) to the USB start-of-frames */
+	timesync_init();
+}
+
 /*! Send card change flags over USB
  *  @param[in] flags change flags corresponding to SIMTRACE_MSGT_SNIFF_CHANGE 
  */
-static void usb_send_change(uint32_t flags)
+static void usb_send_change(struct sniff_inst *si, uint32_t flags)
 {
 	/* Check flags */
 	if(0 == flags) { /* no changes */
@@ -962,7 +1490,7 @@ static void usb_send_change(uint32_t flags)
 	}
 
 	/* Send message over USB */
-	struct msgb *usb_msg = usb_msg_alloc_hdr(SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, SIMTRACE_MSGT_SNIFF_CHANGE);
+	struct msgb *usb_msg = usb_msg_alloc_hdr(si, SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, SIMTRACE_MSGT_SNIFF_CHANGE);
 	if (!usb_msg) {
 		return;
 	}
@@ -971,126 +1499,283 @@ static void usb_send_change(uint32_t flags)
 	usb_msg_upd_len_and_submit(usb_msg);
 }
 
-/* Main (idle/busy) loop of this USB configuration */
-void Sniffer_run(void)
+/*! Send the SIM clock frequency over USB when it is first measured, changes or stops
+ *  @param[in] si sniffer instance
+ */
+static void usb_send_clk(struct sniff_inst *si)
 {
-	/* Handle USB queue */
-	/* first try to send any pending messages on INT */
-	usb_refill_to_host(SIMTRACE_USB_EP_CARD_INT);
-	/* then try to send any pending messages on IN */
-	usb_refill_to_host(SIMTRACE_USB_EP_CARD_DATAIN);
-	/* ensure we can handle incoming USB messages from the host */
-	/* currently we don't need any incoming data
-	usb_refill_from_host(SIMTRACE_USB_EP_CARD_DATAOUT);
-	struct llist_head *queue = usb_get_queue(SIMTRACE_USB_EP_CARD_DATAOUT);
-	process_any_usb_commands(queue);
-	*/
+	uint32_t hz, diff;
+	bool stopped;
 
-	/* WARNING: the signal data and flags are not synchronized. We have to hope 
-	 * the processing is fast enough to not land in the wrong state while data
-	 * is remaining
-	 */
-	/* Handle sniffed data */
-	if (!rbuf_is_empty(&sniff_buffer)) { /* use if instead of while to let the main loop restart the watchdog */
-		uint8_t byte = rbuf_read(&sniff_buffer);
-		/* Convert convention if required */
-		if (convention_convert) {
-			byte = convention_convert_lut[byte];
+	if (si->clk_tc < 0) {
+		return;
+	}
+	hz = sim_clk_hz(si->clk_tc);
+	stopped = sim_clk_stopped(si->clk_tc);
+	diff = hz > si->clk_hz_sent ? hz - si->clk_hz_sent : si->clk_hz_sent - hz;
+	/* ignore the jitter of the measurement (below 1%) */
+	if (stopped == si->clk_stopped_sent && diff <= si->clk_hz_sent / 100) {
+		return;
+	}
+
+	struct msgb *usb_msg = usb_msg_alloc_hdr(si, SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, SIMTRACE_MSGT_SNIFF_CLK);
+	if (!usb_msg) {
+		return;
+	}
+	struct sniff_clk *usb_sniff_clk = (struct sniff_clk *) msgb_put(usb_msg, sizeof(*usb_sniff_clk));
+	usb_sniff_clk->flags = stopped ? SNIFF_CLK_F_STOPPED : 0;
+	usb_sniff_clk->hz = hz;
+	usb_msg_upd_len_and_submit(usb_msg);
+
+	si->clk_hz_sent = hz;
+	si->clk_stopped_sent = stopped;
+}
+
+/*! Send the sniffer configuration over USB
+ *  @param[in] si sniffer instance the request was addressed to
+ */
+static void usb_send_config(struct sniff_inst *si)
+{
+	struct msgb *usb_msg = usb_msg_alloc_hdr(si, SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, SIMTRACE_MSGT_SNIFF_CONFIG);
+	if (!usb_msg) {
+		return;
+	}
+	struct sniff_config *usb_sniff_config = (struct sniff_config *) msgb_put(usb_msg, sizeof(*usb_sniff_config));
+	usb_sniff_config->features = sniff_features;
+	usb_msg_upd_len_and_submit(usb_msg);
+}
+
+/*! Handle a single command from the host
+ *  @param[in] hdr message header, followed by the payload (msg_len bytes in total)
+ */
+static void dispatch_usb_command(const struct simtrace_msg_hdr *hdr)
+{
+	struct sniff_inst *si = &sniff_inst[hdr->slot_nr < ARRAY_SIZE(sniff_inst) ? hdr->slot_nr : 0];
+
+	if (SIMTRACE_MSGC_GENERIC == hdr->msg_class && SIMTRACE_CMD_BD_TIMESYNC == hdr->msg_type) {
+		/* return the latest latched USB start-of-frames, to relate the time-stamps to other devices and the host */
+		struct msgb *usb_msg = usb_msg_alloc_hdr(si, SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_TIMESYNC);
+		if (!usb_msg) {
+			return;
 		}
-		//TRACE_ERROR_WP(">%02x", byte);
-		switch (iso_state) { /* Handle byte depending on state */
-		case ISO7816_S_RESET: /* During reset we shouldn't receive any data */
-			break;
-		case ISO7816_S_WAIT_ATR: /* After a reset we expect the ATR */
-			change_state(ISO7816_S_IN_ATR); /* go to next state */
-		case ISO7816_S_IN_ATR: /* More ATR data incoming */
-			process_byte_atr(byte);
+		timesync_dump(usb_msg);
+		usb_msg_upd_len_and_submit(usb_msg);
+		return;
+	}
+	if (SIMTRACE_MSGC_SNIFF != hdr->msg_class) {
+		return;
+	}
+	switch (hdr->msg_type) {
+	case SIMTRACE_MSGT_SNIFF_CONFIG:
+		/* without payload, only the current configuration is returned */
+		if (hdr->msg_len >= sizeof(*hdr) + sizeof(struct sniff_config)) {
+			const struct sniff_config *cfg = (const struct sniff_config *) hdr->payload;
+			sniff_features = cfg->features & SNIFF_SUPPORTED_FEATURES;
+			TRACE_INFO("Sniffer features 0x%lx\n\r", sniff_features);
+		}
+		usb_send_config(si);
+		break;
+	default:
+		TRACE_ERROR("unhandled sniffer command %u\n\r", hdr->msg_type);
+		break;
+	}
+}
+
+/*! Handle the commands received from the host
+ *  @param[in] queue queue of the USB OUT endpoint
+ */
+static void process_any_usb_commands(struct llist_head *queue)
+{
+	unsigned int i;
+
+	/* limit the number of buffers handled at once, to return to the main loop */
+	for (i = 0; i < 10; i++) {
+		struct llist_head *lh = llist_head_dequeue_irqsafe(queue);
+		struct msgb *msg;
+
+		if (!lh) {
 			break;
-		case ISO7816_S_WAIT_TPDU: /* After the ATR we expect TPDU or PPS data */
-		case ISO7816_S_WAIT_PPS_RSP:
-			if (0xff == byte) {
-				if (ISO7816_S_WAIT_PPS_RSP == iso_state) {
-					change_state(ISO7816_S_IN_PPS_RSP); /* Go to PPS state */
-				} else {
-					change_state(ISO7816_S_IN_PPS_REQ); /* Go to PPS state */
-				}
-				process_byte_pps(byte);
+		}
+		msg = llist_entry(lh, struct msgb, list);
+		/* USB endpoints are streams, a transfer can contain several messages */
+		while (msgb_length(msg) >= sizeof(struct simtrace_msg_hdr)) {
+			const struct simtrace_msg_hdr *hdr = (const struct simtrace_msg_hdr *) msg->data;
+			if (hdr->msg_len < sizeof(*hdr) || hdr->msg_len > msgb_length(msg)) {
+				TRACE_ERROR("invalid command length %u\n\r", hdr->msg_len);
 				break;
 			}
-		case ISO7816_S_IN_TPDU: /* More TPDU data incoming */
-			if (ISO7816_S_WAIT_TPDU == iso_state) {
-				change_state(ISO7816_S_IN_TPDU);
+			dispatch_usb_command(hdr);
+			msgb_pull(msg, hdr->msg_len);
+		}
+		usb_buf_free(msg);
+	}
+}
+
+/*! Process a sniffed byte depending on the current ISO 7816 state
+ *  @param[in] byte sniffed byte (as read from the USART)
+ */
+static void process_byte(struct sniff_inst *si, uint8_t byte)
+{
+	/* Convert convention if required */
+	if (si->convention_convert) {
+		byte = convention_convert_lut[byte];
+	}
+	//TRACE_ERROR_WP(">%02x", byte);
+	switch (si->iso_state) { /* Handle byte depending on state */
+	case ISO7816_S_RESET: /* During reset we shouldn't receive any data */
+		break;
+	case ISO7816_S_WAIT_ATR: /* After a reset we expect the ATR */
+		change_state(si, ISO7816_S_IN_ATR); /* go to next state */
+	case ISO7816_S_IN_ATR: /* More ATR data incoming */
+		process_byte_atr(si, byte);
+		break;
+	case ISO7816_S_WAIT_TPDU: /* After the ATR we expect TPDU or PPS data */
+	case ISO7816_S_WAIT_PPS_RSP:
+		if (0xff == byte) {
+			if (ISO7816_S_WAIT_PPS_RSP == si->iso_state) {
+				change_state(si, ISO7816_S_IN_PPS_RSP); /* Go to PPS state */
+			} else {
+				change_state(si, ISO7816_S_IN_PPS_REQ); /* Go to PPS state */
 			}
-			process_byte_tpdu(byte);
+			process_byte_pps(si, byte);
 			break;
-		case ISO7816_S_IN_PPS_REQ:
-		case ISO7816_S_IN_PPS_RSP:
-			process_byte_pps(byte);
+		}
+	case ISO7816_S_IN_TPDU: /* More TPDU data incoming */
+		if (ISO7816_S_WAIT_TPDU == si->iso_state) {
+			change_state(si, ISO7816_S_IN_TPDU);
+		}
+		process_byte_tpdu(si, byte);
+		break;
+	case ISO7816_S_IN_PPS_REQ:
+	case ISO7816_S_IN_PPS_RSP:
+		process_byte_pps(si, byte);
+		break;
+	default:
+		TRACE_ERROR("Data received in unknown state %u\n\r", si->iso_state);
+	}
+}
+
+/*! Handle the sniffed data and status changes of one link
+ *  @param[in] si sniffer instance
+ */
+static void sniff_inst_run(struct sniff_inst *si)
+{
+	/* Maximum number of sniffed bytes to process in this iteration */
+	unsigned int budget = SNIFF_RUN_BUDGET;
+
+	/* Keep track of the cycle counter wrap-around */
+	sniff_ts_update(si);
+
+	/* WARNING: the signal data and flags are not synchronized. We have to hope 
+	 * the processing is fast enough to not land in the wrong state while data
+	 * is remaining
+	 */
+	/* Handle sniffed data */
+	/* drain the data in bounded batches to let the main loop restart the watchdog */
+	while (budget) {
+		uint8_t bytes[SNIFF_RUN_CHUNK_LEN];
+		size_t len = rbuf_read_buf(&si->buffer, bytes, budget < sizeof(bytes) ? budget : sizeof(bytes));
+		size_t i;
+
+		if (!len) {
 			break;
-		default:
-			TRACE_ERROR("Data received in unknown state %u\n\r", iso_state);
 		}
+		for (i = 0; i < len; i++) {
+			si->byte_cycles = sniff_ts_next(si);
+			process_byte(si, bytes[i]);
+		}
+		budget -= len;
+	}
+	if (!budget) {
+		/* there might be data left, come back after the other main loop work */
+		main_event_set(MAIN_EV_MODE);
 	}
 
 	/* Handle flags */
-	if (change_flags) { /* WARNING this is not synced with the data buffer handling */
-		if (change_flags & SNIFF_CHANGE_FLAG_RESET_ASSERT) {
-			switch (iso_state) {
+	if (si->change_flags) { /* WARNING this is not synced with the data buffer handling */
+		if (si->change_flags & SNIFF_CHANGE_FLAG_RESET_ASSERT) {
+			switch (si->iso_state) {
 			case ISO7816_S_IN_ATR:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-				usb_send_atr(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete ATR to host software using USB */
+				usb_send_atr(si, SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete ATR to host software using USB */
 				break;
 			case ISO7816_S_IN_TPDU:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-				usb_send_tpdu(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete PPS to host software using USB */
+				usb_send_tpdu(si, SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete PPS to host software using USB */
 				break;
 			case ISO7816_S_IN_PPS_REQ:
 			case ISO7816_S_IN_PPS_RSP:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-				usb_send_pps(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete TPDU to host software using USB */
+				usb_send_pps(si, SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete TPDU to host software using USB */
 				break;
 			default:
 				break;
 			}
-			if (ISO7816_S_RESET != iso_state) {
-				change_state(ISO7816_S_RESET);
+			if (ISO7816_S_RESET != si->iso_state) {
+				change_state(si, ISO7816_S_RESET);
 				printf("reset asserted\n\r");
 			}
 		}
-		if (change_flags & SNIFF_CHANGE_FLAG_RESET_DEASSERT) {
-			if (ISO7816_S_WAIT_ATR != iso_state) {
-				change_state(ISO7816_S_WAIT_ATR);
+		if (si->change_flags & SNIFF_CHANGE_FLAG_RESET_DEASSERT) {
+			if (ISO7816_S_WAIT_ATR != si->iso_state) {
+				change_state(si, ISO7816_S_WAIT_ATR);
 				printf("reset de-asserted\n\r");
 			}
 		}
-		if (change_flags & SNIFF_CHANGE_FLAG_TIMEOUT_WT) {
+		if (si->change_flags & SNIFF_CHANGE_FLAG_TIMEOUT_WT) {
 			/* Use timeout to detect interrupted data transmission */
-			switch (iso_state) {
+			switch (si->iso_state) {
 			case ISO7816_S_IN_ATR:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-				usb_send_atr(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete ATR to host software using USB */
-				change_state(ISO7816_S_WAIT_ATR);
+				usb_send_atr(si, SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete ATR to host software using USB */
+				change_state(si, ISO7816_S_WAIT_ATR);
 				break;
 			case ISO7816_S_IN_TPDU:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-				usb_send_tpdu(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete PPS to host software using USB */
-				change_state(ISO7816_S_WAIT_TPDU);
+				usb_send_tpdu(si, SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete PPS to host software using USB */
+				change_state(si, ISO7816_S_WAIT_TPDU);
 				break;
 			case ISO7816_S_IN_PPS_REQ:
 			case ISO7816_S_IN_PPS_RSP:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
-				usb_send_pps(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete TPDU to host software using USB */
-				change_state(ISO7816_S_WAIT_TPDU);
+				usb_send_pps(si, SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete TPDU to host software using USB */
+				change_state(si, ISO7816_S_WAIT_TPDU);
 				break;
 			default:
-				change_flags &= ~SNIFF_CHANGE_FLAG_TIMEOUT_WT; /* We don't care about the timeout is all other cases */
+				si->change_flags &= ~SNIFF_CHANGE_FLAG_TIMEOUT_WT; /* We don't care about the timeout is all other cases */
 				break;
 			}
 		}
-		if (change_flags) {
-			usb_send_change(change_flags); /* send timeout to host software over USB */
-			change_flags = 0; /* Reset flags */
+		if (si->change_flags) {
+			usb_send_change(si, si->change_flags); /* send timeout to host software over USB */
+			si->change_flags = 0; /* Reset flags */
 		}
 	}
+
+	/* Report the SIM clock */
+	usb_send_clk(si);
+}
+
+/* Main (idle/busy) loop of this USB configuration */
+void Sniffer_run(void)
+{
+	unsigned int i;
+
+	/* Handle USB queue */
+	/* first try to send any pending messages on INT */
+	usb_refill_to_host(SIMTRACE_USB_EP_CARD_INT);
+	/* then try to send any pending messages on IN */
+	usb_refill_to_host(SIMTRACE_USB_EP_CARD_DATAIN);
+	/* ensure we can handle incoming USB messages from the host */
+	usb_refill_from_host(SIMTRACE_USB_EP_CARD_DATAOUT);
+	process_any_usb_commands(usb_get_queue(SIMTRACE_USB_EP_CARD_DATAOUT));
+
+	/* Latch the next USB start-of-frame, and detect a stopped SIM clock */
+	timesync_poll();
+	sim_clk_poll();
+
+	for (i = 0; i < ARRAY_SIZE(sniff_inst); i++) {
+		sniff_inst_run(&sniff_inst[i]);
+	}
 }
 #endif /* HAVE_SNIFFER */
@@ -16,6 +16,7 @@
 
 #include "utils.h"
 #include "tc_etu.h"
+#include "main_events.h"
 
 #include "chip.h"
 
@@ -100,11 +101,13 @@ static void tc_etu_irq(struct tc_etu_state *te)
 void TC0_IrqHandler(void)
 {
 	tc_etu_irq(&te_state0);
+	main_event_set(MAIN_EV_TC);
 }
 
 void TC2_IrqHandler(void)
 {
 	tc_etu_irq(&te_state2);
+	main_event_set(MAIN_EV_TC);
 }
 
 static void recalc_nr_events(struct tc_etu_state *te)
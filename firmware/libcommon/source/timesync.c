@@ -0,0 +1,105 @@
+/* USB start-of-frame based time synchronization
+ *
+ * The USB host sends a start-of-frame (SOF) with an incrementing frame
+ * number every millisecond, to all devices on the bus at the same time.
+ * Every TIMESYNC_INTERVAL_MS, the SOF interrupt is enabled for a single
+ * frame, which latches the frame number together with the cycle counter,
+ * the time base of the event trace and the deferred log.  The
+ * host reads the latest pairs using SIMTRACE_CMD_BD_TIMESYNC and maps the
+ * cycle counter to the bus time, and from there to its own clocks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "timesync.h"
+#include "cycle_counter.h"
+
+#include <string.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/utils.h>
+
+#if (TIMESYNC_NUM_PAIRS & (TIMESYNC_NUM_PAIRS - 1)) != 0
+#error "TIMESYNC_NUM_PAIRS must be a power of two"
+#endif
+
+static struct {
+	struct simtrace_timesync_pair pairs[TIMESYNC_NUM_PAIRS];
+	/* total number of pairs latched (wraps around) */
+	uint32_t num_latched;
+	/* cycle counter when the SOF interrupt was last enabled */
+	uint32_t armed_cycles;
+} timesync;
+
+void timesync_init(void)
+{
+	cycle_counter_init();
+
+	timesync.num_latched = 0;
+	timesync.armed_cycles = cycle_counter_get();
+}
+
+void timesync_poll(void)
+{
+	uint32_t now = cycle_counter_get();
+
+	if (now - timesync.armed_cycles < BOARD_MCK / 1000 * TIMESYNC_INTERVAL_MS)
+		return;
+	timesync.armed_cycles = now;
+
+	/* only latch a SOF occurring from now on */
+	UDP->UDP_ICR = UDP_ICR_SOFINT;
+	UDP->UDP_IER = UDP_IER_SOFINT;
+}
+
+/* USB interrupt on start-of-frame */
+void USBDCallbacks_StartOfFrame(void)
+{
+	/* as early as possible, the interrupt latency is part of the error */
+	uint32_t cycles = cycle_counter_get();
+	uint32_t frm_num = UDP->UDP_FRM_NUM;
+	struct simtrace_timesync_pair *pair;
+
+	UDP->UDP_IDR = UDP_IDR_SOFINT;
+
+	if (!(frm_num & UDP_FRM_NUM_FRM_OK))
+		return;
+
+	pair = &timesync.pairs[timesync.num_latched & (TIMESYNC_NUM_PAIRS - 1)];
+	pair->frame = frm_num & UDP_FRM_NUM_FRM_NUM_Msk;
+	pair->_reserved = 0;
+	pair->cycles = cycles;
+	timesync.num_latched++;
+}
+
+void timesync_dump(struct msgb *msg)
+{
+	struct simtrace_timesync_resp *resp;
+	unsigned int i, num;
+	uint32_t first;
+	unsigned long x;
+
+	resp = (struct simtrace_timesync_resp *) msgb_put(msg, sizeof(*resp));
+	resp->cycles_per_sec = BOARD_MCK;
+
+	local_irq_save(x);
+	num = OSMO_MIN(timesync.num_latched, TIMESYNC_NUM_PAIRS);
+	/* number of the oldest pair */
+	first = timesync.num_latched - num;
+	for (i = 0; i < num; i++) {
+		uint32_t idx = (first + i) & (TIMESYNC_NUM_PAIRS - 1);
+		memcpy(msgb_put(msg, sizeof(resp->pairs[0])), &timesync.pairs[idx], sizeof(resp->pairs[0]));
+	}
+	resp->num_latched = timesync.num_latched;
+	resp->num_pairs = num;
+	resp->cycles_now = cycle_counter_get();
+	local_irq_restore(x);
+}
@@ -245,19 +245,19 @@ static const CCIDDriverConfigurationDescriptors configurationDescriptorCCID = {
 		.bcdCCID		= CCID1_10,	// CCID version
 		.bMaxSlotIndex		= 0,	// 1 slot 
 		.bVoltageSupport	= VOLTS_3_0,
-		.dwProtocols		= (1 << PROTOCOL_TO),
+		.dwProtocols		= (1 << PROTOCOL_TO) | (1 << PROTOCOL_T1),
 		.dwDefaultClock		= 3580,
 		.dwMaximumClock		= 3580,
 		.bNumClockSupported	= 0,
 		.dwDataRate		= 9600,
-		.dwMaxDataRate		= 9600,
+		.dwMaxDataRate		= 3580000 / ISO7816_MIN_FD_RATIO,
 		.bNumDataRatesSupported = 0,
 		.dwMaxIFSD		= 0xfe,
 		.dwSynchProtocols	= 0,
 		.dwMechanical		= 0,
 		.dwFeatures = CCID_FEATURES_AUTO_CLOCK | CCID_FEATURES_AUTO_BAUD |
 			      CCID_FEATURES_AUTO_PCONF | CCID_FEATURES_AUTO_PNEGO |
-			      CCID_FEATURES_EXC_TPDU,
+			      CCID_FEATURES_AUTO_IFSD | CCID_FEATURES_EXC_SAPDU,
 		.dwMaxCCIDMessageLength	= 271,	/* For extended APDU
 						   level the value shall
 						   be between 261 + 10 */
@@ -494,19 +494,19 @@ static const SIMTraceDriverConfigurationDescriptorMITM
 		.bcdCCID		= CCID1_10,	// CCID version
 		.bMaxSlotIndex		= 0,	// 1 slot 
 		.bVoltageSupport	= VOLTS_3_0,
-		.dwProtocols		= (1 << PROTOCOL_TO),
+		.dwProtocols		= (1 << PROTOCOL_TO) | (1 << PROTOCOL_T1),
 		.dwDefaultClock		= 3580,
 		.dwMaximumClock		= 3580,
 		.bNumClockSupported	= 0,
 		.dwDataRate		= 9600,
-		.dwMaxDataRate		= 9600,
+		.dwMaxDataRate		= 3580000 / ISO7816_MIN_FD_RATIO,
 		.bNumDataRatesSupported = 0,
 		.dwMaxIFSD		= 0xfe,
 		.dwSynchProtocols	= 0,
 		.dwMechanical		= 0,
 		.dwFeatures = CCID_FEATURES_AUTO_CLOCK | CCID_FEATURES_AUTO_BAUD |
 			      CCID_FEATURES_AUTO_PCONF | CCID_FEATURES_AUTO_PNEGO |
-			      CCID_FEATURES_EXC_TPDU,
+			      CCID_FEATURES_AUTO_IFSD | CCID_FEATURES_EXC_SAPDU,
 		.dwMaxCCIDMessageLength	= 271,	/* For extended APDU
 						   level the value shall
 						   be between 261 + 10 */
@@ -12,14 +12,17 @@
  */
 #include "board.h"
 #include "trace.h"
+#include "utils.h"
 #include "usb_buf.h"
 #include "simtrace_usb.h"
+#include "evtrace.h"
 
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
 #include <errno.h>
 
-#define USB_ALLOC_SIZE	280
+/* fits a sniffed TPDU of 5+256+2 bytes with time-stamps (see pseudo_talloc.c) */
+#define USB_ALLOC_SIZE	320
 #define USB_MAX_QLEN	3
 
 static struct usb_buffered_ep usb_buffered_ep[BOARD_USB_NUMENDPOINTS];
@@ -57,7 +60,7 @@ struct msgb *usb_buf_alloc(uint8_t ep)
 }
 
 /* release/return the USB buffer to the pool */
-void usb_buf_free(struct msgb *msg)
+__ramfunc void usb_buf_free(struct msgb *msg)
 {
 	msgb_free(msg);
 }
@@ -84,9 +87,11 @@ int usb_buf_submit(struct msgb *msg)
 		evict = msgb_dequeue_count(&ep->queue, &ep->queue_len);
 		OSMO_ASSERT(evict);
 		usb_buf_free(evict);
+		ep->dropped++;
 	}
 
 	msgb_enqueue_count(&ep->queue, msg, &ep->queue_len);
+	evtrace_log(SIMTRACE_EVT_USB_IN_QUEUE, (ep->ep << 16) | msgb_length(msg));
 	return 0;
 }
 
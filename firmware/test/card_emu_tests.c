@@ -3,6 +3,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "card_emu.h"
 #include "simtrace_prot.h"
@@ -54,6 +55,25 @@ int card_emu_uart_tx(uint8_t uart_chan, uint8_t byte)
 	return 1;
 }
 
+/* number of bytes of the last (not yet completed) DMA transfer */
+static unsigned int tx_dma_len;
+
+int card_emu_uart_tx_dma(uint8_t uart_chan, const uint8_t *data, uint16_t len)
+{
+	printf("UART_TX_DMA(%s)\n", osmo_hexdump(data, len));
+	assert(tx_dma_len == 0);
+	memcpy(tx_debug_buf + tx_debug_buf_idx, data, len);
+	tx_debug_buf_idx += len;
+	tx_dma_len = len;
+	return len;
+}
+
+void card_emu_uart_tx_dma_abort(uint8_t uart_chan)
+{
+	printf("%s(uart_chan=%u)\n", __func__, uart_chan);
+	tx_dma_len = 0;
+}
+
 void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx)
 {
 	char *rts;
@@ -83,6 +103,11 @@ void card_emu_uart_interrupt(uint8_t uart_chan)
 	printf("uart_interrupt(uart_chan=%u)\n", uart_chan);
 }
 
+void card_emu_uart_get_stats(uint8_t uart_chan, struct cardemu_usb_msg_stats *st)
+{
+	st->usart_parity = 23;
+}
+
 void card_emu_uart_update_wt(uint8_t uart_chan, uint32_t wt)
 {
 	printf("%s(uart_chan=%u, wtime=%u)\n", __func__, uart_chan, wt);
@@ -93,6 +118,14 @@ void card_emu_uart_reset_wt(uint8_t uart_chan)
 	printf("%s(uart_chan=%u\n", __func__, uart_chan);
 }
 
+static int selected_slot = -1;
+
+void card_emu_select_slot(uint8_t uart_chan, uint8_t slot)
+{
+	printf("%s(uart_chan=%u, slot=%u)\n", __func__, uart_chan, slot);
+	selected_slot = slot;
+}
+
 
 
 /***********************************************************************
@@ -292,9 +325,16 @@ static void host_to_device_data(struct card_handle *ch, const uint8_t *data, uin
 static int card_tx_verify_chars(struct card_handle *ch, const uint8_t *data, unsigned int data_len)
 {
 	int count = 0;
-
-	while (card_emu_tx_byte(ch)) {
-		count++;
+	int rc;
+
+	while ((rc = card_emu_tx_byte(ch))) {
+		count += rc;
+		/* emulate the end-of-transfer interrupt of the UART DMA */
+		if (tx_dma_len) {
+			tx_dma_len = 0;
+			if (!card_emu_tx_dma_done(ch))
+				break;
+		}
 	}
 
 	assert(count == data_len);
@@ -375,6 +415,131 @@ test_tpdu_card2reader(struct card_handle *ch, const uint8_t *hdr, const uint8_t
 	card_emu_io_statechg(ch, CARD_IO_CLK, 1);
 }
 
+/* same as above, but with the firmware acknowledging the header (CEMU_FEAT_F_AUTO_PB_RX) */
+static void
+test_tpdu_reader2card_auto_pb(struct card_handle *ch, const uint8_t *hdr, const uint8_t *body, uint8_t body_len)
+{
+	uint8_t hdr_body[5 + body_len];
+
+	printf("\n==> transmitting APDU (HDR + auto-PB + card-RX)\n");
+
+	memcpy(hdr_body, hdr, 5);
+	memcpy(hdr_body + 5, body, body_len);
+
+	/* emulate the reader sending a TPDU header */
+	reader_send_bytes(ch, hdr, 5);
+	/* the header is not sent to the host on its own */
+	assert(llist_empty(usb_get_queue(PHONE_DATAIN)));
+
+	/* card sends the PB without waiting for the host */
+	card_tx_verify_chars(ch, hdr+1, 1);
+
+	/* emulate more characters from reader to card */
+	reader_send_bytes(ch, body, body_len);
+
+	/* check if we have received header + body in one message on the USB side */
+	get_and_verify_rctx(PHONE_DATAIN, hdr_body, sizeof(hdr_body));
+
+	/* ensure there is no extra data received on usb */
+	assert(llist_empty(usb_get_queue(PHONE_DATAOUT)));
+
+	/* card emulator sends SW via USB */
+	host_to_device_data(ch, tpdu_pb_sw, sizeof(tpdu_pb_sw),
+			    CEMU_DATA_F_FINAL | CEMU_DATA_F_PB_AND_TX);
+	/* obtain any pending tx chars */
+	card_tx_verify_chars(ch, tpdu_pb_sw, sizeof(tpdu_pb_sw));
+}
+
+/* emulate a SIMTRACE_MSGT_BD_CEMU_CONFIG received from USB */
+static void host_set_config(struct card_handle *ch, uint32_t features, uint8_t max_fidi)
+{
+	struct cardemu_usb_msg_config cfg = { .features = features, .max_fidi = max_fidi };
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_DATAIN);
+	struct msgb *msg;
+
+	card_emu_set_config(ch, &cfg, sizeof(cfg));
+
+	/* the firmware reports back its configuration */
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	dump_rctx(msg);
+	assert(((struct simtrace_msg_hdr *) msg->l1h)->msg_type == SIMTRACE_MSGT_BD_CEMU_CONFIG);
+	assert(((struct cardemu_usb_msg_config *) msg->l2h)->features == features);
+	assert(((struct cardemu_usb_msg_config *) msg->l2h)->max_fidi == max_fidi);
+	usb_buf_free(msg);
+}
+
+/* emulate a SIMTRACE_MSGT_DT_CEMU_CACHE_ADD received from USB */
+static int host_cache_add(struct card_handle *ch, const uint8_t *hdr, const uint8_t *data, uint8_t data_len,
+			  const uint8_t *resp, uint16_t resp_len)
+{
+	struct msgb *msg;
+	struct simtrace_msg_hdr *mh;
+	struct cardemu_usb_msg_cache_add *ce;
+
+	msg = usb_buf_alloc(PHONE_DATAOUT);
+	assert(msg);
+	msg->l1h = msg->head;
+	mh = (struct simtrace_msg_hdr *) msgb_put(msg, sizeof(*mh));
+	mh->msg_class = SIMTRACE_MSGC_CARDEM;
+	mh->msg_type = SIMTRACE_MSGT_DT_CEMU_CACHE_ADD;
+
+	msg->l2h = msgb_put(msg, sizeof(*ce) + data_len + resp_len);
+	ce = (struct cardemu_usb_msg_cache_add *) msg->l2h;
+	memcpy(ce->hdr, hdr, sizeof(ce->hdr));
+	ce->data_len = data_len;
+	ce->resp_len = resp_len;
+	memcpy(ce->data, data, data_len);
+	memcpy(ce->data + data_len, resp, resp_len);
+
+	mh->msg_len = msgb_length(msg);
+
+	return card_emu_cache_add(ch, msg);
+}
+
+/* SELECT MF */
+const uint8_t tpdu_hdr_sel[] = { 0xA0, 0xA4, 0x00, 0x00, 0x02 };
+const uint8_t tpdu_body_sel_mf[] = { 0x3F, 0x00 };
+const uint8_t tpdu_body_sel_df_gsm[] = { 0x7F, 0x20 };
+const uint8_t tpdu_sw_sel_mf[] = { 0x9F, 0x16 };
+
+static void
+test_tpdu_cache(struct card_handle *ch, const uint8_t *hdr, const uint8_t *body, uint8_t body_len)
+{
+	uint8_t resp[1 + body_len + sizeof(tpdu_pb_sw)];
+	uint8_t hdr_body[5 + sizeof(tpdu_body_sel_mf)];
+
+	printf("\n==> transmitting APDU (HDR + cached PB + card-TX)\n");
+
+	/* host preloads the complete response */
+	resp[0] = hdr[1];
+	memcpy(resp + 1, body, body_len);
+	memcpy(resp + 1 + body_len, tpdu_pb_sw, sizeof(tpdu_pb_sw));
+	assert(host_cache_add(ch, hdr, NULL, 0, resp, sizeof(resp)) == 0);
+
+	/* the card answers without the host being involved */
+	reader_send_bytes(ch, hdr, 5);
+	assert(llist_empty(usb_get_queue(PHONE_DATAIN)));
+	card_tx_verify_chars(ch, resp, sizeof(resp));
+
+	/* the card behind the host has to see every SELECT */
+	assert(host_cache_add(ch, tpdu_hdr_sel, tpdu_body_sel_mf, sizeof(tpdu_body_sel_mf),
+			      tpdu_sw_sel_mf, sizeof(tpdu_sw_sel_mf)) == -EPERM);
+	assert(host_cache_add(ch, tpdu_hdr_sel, NULL, 0, tpdu_sw_sel_mf, sizeof(tpdu_sw_sel_mf)) == -EPERM);
+
+	printf("\n==> transmitting APDU (HDR + auto-PB + card-RX), dropping the cache\n");
+
+	memcpy(hdr_body, tpdu_hdr_sel, 5);
+	memcpy(hdr_body + 5, tpdu_body_sel_mf, sizeof(tpdu_body_sel_mf));
+	reader_send_bytes(ch, tpdu_hdr_sel, 5);
+	card_tx_verify_chars(ch, tpdu_hdr_sel+1, 1);
+	reader_send_bytes(ch, tpdu_body_sel_mf, sizeof(tpdu_body_sel_mf));
+	get_and_verify_rctx(PHONE_DATAIN, hdr_body, sizeof(hdr_body));
+	host_to_device_data(ch, tpdu_sw_sel_mf, sizeof(tpdu_sw_sel_mf),
+			    CEMU_DATA_F_FINAL | CEMU_DATA_F_PB_AND_TX);
+	card_tx_verify_chars(ch, tpdu_sw_sel_mf, sizeof(tpdu_sw_sel_mf));
+}
+
 const uint8_t pps[] = {
 	/* PPSS identifies the PPS request or response and is set to
 	 * 'FF'. */
@@ -397,14 +562,353 @@ test_ppss(struct card_handle *ch)
 	card_tx_verify_chars(ch, pps, sizeof(pps));
 }
 
+/* ATR indicating T=1, hence with TCK */
+const uint8_t atr_t1[] = { 0x3b, 0x80, 0x01, 0x81 };
+/* the same with TA1=0x95 (Fi=512, Di=16) */
+const uint8_t atr_t1_ta1[] = { 0x3b, 0x90, 0x95, 0x01, 0x04 };
+
+/* PPS requests for F/D ratio 16 and 32 */
+const uint8_t pps_fast[] = { 0xFF, 0x10, 0x96, 0xFF ^ 0x10 ^ 0x96 };
+const uint8_t pps_fast_resp[] = { 0xFF, 0x00, 0xFF };
+const uint8_t pps_policy[] = { 0xFF, 0x10, 0x95, 0xFF ^ 0x10 ^ 0x95 };
+
+static void
+test_pps_policy(struct card_handle *ch, const uint8_t *req, unsigned int req_len,
+		const uint8_t *resp, unsigned int resp_len)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_DATAIN);
+	struct cardemu_usb_msg_pts_info *ptsi;
+	struct msgb *msg;
+
+	reader_send_bytes(ch, req, req_len);
+
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	dump_rctx(msg);
+	ptsi = (struct cardemu_usb_msg_pts_info *) msg->l2h;
+	assert(((struct simtrace_msg_hdr *) msg->l1h)->msg_type == SIMTRACE_MSGT_DO_CEMU_PTS);
+	assert(!memcmp(ptsi->req, req, req_len));
+	assert(!memcmp(ptsi->resp, resp, resp_len));
+	usb_buf_free(msg);
+
+	card_tx_verify_chars(ch, resp, resp_len);
+}
+
+static void
+test_speed_policy(struct card_handle *ch)
+{
+	struct cardemu_usb_msg_config cfg_fast = { .max_fidi = 0x96 };
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_DATAIN);
+	struct msgb *msg;
+	unsigned int i;
+
+	printf("\n==> speed policy (TA1=95)\n");
+
+	card_emu_set_atr(ch, atr_t1, sizeof(atr_t1));
+	host_set_config(ch, 0, 0x95);
+
+	/* reset the card and verify TA1 has been inserted */
+	card_emu_io_statechg(ch, CARD_IO_RST, 1);
+	card_emu_io_statechg(ch, CARD_IO_RST, 0);
+	card_emu_wtime_expired(ch);
+	for (i = 0; i < sizeof(atr_t1_ta1); i++)
+		assert(card_emu_tx_byte(ch) == 1);
+	assert(card_emu_tx_byte(ch) == 0);
+	reader_check_and_clear(atr_t1_ta1, sizeof(atr_t1_ta1));
+
+	/* faster than the policy: we stay at the default F/D */
+	test_pps_policy(ch, pps_fast, sizeof(pps_fast), pps_fast_resp, sizeof(pps_fast_resp));
+	/* at the policy limit: accepted */
+	test_pps_policy(ch, pps_policy, sizeof(pps_policy), pps_policy, sizeof(pps_policy));
+
+	/* F/D ratios the UART can't handle are refused, the policy is kept */
+	card_emu_set_config(ch, &cfg_fast, sizeof(cfg_fast));
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	assert(((struct cardemu_usb_msg_config *) msg->l2h)->max_fidi == 0x95);
+	usb_buf_free(msg);
+}
+
+static struct cardemu_usb_msg_stats
+get_stats(struct card_handle *ch)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_DATAIN);
+	struct cardemu_usb_msg_stats st;
+	struct msgb *msg;
+
+	card_emu_report_stats(ch);
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	assert(((struct simtrace_msg_hdr *) msg->l1h)->msg_type == SIMTRACE_MSGT_BD_CEMU_STATS);
+	assert(msgb_l2len(msg) == sizeof(st));
+	memcpy(&st, msg->l2h, sizeof(st));
+	usb_buf_free(msg);
+
+	return st;
+}
+
+static void
+test_stats(struct card_handle *ch, const uint8_t *hdr_wr, const uint8_t *body_wr, uint8_t body_wr_len,
+	   const uint8_t *hdr_rd, const uint8_t *body_rd, uint8_t body_rd_len)
+{
+	struct cardemu_usb_msg_stats before, after;
+
+	printf("\n==> statistics\n");
+
+	before = get_stats(ch);
+	test_tpdu_reader2card(ch, hdr_wr, body_wr, body_wr_len);
+	test_tpdu_card2reader(ch, hdr_rd, body_rd, body_rd_len);
+	after = get_stats(ch);
+
+	assert(after.tpdu_case1 == before.tpdu_case1);
+	assert(after.tpdu_case2 == before.tpdu_case2 + 1);
+	assert(after.tpdu_case3 == before.tpdu_case3 + 1);
+	/* two headers, one body from the reader */
+	assert(after.rx_bytes == before.rx_bytes + 5 + body_wr_len + 5);
+	/* PB + SW for the write, PB + body + SW for the read */
+	assert(after.tx_bytes == before.tx_bytes + 3 + 1 + body_rd_len + 2);
+	/* filled in by the UART driver */
+	assert(after.usart_parity == 23);
+}
+
+static void test_card_present(struct card_handle *ch)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_INT);
+	struct cardemu_usb_msg_status *sts;
+	struct msgb *msg;
+
+	printf("\n==> card presence\n");
+
+	host_set_config(ch, CEMU_FEAT_F_STATUS_IRQ, 0);
+
+	/* insertion is reported on the interrupt endpoint */
+	card_emu_set_card_present(ch, true);
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	assert(((struct simtrace_msg_hdr *) msg->l1h)->msg_type == SIMTRACE_MSGT_BD_CEMU_STATUS);
+	sts = (struct cardemu_usb_msg_status *) msg->l2h;
+	assert(sts->flags & CEMU_STATUS_F_CARD_INSERT);
+	usb_buf_free(msg);
+
+	/* no change, no report */
+	card_emu_set_card_present(ch, true);
+	assert(!msgb_dequeue_count(&bep->queue, &bep->queue_len));
+
+	card_emu_set_card_present(ch, false);
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	sts = (struct cardemu_usb_msg_status *) msg->l2h;
+	assert(!(sts->flags & CEMU_STATUS_F_CARD_INSERT));
+	usb_buf_free(msg);
+
+	host_set_config(ch, 0, 0);
+}
+
+static void test_clk_hz(struct card_handle *ch)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_INT);
+	struct cardemu_usb_msg_status *sts;
+	struct msgb *msg;
+
+	printf("\n==> measured clock\n");
+
+	host_set_config(ch, CEMU_FEAT_F_STATUS_IRQ, 0);
+
+	/* the first measurement is reported */
+	card_emu_set_clk_hz(ch, 3571200);
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	assert(((struct simtrace_msg_hdr *) msg->l1h)->msg_type == SIMTRACE_MSGT_BD_CEMU_STATUS);
+	sts = (struct cardemu_usb_msg_status *) msg->l2h;
+	assert(sts->clk_hz == 3571200);
+	usb_buf_free(msg);
+
+	/* jitter is not */
+	card_emu_set_clk_hz(ch, 3571300);
+	assert(!msgb_dequeue_count(&bep->queue, &bep->queue_len));
+
+	/* a different clock is */
+	card_emu_set_clk_hz(ch, 4875000);
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	sts = (struct cardemu_usb_msg_status *) msg->l2h;
+	assert(sts->clk_hz == 4875000);
+	usb_buf_free(msg);
+
+	/* forgetting it is reported along with the next status */
+	card_emu_set_clk_hz(ch, 0);
+	assert(!msgb_dequeue_count(&bep->queue, &bep->queue_len));
+
+	host_set_config(ch, 0, 0);
+}
+
+/* emulate a SIMTRACE_MSGT_DT_CEMU_SCHEDULE with two entries received from USB */
+static void host_sched(struct card_handle *ch, uint8_t flags, const uint8_t *atr0, uint8_t atr0_len)
+{
+	struct msgb *msg;
+	struct simtrace_msg_hdr *mh;
+	struct cardemu_usb_msg_schedule *sh;
+	struct cardemu_usb_msg_sched_entry *se;
+
+	msg = usb_buf_alloc(PHONE_DATAOUT);
+	assert(msg);
+	msg->l1h = msg->head;
+	mh = (struct simtrace_msg_hdr *) msgb_put(msg, sizeof(*mh));
+	mh->msg_class = SIMTRACE_MSGC_CARDEM;
+	mh->msg_type = SIMTRACE_MSGT_DT_CEMU_SCHEDULE;
+
+	msg->l2h = msgb_put(msg, sizeof(*sh));
+	sh = (struct cardemu_usb_msg_schedule *) msg->l2h;
+	sh->flags = flags;
+	sh->num_entries = 2;
+	se = (struct cardemu_usb_msg_sched_entry *) msgb_put(msg, sizeof(*se) + atr0_len);
+	se->slot_mux_nr = 3;
+	se->script_id = 0x101;
+	se->atr_len = atr0_len;
+	memcpy(se->atr, atr0, atr0_len);
+	se = (struct cardemu_usb_msg_sched_entry *) msgb_put(msg, sizeof(*se));
+	se->slot_mux_nr = 5;
+	se->script_id = 0x102;
+	se->atr_len = 0;
+
+	mh->msg_len = msgb_length(msg);
+
+	assert(card_emu_sched_add(ch, msg) == 0);
+}
+
+static void verify_sched_step(uint8_t index, uint8_t slot, uint16_t script_id)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_INT);
+	struct cardemu_usb_msg_sched_step *step;
+	struct msgb *msg;
+
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	assert(((struct simtrace_msg_hdr *) msg->l1h)->msg_type == SIMTRACE_MSGT_DO_CEMU_SCHED_STEP);
+	step = (struct cardemu_usb_msg_sched_step *) msg->l2h;
+	assert(step->index == index);
+	if (index != CEMU_SCHED_IDX_DONE) {
+		assert(step->slot_mux_nr == slot);
+		assert(step->script_id == script_id);
+		assert(selected_slot == slot);
+	}
+	usb_buf_free(msg);
+}
+
+/* power up the card and verify the ATR it sends */
+static void power_up_verify_atr(struct card_handle *ch, const uint8_t *atr_exp, unsigned int len)
+{
+	card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+	card_emu_io_statechg(ch, CARD_IO_CLK, 1);
+	card_emu_io_statechg(ch, CARD_IO_RST, 1);
+	card_emu_io_statechg(ch, CARD_IO_RST, 0);
+	card_emu_wtime_expired(ch);
+	card_tx_verify_chars(ch, atr_exp, len);
+}
+
+static void test_schedule(struct card_handle *ch)
+{
+	static const uint8_t atr_sched[] = { 0x3b, 0x02, 0x14, 0x51 };
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_INT);
+	unsigned int i;
+
+	printf("\n==> slot schedule\n");
+
+	host_set_config(ch, 0, 0);
+
+	/* no slot switching while the card is powered */
+	host_sched(ch, 0, atr_sched, sizeof(atr_sched));
+	assert(selected_slot == -1);
+	assert(!msgb_dequeue_count(&bep->queue, &bep->queue_len));
+
+	/* end of the card session: first entry, with its ATR */
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(0, 3, 0x101);
+	power_up_verify_atr(ch, atr_sched, sizeof(atr_sched));
+
+	/* second entry keeps the ATR */
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(1, 5, 0x102);
+	power_up_verify_atr(ch, atr_sched, sizeof(atr_sched));
+
+	/* end of the schedule */
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(CEMU_SCHED_IDX_DONE, 0, 0);
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	assert(!msgb_dequeue_count(&bep->queue, &bep->queue_len));
+
+	/* with VCC off it starts right away, and loops */
+	host_sched(ch, CEMU_SCHED_F_LOOP, atr, sizeof(atr));
+	verify_sched_step(0, 3, 0x101);
+	power_up_verify_atr(ch, atr, sizeof(atr));
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(1, 5, 0x102);
+	card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(0, 3, 0x101);
+	card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+
+	/* without LOOP, the host can keep appending to a running schedule,
+	 * beyond the number of messages the firmware holds at a time */
+	host_sched(ch, 0, atr, sizeof(atr));
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(0, 3, 0x101);
+	for (i = 0; i < 8; i++) {
+		host_sched(ch, CEMU_SCHED_F_APPEND, atr, sizeof(atr));
+		card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+		card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+		verify_sched_step(2 * i + 1, 5, 0x102);
+		card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+		card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+		verify_sched_step(2 * i + 2, 3, 0x101);
+	}
+	card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(2 * i + 1, 5, 0x102);
+	card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+	card_emu_io_statechg(ch, CARD_IO_VCC, 0);
+	verify_sched_step(CEMU_SCHED_IDX_DONE, 0, 0);
+}
+
 /* READ RECORD (offset 0, 10 bytes) */
 const uint8_t tpdu_hdr_read_rec[] = { 0xA0, 0xB2, 0x00, 0x00, 0x0A };
 const uint8_t tpdu_body_read_rec[] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
+/* READ RECORD 1 of the current EF, absolute mode */
+const uint8_t tpdu_hdr_read_rec_abs[] = { 0xA0, 0xB2, 0x01, 0x04, 0x0A };
 
 /* WRITE RECORD */
 const uint8_t tpdu_hdr_write_rec[] = { 0xA0, 0xD2, 0x00, 0x00, 0x07 };
 const uint8_t tpdu_body_write_rec[] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
 
+/* configuration restored from flash at start-up, and read back for storing it */
+static void test_stored_config(struct card_handle *ch)
+{
+	static const uint8_t atr_stored[] = { 0x3b, 0x02, 0x14, 0x50 };
+	struct cardemu_usb_msg_config cfg = { .features = CEMU_FEAT_F_STATUS_IRQ, .slot_mux_nr = 3 };
+	struct cardemu_usb_msg_config cfg_rd;
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_DATAIN);
+	uint8_t atr_rd[33];
+	uint8_t atr_rd_len;
+
+	printf("\n==> stored configuration\n");
+
+	/* nothing is reported, the host may not even be connected */
+	card_emu_apply_config(ch, &cfg, sizeof(cfg));
+	assert(llist_empty(&bep->queue));
+	assert(card_emu_set_atr(ch, atr_stored, sizeof(atr_stored)) == 0);
+
+	card_emu_get_config(ch, &cfg_rd);
+	assert(cfg_rd.features == cfg.features);
+	assert(cfg_rd.max_fidi == 0);
+	atr_rd_len = card_emu_get_atr(ch, atr_rd, sizeof(atr_rd));
+	assert(atr_rd_len == sizeof(atr_stored));
+	assert(!memcmp(atr_rd, atr_stored, sizeof(atr_stored)));
+	/* truncated to the buffer */
+	assert(card_emu_get_atr(ch, atr_rd, 2) == 2);
+
+	host_set_config(ch, 0, 0);
+}
+
 int main(int argc, char **argv)
 {
 	struct card_handle *ch;
@@ -427,5 +931,34 @@ int main(int argc, char **argv)
 		test_tpdu_card2reader(ch, tpdu_hdr_read_rec, tpdu_body_read_rec, sizeof(tpdu_body_read_rec));
 	}
 
+	host_set_config(ch, CEMU_FEAT_F_AUTO_PB_RX, 0);
+	for (i = 0; i < 2; i++) {
+		test_tpdu_reader2card_auto_pb(ch, tpdu_hdr_write_rec, tpdu_body_write_rec, sizeof(tpdu_body_write_rec));
+
+		/* card-to-reader TPDUs are still handled by the host */
+		test_tpdu_card2reader(ch, tpdu_hdr_read_rec, tpdu_body_read_rec, sizeof(tpdu_body_read_rec));
+	}
+
+	for (i = 0; i < 2; i++) {
+		test_tpdu_cache(ch, tpdu_hdr_read_rec_abs, tpdu_body_read_rec, sizeof(tpdu_body_read_rec));
+
+		/* the SELECT dropped the entry, so the host is asked again */
+		test_tpdu_card2reader(ch, tpdu_hdr_read_rec_abs, tpdu_body_read_rec, sizeof(tpdu_body_read_rec));
+	}
+
+	host_set_config(ch, 0, 0);
+	test_stats(ch, tpdu_hdr_write_rec, tpdu_body_write_rec, sizeof(tpdu_body_write_rec),
+		   tpdu_hdr_read_rec, tpdu_body_read_rec, sizeof(tpdu_body_read_rec));
+
+	test_card_present(ch);
+
+	test_clk_hz(ch);
+
+	test_speed_policy(ch);
+
+	test_schedule(ch);
+
+	test_stored_config(ch);
+
 	exit(0);
 }
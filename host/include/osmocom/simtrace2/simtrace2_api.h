@@ -44,6 +44,9 @@ struct osmo_st2_cardem_inst {
 int osmo_st2_slot_tx_msg(struct osmo_st2_slot *slot, struct msgb *msg,
                          uint8_t msg_class, uint8_t msg_type);
 
+int osmo_st2_generic_request_evtrace(struct osmo_st2_slot *slot, uint16_t offset, uint8_t flags);
+int osmo_st2_generic_request_dlog(struct osmo_st2_slot *slot);
+int osmo_st2_generic_request_timesync(struct osmo_st2_slot *slot);
 
 int osmo_st2_cardem_request_card_insert(struct osmo_st2_cardem_inst *ci, bool inserted);
 int osmo_st2_cardem_request_pb_and_rx(struct osmo_st2_cardem_inst *ci, uint8_t pb, uint8_t le);
@@ -53,6 +56,28 @@ int osmo_st2_cardem_request_sw_tx(struct osmo_st2_cardem_inst *ci, const uint8_t
 int osmo_st2_cardem_request_set_atr(struct osmo_st2_cardem_inst *ci, const uint8_t *atr,
 				    unsigned int atr_len);
 int osmo_st2_cardem_request_config(struct osmo_st2_cardem_inst *ci, uint32_t features);
+int osmo_st2_cardem_request_config_fidi(struct osmo_st2_cardem_inst *ci, uint32_t features,
+					uint8_t max_fidi);
+int osmo_st2_cardem_request_cache_add(struct osmo_st2_cardem_inst *ci, const uint8_t *hdr,
+				      const uint8_t *data, uint8_t data_len,
+				      const uint8_t *resp, uint16_t resp_len);
+int osmo_st2_cardem_request_cache_flush(struct osmo_st2_cardem_inst *ci);
+int osmo_st2_cardem_request_stats(struct osmo_st2_cardem_inst *ci);
+int osmo_st2_cardem_request_vcc(struct osmo_st2_cardem_inst *ci, uint8_t flags);
+int osmo_st2_cardem_request_persist(struct osmo_st2_cardem_inst *ci, uint8_t flags);
+
+/*! entry of a slot schedule, see osmo_st2_cardem_request_schedule() */
+struct osmo_st2_sched_entry {
+	/*! slot of the external mux */
+	uint8_t slot_mux_nr;
+	/*! reported back when the entry becomes active */
+	uint16_t script_id;
+	/*! ATR to use for this slot (NULL to keep the current one) */
+	const uint8_t *atr;
+	uint8_t atr_len;
+};
+int osmo_st2_cardem_request_schedule(struct osmo_st2_cardem_inst *ci, uint8_t flags,
+				     const struct osmo_st2_sched_entry *entries, unsigned int num_entries);
 
 
 int osmo_st2_modem_reset_pulse(struct osmo_st2_slot *slot, uint16_t duration_ms);
@@ -0,0 +1,75 @@
+/* timesync - map the SIMtrace2 cycle counter to USB bus and host time
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <osmocom/simtrace2/simtrace_prot.h>
+
+/* number of samples the estimations are made over */
+#define OSMO_ST2_TIMESYNC_WIN	32
+
+/* Clock model of one device.  Feed it with osmo_st2_timesync_update() at
+ * least every 30 seconds (the cycle counter wraps after about a minute). */
+struct osmo_st2_timesync {
+	uint32_t cycles_per_sec;
+
+	/* latest start-of-frame pair taken into account */
+	bool have_pair;
+	uint32_t last_num;
+	uint32_t last_cycles;
+	uint16_t last_frame;
+
+	/* start-of-frame pairs, unwrapped to 64 bit */
+	struct {
+		int64_t cycles;
+		int64_t frame;
+	} sof[OSMO_ST2_TIMESYNC_WIN];
+	unsigned int sof_len;
+	unsigned int sof_idx;
+
+	/* request/response round trips: cycle counter of the device 'now'
+	 * (unwrapped) and CLOCK_MONOTONIC in the middle of the round trip */
+	struct {
+		int64_t cycles;
+		double mono_ms;
+		double rtt_ms;
+	} rt[OSMO_ST2_TIMESYNC_WIN];
+	unsigned int rt_len;
+	unsigned int rt_idx;
+
+	/* estimations, valid once 'valid' is set */
+	bool valid;
+	/* cycle counter to bus time: bus_ms = bus_ref_ms + (cycles - cycles_ref) * ms_per_cycle */
+	int64_t cycles_ref;
+	double bus_ref_ms;
+	double ms_per_cycle;
+	/* bus time to CLOCK_MONOTONIC: mono_ms = mono_ref_ms + (bus_ms - bus_ref_ms) * mono_rate */
+	double mono_ref_ms;
+	double mono_rate;
+	/* deviation of the device clock from its nominal frequency, in ppm */
+	double device_ppm;
+	/* deviation of the host clock from the bus clock, in ppm */
+	double host_ppm;
+	/* bound of the bus to host error: half of the shortest round trip */
+	double err_ms;
+};
+
+void osmo_st2_timesync_init(struct osmo_st2_timesync *ts);
+int osmo_st2_timesync_update(struct osmo_st2_timesync *ts, const struct simtrace_timesync_resp *resp,
+			     unsigned int len, const struct timespec *t_req, const struct timespec *t_resp);
+int osmo_st2_timesync_to_bus(const struct osmo_st2_timesync *ts, uint32_t cycles, double *bus_ms);
+int osmo_st2_timesync_to_mono(const struct osmo_st2_timesync *ts, uint32_t cycles, struct timespec *mono);
+int osmo_st2_timesync_to_wall(const struct osmo_st2_timesync *ts, uint32_t cycles, struct timespec *wall);
@@ -154,6 +154,50 @@ int osmo_st2_slot_tx_msg(struct osmo_st2_slot *slot, struct msgb *msg,
 	return rc;
 }
 
+/***********************************************************************
+ * Generic protocol
+ ***********************************************************************/
+
+/*! \brief Request a part of the firmware event trace ring
+ *  \param[in] slot slot whose transport is used
+ *  \param[in] offset first record to read, counted from the oldest one
+ *  \param[in] flags SIMTRACE_EVTRACE_F_* flags */
+int osmo_st2_generic_request_evtrace(struct osmo_st2_slot *slot, uint16_t offset, uint8_t flags)
+{
+	struct msgb *msg = st_msgb_alloc();
+	struct simtrace_evtrace_req *req;
+
+	LOGSLOT(slot, LOGL_DEBUG, "<= %s(offset=%u, flags=0x%02x)\n", __func__, offset, flags);
+
+	req = (struct simtrace_evtrace_req *) msgb_put(msg, sizeof(*req));
+	req->offset = offset;
+	req->flags = flags;
+
+	return osmo_st2_slot_tx_msg(slot, msg, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_EVTRACE);
+}
+
+/*! \brief Request the pending messages of the firmware deferred log
+ *  \param[in] slot slot whose transport is used */
+int osmo_st2_generic_request_dlog(struct osmo_st2_slot *slot)
+{
+	struct msgb *msg = st_msgb_alloc();
+
+	LOGSLOT(slot, LOGL_DEBUG, "<= %s\n", __func__);
+
+	return osmo_st2_slot_tx_msg(slot, msg, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_DLOG);
+}
+
+/*! \brief Request the latest start-of-frame / cycle counter pairs for time synchronization
+ *  \param[in] slot slot whose transport is used */
+int osmo_st2_generic_request_timesync(struct osmo_st2_slot *slot)
+{
+	struct msgb *msg = st_msgb_alloc();
+
+	LOGSLOT(slot, LOGL_DEBUG, "<= %s\n", __func__);
+
+	return osmo_st2_slot_tx_msg(slot, msg, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_TIMESYNC);
+}
+
 /***********************************************************************
  * Card Emulation protocol
  ***********************************************************************/
@@ -258,20 +302,181 @@ int osmo_st2_cardem_request_set_atr(struct osmo_st2_cardem_inst *ci, const uint8
 }
 
 int osmo_st2_cardem_request_config(struct osmo_st2_cardem_inst *ci, uint32_t features)
+{
+	return osmo_st2_cardem_request_config_fidi(ci, features, 0);
+}
+
+/*! \brief Request the SIMtrace2 to use the given features and speed policy
+ *  \param[in] ci card emulation instance
+ *  \param[in] features bit-mask of CEMU_FEAT_F_* flags
+ *  \param[in] max_fidi fastest F/D to advertise in TA1 and to accept in PPS
+ *  (encoded like TA1), 0 to use the ATR as is and accept any PPS */
+int osmo_st2_cardem_request_config_fidi(struct osmo_st2_cardem_inst *ci, uint32_t features,
+					uint8_t max_fidi)
 {
 	struct msgb *msg = st_msgb_alloc();
 	struct cardemu_usb_msg_config *cfg;
 
 	cfg = (struct cardemu_usb_msg_config *) msgb_put(msg, sizeof(*cfg));
 
-	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(features=%08x)\n", __func__, features);
+	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(features=%08x, max_fidi=%02x)\n", __func__,
+		features, max_fidi);
 
 	memset(cfg, 0, sizeof(*cfg));
 	cfg->features = features;
+	cfg->max_fidi = max_fidi;
 
 	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_CONFIG);
 }
 
+/*! \brief Request the SIMtrace2 to answer a TPDU on its own
+ *  \param[in] ci card emulation instance
+ *  \param[in] hdr TPDU header (CLA INS P1 P2 P3) to match
+ *  \param[in] data command data to match (NULL for TPDUs without command data)
+ *  \param[in] data_len length of data (0 or P3)
+ *  \param[in] resp bytes sent by the card after header (or command data): procedure byte, data, SW1 SW2
+ *  \param[in] resp_len length of resp
+ *
+ *  The firmware drops all entries when the card is reset. */
+int osmo_st2_cardem_request_cache_add(struct osmo_st2_cardem_inst *ci, const uint8_t *hdr,
+				      const uint8_t *data, uint8_t data_len,
+				      const uint8_t *resp, uint16_t resp_len)
+{
+	struct msgb *msg = st_msgb_alloc();
+	struct cardemu_usb_msg_cache_add *ce;
+	uint8_t *cur;
+
+	ce = (struct cardemu_usb_msg_cache_add *) msgb_put(msg, sizeof(*ce));
+
+	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s(hdr=%s, data_len=%u, resp=%s)\n", __func__,
+		osmo_hexdump(hdr, sizeof(ce->hdr)), data_len, osmo_hexdump(resp, resp_len));
+
+	memset(ce, 0, sizeof(*ce));
+	memcpy(ce->hdr, hdr, sizeof(ce->hdr));
+	ce->data_len = data_len;
+	ce->resp_len = resp_len;
+	if (data_len) {
+		cur = msgb_put(msg, data_len);
+		memcpy(cur, data, data_len);
+	}
+	cur = msgb_put(msg, resp_len);
+	memcpy(cur, resp, resp_len);
+
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_CACHE_ADD);
+}
+
+/*! \brief Request the SIMtrace2 to drop all cached TPDU responses */
+int osmo_st2_cardem_request_cache_flush(struct osmo_st2_cardem_inst *ci)
+{
+	struct msgb *msg = st_msgb_alloc();
+
+	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s()\n", __func__);
+
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_CACHE_FLUSH);
+}
+
+/*! \brief Request the SIMtrace2 to report its statistics counters
+ *  The counters are returned as SIMTRACE_MSGT_BD_CEMU_STATS on the IN endpoint */
+int osmo_st2_cardem_request_stats(struct osmo_st2_cardem_inst *ci)
+{
+	struct msgb *msg = st_msgb_alloc();
+
+	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s()\n", __func__);
+
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_STATS);
+}
+
+/*! \brief Request the SIMtrace2 to report the VCC voltage trace (latest, min, max, average)
+ *  The trace is returned as SIMTRACE_MSGT_BD_CEMU_VCC on the IN endpoint
+ *  \param[in] flags CEMU_VCC_F_RESET to restart min/max/average after this report */
+int osmo_st2_cardem_request_vcc(struct osmo_st2_cardem_inst *ci, uint8_t flags)
+{
+	struct msgb *msg = st_msgb_alloc();
+	struct cardemu_usb_msg_vcc_req *req;
+
+	req = (struct cardemu_usb_msg_vcc_req *) msgb_put(msg, sizeof(*req));
+	req->flags = flags;
+
+	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s(flags=0x%02x)\n", __func__, flags);
+
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_VCC);
+}
+
+/*! \brief Request the SIMtrace2 to store the current ATR and configuration in flash
+ *  \param[in] flags CEMU_PERSIST_F_ERASE to forget the stored configuration instead
+ *
+ *  The stored configuration is applied when the firmware starts, so the phone
+ *  gets the right ATR before the host connects.  The firmware writes the flash
+ *  once the reader switches off VCC, and then responds with
+ *  SIMTRACE_MSGT_BD_CEMU_PERSIST on the IN endpoint. */
+int osmo_st2_cardem_request_persist(struct osmo_st2_cardem_inst *ci, uint8_t flags)
+{
+	struct msgb *msg = st_msgb_alloc();
+	struct cardemu_usb_msg_persist_req *req;
+
+	req = (struct cardemu_usb_msg_persist_req *) msgb_put(msg, sizeof(*req));
+	req->flags = flags;
+
+	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(flags=0x%02x)\n", __func__, flags);
+
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_PERSIST);
+}
+
+/*! \brief Submit a slot schedule to the SIMtrace2 (boards with an external mux)
+ *  \param[in] ci card emulation instance
+ *  \param[in] flags CEMU_SCHED_F_LOOP to restart at the first entry after the last one
+ *  \param[in] entries array of schedule entries
+ *  \param[in] num_entries number of entries; 0 cancels the current schedule
+ *
+ *  Each time the reader switches off VCC, the firmware continues with the next
+ *  entry on its own: it selects the slot and the ATR, and reports the entry as
+ *  SIMTRACE_MSGT_DO_CEMU_SCHED_STEP on the IRQ endpoint. */
+int osmo_st2_cardem_request_schedule(struct osmo_st2_cardem_inst *ci, uint8_t flags,
+				     const struct osmo_st2_sched_entry *entries, unsigned int num_entries)
+{
+	unsigned int i = 0;
+	int rc;
+
+	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s(flags=0x%02x, num_entries=%u)\n", __func__, flags, num_entries);
+
+	flags &= ~CEMU_SCHED_F_APPEND;
+	do {
+		struct msgb *msg = st_msgb_alloc();
+		struct cardemu_usb_msg_schedule *sh;
+
+		sh = (struct cardemu_usb_msg_schedule *) msgb_put(msg, sizeof(*sh));
+		sh->flags = flags;
+		sh->num_entries = 0;
+
+		/* split the schedule into messages the firmware can receive */
+		for (; i < num_entries && sh->num_entries < 255; i++) {
+			const struct osmo_st2_sched_entry *e = &entries[i];
+			struct cardemu_usb_msg_sched_entry *se;
+
+			if (msgb_length(msg) + sizeof(*se) + e->atr_len > CEMU_SCHED_MSG_MAX)
+				break;
+			se = (struct cardemu_usb_msg_sched_entry *) msgb_put(msg, sizeof(*se) + e->atr_len);
+			se->slot_mux_nr = e->slot_mux_nr;
+			se->script_id = e->script_id;
+			se->atr_len = e->atr_len;
+			if (e->atr_len)
+				memcpy(se->atr, e->atr, e->atr_len);
+			sh->num_entries++;
+		}
+		if (!sh->num_entries && i < num_entries) {
+			msgb_free(msg);
+			return -EINVAL;
+		}
+
+		rc = osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_SCHEDULE);
+		if (rc < 0)
+			return rc;
+		flags |= CEMU_SCHED_F_APPEND;
+	} while (i < num_entries);
+
+	return 0;
+}
+
 /***********************************************************************
  * Modem Control protocol
  ***********************************************************************/
@@ -0,0 +1,290 @@
+/* timesync - map the SIMtrace2 cycle counter to USB bus and host time
+ *
+ * The firmware latches the USB start-of-frame (SOF) number together with
+ * its cycle counter every 100ms.  As every device on the bus sees the
+ * same SOF at the same time, fitting the cycle counter onto the frame
+ * number puts the traces of all devices on one time line (the bus time,
+ * in milliseconds), with an error of about the SOF interrupt latency.
+ *
+ * The frame number of the host controller is not available through
+ * libusb, so the bus time is related to CLOCK_MONOTONIC using the round
+ * trips of the requests: the device reports its cycle counter in the
+ * response, and it was read somewhere between the request and the
+ * response.  Only the shortest round trips are used, and the error of
+ * this mapping is bounded by half the shortest round trip.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include <osmocom/simtrace2/timesync.h>
+
+/* frame numbers are 11 bit */
+#define FRAME_MOD	2048
+/* the firmware latches a pair every 100ms; beyond this gap the cycle
+ * counter (32 bit) may have wrapped without us noticing */
+#define MAX_PAIR_GAP	300
+
+static double ts_to_ms(const struct timespec *t)
+{
+	return t->tv_sec * 1000.0 + t->tv_nsec / 1e6;
+}
+
+static void ms_to_ts(double ms, struct timespec *t)
+{
+	double sec = floor(ms / 1000.0);
+
+	t->tv_sec = sec;
+	t->tv_nsec = (ms - sec * 1000.0) * 1e6;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+/* least-squares fit of y = a + b * x, returned as the mean and the slope */
+struct fit {
+	unsigned int n;
+	double sx, sy, sxx, sxy;
+};
+
+static void fit_add(struct fit *f, double x, double y)
+{
+	f->n++;
+	f->sx += x;
+	f->sy += y;
+	f->sxx += x * x;
+	f->sxy += x * y;
+}
+
+static int fit_solve(const struct fit *f, double *x_mean, double *y_mean, double *slope)
+{
+	double var;
+
+	if (f->n < 2)
+		return -EAGAIN;
+	*x_mean = f->sx / f->n;
+	*y_mean = f->sy / f->n;
+	var = f->sxx / f->n - *x_mean * *x_mean;
+	if (var <= 0)
+		return -EAGAIN;
+	*slope = (f->sxy / f->n - *x_mean * *y_mean) / var;
+	return 0;
+}
+
+void osmo_st2_timesync_init(struct osmo_st2_timesync *ts)
+{
+	memset(ts, 0, sizeof(*ts));
+	ts->mono_rate = 1.0;
+}
+
+static unsigned int win_prev(unsigned int idx)
+{
+	return (idx + OSMO_ST2_TIMESYNC_WIN - 1) % OSMO_ST2_TIMESYNC_WIN;
+}
+
+static void add_pair(struct osmo_st2_timesync *ts, const struct simtrace_timesync_pair *pair)
+{
+	int64_t cycles = pair->cycles, frame = pair->frame;
+
+	if (ts->sof_len) {
+		const unsigned int prev = win_prev(ts->sof_idx);
+		uint32_t d_cycles = pair->cycles - ts->last_cycles;
+		uint16_t d_frame = (pair->frame - ts->last_frame) % FRAME_MOD;
+		/* the cycle counter tells how often the frame number wrapped */
+		double elapsed_ms = d_cycles * 1000.0 / ts->cycles_per_sec;
+
+		cycles = ts->sof[prev].cycles + d_cycles;
+		frame = ts->sof[prev].frame + d_frame + FRAME_MOD * lround((elapsed_ms - d_frame) / FRAME_MOD);
+	}
+
+	ts->sof[ts->sof_idx].cycles = cycles;
+	ts->sof[ts->sof_idx].frame = frame;
+	ts->sof_idx = (ts->sof_idx + 1) % OSMO_ST2_TIMESYNC_WIN;
+	if (ts->sof_len < OSMO_ST2_TIMESYNC_WIN)
+		ts->sof_len++;
+	ts->last_cycles = pair->cycles;
+	ts->last_frame = pair->frame;
+}
+
+/* cycle counter (unwrapped) to bus time, using the current fit */
+static double cycles_to_bus(const struct osmo_st2_timesync *ts, int64_t cycles)
+{
+	return ts->bus_ref_ms + (cycles - ts->cycles_ref) * ts->ms_per_cycle;
+}
+
+static int estimate_bus(struct osmo_st2_timesync *ts)
+{
+	const unsigned int latest = win_prev(ts->sof_idx);
+	double x_mean, y_mean, slope;
+	struct fit f = {};
+	unsigned int i;
+	int rc;
+
+	/* relative to the latest pair, to keep the precision of doubles */
+	for (i = 0; i < ts->sof_len; i++)
+		fit_add(&f, ts->sof[i].cycles - ts->sof[latest].cycles, ts->sof[i].frame - ts->sof[latest].frame);
+	rc = fit_solve(&f, &x_mean, &y_mean, &slope);
+	if (rc < 0)
+		return rc;
+
+	ts->cycles_ref = ts->sof[latest].cycles;
+	ts->bus_ref_ms = ts->sof[latest].frame + y_mean - slope * x_mean;
+	ts->ms_per_cycle = slope;
+	ts->device_ppm = (1000.0 / ts->cycles_per_sec / slope - 1.0) * 1e6;
+	return 0;
+}
+
+static int estimate_mono(struct osmo_st2_timesync *ts)
+{
+	double min_rtt = INFINITY, bus_best = 0, mono_best = 0, max_rtt;
+	double x_mean, y_mean, slope;
+	struct fit f = {};
+	unsigned int i;
+
+	for (i = 0; i < ts->rt_len; i++) {
+		if (ts->rt[i].rtt_ms < min_rtt) {
+			min_rtt = ts->rt[i].rtt_ms;
+			bus_best = cycles_to_bus(ts, ts->rt[i].cycles);
+			mono_best = ts->rt[i].mono_ms;
+		}
+	}
+	if (!ts->rt_len)
+		return -EAGAIN;
+
+	/* the rate only from the round trips close to the shortest one, the
+	 * others mostly measure the scheduling of the host */
+	max_rtt = min_rtt + fmax(min_rtt / 2, 0.1);
+	for (i = 0; i < ts->rt_len; i++) {
+		if (ts->rt[i].rtt_ms > max_rtt)
+			continue;
+		fit_add(&f, cycles_to_bus(ts, ts->rt[i].cycles) - bus_best, ts->rt[i].mono_ms - mono_best);
+	}
+	/* a span of a few seconds is needed before the rate means anything */
+	if (fit_solve(&f, &x_mean, &y_mean, &slope) == 0 && f.sxx / f.n - x_mean * x_mean > 1e6) {
+		ts->mono_rate = slope;
+		/* through the centre of the short round trips */
+		ts->mono_ref_ms = mono_best + y_mean + (ts->bus_ref_ms - bus_best - x_mean) * slope;
+	} else {
+		/* the offset from the shortest round trip alone */
+		ts->mono_ref_ms = mono_best + (ts->bus_ref_ms - bus_best) * ts->mono_rate;
+	}
+	ts->host_ppm = (ts->mono_rate - 1.0) * 1e6;
+	ts->err_ms = min_rtt / 2;
+	return 0;
+}
+
+/*! \brief Update the clock model with a SIMTRACE_CMD_BD_TIMESYNC response
+ *  \param[in] ts clock model of the device
+ *  \param[in] resp response payload (after the message header)
+ *  \param[in] len length of the response payload
+ *  \param[in] t_req CLOCK_MONOTONIC before the request was submitted
+ *  \param[in] t_resp CLOCK_MONOTONIC after the response was received
+ *  \returns 0 if the model can be used, -EAGAIN if more responses are needed */
+int osmo_st2_timesync_update(struct osmo_st2_timesync *ts, const struct simtrace_timesync_resp *resp,
+			     unsigned int len, const struct timespec *t_req, const struct timespec *t_resp)
+{
+	uint32_t first;
+	unsigned int i;
+	int rc;
+
+	if (len < sizeof(*resp) || len < sizeof(*resp) + resp->num_pairs * sizeof(resp->pairs[0]))
+		return -EINVAL;
+	if (resp->cycles_per_sec == 0)
+		return -EINVAL;
+
+	/* restart from scratch after a reset of the device, or after a gap
+	 * long enough for the cycle counter to wrap */
+	if (resp->cycles_per_sec != ts->cycles_per_sec ||
+	    (ts->have_pair && (int32_t) (resp->num_latched - ts->last_num) < 0) ||
+	    (ts->have_pair && resp->num_latched - ts->last_num > MAX_PAIR_GAP)) {
+		osmo_st2_timesync_init(ts);
+		ts->cycles_per_sec = resp->cycles_per_sec;
+	}
+
+	first = resp->num_latched - resp->num_pairs;
+	for (i = 0; i < resp->num_pairs; i++) {
+		uint32_t num = first + i;
+
+		if (ts->have_pair && (int32_t) (num - ts->last_num) <= 0)
+			continue;
+		add_pair(ts, &resp->pairs[i]);
+		ts->last_num = num;
+		ts->have_pair = true;
+	}
+
+	rc = estimate_bus(ts);
+	if (rc < 0)
+		return rc;
+
+	ts->rt[ts->rt_idx].cycles = ts->cycles_ref + (int32_t) (resp->cycles_now - ts->last_cycles);
+	ts->rt[ts->rt_idx].mono_ms = (ts_to_ms(t_req) + ts_to_ms(t_resp)) / 2;
+	ts->rt[ts->rt_idx].rtt_ms = ts_to_ms(t_resp) - ts_to_ms(t_req);
+	ts->rt_idx = (ts->rt_idx + 1) % OSMO_ST2_TIMESYNC_WIN;
+	if (ts->rt_len < OSMO_ST2_TIMESYNC_WIN)
+		ts->rt_len++;
+
+	rc = estimate_mono(ts);
+	if (rc < 0)
+		return rc;
+
+	ts->valid = true;
+	return 0;
+}
+
+/*! \brief Convert a cycle counter value of the device to bus time
+ *  \param[in] ts clock model of the device
+ *  \param[in] cycles cycle counter value, within about 30s of the latest update
+ *  \param[out] bus_ms bus time in milliseconds (frame numbers, unwrapped)
+ *  \returns 0 on success, -EAGAIN if the model is not usable yet */
+int osmo_st2_timesync_to_bus(const struct osmo_st2_timesync *ts, uint32_t cycles, double *bus_ms)
+{
+	if (!ts->valid)
+		return -EAGAIN;
+
+	*bus_ms = cycles_to_bus(ts, ts->cycles_ref + (int32_t) (cycles - ts->last_cycles));
+	return 0;
+}
+
+/*! \brief Convert a cycle counter value of the device to CLOCK_MONOTONIC */
+int osmo_st2_timesync_to_mono(const struct osmo_st2_timesync *ts, uint32_t cycles, struct timespec *mono)
+{
+	double bus_ms;
+	int rc;
+
+	rc = osmo_st2_timesync_to_bus(ts, cycles, &bus_ms);
+	if (rc < 0)
+		return rc;
+
+	ms_to_ts(ts->mono_ref_ms + (bus_ms - ts->bus_ref_ms) * ts->mono_rate, mono);
+	return 0;
+}
+
+/*! \brief Convert a cycle counter value of the device to CLOCK_REALTIME */
+int osmo_st2_timesync_to_wall(const struct osmo_st2_timesync *ts, uint32_t cycles, struct timespec *wall)
+{
+	struct timespec mono, now_mono, now_real;
+	int rc;
+
+	rc = osmo_st2_timesync_to_mono(ts, cycles, &mono);
+	if (rc < 0)
+		return rc;
+
+	/* the wall clock may be stepped, so use its current offset */
+	clock_gettime(CLOCK_MONOTONIC, &now_mono);
+	clock_gettime(CLOCK_REALTIME, &now_real);
+	ms_to_ts(ts_to_ms(&mono) + ts_to_ms(&now_real) - ts_to_ms(&now_mono), wall);
+	return 0;
+}
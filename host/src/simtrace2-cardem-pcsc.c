@@ -72,6 +72,33 @@ static void cemu_status_flags2str(char *out, unsigned int out_len, uint32_t flag
 		 flags & CEMU_STATUS_F_RCEMU_ACTIVE ? "RCEMU " : "");
 }
 
+/* ISO 7816-3 Table 7 (Fi) and Table 8 (Di), 0 for RFU */
+static const uint16_t fi_table[] = { 372, 372, 558, 744, 1116, 1488, 1860, 0, 0, 512, 768, 1024, 1536, 2048, 0, 0, };
+static const uint8_t di_table[] = { 0, 1, 2, 4, 8, 16, 32, 64, 12, 20, 2, 4, 8, 16, 32, 64, };
+
+/* len includes the message header, older firmware does not send clk_hz */
+static void cemu_status_clk2str(char *out, unsigned int out_len, const struct cardemu_usb_msg_status *status,
+				int len)
+{
+	unsigned int f, d;
+	uint64_t wt_us;
+
+	if (len < sizeof(struct simtrace_msg_hdr) + sizeof(*status) || !status->clk_hz) {
+		snprintf(out, out_len, "clk=?");
+		return;
+	}
+	f = fi_table[status->F_index & 0x0f];
+	d = di_table[status->D_index & 0x0f];
+	if (!f || !d) {
+		snprintf(out, out_len, "clk=%u.%03uMHz", status->clk_hz / 1000000, (status->clk_hz / 1000) % 1000);
+		return;
+	}
+	/* the waiting time is counted in ETU of F/D clock cycles */
+	wt_us = (uint64_t) status->waiting_time * f * 1000000 / d / status->clk_hz;
+	snprintf(out, out_len, "clk=%u.%03uMHz wtime=%u.%03ums", status->clk_hz / 1000000,
+		 (status->clk_hz / 1000) % 1000, (unsigned int) (wt_us / 1000), (unsigned int) (wt_us % 1000));
+}
+
 static uint32_t last_status_flags = 0;
 
 #define NO_RESET 0
@@ -131,11 +158,13 @@ static int process_do_status(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int
 {
 	struct cardemu_usb_msg_status *status = (struct cardemu_usb_msg_status *) buf;
 	char fbuf[80];
+	char cbuf[48];
 
 	cemu_status_flags2str(fbuf, sizeof(fbuf), status->flags);
-	LOGCI(ci, LOGL_NOTICE, "=> STATUS: flags=0x%x, fi=%u, di=%u, wi=%u wtime=%u (%s)\n",
+	cemu_status_clk2str(cbuf, sizeof(cbuf), status, len);
+	LOGCI(ci, LOGL_NOTICE, "=> STATUS: flags=0x%x, fi=%u, di=%u, wi=%u wtime=%u %s (%s)\n",
 		status->flags, status->fi, status->di, status->wi,
-		status->waiting_time, fbuf);
+		status->waiting_time, cbuf, fbuf);
 
 	update_status_flags(ci, status->flags);
 
@@ -149,10 +178,48 @@ static int process_do_pts(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int len
 	pts = (struct cardemu_usb_msg_pts_info *) buf;
 
 	LOGCI(ci, LOGL_NOTICE, "=> PTS req: %s\n", osmo_hexdump(pts->req, pts->pts_len));
+	/* PPS1 is only present in the response if the reader's F/D proposal was accepted */
+	LOGCI(ci, LOGL_NOTICE, "=> PTS resp: %s\n", osmo_hexdump(pts->resp, pts->pts_len));
 
 	return 0;
 }
 
+/* offer the responses to commands reading the current file to the firmware's cache */
+static bool cache_reads = false;
+
+/*! \brief Would the firmware answer this command from its cache? (see struct cardemu_usb_msg_cache_add) */
+static bool cache_hdr_allowed(const struct osim_apdu_cmd_hdr *hdr)
+{
+	switch (hdr->ins) {
+	case 0xB0:	/* READ BINARY, not selecting by short file identifier */
+		return !(hdr->p1 & 0x80);
+	case 0xB2:	/* READ RECORD, absolute mode on the current EF */
+		return hdr->p2 == 0x04;
+	case 0xF2:	/* STATUS */
+		return hdr->p1 == 0x00;
+	default:
+		return false;
+	}
+}
+
+/*! \brief Add the complete response of a successful read command to the firmware's cache */
+static void cache_response(struct osmo_st2_cardem_inst *ci, const struct osmo_apdu_context *ac,
+			   const uint8_t *data, unsigned int data_len)
+{
+	uint8_t resp[1 + 256 + 2];
+
+	if (ac->apdu_case != 2 || !cache_hdr_allowed(&ac->hdr))
+		return;
+	if (ac->sw[0] != 0x90 || ac->sw[1] != 0x00 || data_len != (ac->hdr.p3 ? ac->hdr.p3 : 256))
+		return;
+
+	resp[0] = ac->hdr.ins;
+	memcpy(resp + 1, data, data_len);
+	memcpy(resp + 1 + data_len, ac->sw, sizeof(ac->sw));
+	osmo_st2_cardem_request_cache_add(ci, (const uint8_t *) &ac->hdr, NULL, 0, resp,
+					  1 + data_len + sizeof(ac->sw));
+}
+
 /*! \brief Process a RX-DATA indication message from the SIMtrace2 */
 static int process_do_rx_da(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int len)
 {
@@ -205,12 +272,41 @@ static int process_do_rx_da(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int l
 		if (msgb_l3len(tmsg))
 			osmo_st2_cardem_request_pb_and_tx(ci, ac.hdr.ins, tmsg->l3h, msgb_l3len(tmsg));
 		osmo_st2_cardem_request_sw_tx(ci, ac.sw);
+		if (cache_reads)
+			cache_response(ci, &ac, tmsg->l3h, msgb_l3len(tmsg));
 	} else if (ac.lc.tot > ac.lc.cur) {
 		osmo_st2_cardem_request_pb_and_rx(ci, ac.hdr.ins, ac.lc.tot - ac.lc.cur);
 	}
 	return 0;
 }
 
+/*! \brief Process a PERSIST response (the configuration was written to flash) */
+static int process_bd_persist(struct osmo_st2_cardem_inst *ci, const uint8_t *buf, int len)
+{
+	const struct cardemu_usb_msg_persist *p = (struct cardemu_usb_msg_persist *) buf;
+
+	if (p->rc < 0)
+		LOGCI(ci, LOGL_ERROR, "=> PERSIST: storing the configuration failed (%d)\n", p->rc);
+	else
+		LOGCI(ci, LOGL_NOTICE, "=> PERSIST: configuration stored (write #%u)\n", p->seq);
+
+	return 0;
+}
+
+/*! \brief Process an ERROR message (a request has been rejected by the SIMtrace2) */
+static int process_do_error(struct osmo_st2_cardem_inst *ci, const uint8_t *buf, int len)
+{
+	const struct cardemu_usb_msg_error *err = (struct cardemu_usb_msg_error *) buf;
+
+	if (len < sizeof(struct simtrace_msg_hdr) + sizeof(*err))
+		return -1;
+
+	LOGCI(ci, LOGL_ERROR, "=> ERROR: request type 0x%02x rejected: %s\n",
+	      err->subsystem, strerror(err->code));
+
+	return 0;
+}
+
 /*! \brief Process an incoming message from the SIMtrace2 */
 static int process_usb_msg(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int len)
 {
@@ -219,6 +315,9 @@ static int process_usb_msg(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int le
 
 	buf += sizeof(*sh);
 
+	if (sh->msg_class == SIMTRACE_MSGC_GENERIC && sh->msg_type == SIMTRACE_CMD_DO_ERROR)
+		return process_do_error(ci, buf, len);
+
 	switch (sh->msg_type) {
 	case SIMTRACE_MSGT_BD_CEMU_STATUS:
 		rc = process_do_status(ci, buf, len);
@@ -233,6 +332,9 @@ static int process_usb_msg(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int le
 		/* firmware confirms configuration change; ignore */
 		rc = 0;
 		break;
+	case SIMTRACE_MSGT_BD_CEMU_PERSIST:
+		rc = process_bd_persist(ci, buf, len);
+		break;
 	default:
 		printf("unknown simtrace msg type 0x%02x\n", sh->msg_type);
 		rc = -1;
@@ -247,17 +349,33 @@ static int process_irq_status(struct osmo_st2_cardem_inst *ci, const uint8_t *bu
 {
 	const struct cardemu_usb_msg_status *status = (struct cardemu_usb_msg_status *) buf;
 	char fbuf[80];
+	char cbuf[48];
 
 	cemu_status_flags2str(fbuf, sizeof(fbuf), status->flags);
-	LOGCI(ci, LOGL_NOTICE, "=> IRQ STATUS: flags=0x%x, fi=%u, di=%u, wi=%u wtime=%u (%s)\n",
+	cemu_status_clk2str(cbuf, sizeof(cbuf), status, len);
+	LOGCI(ci, LOGL_NOTICE, "=> IRQ STATUS: flags=0x%x, fi=%u, di=%u, wi=%u wtime=%u %s (%s)\n",
 		status->flags, status->fi, status->di, status->wi,
-		status->waiting_time, fbuf);
+		status->waiting_time, cbuf, fbuf);
 
 	update_status_flags(ci, status->flags);
 
 	return 0;
 }
 
+/*! \brief Process a SCHED_STEP message on IRQ endpoint from the SIMtrace2 */
+static int process_irq_sched_step(struct osmo_st2_cardem_inst *ci, const uint8_t *buf, int len)
+{
+	const struct cardemu_usb_msg_sched_step *step = (struct cardemu_usb_msg_sched_step *) buf;
+
+	if (step->index == CEMU_SCHED_IDX_DONE)
+		LOGCI(ci, LOGL_NOTICE, "=> IRQ SCHED_STEP: schedule done\n");
+	else
+		LOGCI(ci, LOGL_NOTICE, "=> IRQ SCHED_STEP: entry %u, slot %u, script %u\n",
+			step->index, step->slot_mux_nr, step->script_id);
+
+	return 0;
+}
+
 static int process_usb_msg_irq(struct osmo_st2_cardem_inst *ci, const uint8_t *buf, unsigned int len)
 {
 	struct simtrace_msg_hdr *sh = (struct simtrace_msg_hdr *)buf;
@@ -269,6 +387,9 @@ static int process_usb_msg_irq(struct osmo_st2_cardem_inst *ci, const uint8_t *b
 	case SIMTRACE_MSGT_BD_CEMU_STATUS:
 		rc = process_irq_status(ci, buf, len);
 		break;
+	case SIMTRACE_MSGT_DO_CEMU_SCHED_STEP:
+		rc = process_irq_sched_step(ci, buf, len);
+		break;
 	default:
 		LOGCI(ci, LOGL_ERROR, "unknown simtrace msg type 0x%02x\n", sh->msg_type);
 		rc = -1;
@@ -401,6 +522,9 @@ static void print_help(void)
 		"\t-i\t--gsmtap-ip\tA.B.C.D\n"
 		"\t-a\t--skip-atr\n"
 		"\t-t\t--set-atr\tATR-STRING in HEX\n"
+		"\t-f\t--max-fidi\tTA1 in HEX (fastest F/D to offer to the phone)\n"
+		"\t-p\t--persist\t(store ATR and configuration in the device for the next start)\n"
+		"\t-c\t--cache\t(let the device answer repeated reads of the current file)\n"
 		"\t-k\t--keep-running\n"
 		"\t-n\t--pcsc-reader-num\n"
 		"\t-V\t--usb-vendor\tVENDOR_ID\n"
@@ -418,7 +542,10 @@ static const struct option opts[] = {
 	{ "gsmtap-ip", 1, 0, 'i' },
 	{ "skip-atr", 0, 0, 'a' },
 	{ "set-atr", 1, 0, 't' },
+	{ "max-fidi", 1, 0, 'f' },
 	{ "help", 0, 0, 'h' },
+	{ "persist", 0, 0, 'p' },
+	{ "cache", 0, 0, 'c' },
 	{ "keep-running", 0, 0, 'k' },
 	{ "pcsc-reader-num", 1, 0, 'n' },
 	{ "usb-vendor", 1, 0, 'V' },
@@ -474,7 +601,9 @@ int main(int argc, char **argv)
 	int rc;
 	int c, ret = 1;
 	int skip_atr = 0;
+	int persist = 0;
 	char *atr = NULL;
+	uint8_t max_fidi = 0;
 	uint8_t override_atr[OSIM_MAX_ATR_LEN];
 	int override_atr_len = 0;
 	int keep_running = 0;
@@ -506,7 +635,7 @@ int main(int argc, char **argv)
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "hi:V:P:C:I:S:A:H:akn:t:", opts, &option_index);
+		c = getopt_long(argc, argv, "hi:V:P:C:I:S:A:H:akpcn:t:f:", opts, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -523,6 +652,15 @@ int main(int argc, char **argv)
 		case 't':
 		        atr = optarg;
 			break;
+		case 'f':
+			max_fidi = strtol(optarg, NULL, 16);
+			break;
+		case 'p':
+			persist = 1;
+			break;
+		case 'c':
+			cache_reads = true;
+			break;
 		case 'k':
 			keep_running = 1;
 			break;
@@ -632,8 +770,10 @@ int main(int argc, char **argv)
 		for (int i = 0; i < 4; i++)
 			allocate_and_submit_in(ci);
 
-		/* request firmware to generate STATUS on IRQ endpoint */
-		osmo_st2_cardem_request_config(ci, CEMU_FEAT_F_STATUS_IRQ);
+		/* request firmware to generate STATUS on IRQ endpoint, and to
+		 * acknowledge TPDU headers of commands with data on its own */
+		osmo_st2_cardem_request_config_fidi(ci, CEMU_FEAT_F_STATUS_IRQ | CEMU_FEAT_F_AUTO_PB_RX,
+						    max_fidi);
 
 		/* simulate card-insert to modem (owhw, not qmod) */
 		osmo_st2_cardem_request_card_insert(ci, true);
@@ -653,6 +793,10 @@ int main(int argc, char **argv)
 			}
 		}
 
+		/* let the firmware use this ATR and configuration right after the next start */
+		if (persist)
+			osmo_st2_cardem_request_persist(ci, 0);
+
 		/* select remote (forwarded) SIM */
 		osmo_st2_modem_reset_pulse(ci->slot, 300);
 
@@ -0,0 +1,928 @@
+/* simtrace2-octsimtest-batch - run a list of card tests on all slots of
+ * all octsimtest boards attached to the host
+ *
+ * Every octsimtest board emulates one card at a time, which its mux
+ * connects to one of the slots.  The boards are driven concurrently from a
+ * single event loop, each with a slot schedule: the firmware switches to the
+ * next slot and ATR as soon as the reader of the current slot switches off
+ * VCC, so no slot waits for a round trip to the host.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include <libusb.h>
+
+#include <osmocom/usb/libusb.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
+#include <osmocom/simtrace2/simtrace_prot.h>
+#include <osmocom/simtrace2/simtrace_usb.h>
+#include <osmocom/simtrace2/apdu_dispatch.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/application.h>
+#include <osmocom/sim/sim.h>
+
+#define LOGB(b, lvl, fmt, args ...) LOGP(DLGLOBAL, lvl, "%s: " fmt, (b)->ci.usb_path, ## args)
+
+/* slots of the octsimtest mux */
+#define BATCH_SLOTS_MAX		8
+#define BATCH_BOARDS_MAX	32
+#define BATCH_TIMEOUT_DEFAULT	30
+/* seconds a reader has to end its session after the card was pulled */
+#define BATCH_RELEASE_TIMEOUT	10
+
+/* schedule entries sent to the firmware at a time.  A new chunk is appended
+ * whenever less than one chunk is left, so the firmware always knows the
+ * next slot, without holding more messages than it has room for. */
+#define SCHED_CHUNK		4
+
+/***********************************************************************
+ * Test list
+ ***********************************************************************/
+
+/* response to a command APDU starting with cmd (any command if cmd_len is 0) */
+struct batch_rule {
+	struct llist_head list;
+	uint8_t cmd[5 + 256];
+	unsigned int cmd_len;
+	/* response data, followed by SW1 SW2 */
+	uint8_t resp[256 + 2];
+	unsigned int resp_len;
+};
+
+struct batch_test {
+	struct llist_head list;
+	char name[64];
+	uint8_t atr[OSIM_MAX_ATR_LEN];
+	uint8_t atr_len;
+	/* seconds from selecting the slot until the reader ended the session */
+	unsigned int timeout_s;
+	struct llist_head rules;
+};
+
+static LLIST_HEAD(g_tests);
+static unsigned int g_num_tests;
+
+static int parse_hex(const char *str, uint8_t *out, unsigned int out_len)
+{
+	int rc = osmo_hexparse(str, out, out_len);
+	if (rc < 0)
+		fprintf(stderr, "invalid hex string '%s'\n", str);
+	return rc;
+}
+
+/* test list format, one keyword per line ('#' starts a comment):
+ *   test NAME ATR [TIMEOUT_S]
+ *   apdu CMD RESP
+ * apdu lines belong to the test before them.  The C-APDU is matched by its
+ * first bytes given as CMD ("*" for any command), RESP contains the response
+ * data and the status word.  Response data of a command with command data is
+ * announced by 61xx and sent on the following GET RESPONSE. */
+static int read_test_list(const char *fname)
+{
+	struct batch_test *test = NULL;
+	char line[1024];
+	unsigned int line_nr = 0;
+	FILE *f;
+	int rc = 0;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char *kw, *arg[3], *save;
+		int i, num_args = 0;
+
+		line_nr++;
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+		kw = strtok_r(line, " \t\r\n", &save);
+		if (!kw)
+			continue;
+		for (i = 0; i < ARRAY_SIZE(arg); i++) {
+			arg[i] = strtok_r(NULL, " \t\r\n", &save);
+			if (!arg[i])
+				break;
+			num_args++;
+		}
+
+		if (!strcmp(kw, "test") && num_args >= 2) {
+			test = calloc(1, sizeof(*test));
+			OSMO_ASSERT(test);
+			INIT_LLIST_HEAD(&test->rules);
+			osmo_strlcpy(test->name, arg[0], sizeof(test->name));
+			rc = parse_hex(arg[1], test->atr, sizeof(test->atr));
+			if (rc < 2) {
+				free(test);
+				rc = -EINVAL;
+				break;
+			}
+			test->atr_len = rc;
+			test->timeout_s = BATCH_TIMEOUT_DEFAULT;
+			if (num_args > 2) {
+				char *end;
+				unsigned long timeout_s = strtoul(arg[2], &end, 10);
+				/* a timeout of 0 would fail the test right away */
+				if (*end || !timeout_s || timeout_s > UINT_MAX) {
+					fprintf(stderr, "invalid timeout '%s'\n", arg[2]);
+					free(test);
+					rc = -EINVAL;
+					break;
+				}
+				test->timeout_s = timeout_s;
+			}
+			llist_add_tail(&test->list, &g_tests);
+			g_num_tests++;
+		} else if (!strcmp(kw, "apdu") && num_args == 2 && test) {
+			struct batch_rule *rule = calloc(1, sizeof(*rule));
+			OSMO_ASSERT(rule);
+			if (strcmp(arg[0], "*")) {
+				rc = parse_hex(arg[0], rule->cmd, sizeof(rule->cmd));
+				if (rc < 0) {
+					free(rule);
+					rc = -EINVAL;
+					break;
+				}
+				rule->cmd_len = rc;
+			}
+			rc = parse_hex(arg[1], rule->resp, sizeof(rule->resp));
+			if (rc < 2) {
+				free(rule);
+				rc = -EINVAL;
+				break;
+			}
+			rule->resp_len = rc;
+			llist_add_tail(&rule->list, &test->rules);
+		} else {
+			rc = -EINVAL;
+			break;
+		}
+		rc = 0;
+	}
+	fclose(f);
+
+	if (rc < 0) {
+		fprintf(stderr, "%s:%u: invalid line\n", fname, line_nr);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/***********************************************************************
+ * Boards and jobs
+ ***********************************************************************/
+
+enum batch_result {
+	RESULT_PENDING,
+	RESULT_RUNNING,
+	RESULT_PASS,
+	RESULT_FAIL,
+};
+
+static const struct value_string batch_result_names[] = {
+	{ RESULT_PENDING,	"pending" },
+	{ RESULT_RUNNING,	"running" },
+	{ RESULT_PASS,		"pass" },
+	{ RESULT_FAIL,		"fail" },
+	{ 0, NULL }
+};
+
+/* one test on one slot of one board */
+struct batch_job {
+	const struct batch_test *test;
+	uint8_t slot;
+	enum batch_result result;
+	const char *reason;
+	struct timespec start;
+	struct timespec end;
+	bool vcc_seen;
+	unsigned int apdus;
+	unsigned int unexpected;
+};
+
+struct batch_board {
+	struct osmo_st2_transport transp;
+	struct osmo_st2_slot slot;
+	struct osmo_st2_cardem_inst ci;
+	struct osmo_apdu_context ac;
+
+	/* all jobs of the board, in schedule order; the index is the script_id */
+	struct batch_job *jobs;
+	unsigned int num_jobs;
+	/* first job not yet sent to the firmware */
+	unsigned int next_submit;
+	/* first job of the latest schedule message */
+	unsigned int last_submit;
+	/* job of the active schedule entry */
+	struct batch_job *cur;
+	/* rule whose response data is fetched by the next GET RESPONSE */
+	const struct batch_rule *get_resp;
+	/* the card was pulled after a timeout, until the next job's slot is selected */
+	bool card_pulled;
+	struct osmo_timer_list timer;
+	bool finished;
+	/* the USB device disappeared */
+	bool gone;
+};
+
+static struct batch_board *g_boards[BATCH_BOARDS_MAX];
+static unsigned int g_num_boards;
+static unsigned int g_boards_finished;
+
+static void job_finish(struct batch_job *job, enum batch_result result, const char *reason)
+{
+	clock_gettime(CLOCK_MONOTONIC, &job->end);
+	job->result = result;
+	job->reason = reason;
+}
+
+static void board_finish(struct batch_board *b)
+{
+	unsigned int i;
+
+	if (b->finished)
+		return;
+
+	/* jobs that never started: aborted, or the board disappeared */
+	for (i = 0; i < b->num_jobs; i++) {
+		if (b->jobs[i].result == RESULT_PENDING)
+			job_finish(&b->jobs[i], RESULT_FAIL, "not run");
+	}
+
+	osmo_timer_del(&b->timer);
+	if (!b->gone)
+		osmo_st2_cardem_request_card_insert(&b->ci, false);
+	b->finished = true;
+	g_boards_finished++;
+	LOGB(b, LOGL_NOTICE, "all jobs done\n");
+}
+
+/* send the schedule entries of the jobs from next_submit on; only extend the
+ * running schedule if append is set */
+static int board_submit(struct batch_board *b, bool append)
+{
+	struct osmo_st2_sched_entry entries[SCHED_CHUNK];
+	unsigned int num = 0;
+	uint8_t flags = 0;
+
+	b->last_submit = b->next_submit;
+	while (num < SCHED_CHUNK && b->next_submit < b->num_jobs) {
+		struct batch_job *job = &b->jobs[b->next_submit];
+		entries[num].slot_mux_nr = job->slot;
+		entries[num].script_id = b->next_submit;
+		entries[num].atr = job->test->atr;
+		entries[num].atr_len = job->test->atr_len;
+		b->next_submit++;
+		num++;
+	}
+	if (!num && append)
+		return 0;
+
+	if (append)
+		flags |= CEMU_SCHED_F_APPEND;
+	return osmo_st2_cardem_request_schedule(&b->ci, flags, entries, num);
+}
+
+/* keep at least one chunk of entries queued behind the active one */
+static void board_refill(struct batch_board *b)
+{
+	unsigned int active = b->cur ? b->cur - b->jobs : 0;
+
+	if (b->next_submit - active - 1 < SCHED_CHUNK)
+		board_submit(b, true);
+}
+
+/* the reader ended the session of the active job by switching off VCC */
+static void board_end_cur(struct batch_board *b)
+{
+	struct batch_job *job = b->cur;
+
+	if (!job)
+		return;
+	osmo_timer_del(&b->timer);
+	b->cur = NULL;
+	b->get_resp = NULL;
+
+	if (job->unexpected)
+		job_finish(job, RESULT_FAIL, "unexpected APDU");
+	else if (!job->apdus)
+		job_finish(job, RESULT_FAIL, "no APDU");
+	else
+		job_finish(job, RESULT_PASS, NULL);
+
+	LOGB(b, LOGL_INFO, "slot %u: %s: %s\n", job->slot, job->test->name,
+	     get_value_string(batch_result_names, job->result));
+}
+
+static void board_start_job(struct batch_board *b, struct batch_job *job)
+{
+	b->cur = job;
+	job->result = RESULT_RUNNING;
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	osmo_timer_schedule(&b->timer, job->test->timeout_s, 0);
+	LOGB(b, LOGL_INFO, "slot %u: %s: started\n", job->slot, job->test->name);
+}
+
+static void board_timeout_cb(void *data)
+{
+	struct batch_board *b = data;
+	struct batch_job *job = b->cur;
+
+	if (!job) {
+		/* the firmware stays on the slot of the timed out job */
+		LOGB(b, LOGL_ERROR, "reader does not end its session after pulling the card\n");
+		osmo_st2_cardem_request_schedule(&b->ci, 0, NULL, 0);
+		board_finish(b);
+		return;
+	}
+	b->cur = NULL;
+	job_finish(job, RESULT_FAIL, job->vcc_seen ? "timeout" : "not powered");
+	LOGB(b, LOGL_NOTICE, "slot %u: %s: %s\n", job->slot, job->test->name, job->reason);
+
+	b->next_submit = job - b->jobs + 1;
+	if (b->next_submit >= b->num_jobs) {
+		osmo_st2_cardem_request_schedule(&b->ci, 0, NULL, 0);
+		board_finish(b);
+		return;
+	}
+
+	/* replace the schedule by the remaining jobs, and pull the card to
+	 * make a hanging reader end its session: the firmware switches to the
+	 * next job once VCC is off, which starts it (and re-inserts the card).
+	 * Until then, the APDUs of the old session belong to no job. */
+	osmo_st2_cardem_request_card_insert(&b->ci, false);
+	b->card_pulled = true;
+	board_submit(b, false);
+	osmo_timer_schedule(&b->timer, BATCH_RELEASE_TIMEOUT, 0);
+}
+
+/***********************************************************************
+ * Incoming Messages
+ ***********************************************************************/
+
+static void process_irq_status(struct batch_board *b, const uint8_t *buf, int len)
+{
+	const struct cardemu_usb_msg_status *status = (struct cardemu_usb_msg_status *) buf;
+
+	if (b->cur && (status->flags & CEMU_STATUS_F_VCC_PRESENT))
+		b->cur->vcc_seen = true;
+}
+
+static void process_irq_sched_step(struct batch_board *b, const uint8_t *buf, int len)
+{
+	const struct cardemu_usb_msg_sched_step *step = (struct cardemu_usb_msg_sched_step *) buf;
+	struct batch_job *job;
+
+	if (step->index == CEMU_SCHED_IDX_DONE) {
+		board_end_cur(b);
+		if (b->next_submit >= b->num_jobs)
+			board_finish(b);
+		else
+			board_submit(b, false);
+		return;
+	}
+
+	if (step->script_id >= b->num_jobs)
+		return;
+	job = &b->jobs[step->script_id];
+
+	board_end_cur(b);
+	if (b->card_pulled) {
+		/* the insert state applies to the newly selected slot */
+		osmo_st2_cardem_request_card_insert(&b->ci, true);
+		b->card_pulled = false;
+	}
+	board_start_job(b, job);
+	board_refill(b);
+}
+
+/* the firmware rejected a request */
+static void process_do_error(struct batch_board *b, const uint8_t *buf, int len)
+{
+	const struct cardemu_usb_msg_error *err = (struct cardemu_usb_msg_error *) buf;
+
+	if (len < sizeof(struct simtrace_msg_hdr) + sizeof(*err))
+		return;
+
+	LOGB(b, LOGL_ERROR, "request type 0x%02x rejected: %s\n", err->subsystem, strerror(err->code));
+	if (err->subsystem != SIMTRACE_MSGT_DT_CEMU_SCHEDULE || b->finished)
+		return;
+
+	/* a chunk is only appended per schedule step, so the error is about
+	 * the latest schedule message */
+	if (err->code == ENOSPC && b->cur && b->last_submit > (unsigned int) (b->cur - b->jobs)) {
+		/* the firmware has no room yet: send these jobs again on the next step */
+		b->next_submit = b->last_submit;
+		return;
+	}
+
+	/* the jobs would never be started */
+	osmo_st2_cardem_request_schedule(&b->ci, 0, NULL, 0);
+	if (b->cur)
+		job_finish(b->cur, RESULT_FAIL, "schedule rejected");
+	b->cur = NULL;
+	board_finish(b);
+}
+
+static void respond_apdu(struct batch_board *b)
+{
+	struct osmo_apdu_context *ac = &b->ac;
+	struct batch_job *job = b->cur;
+	uint8_t capdu[sizeof(ac->hdr) + sizeof(ac->dc)];
+	static const uint8_t sw_unknown[2] = { 0x6d, 0x00 };
+	const struct batch_rule *rule, *match = NULL;
+	unsigned int capdu_len;
+
+	memcpy(capdu, &ac->hdr, sizeof(ac->hdr));
+	memcpy(capdu + sizeof(ac->hdr), ac->dc, ac->lc.tot);
+	capdu_len = sizeof(ac->hdr) + ac->lc.tot;
+
+	/* GET RESPONSE right after a case 4 command: send its response data */
+	if (b->get_resp && ac->hdr.ins == 0xC0 && !ac->lc.tot) {
+		match = b->get_resp;
+		b->get_resp = NULL;
+		osmo_st2_cardem_request_pb_and_tx(&b->ci, ac->hdr.ins, match->resp, match->resp_len - 2);
+		osmo_st2_cardem_request_sw_tx(&b->ci, match->resp + match->resp_len - 2);
+		return;
+	}
+	b->get_resp = NULL;
+
+	if (job) {
+		job->apdus++;
+		llist_for_each_entry(rule, &job->test->rules, list) {
+			if (rule->cmd_len <= capdu_len && !memcmp(rule->cmd, capdu, rule->cmd_len)) {
+				match = rule;
+				break;
+			}
+		}
+	}
+
+	if (!match) {
+		LOGB(b, LOGL_NOTICE, "unexpected APDU %s\n", osmo_hexdump(capdu, capdu_len));
+		if (job)
+			job->unexpected++;
+		osmo_st2_cardem_request_sw_tx(&b->ci, sw_unknown);
+		return;
+	}
+
+	if (match->resp_len > 2 && ac->lc.tot) {
+		/* case 4: in T=0, no data can follow the command data. Announce
+		 * it with 61xx, the reader fetches it with GET RESPONSE */
+		uint8_t sw_more[2] = { 0x61, (match->resp_len - 2) & 0xff };
+
+		b->get_resp = match;
+		osmo_st2_cardem_request_sw_tx(&b->ci, sw_more);
+		return;
+	}
+
+	/* case 2: the data follows the procedure byte */
+	if (match->resp_len > 2)
+		osmo_st2_cardem_request_pb_and_tx(&b->ci, ac->hdr.ins, match->resp, match->resp_len - 2);
+	osmo_st2_cardem_request_sw_tx(&b->ci, match->resp + match->resp_len - 2);
+}
+
+static void process_do_rx_da(struct batch_board *b, uint8_t *buf, int len)
+{
+	struct cardemu_usb_msg_rx_data *data = (struct cardemu_usb_msg_rx_data *) buf;
+	int rc;
+
+	rc = osmo_apdu_segment_in(&b->ac, data->data, data->data_len,
+				  data->flags & CEMU_DATA_F_TPDU_HDR);
+	if (rc < 0) {
+		LOGB(b, LOGL_ERROR, "failed to recognize APDU\n");
+		if (b->cur)
+			b->cur->unexpected++;
+		return;
+	}
+
+	if (rc & APDU_ACT_TX_CAPDU_TO_CARD)
+		respond_apdu(b);
+	else if (b->ac.lc.tot > b->ac.lc.cur)
+		osmo_st2_cardem_request_pb_and_rx(&b->ci, b->ac.hdr.ins, b->ac.lc.tot - b->ac.lc.cur);
+}
+
+static void process_usb_msg(struct batch_board *b, uint8_t *buf, int len)
+{
+	struct simtrace_msg_hdr *sh = (struct simtrace_msg_hdr *)buf;
+
+	buf += sizeof(*sh);
+
+	if (sh->msg_class == SIMTRACE_MSGC_GENERIC && sh->msg_type == SIMTRACE_CMD_DO_ERROR) {
+		process_do_error(b, buf, len);
+		return;
+	}
+
+	switch (sh->msg_type) {
+	case SIMTRACE_MSGT_DO_CEMU_RX_DATA:
+		process_do_rx_da(b, buf, len);
+		break;
+	case SIMTRACE_MSGT_BD_CEMU_STATUS:
+	case SIMTRACE_MSGT_DO_CEMU_PTS:
+	case SIMTRACE_MSGT_BD_CEMU_CONFIG:
+		break;
+	default:
+		LOGB(b, LOGL_ERROR, "unknown simtrace msg type 0x%02x\n", sh->msg_type);
+		break;
+	}
+}
+
+static void process_usb_msg_irq(struct batch_board *b, const uint8_t *buf, unsigned int len)
+{
+	struct simtrace_msg_hdr *sh = (struct simtrace_msg_hdr *)buf;
+
+	buf += sizeof(*sh);
+
+	switch (sh->msg_type) {
+	case SIMTRACE_MSGT_BD_CEMU_STATUS:
+		process_irq_status(b, buf, len);
+		break;
+	case SIMTRACE_MSGT_DO_CEMU_SCHED_STEP:
+		process_irq_sched_step(b, buf, len);
+		break;
+	default:
+		LOGB(b, LOGL_ERROR, "unknown simtrace msg type 0x%02x\n", sh->msg_type);
+		break;
+	}
+}
+
+static void usb_xfer_cb(struct libusb_transfer *xfer)
+{
+	struct batch_board *b = xfer->user_data;
+	int rc;
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (xfer->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+			process_usb_msg_irq(b, xfer->buffer, xfer->actual_length);
+		else
+			process_usb_msg(b, xfer->buffer, xfer->actual_length);
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+		LOGB(b, LOGL_ERROR, "USB transfer error, trying resubmit\n");
+		break;
+	default:
+		/* this board is gone, its jobs cannot complete anymore */
+		LOGB(b, LOGL_ERROR, "USB transfer failed, status=%u\n", xfer->status);
+		if (b->cur)
+			job_finish(b->cur, RESULT_FAIL, "USB error");
+		b->cur = NULL;
+		b->gone = true;
+		board_finish(b);
+		return;
+	}
+
+	rc = libusb_submit_transfer(xfer);
+	OSMO_ASSERT(rc == 0);
+}
+
+static void allocate_and_submit(struct batch_board *b, uint8_t ep, uint8_t type, int length)
+{
+	struct libusb_transfer *xfer;
+	int rc;
+
+	xfer = libusb_alloc_transfer(0);
+	OSMO_ASSERT(xfer);
+	xfer->dev_handle = b->transp.usb_devh;
+	xfer->flags = 0;
+	xfer->type = type;
+	xfer->endpoint = ep;
+	xfer->timeout = 0;
+	xfer->user_data = b;
+	xfer->length = length;
+
+	xfer->buffer = libusb_dev_mem_alloc(xfer->dev_handle, xfer->length);
+	OSMO_ASSERT(xfer->buffer);
+	xfer->callback = usb_xfer_cb;
+
+	rc = libusb_submit_transfer(xfer);
+	OSMO_ASSERT(rc == 0);
+}
+
+/***********************************************************************
+ * Setup and report
+ ***********************************************************************/
+
+static const struct dev_id octsimtest_dev_ids[] = {
+	{ USB_VENDOR_OPENMOKO, USB_PRODUCT_OCTSIMTEST },
+	{ 0, 0 }
+};
+
+static struct batch_board *board_open(struct usb_interface_match *m, unsigned int num_slots)
+{
+	struct batch_board *b;
+	const struct batch_test *test;
+	unsigned int i = 0;
+	int rc;
+
+	b = calloc(1, sizeof(*b));
+	OSMO_ASSERT(b);
+	b->slot.transp = &b->transp;
+	b->ci.slot = &b->slot;
+	b->ci.priv = b;
+	b->ci.usb_path = strdup(m->path);
+	b->transp.udp_fd = -1;
+	b->transp.usb_async = true;
+	osmo_timer_setup(&b->timer, board_timeout_cb, b);
+
+	b->transp.usb_devh = osmo_libusb_open_claim_interface(NULL, NULL, m);
+	if (!b->transp.usb_devh) {
+		fprintf(stderr, "%s: can't open USB device: %s\n", m->path, strerror(errno));
+		goto free_b;
+	}
+	rc = osmo_libusb_get_ep_addrs(b->transp.usb_devh, m->interface, &b->transp.usb_ep.out,
+				      &b->transp.usb_ep.in, &b->transp.usb_ep.irq_in);
+	if (rc < 0) {
+		fprintf(stderr, "%s: can't obtain EP addrs; rc=%d\n", m->path, rc);
+		goto close;
+	}
+
+	/* run each test on all slots before the next one, so a slot is never
+	 * selected twice in a row */
+	b->num_jobs = g_num_tests * num_slots;
+	b->jobs = calloc(b->num_jobs, sizeof(*b->jobs));
+	OSMO_ASSERT(b->jobs);
+	llist_for_each_entry(test, &g_tests, list) {
+		unsigned int s;
+		for (s = 0; s < num_slots; s++, i++) {
+			b->jobs[i].test = test;
+			b->jobs[i].slot = s;
+		}
+	}
+
+	return b;
+
+close:
+	libusb_close(b->transp.usb_devh);
+free_b:
+	free(b->ci.usb_path);
+	free(b);
+	return NULL;
+}
+
+static int find_boards(unsigned int num_slots)
+{
+	struct usb_interface_match ifm[BATCH_BOARDS_MAX];
+	int rc, i;
+
+	rc = osmo_libusb_find_matching_interfaces(NULL, octsimtest_dev_ids, USB_CLASS_PROPRIETARY,
+						  SIMTRACE_CARDEM_USB_SUBCLASS, -1, ifm, ARRAY_SIZE(ifm));
+	if (rc < 0)
+		return rc;
+
+	for (i = 0; i < rc; i++) {
+		struct batch_board *b = board_open(&ifm[i], num_slots);
+		if (b)
+			g_boards[g_num_boards++] = b;
+	}
+
+	return g_num_boards;
+}
+
+static void board_start(struct batch_board *b)
+{
+	int i;
+
+	allocate_and_submit(b, b->transp.usb_ep.irq_in, LIBUSB_TRANSFER_TYPE_INTERRUPT, 64);
+	for (i = 0; i < 4; i++)
+		allocate_and_submit(b, b->transp.usb_ep.in, LIBUSB_TRANSFER_TYPE_BULK, 16*256);
+
+	osmo_st2_cardem_request_config(&b->ci, CEMU_FEAT_F_STATUS_IRQ);
+	/* re-applied by the firmware to every slot it selects */
+	osmo_st2_cardem_request_card_insert(&b->ci, true);
+	board_submit(b, false);
+}
+
+static unsigned long ts_diff_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000 + (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+/* write str as a JSON string, including the quotes */
+static void json_str(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/* write the results as JSON */
+static int write_report(FILE *f, const struct timespec *start, const struct timespec *end)
+{
+	unsigned int i, j, passed = 0, failed = 0;
+	bool first = true;
+
+	fprintf(f, "{\n\t\"results\": [");
+	for (i = 0; i < g_num_boards; i++) {
+		struct batch_board *b = g_boards[i];
+		for (j = 0; j < b->num_jobs; j++) {
+			const struct batch_job *job = &b->jobs[j];
+
+			if (job->result == RESULT_PASS)
+				passed++;
+			else
+				failed++;
+
+			fprintf(f, "%s\n\t\t{ \"board\": ", first ? "" : ",");
+			json_str(f, b->ci.usb_path);
+			fprintf(f, ", \"slot\": %u, \"test\": ", job->slot);
+			json_str(f, job->test->name);
+			fprintf(f, ", \"result\": \"%s\", \"reason\": ",
+				get_value_string(batch_result_names, job->result));
+			json_str(f, job->reason ? job->reason : "");
+			fprintf(f, ", \"duration_ms\": %lu, \"apdus\": %u, \"unexpected_apdus\": %u }",
+				job->start.tv_sec ? ts_diff_ms(&job->start, &job->end) : 0,
+				job->apdus, job->unexpected);
+			first = false;
+		}
+	}
+	fprintf(f, "\n\t],\n");
+	fprintf(f, "\t\"boards\": %u,\n\t\"tests\": %u,\n", g_num_boards, g_num_tests);
+	fprintf(f, "\t\"passed\": %u,\n\t\"failed\": %u,\n", passed, failed);
+	fprintf(f, "\t\"duration_ms\": %lu\n}\n", ts_diff_ms(start, end));
+
+	return failed ? 1 : 0;
+}
+
+static void print_welcome(void)
+{
+	printf("simtrace2-octsimtest-batch - Run card tests on all octsimtest slots\n\n");
+}
+
+static void print_help(void)
+{
+	printf( "\t-h\t--help\n"
+		"\t-l\t--test-list\tFILE\n"
+		"\t-o\t--output\tFILE (JSON report, default stdout)\n"
+		"\t-s\t--slots\t\tNUM (populated slots of each board, default 8)\n"
+		"\n"
+		"Test list format ('#' starts a comment):\n"
+		"\ttest NAME ATR-HEX [TIMEOUT_S]\n"
+		"\tapdu CMD-PREFIX-HEX|* RESPONSE-HEX (data and SW)\n"
+		"\n"
+		);
+}
+
+static const struct option opts[] = {
+	{ "help", 0, 0, 'h' },
+	{ "test-list", 1, 0, 'l' },
+	{ "output", 1, 0, 'o' },
+	{ "slots", 1, 0, 's' },
+	{ NULL, 0, 0, 0 }
+};
+
+static volatile bool g_stop;
+
+static void signal_handler(int signal)
+{
+	switch (signal) {
+	case SIGINT:
+		g_stop = true;
+		break;
+	default:
+		break;
+	}
+}
+
+static struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	const char *test_list = NULL, *output = NULL;
+	unsigned int num_slots = BATCH_SLOTS_MAX;
+	struct timespec start, end;
+	FILE *f = stdout;
+	int rc, c, i, ret = 2;
+
+	print_welcome();
+
+	osmo_init_logging2(NULL, &log_info);
+	log_set_print_category_hex(osmo_stderr_target, false);
+	log_set_print_level(osmo_stderr_target, true);
+	log_set_print_filename2(osmo_stderr_target, LOG_FILENAME_NONE);
+	log_set_category_filter(osmo_stderr_target, DLGLOBAL, 1, LOGL_NOTICE);
+
+	while (1) {
+		int option_index = 0;
+
+		c = getopt_long(argc, argv, "hl:o:s:", opts, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'h':
+			print_help();
+			exit(0);
+			break;
+		case 'l':
+			test_list = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			num_slots = atoi(optarg);
+			if (num_slots < 1 || num_slots > BATCH_SLOTS_MAX) {
+				fprintf(stderr, "number of slots must be 1..%u\n", BATCH_SLOTS_MAX);
+				exit(2);
+			}
+			break;
+		}
+	}
+
+	if (!test_list) {
+		fprintf(stderr, "You have to specify a test list\n");
+		goto do_exit;
+	}
+	if (read_test_list(test_list) < 0)
+		goto do_exit;
+	if (!g_num_tests || g_num_tests * num_slots > UINT16_MAX) {
+		fprintf(stderr, "The test list must contain 1..%u tests\n", UINT16_MAX / num_slots);
+		goto do_exit;
+	}
+
+	rc = osmo_libusb_init(NULL);
+	if (rc < 0) {
+		fprintf(stderr, "libusb initialization failed\n");
+		goto do_exit;
+	}
+
+	rc = find_boards(num_slots);
+	if (rc <= 0) {
+		fprintf(stderr, "No octsimtest board found\n");
+		goto close_exit;
+	}
+	printf("Running %u tests on %u slots of %u boards\n", g_num_tests, num_slots, g_num_boards);
+
+	signal(SIGINT, &signal_handler);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < g_num_boards; i++)
+		board_start(g_boards[i]);
+	while (g_boards_finished < g_num_boards && !g_stop)
+		osmo_select_main(0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* the event loop does not run anymore from here on */
+	for (i = 0; i < g_num_boards; i++) {
+		struct batch_board *b = g_boards[i];
+		if (b->cur)
+			job_finish(b->cur, RESULT_FAIL, "aborted");
+		b->cur = NULL;
+		b->transp.usb_async = false;
+		if (!b->gone && !b->finished)
+			osmo_st2_cardem_request_schedule(&b->ci, 0, NULL, 0);
+		board_finish(b);
+	}
+
+	if (output) {
+		f = fopen(output, "w");
+		if (!f) {
+			perror(output);
+			goto close_exit;
+		}
+	}
+	ret = write_report(f, &start, &end);
+	if (output)
+		fclose(f);
+
+close_exit:
+	for (i = 0; i < g_num_boards; i++)
+		libusb_close(g_boards[i]->transp.usb_devh);
+	osmo_libusb_exit(NULL);
+do_exit:
+	return ret;
+}
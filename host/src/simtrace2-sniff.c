@@ -40,6 +40,8 @@
 #include <osmocom/simtrace2/gsmtap.h>
 
 #include <osmocom/core/utils.h>
+#include <osmocom/core/bit16gen.h>
+#include <osmocom/core/bit32gen.h>
 #include <osmocom/core/socket.h>
 #include <osmocom/core/msgb.h>
 #include <osmocom/sim/class_tables.h>
@@ -85,7 +87,7 @@ static void print_flags(const struct value_string* flag_meanings, uint32_t nb_fl
 	}
 }
 
-static int process_change(const uint8_t *buf, int len)
+static int process_change(uint8_t slot, const uint8_t *buf, int len)
 {
 	/* check if there is enough data for the structure */
 	if (len < sizeof(struct sniff_change)) {
@@ -93,6 +95,9 @@ static int process_change(const uint8_t *buf, int len)
 	}
 	struct sniff_change *change = (struct sniff_change *)buf;
 
+	if (slot) {
+		printf("slot %u: ", slot);
+	}
 	printf("Card state change: ");
 	if (change->flags) {
 		print_flags(change_flags, ARRAY_SIZE(change_flags), change->flags);
@@ -110,7 +115,7 @@ static const uint16_t fi_table[] = { 372, 372, 558, 744, 1116, 1488, 1860, 0, 0,
 /* Table 8 from ISO 7816-3:2006 */
 static const uint8_t di_table[] = { 0, 1, 2, 4, 8, 16, 32, 64, 12, 20, 2, 4, 8, 16, 32, 64, };
 
-static int process_fidi(const uint8_t *buf, int len)
+static int process_fidi(uint8_t slot, const uint8_t *buf, int len)
 {
 	/* check if there is enough data for the structure */
 	if (len<sizeof(struct sniff_fidi)) {
@@ -118,28 +123,259 @@ static int process_fidi(const uint8_t *buf, int len)
 	}
 	struct sniff_fidi *fidi = (struct sniff_fidi *)buf;
 
+	if (slot) {
+		printf("slot %u: ", slot);
+	}
 	printf("Fi/Di switched to %u/%u\n", fi_table[fidi->fidi>>4], di_table[fidi->fidi&0x0f]);
 	return 0;
 }
 
-static int process_data(enum simtrace_msg_type_sniff type, const uint8_t *buf, int len)
+static int process_config(uint8_t slot, const uint8_t *buf, int len)
+{
+	/* check if there is enough data for the structure */
+	if (len < sizeof(struct sniff_config)) {
+		return -1;
+	}
+	struct sniff_config *config = (struct sniff_config *)buf;
+
+	if (slot) {
+		printf("slot %u: ", slot);
+	}
+	printf("Device time-stamps %s\n", (config->features & SNIFF_FEAT_F_TIMESTAMPS) ? "enabled" : "not supported");
+	return 0;
+}
+
+static int process_clk(uint8_t slot, const uint8_t *buf, int len)
 {
 	/* check if there is enough data for the structure */
-	if (len < sizeof(struct sniff_data)) {
+	if (len < sizeof(struct sniff_clk)) {
 		return -1;
 	}
-	struct sniff_data *data = (struct sniff_data *)buf;
+	struct sniff_clk *clk = (struct sniff_clk *)buf;
+
+	if (slot) {
+		printf("slot %u: ", slot);
+	}
+	if (clk->flags & SNIFF_CLK_F_STOPPED) {
+		printf("SIM clock stopped\n");
+	} else {
+		printf("SIM clock %u.%03u MHz\n", clk->hz / 1000000, (clk->hz / 1000) % 1000);
+	}
+	return 0;
+}
+
+/* pcap file to write the GSMTAP messages to (with the device time-stamps) */
+static FILE *pcap_file;
+
+/* raw IPv4 packets, see https://www.tcpdump.org/linktypes.html */
+#define PCAP_LINKTYPE_RAW 101
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+static int pcap_open(const char *path)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = 0xa1b2c3d4,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = 65535,
+		.network = PCAP_LINKTYPE_RAW,
+	};
+
+	pcap_file = fopen(path, "wb");
+	if (!pcap_file) {
+		return -errno;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, pcap_file) != 1) {
+		fclose(pcap_file);
+		pcap_file = NULL;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* write a GSMTAP message, as it would have been sent to the local GSMTAP port */
+static void pcap_write_gsmtap(uint64_t time_us, uint8_t sub_type, const uint8_t *data, unsigned int len)
+{
+	uint8_t pkt[20 + 8 + sizeof(struct gsmtap_hdr)];
+	struct gsmtap_hdr *gh = (struct gsmtap_hdr *) &pkt[28];
+	unsigned int ip_len = sizeof(pkt) + len;
+	struct pcap_rec_hdr rec = {
+		.ts_sec = time_us / 1000000,
+		.ts_usec = time_us % 1000000,
+		.incl_len = ip_len,
+		.orig_len = ip_len,
+	};
+	uint32_t sum = 0;
+	unsigned int i;
+
+	if (!pcap_file) {
+		return;
+	}
 
-	/* check if the data is available */
-	if (len < sizeof(struct sniff_data) + data->length) {
-		return -2;
+	memset(pkt, 0, sizeof(pkt));
+	/* IPv4 header, from and to 127.0.0.1 */
+	pkt[0] = 0x45;
+	osmo_store16be(ip_len, &pkt[2]);
+	pkt[8] = 64; /* TTL */
+	pkt[9] = IPPROTO_UDP;
+	osmo_store32be(INADDR_LOOPBACK, &pkt[12]);
+	osmo_store32be(INADDR_LOOPBACK, &pkt[16]);
+	for (i = 0; i < 20; i += 2) {
+		sum += osmo_load16be(&pkt[i]);
 	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	osmo_store16be(~sum, &pkt[10]);
+	/* UDP header (without checksum) */
+	osmo_store16be(GSMTAP_UDP_PORT, &pkt[20]);
+	osmo_store16be(GSMTAP_UDP_PORT, &pkt[22]);
+	osmo_store16be(ip_len - 20, &pkt[24]);
+	/* GSMTAP header, as filled by osmo_st2_gsmtap_send_apdu() */
+	gh->version = GSMTAP_VERSION;
+	gh->hdr_len = sizeof(*gh) / 4;
+	gh->type = GSMTAP_TYPE_SIM;
+	gh->sub_type = sub_type;
+
+	if (fwrite(&rec, sizeof(rec), 1, pcap_file) != 1 ||
+	    fwrite(pkt, sizeof(pkt), 1, pcap_file) != 1 ||
+	    fwrite(data, len, 1, pcap_file) != 1) {
+		perror("writing pcap file");
+	}
+}
+
+static uint64_t host_time_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* number of sniffed links (slots) a device can report */
+#define MAX_SNIFF_SLOTS 2
+
+/* mapping of the device time-stamps to the host time (per slot) */
+static struct {
+	bool synced;
+	/* device time base */
+	uint32_t epoch;
+	/* latest device time-stamp */
+	uint64_t last_us;
+	/* host time at the start of the device epoch */
+	uint64_t offset_us;
+} ts_sync[MAX_SNIFF_SLOTS];
+
+/* card response time, from the end of the command header (P3) to the first procedure byte */
+static struct {
+	unsigned long count;
+	uint64_t min_us;
+	uint64_t max_us;
+	uint64_t sum_us;
+} resp_stats;
+
+static void print_resp_stats(void)
+{
+	if (!resp_stats.count) {
+		return;
+	}
+	printf("card response time over %lu TPDUs: min %llu us, avg %llu us, max %llu us\n", resp_stats.count,
+	       (unsigned long long)resp_stats.min_us, (unsigned long long)(resp_stats.sum_us / resp_stats.count),
+	       (unsigned long long)resp_stats.max_us);
+}
 
-	/* check type */
-	if (type != SIMTRACE_MSGT_SNIFF_ATR && type != SIMTRACE_MSGT_SNIFF_PPS && type != SIMTRACE_MSGT_SNIFF_TPDU) {
+/* convert the device time-stamps to host time */
+static uint64_t sync_time(uint8_t slot, const struct sniff_data_ts *data_ts)
+{
+	if (slot >= MAX_SNIFF_SLOTS) {
+		return host_time_us();
+	}
+	/* the device time only goes backwards when it restarted */
+	if (!ts_sync[slot].synced || ts_sync[slot].epoch != data_ts->epoch || data_ts->end_us < ts_sync[slot].last_us) {
+		/* the message is sent right after receiving the last byte */
+		ts_sync[slot].offset_us = host_time_us() - data_ts->end_us;
+		ts_sync[slot].epoch = data_ts->epoch;
+		ts_sync[slot].synced = true;
+	}
+	ts_sync[slot].last_us = data_ts->end_us;
+
+	return ts_sync[slot].offset_us + data_ts->start_us;
+}
+
+static int process_data(uint8_t slot, enum simtrace_msg_type_sniff type, const uint8_t *buf, int len)
+{
+	const struct sniff_data_ts *data_ts = NULL;
+	const uint8_t *payload;
+	uint16_t length;
+	uint32_t flags;
+	uint64_t time_us;
+
+	switch (type) {
+	case SIMTRACE_MSGT_SNIFF_ATR:
+	case SIMTRACE_MSGT_SNIFF_PPS:
+	case SIMTRACE_MSGT_SNIFF_TPDU:
+		/* check if there is enough data for the structure */
+		if (len < sizeof(struct sniff_data)) {
+			return -1;
+		}
+		const struct sniff_data *data = (struct sniff_data *)buf;
+		/* check if the data is available */
+		if (len < sizeof(struct sniff_data) + data->length) {
+			return -2;
+		}
+		flags = data->flags;
+		length = data->length;
+		payload = data->data;
+		time_us = host_time_us();
+		break;
+	case SIMTRACE_MSGT_SNIFF_ATR_TS:
+	case SIMTRACE_MSGT_SNIFF_PPS_TS:
+	case SIMTRACE_MSGT_SNIFF_TPDU_TS:
+		if (len < sizeof(struct sniff_data_ts)) {
+			return -1;
+		}
+		data_ts = (struct sniff_data_ts *)buf;
+		if (len < sizeof(struct sniff_data_ts) + data_ts->length) {
+			return -2;
+		}
+		flags = data_ts->flags;
+		length = data_ts->length;
+		payload = data_ts->data;
+		time_us = sync_time(slot, data_ts);
+		/* handle the data the same way as without time-stamps */
+		type -= SIMTRACE_MSGT_SNIFF_ATR_TS - SIMTRACE_MSGT_SNIFF_ATR;
+		break;
+	default:
 		return -3;
 	}
 
+	/* Print slot, for devices sniffing more than one link */
+	if (slot) {
+		printf("slot %u: ", slot);
+	}
+	/* Print time-stamp (device time) */
+	if (data_ts) {
+		printf("[%llu.%06llu] ", (unsigned long long)(data_ts->start_us / 1000000),
+		       (unsigned long long)(data_ts->start_us % 1000000));
+	}
+
 	/* Print message */
 	switch (type) {
 	case SIMTRACE_MSGT_SNIFF_ATR:
@@ -155,26 +391,48 @@ static int process_data(enum simtrace_msg_type_sniff type, const uint8_t *buf, i
 		printf("???");
 		break;
 	}
-	if (data->flags) {
+	if (flags) {
 		printf(" (");
-		print_flags(data_flags, ARRAY_SIZE(data_flags), data->flags);
+		print_flags(data_flags, ARRAY_SIZE(data_flags), flags);
 		printf(")");
 	}
 	printf(": ");
 	uint16_t i;
-	for (i = 0; i < data->length; i++) {
-		printf("%02x ", data->data[i]);
+	for (i = 0; i < length; i++) {
+		printf("%02x ", payload[i]);
+	}
+	if (data_ts) {
+		printf("(%llu us", (unsigned long long)(data_ts->end_us - data_ts->start_us));
+		if (data_ts->hdr_us && data_ts->pb_us) {
+			printf(", response after %llu us", (unsigned long long)(data_ts->pb_us - data_ts->hdr_us));
+		}
+		printf(")");
 	}
 	printf("\n");
 
+	/* Collect card response time statistics */
+	if (data_ts && SIMTRACE_MSGT_SNIFF_TPDU == type && data_ts->hdr_us && data_ts->pb_us) {
+		uint64_t resp_us = data_ts->pb_us - data_ts->hdr_us;
+		if (!resp_stats.count || resp_us < resp_stats.min_us) {
+			resp_stats.min_us = resp_us;
+		}
+		if (resp_us > resp_stats.max_us) {
+			resp_stats.max_us = resp_us;
+		}
+		resp_stats.sum_us += resp_us;
+		resp_stats.count++;
+	}
+
 	/* Send message as GSNTAP */
 	switch (type) {
 	case SIMTRACE_MSGT_SNIFF_ATR:
-		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_ATR, data->data, data->length);
+		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_ATR, payload, length);
+		pcap_write_gsmtap(time_us, GSMTAP_SIM_ATR, payload, length);
 		break;
 	case SIMTRACE_MSGT_SNIFF_TPDU:
 		/* TPDU is now considered as APDU since SIMtrace sends complete TPDU */
-		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_APDU, data->data, data->length);
+		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_APDU, payload, length);
+		pcap_write_gsmtap(time_us, GSMTAP_SIM_APDU, payload, length);
 		break;
 	default:
 		break;
@@ -208,15 +466,24 @@ static int process_usb_msg(const uint8_t *buf, int len)
 	len -= sizeof(struct simtrace_msg_hdr);
 	switch (msg_hdr->msg_type) {
 	case SIMTRACE_MSGT_SNIFF_CHANGE:
-		process_change(buf, len);
+		process_change(msg_hdr->slot_nr, buf, len);
 		break;
 	case SIMTRACE_MSGT_SNIFF_FIDI:
-		process_fidi(buf, len);
+		process_fidi(msg_hdr->slot_nr, buf, len);
+		break;
+	case SIMTRACE_MSGT_SNIFF_CLK:
+		process_clk(msg_hdr->slot_nr, buf, len);
+		break;
+	case SIMTRACE_MSGT_SNIFF_CONFIG:
+		process_config(msg_hdr->slot_nr, buf, len);
 		break;
 	case SIMTRACE_MSGT_SNIFF_ATR:
 	case SIMTRACE_MSGT_SNIFF_PPS:
 	case SIMTRACE_MSGT_SNIFF_TPDU:
-		process_data(msg_hdr->msg_type, buf, len);
+	case SIMTRACE_MSGT_SNIFF_ATR_TS:
+	case SIMTRACE_MSGT_SNIFF_PPS_TS:
+	case SIMTRACE_MSGT_SNIFF_TPDU_TS:
+		process_data(msg_hdr->slot_nr, msg_hdr->msg_type, buf, len);
 		break;
 	default:
 		printf("unknown SIMtrace msg type 0x%02x\n", msg_hdr->msg_type);
@@ -229,6 +496,28 @@ static int process_usb_msg(const uint8_t *buf, int len)
 /*! Transport to SIMtrace device (e.g. USB handle) */
 static struct st_transport _transp;
 
+/*! \brief Ask the device to send the sniffed data with time-stamps
+ *  \note firmware without time-stamps does not read the request, and keeps sending the original messages */
+static void request_timestamps(void)
+{
+	struct {
+		struct simtrace_msg_hdr hdr;
+		struct sniff_config config;
+	} __attribute__ ((packed)) req;
+	int rc, xfer_len;
+
+	memset(&req, 0, sizeof(req));
+	req.hdr.msg_class = SIMTRACE_MSGC_SNIFF;
+	req.hdr.msg_type = SIMTRACE_MSGT_SNIFF_CONFIG;
+	req.hdr.msg_len = sizeof(req);
+	req.config.features = SNIFF_FEAT_F_TIMESTAMPS;
+
+	rc = libusb_bulk_transfer(_transp.usb_devh, _transp.usb_ep.out, (uint8_t *)&req, sizeof(req), &xfer_len, 1000);
+	if (rc < 0) {
+		fprintf(stderr, "unable to request time-stamps (rc=%d), using host time\n", rc);
+	}
+}
+
 static void run_mainloop()
 {
 	int rc;
@@ -285,6 +574,7 @@ static void print_help(void)
 		"\t-h\t--help\n"
 		"\t-i\t--gsmtap-ip\tA.B.C.D\n"
 		"\t-k\t--keep-running\n"
+		"\t-w\t--pcap\tFILE\n"
 		"\t-V\t--usb-vendor\tVENDOR_ID\n"
 		"\t-P\t--usb-product\tPRODUCT_ID\n"
 		"\t-C\t--usb-config\tCONFIG_ID\n"
@@ -299,6 +589,7 @@ static const struct option opts[] = {
 	{ "help", 0, 0, 'h' },
 	{ "gsmtap-ip", 1, 0, 'i' },
 	{ "keep-running", 0, 0, 'k' },
+	{ "pcap", 1, 0, 'w' },
 	{ "usb-vendor", 1, 0, 'V' },
 	{ "usb-product", 1, 0, 'P' },
 	{ "usb-config", 1, 0, 'C' },
@@ -334,12 +625,13 @@ int main(int argc, char **argv)
 	/* Parse arguments */
 	char *gsmtap_host = "127.0.0.1";
 	int keep_running = 0;
+	char *pcap_path = NULL;
 	int vendor_id = -1, product_id = -1, addr = -1, config_id = -1, if_num = -1, altsetting = -1;
 
 	while (1) {
 		int option_index = 0;
 
-		int c = getopt_long(argc, argv, "hi:kV:P:C:I:S:A:", opts, &option_index);
+		int c = getopt_long(argc, argv, "hi:kw:V:P:C:I:S:A:", opts, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -353,6 +645,9 @@ int main(int argc, char **argv)
 		case 'k':
 			keep_running = 1;
 			break;
+		case 'w':
+			pcap_path = optarg;
+			break;
 		case 'V':
 			vendor_id = strtol(optarg, NULL, 16);
 			break;
@@ -467,6 +762,15 @@ int main(int argc, char **argv)
 		goto close_exit;
 	}
 
+	if (pcap_path) {
+		rc = pcap_open(pcap_path);
+		if (rc < 0) {
+			fprintf(stderr, "unable to open pcap file %s: %s\n", pcap_path, strerror(-rc));
+			goto close_exit;
+		}
+	}
+
+	atexit(print_resp_stats);
 	signal(SIGINT, &signal_handler);
 
 	do {
@@ -489,6 +793,7 @@ int main(int argc, char **argv)
 			goto close_exit;
 		}
 
+		request_timestamps();
 		run_mainloop();
 		ret = 0;
 
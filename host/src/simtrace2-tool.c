@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <signal.h>
+#include <time.h>
 #define _GNU_SOURCE
 #include <getopt.h>
 
@@ -32,6 +33,7 @@
 #include <osmocom/simtrace2/simtrace2_api.h>
 #include <osmocom/simtrace2/simtrace_prot.h>
 #include <osmocom/simtrace2/gsmtap.h>
+#include <osmocom/simtrace2/timesync.h>
 
 #include <osmocom/core/utils.h>
 #include <osmocom/core/msgb.h>
@@ -66,6 +68,12 @@ static void print_help(void)
 		"\tmodem reset (enable|disable|cycle)\n"
 		"\tmodem sim-switch (local|remote)\n"
 		"\tmodem sim-card (insert|remove)\n"
+		"\tstats [INTERVAL_S [COUNT]]\t(print counters and rates per second)\n"
+		"\tvcc [INTERVAL_S [COUNT]]\t(print VCC min/max/average per interval)\n"
+		"\tevtrace FILE\t\t\t(dump event trace as Chrome trace JSON)\n"
+		"\tdlog TABLE [IMAGE]\t\t(print deferred log; TABLE is the .dlog file,\n"
+		"\t\t\t\t\t IMAGE the .bin file of the running firmware)\n"
+		"\ttimesync [COUNT]\t\t(estimate device and host clocks from the USB SOF)\n"
 		"\n");
 }
 
@@ -216,6 +224,534 @@ static int do_subsys_modem(int argc, char **argv)
 	return rc;
 }
 
+/* wait for the response to a request, skipping any unrelated messages */
+static int read_response(uint8_t msg_class, uint8_t msg_type, uint8_t *buf, unsigned int buf_len)
+{
+	struct osmo_st2_transport *transp = ci->slot->transp;
+	struct simtrace_msg_hdr *sh = (struct simtrace_msg_hdr *) buf;
+	int xfer_len;
+	int rc, i;
+
+	for (i = 0; i < 10; i++) {
+		rc = libusb_bulk_transfer(transp->usb_devh, transp->usb_ep.in,
+					  buf, buf_len, &xfer_len, 100);
+		if (rc == LIBUSB_ERROR_TIMEOUT || rc == LIBUSB_ERROR_INTERRUPTED)
+			continue;
+		if (rc < 0)
+			return rc;
+		if (xfer_len < (int) sizeof(*sh))
+			continue;
+		if (sh->msg_class == msg_class && sh->msg_type == msg_type)
+			return xfer_len;
+	}
+
+	return -ETIMEDOUT;
+}
+
+static void print_counter(const char *name, uint32_t val, uint32_t prev, unsigned int interval)
+{
+	if (interval)
+		printf("%-16s %10u %10.1f/s\n", name, val, (double)(uint32_t)(val - prev) / interval);
+	else
+		printf("%-16s %10u\n", name, val);
+}
+
+/* periodically poll and print the card emulation statistics counters */
+static int do_stats(int argc, char **argv)
+{
+	struct cardemu_usb_msg_stats st, prev;
+	uint8_t buf[16*265];
+	unsigned int interval = 1, count = 1, i;
+	int rc;
+
+	/* a single snapshot by default, poll forever if only an interval is given */
+	if (argc >= 1) {
+		interval = atoi(argv[0]);
+		count = 0;
+	}
+	if (argc >= 2)
+		count = atoi(argv[1]);
+	if (interval < 1)
+		interval = 1;
+
+	memset(&prev, 0, sizeof(prev));
+	for (i = 0; !count || i < count; i++) {
+		if (i > 0)
+			sleep(interval);
+
+		rc = osmo_st2_cardem_request_stats(ci);
+		if (rc < 0)
+			return rc;
+		rc = read_response(SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_STATS, buf, sizeof(buf));
+		if (rc < 0)
+			return rc;
+		if (rc < (int) (sizeof(struct simtrace_msg_hdr) + sizeof(st))) {
+			fprintf(stderr, "Short statistics response (%d bytes)\n", rc);
+			return -EIO;
+		}
+		memcpy(&st, buf + sizeof(struct simtrace_msg_hdr), sizeof(st));
+
+		printf("\n");
+#define PRINT_CTR(x)	print_counter(#x, st.x, prev.x, i ? interval : 0)
+		PRINT_CTR(rx_bytes);
+		PRINT_CTR(tx_bytes);
+		PRINT_CTR(pps);
+		PRINT_CTR(tpdu_case1);
+		PRINT_CTR(tpdu_case2);
+		PRINT_CTR(tpdu_case3);
+		PRINT_CTR(null_pb);
+		PRINT_CTR(rbuf_overruns);
+		PRINT_CTR(usart_overrun);
+		PRINT_CTR(usart_frame);
+		PRINT_CTR(usart_parity);
+		PRINT_CTR(usart_nack);
+		PRINT_CTR(usb_in_dropped);
+		PRINT_CTR(usb_irq_dropped);
+		PRINT_CTR(alloc_failed);
+		PRINT_CTR(console_dropped);
+#undef PRINT_CTR
+		prev = st;
+	}
+
+	return 0;
+}
+
+/* periodically poll and print the VCC voltage trace */
+static int do_vcc(int argc, char **argv)
+{
+	struct cardemu_usb_msg_vcc v;
+	uint8_t buf[16*265];
+	unsigned int interval = 1, count = 1, i;
+	int rc;
+
+	/* a single snapshot by default, poll forever if only an interval is given */
+	if (argc >= 1) {
+		interval = atoi(argv[0]);
+		count = 0;
+	}
+	if (argc >= 2)
+		count = atoi(argv[1]);
+	if (interval < 1)
+		interval = 1;
+
+	printf("%8s %8s %8s %8s %10s %6s %6s\n", "mV", "min", "max", "avg", "samples", "on", "off");
+	for (i = 0; !count || i < count; i++) {
+		if (i > 0)
+			sleep(interval);
+
+		/* each report covers the time since the previous one */
+		rc = osmo_st2_cardem_request_vcc(ci, CEMU_VCC_F_RESET);
+		if (rc < 0)
+			return rc;
+		rc = read_response(SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_VCC, buf, sizeof(buf));
+		if (rc < 0)
+			return rc;
+		if (rc < (int) (sizeof(struct simtrace_msg_hdr) + sizeof(v))) {
+			fprintf(stderr, "Short VCC response (%d bytes)\n", rc);
+			return -EIO;
+		}
+		memcpy(&v, buf + sizeof(struct simtrace_msg_hdr), sizeof(v));
+
+		printf("%8u %8u %8u %8u %10u %6u %6u\n", v.mv, v.min_mv, v.max_mv, v.avg_mv,
+		       v.samples, v.vcc_on, v.vcc_off);
+	}
+
+	return 0;
+}
+
+static const struct value_string evtrace_names[] = {
+	{ SIMTRACE_EVT_USART_ISR_ENTER,	"USART ISR" },
+	{ SIMTRACE_EVT_USART_ISR_EXIT,	"USART ISR" },
+	{ SIMTRACE_EVT_ISO_STATE,	"ISO state" },
+	{ SIMTRACE_EVT_TPDU_STATE,	"TPDU state" },
+	{ SIMTRACE_EVT_USB_IN_QUEUE,	"USB IN queue" },
+	{ SIMTRACE_EVT_USB_IN_SUBMIT,	"USB IN submit" },
+	{ SIMTRACE_EVT_USB_IN_DONE,	"USB IN done" },
+	{ SIMTRACE_EVT_USB_OUT_DONE,	"USB OUT done" },
+	{ SIMTRACE_EVT_WT_HALF_EXPIRED,	"WT half expired" },
+	{ SIMTRACE_EVT_WT_EXPIRED,	"WT expired" },
+	{ 0, NULL }
+};
+
+/* print one record as Chrome trace event (chrome://tracing, ui.perfetto.dev) */
+static void print_evtrace_rec(FILE *f, const struct simtrace_evtrace_rec *rec, double ts_us, bool first)
+{
+	const char *name = get_value_string(evtrace_names, rec->id);
+	const char *ph = "i";
+	unsigned int tid = 0;
+
+	switch (rec->id) {
+	case SIMTRACE_EVT_USART_ISR_ENTER:
+		/* argument is the USART status, not the slot */
+		ph = "B";
+		break;
+	case SIMTRACE_EVT_USART_ISR_EXIT:
+		ph = "E";
+		break;
+	case SIMTRACE_EVT_ISO_STATE:
+	case SIMTRACE_EVT_TPDU_STATE:
+		tid = 1 + (rec->arg >> 16);
+		break;
+	case SIMTRACE_EVT_WT_HALF_EXPIRED:
+	case SIMTRACE_EVT_WT_EXPIRED:
+		tid = 1 + rec->arg;
+		break;
+	default:
+		/* USB events */
+		tid = 16;
+		break;
+	}
+
+	fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": 0, \"tid\": %u, "
+		"\"s\": \"t\", \"args\": {\"arg\": \"0x%08x\"}}",
+		first ? "" : ",", name, ph, ts_us, tid, rec->arg);
+}
+
+/* read the firmware event trace and convert it to Chrome trace JSON */
+static int do_evtrace(int argc, char **argv)
+{
+	struct simtrace_evtrace_resp *resp;
+	struct simtrace_evtrace_rec rec;
+	uint8_t buf[16*265];
+	uint16_t offset = 0;
+	uint32_t last_cycles = 0;
+	uint64_t cycles = 0;
+	/* USART interrupt durations, from the entry to the exit record */
+	uint64_t isr_enter = 0, isr_sum = 0, isr_min = UINT64_MAX, isr_max = 0;
+	unsigned int isr_num = 0;
+	bool in_isr = false;
+	unsigned int i;
+	FILE *f;
+	int rc;
+
+	if (argc < 1)
+		return -EINVAL;
+	f = fopen(argv[0], "w");
+	if (!f) {
+		rc = -errno;
+		fprintf(stderr, "Cannot open %s: %s\n", argv[0], strerror(errno));
+		return rc;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	do {
+		/* keep recording stopped until we have read everything */
+		rc = osmo_st2_generic_request_evtrace(ci->slot, offset, SIMTRACE_EVTRACE_F_FREEZE);
+		if (rc < 0)
+			goto out;
+		rc = read_response(SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_EVTRACE, buf, sizeof(buf));
+		if (rc < 0)
+			goto out;
+		if (rc < (int) (sizeof(struct simtrace_msg_hdr) + sizeof(*resp))) {
+			rc = -EIO;
+			goto out;
+		}
+		resp = (struct simtrace_evtrace_resp *) (buf + sizeof(struct simtrace_msg_hdr));
+		if (rc < (int) (sizeof(struct simtrace_msg_hdr) + sizeof(*resp) + resp->num_recs * sizeof(rec))) {
+			rc = -EIO;
+			goto out;
+		}
+
+		for (i = 0; i < resp->num_recs; i++) {
+			memcpy(&rec, &resp->recs[i], sizeof(rec));
+			/* the 32bit cycle counter wraps around, accumulate the differences */
+			if (offset + i > 0)
+				cycles += (uint32_t) (rec.cycles - last_cycles);
+			last_cycles = rec.cycles;
+			print_evtrace_rec(f, &rec, cycles * 1e6 / resp->cycles_per_sec, offset + i == 0);
+
+			if (rec.id == SIMTRACE_EVT_USART_ISR_ENTER) {
+				isr_enter = cycles;
+				in_isr = true;
+			} else if (rec.id == SIMTRACE_EVT_USART_ISR_EXIT && in_isr) {
+				uint64_t d = cycles - isr_enter;
+				isr_sum += d;
+				isr_min = OSMO_MIN(isr_min, d);
+				isr_max = OSMO_MAX(isr_max, d);
+				isr_num++;
+				in_isr = false;
+			}
+		}
+		offset += resp->num_recs;
+	} while (resp->num_recs && offset < resp->num_total);
+	fprintf(f, "\n]}\n");
+
+	printf("%u events written to %s\n", offset, argv[0]);
+	if (isr_num) {
+		printf("USART ISR: %u calls, %.2f/%.2f/%.2f us (min/avg/max)\n", isr_num,
+			isr_min * 1e6 / resp->cycles_per_sec, isr_sum * 1e6 / isr_num / resp->cycles_per_sec,
+			isr_max * 1e6 / resp->cycles_per_sec);
+	}
+	rc = 0;
+out:
+	/* resume recording */
+	osmo_st2_generic_request_evtrace(ci->slot, offset, 0);
+	read_response(SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_EVTRACE, buf, sizeof(buf));
+	fclose(f);
+	return rc;
+}
+
+/* a file loaded into memory, used to resolve deferred log strings */
+struct dlog_file {
+	uint8_t *data;
+	size_t len;
+};
+
+static int load_file(struct dlog_file *df, const char *path)
+{
+	FILE *f;
+	long len;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	/* terminate, in case the last string is truncated */
+	df->data = calloc(1, len + 1);
+	if (!df->data || fread(df->data, 1, len, f) != (size_t) len) {
+		fclose(f);
+		free(df->data);
+		return -EIO;
+	}
+	df->len = len;
+	fclose(f);
+	return 0;
+}
+
+/* return the string at offset in the file, or NULL if out of range */
+static const char *dlog_file_str(const struct dlog_file *df, uint32_t offset)
+{
+	if (!df->data || offset >= df->len)
+		return NULL;
+	return (const char *) df->data + offset;
+}
+
+/* format a deferred log message like the firmware printf() would have */
+static void dlog_format(char *out, size_t out_len, const char *fmt, const uint32_t *args,
+			unsigned int num_args, const struct dlog_file *image, uint32_t image_base)
+{
+	unsigned int arg = 0;
+	size_t pos = 0;
+
+#define NEXT_ARG()	(arg < num_args ? args[arg++] : 0)
+#define OUT(...)	do {							\
+		int n = snprintf(out + pos, out_len - pos, __VA_ARGS__);		\
+		if (n > 0)								\
+			pos = OSMO_MIN(out_len - 1, pos + n);				\
+	} while (0)
+
+	out[0] = '\0';
+	while (*fmt && pos < out_len - 1) {
+		char spec[32];
+		unsigned int spec_len = 0;
+		const char *str;
+		uint32_t val;
+
+		if (*fmt != '%') {
+			/* the firmware terminates lines with \r\n or \n\r */
+			if (*fmt != '\r' && *fmt != '\n')
+				out[pos++] = *fmt;
+			out[pos] = '\0';
+			fmt++;
+			continue;
+		}
+
+		/* copy flags, width and precision, drop the length modifiers:
+		 * all arguments are recorded as 32bit words */
+		spec[spec_len++] = *fmt++;
+		while (*fmt && strchr("-+ #0123456789.*hlLqjzt", *fmt)) {
+			if (*fmt == '*') {
+				spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len, "%d",
+						     (int32_t) NEXT_ARG());
+			} else if (!strchr("hlLqjzt", *fmt) && spec_len < sizeof(spec) - 2)
+				spec[spec_len++] = *fmt;
+			fmt++;
+		}
+		if (!*fmt)
+			break;
+		spec[spec_len++] = *fmt;
+		spec[spec_len] = '\0';
+
+		switch (*fmt++) {
+		case '%':
+			OUT("%%");
+			break;
+		case 'd':
+		case 'i':
+			OUT(spec, (int32_t) NEXT_ARG());
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+			OUT(spec, (unsigned int) NEXT_ARG());
+			break;
+		case 'p':
+			OUT("0x%08x", NEXT_ARG());
+			break;
+		case 's':
+			val = NEXT_ARG();
+			str = dlog_file_str(image, val - image_base);
+			if (str)
+				OUT(spec, str);
+			else
+				OUT("<0x%08x>", val);
+			break;
+		default:
+			OUT("%s", spec);
+			break;
+		}
+	}
+#undef OUT
+#undef NEXT_ARG
+}
+
+/* continuously read the firmware deferred log and print it */
+static int do_dlog(int argc, char **argv)
+{
+	static const char level_chr[] = "?FEWID";
+	struct dlog_file table = {}, image = {};
+	struct simtrace_dlog_resp *resp;
+	struct simtrace_dlog_rec rec;
+	uint8_t buf[16*265];
+	uint32_t args[255];
+	uint32_t last_cycles = 0, last_dropped = 0;
+	uint64_t cycles = 0;
+	bool first = true;
+	unsigned int i;
+	int rc;
+
+	if (argc < 1)
+		return -EINVAL;
+	rc = load_file(&table, argv[0]);
+	if (rc < 0)
+		return rc;
+	if (argc >= 2) {
+		rc = load_file(&image, argv[1]);
+		if (rc < 0)
+			goto out;
+	}
+
+	while (1) {
+		rc = osmo_st2_generic_request_dlog(ci->slot);
+		if (rc < 0)
+			goto out;
+		rc = read_response(SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_DLOG, buf, sizeof(buf));
+		if (rc < 0)
+			goto out;
+		if (rc < (int) (sizeof(struct simtrace_msg_hdr) + sizeof(*resp))) {
+			rc = -EIO;
+			goto out;
+		}
+		resp = (struct simtrace_dlog_resp *) (buf + sizeof(struct simtrace_msg_hdr));
+		if (rc < (int) (sizeof(struct simtrace_msg_hdr) + sizeof(*resp) + resp->num_words * 4)) {
+			rc = -EIO;
+			goto out;
+		}
+
+		if (resp->num_dropped != last_dropped) {
+			printf("-- %u messages dropped --\n", resp->num_dropped - last_dropped);
+			last_dropped = resp->num_dropped;
+		}
+
+		for (i = 0; i + 2 <= resp->num_words; i += 2 + rec.num_args) {
+			const char *fmt;
+			char line[512];
+
+			memcpy(&rec, &resp->data[i], sizeof(rec));
+			if (i + 2 + rec.num_args > resp->num_words)
+				break;
+			memcpy(args, &resp->data[i + 2], rec.num_args * sizeof(args[0]));
+
+			/* the 32bit cycle counter wraps around, accumulate the differences */
+			if (!first)
+				cycles += (uint32_t) (rec.cycles - last_cycles);
+			last_cycles = rec.cycles;
+			first = false;
+
+			fmt = dlog_file_str(&table, rec.fmt);
+			if (fmt)
+				dlog_format(line, sizeof(line), fmt, args, rec.num_args, &image,
+					    resp->image_base);
+			else
+				snprintf(line, sizeof(line), "unknown format string %u", rec.fmt);
+			printf("[%12.6f] %c %s\n", (double) cycles / resp->cycles_per_sec,
+				rec.level < sizeof(level_chr) - 1 ? level_chr[rec.level] : '?', line);
+		}
+		fflush(stdout);
+
+		/* poll less often while nothing is being logged */
+		if (!resp->num_words)
+			usleep(100 * 1000);
+	}
+
+out:
+	free(table.data);
+	free(image.data);
+	return rc;
+}
+
+/* relate the device cycle counter to the USB bus and host clocks */
+static int do_timesync(int argc, char **argv)
+{
+	struct osmo_st2_timesync ts;
+	struct simtrace_timesync_resp *resp;
+	struct timespec t_req, t_resp, wall;
+	uint8_t buf[16*265];
+	int count = 40, i;
+	int rc;
+
+	if (argc >= 1)
+		count = atoi(argv[0]);
+
+	osmo_st2_timesync_init(&ts);
+	for (i = 0; i < count; i++) {
+		if (i)
+			usleep(250 * 1000);
+
+		clock_gettime(CLOCK_MONOTONIC, &t_req);
+		rc = osmo_st2_generic_request_timesync(ci->slot);
+		if (rc < 0)
+			return rc;
+		rc = read_response(SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_TIMESYNC, buf, sizeof(buf));
+		clock_gettime(CLOCK_MONOTONIC, &t_resp);
+		if (rc < 0)
+			return rc;
+		if (rc < (int) sizeof(struct simtrace_msg_hdr))
+			return -EIO;
+		resp = (struct simtrace_timesync_resp *) (buf + sizeof(struct simtrace_msg_hdr));
+
+		rc = osmo_st2_timesync_update(&ts, resp, rc - sizeof(struct simtrace_msg_hdr), &t_req, &t_resp);
+		if (rc == -EAGAIN) {
+			printf("%u start-of-frames latched, waiting for more\n", resp->num_latched);
+			continue;
+		}
+		if (rc < 0)
+			return rc;
+
+		printf("device %+8.2f ppm  host %+8.2f ppm  rtt %7.3f ms  error <= %6.3f ms\n",
+			ts.device_ppm, ts.host_ppm,
+			(t_resp.tv_sec - t_req.tv_sec) * 1e3 + (t_resp.tv_nsec - t_req.tv_nsec) / 1e6, ts.err_ms);
+		fflush(stdout);
+	}
+
+	if (!ts.valid)
+		return -EAGAIN;
+
+	rc = osmo_st2_timesync_to_wall(&ts, resp->cycles_now, &wall);
+	if (rc < 0)
+		return rc;
+	printf("device cycle counter %u at %ld.%06ld (CLOCK_REALTIME)\n", resp->cycles_now,
+		(long) wall.tv_sec, wall.tv_nsec / 1000);
+
+	return 0;
+}
+
 static int do_command(int argc, char **argv)
 {
 	char *subsys;
@@ -229,6 +765,16 @@ static int do_command(int argc, char **argv)
 
 	if (!strcmp(subsys, "modem"))
 		rc = do_subsys_modem(argc, argv);
+	else if (!strcmp(subsys, "stats"))
+		rc = do_stats(argc, argv);
+	else if (!strcmp(subsys, "vcc"))
+		rc = do_vcc(argc, argv);
+	else if (!strcmp(subsys, "evtrace"))
+		rc = do_evtrace(argc, argv);
+	else if (!strcmp(subsys, "dlog"))
+		rc = do_dlog(argc, argv);
+	else if (!strcmp(subsys, "timesync"))
+		rc = do_timesync(argc, argv);
 	else {
 		fprintf(stderr, "Unsupported subsystem '%s'\n", subsys);
 		rc = -EINVAL;